@@ -0,0 +1,206 @@
+/*
+ * Manifest generation benchmark.
+ *
+ * Builds the SegmentTimeline part of an MPD for R representations of N
+ * segments each (defaults: 8 representations, 10k, 100k and 1M segments)
+ * with
+ *   - printf:      one vsnprintf per attribute into a bounce buffer, the
+ *                  way avio_printf formats
+ *   - full:        YPStrBuf and a fresh timeline cache, every S element is
+ *                  formatted
+ *   - incremental: YPStrBuf and the timeline cache kept from the previous
+ *                  update, the way live manifest updates run
+ * and reports the time of one full manifest, and the average time of an
+ * update after one more segment is added to every representation.
+ *
+ * Usage: mpd_bench [nb_representations] [nb_segments,...]
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../segtable.h"
+#include "../strbuf.h"
+#include "../timeline.h"
+
+#define NB_UPDATES 100
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs of 8 equal durations, as with alternating 2.000 s and 2.002 s GOPs
+static int64_t segment_duration(unsigned int i)
+{
+    return 180000 + (i / 8) % 2 * 180;
+}
+
+static void append_segment(YPSegmentTable *table)
+{
+    unsigned int i = table->nb_segments;
+
+    if (yp_segtable_append(table, segment_duration(i), (int64_t) i * 500000, 500000, i + 1) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+static void out_printf(YPStrBuf *out, const char *fmt, ...)
+{
+    char buf[4096];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    yp_strbuf_append(out, buf, len);
+}
+
+static void write_printf(YPStrBuf *out, YPSegmentTable *tables, YPTimelineCache *caches, int nb_reps)
+{
+    const YPSegmentTable *segments;
+    unsigned int i;
+    int64_t duration;
+    int repeat;
+    int r;
+
+    (void) caches;
+
+    for (r = 0; r < nb_reps; r++) {
+        segments = &tables[r];
+        i = 0;
+
+        out_printf(out, "\t\t\t<Representation id=\"%d\" bandwidth=\"%d\">\n", r, 1000000);
+        out_printf(out, "\t\t\t\t\t<SegmentTimeline>\n");
+
+        if (segments->nb_segments > 0)
+            out_printf(out, "\t\t\t\t\t\t<S t=\"%lld\" ", (long long) segments->start[0]);
+
+        while (i < segments->nb_segments) {
+            duration = segments->duration[i];
+            repeat = 0;
+
+            for (i++; i < segments->nb_segments && segments->duration[i] == duration; i++)
+                repeat++;
+
+            if (repeat > 0)
+                out_printf(out, "d=\"%lld\" r=\"%d\" />\n", (long long) duration, repeat);
+            else
+                out_printf(out, "d=\"%lld\" />\n", (long long) duration);
+
+            if (i < segments->nb_segments)
+                out_printf(out, "\t\t\t\t\t\t<S ");
+        }
+
+        out_printf(out, "\t\t\t\t\t</SegmentTimeline>\n");
+        out_printf(out, "\t\t\t</Representation>\n");
+    }
+}
+
+static void write_strbuf(YPStrBuf *out, YPSegmentTable *tables, YPTimelineCache *caches, int nb_reps)
+{
+    int r;
+
+    for (r = 0; r < nb_reps; r++) {
+        yp_strbuf_puts(out, "\t\t\t<Representation id=\"");
+        yp_strbuf_put_int(out, r);
+        yp_strbuf_puts(out, "\" bandwidth=\"");
+        yp_strbuf_put_int(out, 1000000);
+        yp_strbuf_puts(out, "\">\n");
+        yp_strbuf_puts(out, "\t\t\t\t\t<SegmentTimeline>\n");
+        yp_timeline_write(out, &caches[r], &tables[r], 1);
+        yp_strbuf_puts(out, "\t\t\t\t\t</SegmentTimeline>\n");
+        yp_strbuf_puts(out, "\t\t\t</Representation>\n");
+    }
+}
+
+static void bench(const char *name,
+                  void (*write)(YPStrBuf *, YPSegmentTable *, YPTimelineCache *, int),
+                  int keep_cache, int nb_reps, unsigned int n)
+{
+    YPSegmentTable *tables = calloc(nb_reps, sizeof(*tables));
+    YPTimelineCache *caches = calloc(nb_reps, sizeof(*caches));
+    YPStrBuf out;
+    double start, first, updates = 0;
+    size_t first_len;
+    unsigned int i;
+    int r, u;
+
+    if (tables == NULL || caches == NULL)
+        exit(1);
+
+    yp_strbuf_init(&out);
+
+    for (r = 0; r < nb_reps; r++) {
+        yp_segtable_init(&tables[r]);
+        yp_timeline_init(&caches[r]);
+        for (i = 0; i < n; i++)
+            append_segment(&tables[r]);
+    }
+
+    start = now();
+    write(&out, tables, caches, nb_reps);
+    first = now() - start;
+    first_len = out.len;
+
+    for (u = 0; u < NB_UPDATES; u++) {
+        for (r = 0; r < nb_reps; r++) {
+            append_segment(&tables[r]);
+            if (!keep_cache) {
+                yp_timeline_free(&caches[r]);
+                yp_timeline_init(&caches[r]);
+            }
+        }
+
+        start = now();
+        yp_strbuf_reset(&out);
+        write(&out, tables, caches, nb_reps);
+        updates += now() - start;
+    }
+
+    if (out.error) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        exit(1);
+    }
+
+    printf("%-11s representations=%d segments=%u bytes=%zu manifest_ms=%.3f update_ms=%.3f\n",
+           name, nb_reps, n, first_len, first * 1000, updates * 1000 / NB_UPDATES);
+
+    for (r = 0; r < nb_reps; r++) {
+        yp_segtable_free(&tables[r]);
+        yp_timeline_free(&caches[r]);
+    }
+    yp_strbuf_free(&out);
+    free(tables);
+    free(caches);
+}
+
+int main(int argc, char **argv)
+{
+    int nb_reps = argc > 1 ? atoi(argv[1]) : 8;
+    char *sizes = strdup(argc > 2 ? argv[2] : "10000,100000,1000000");
+    char *size;
+    unsigned int n;
+
+    if (nb_reps <= 0 || sizes == NULL)
+        return 1;
+
+    for (size = strtok(sizes, ","); size; size = strtok(NULL, ",")) {
+        n = (unsigned int) strtoul(size, NULL, 10);
+
+        bench("printf", write_printf, 0, nb_reps, n);
+        bench("full", write_strbuf, 0, nb_reps, n);
+        bench("incremental", write_strbuf, 1, nb_reps, n);
+    }
+
+    free(sizes);
+
+    return 0;
+}
@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+#
+# Packaging throughput benchmark.
+#
+# Packages data/sample.mp4 and longer inputs made by looping it, with one
+# or many representations, in every segment addressing mode and input I/O
+# path, and reports wall time, MB/s, packets/s, CPU seconds per GB of
+# input, peak RSS and optionally syscall counts.
+# Results are written as CSV and JSON with stable columns so that runs of
+# different builds can be compared line by line.
+#
+# Usage: bench/package_bench.py [--scales sample,1h,10h] [--renditions 1,8]
+#                               [--modes template,timeline,single-file]
+#                               [--io default,mmap]
+#                               [--runs 3] [--syscalls] [--label name]
+#                               [--extra "<packager options>"]
+#
+# Looped inputs are generated once with ffmpeg (stream copy) and kept in
+# the work directory.
+
+import argparse
+import csv
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+MODES = {
+    'template': [],
+    'timeline': ['--segment-timeline'],
+    'single-file': ['--single-file'],
+}
+
+# How the packager reads its input
+IO = {
+    'default': [],
+    'mmap': ['--mmap'],
+}
+
+SCALES = {
+    'sample': None,
+    '1h': 3600,
+    '10h': 36000,
+}
+
+COLUMNS = ['label', 'scale', 'mode', 'io', 'renditions', 'run', 'input_bytes',
+           'wall_s', 'mb_per_s', 'packets', 'packets_per_s', 'user_s', 'sys_s',
+           'cpu_s_per_gb', 'peak_rss_kb', 'syscalls', 'status']
+
+
+def make_input(sample, scale, workdir):
+    seconds = SCALES[scale]
+    if seconds is None:
+        return sample
+
+    path = os.path.join(workdir, 'sample-%s.mp4' % scale)
+    if os.path.exists(path):
+        return path
+
+    print('Generating %s input %s' % (scale, path), file=sys.stderr)
+    subprocess.check_call(['ffmpeg', '-v', 'error', '-y', '-stream_loop', '-1',
+                           '-i', sample, '-c', 'copy', '-t', str(seconds),
+                           path + '.tmp.mp4'])
+    os.rename(path + '.tmp.mp4', path)
+    return path
+
+
+def run_once(cmd):
+    """Run cmd, return (status, wall seconds, user and system CPU seconds, peak RSS in kB)"""
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    _, status, rusage = os.wait4(proc.pid, 0)
+    wall = time.monotonic() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    return proc.returncode, wall, rusage.ru_utime, rusage.ru_stime, rusage.ru_maxrss
+
+
+def count_syscalls(cmd, workdir):
+    """Total number of system calls made by cmd and its threads, using strace"""
+    out = os.path.join(workdir, 'strace.txt')
+    subprocess.call(['strace', '-f', '-c', '-o', out] + cmd,
+                    stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    total = 0
+    with open(out) as f:
+        # % time, seconds, usecs/call, calls, [errors,] syscall
+        for line in f:
+            fields = line.split()
+            if len(fields) >= 5 and fields[-1] != 'total' and fields[3].isdigit():
+                total += int(fields[3])
+    return total
+
+
+def print_io_summary(results, ios):
+    """CPU per GB of every input I/O path relative to the first one, best runs"""
+    best = {}
+    for r in results:
+        if r['status'] == 0:
+            key = (r['scale'], r['mode'], r['renditions'], r['io'])
+            best[key] = min(best.get(key, r['cpu_s_per_gb']), r['cpu_s_per_gb'])
+
+    for scale, mode, renditions, io in sorted(best):
+        base = best.get((scale, mode, renditions, ios[0]))
+        if io != ios[0] and base:
+            print('%-6s %-11s x%-3d %s vs %s: %7.3f vs %7.3f cpu-s/GB (%+.1f%%)' % (
+                  scale, mode, renditions, io, ios[0], best[(scale, mode, renditions, io)],
+                  base, (best[(scale, mode, renditions, io)] / base - 1) * 100))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Packaging throughput benchmark')
+    parser.add_argument('--bin', default='bin/segmenter')
+    parser.add_argument('--sample', default='data/sample.mp4')
+    parser.add_argument('--workdir', default=os.path.join(tempfile.gettempdir(), 'yp-bench'))
+    parser.add_argument('--outdir', default='bench/results')
+    parser.add_argument('--label', default='current')
+    parser.add_argument('--scales', default='sample,1h,10h')
+    parser.add_argument('--renditions', default='1,8')
+    parser.add_argument('--modes', default=','.join(MODES))
+    parser.add_argument('--io', default='default', help='input I/O paths, e.g. default,mmap')
+    parser.add_argument('--segment-duration', default='2000')
+    parser.add_argument('--runs', type=int, default=3)
+    parser.add_argument('--syscalls', action='store_true',
+                        help='count system calls in an extra strace run')
+    parser.add_argument('--extra', default='', help='options added to every packager run')
+    args = parser.parse_args()
+
+    os.makedirs(args.workdir, exist_ok=True)
+    os.makedirs(args.outdir, exist_ok=True)
+
+    if args.syscalls and shutil.which('strace') is None:
+        parser.error('--syscalls needs strace')
+
+    results = []
+
+    for scale in args.scales.split(','):
+        infile = make_input(args.sample, scale, args.workdir)
+        input_bytes = os.path.getsize(infile)
+
+        for renditions in [int(r) for r in args.renditions.split(',')]:
+            for mode, io in [(m, i) for m in args.modes.split(',') for i in args.io.split(',')]:
+                outdir = os.path.join(args.workdir, 'out')
+                stats = os.path.join(args.workdir, 'stats.json')
+                cmd = [args.bin, '--segment-duration', args.segment_duration,
+                       '-o', outdir, '--stats-json', stats, '--log-level', 'warning']
+                # Every -i entry makes a representation, all read from the
+                # same demuxer
+                for _ in range(renditions):
+                    cmd += ['-i', infile + '#0']
+                cmd += MODES[mode] + IO[io] + args.extra.split()
+
+                syscalls = None
+                if args.syscalls:
+                    shutil.rmtree(outdir, ignore_errors=True)
+                    syscalls = count_syscalls(cmd, args.workdir)
+
+                for run in range(args.runs):
+                    shutil.rmtree(outdir, ignore_errors=True)
+                    if os.path.exists(stats):
+                        os.remove(stats)
+                    status, wall, user, sys_, rss = run_once(cmd)
+
+                    packets = 0
+                    if status == 0 and os.path.exists(stats):
+                        with open(stats) as f:
+                            packets = json.load(f)['packets']
+
+                    row = {
+                        'label': args.label,
+                        'scale': scale,
+                        'mode': mode,
+                        'io': io,
+                        'renditions': renditions,
+                        'run': run,
+                        'input_bytes': input_bytes,
+                        'wall_s': round(wall, 4),
+                        'mb_per_s': round(input_bytes / wall / 1e6, 2),
+                        'packets': packets,
+                        'packets_per_s': round(packets / wall, 1),
+                        'user_s': round(user, 4),
+                        'sys_s': round(sys_, 4),
+                        'cpu_s_per_gb': round((user + sys_) / (input_bytes / 1e9), 3),
+                        'peak_rss_kb': rss,
+                        'syscalls': syscalls if syscalls is not None else '',
+                        'status': status,
+                    }
+                    results.append(row)
+                    print('%-6s %-11s %-7s x%-3d run %d: %7.3f s %8.2f MB/s %10.1f pkt/s %7.3f cpu-s/GB %8d kB%s' % (
+                          scale, mode, io, renditions, run, wall, row['mb_per_s'],
+                          row['packets_per_s'], row['cpu_s_per_gb'], rss,
+                          '' if status == 0 else ' FAILED'))
+
+    print_io_summary(results, args.io.split(','))
+
+    base = os.path.join(args.outdir, args.label)
+
+    with open(base + '.csv', 'w', newline='') as f:
+        writer = csv.DictWriter(f, fieldnames=COLUMNS)
+        writer.writeheader()
+        writer.writerows(results)
+
+    with open(base + '.json', 'w') as f:
+        json.dump({'label': args.label, 'columns': COLUMNS, 'results': results}, f, indent=2)
+
+    print('Results written to %s.csv and %s.json' % (base, base))
+
+    return 1 if any(r['status'] != 0 for r in results) else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,146 @@
+/*
+ * Memory benchmark of the per-representation segment storage.
+ *
+ * Fills N segments (default 1M) into
+ *   - list:  the former layout, one malloc'd node per segment carrying a
+ *            1 KiB file name and a next pointer
+ *   - table: YPSegmentTable, growable columns without file names
+ * each in a child process, and reports the peak RSS growth and the time to
+ * fill then walk the segments the way the manifest writer does.
+ *
+ * Usage: segtable_bench [nb_segments]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "../segtable.h"
+
+typedef struct ListSegment {
+    char filename[1024];
+    int64_t pos;
+    int64_t size;
+    int64_t index_size;
+    int64_t duration;
+    int num;
+    struct ListSegment *next;
+} ListSegment;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static int64_t run_list(unsigned int n)
+{
+    ListSegment *head = NULL, *last = NULL, *seg;
+    int64_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        seg = malloc(sizeof(ListSegment));
+        if (seg == NULL)
+            return -1;
+        snprintf(seg->filename, sizeof(seg->filename), "0/seg-%u.m4s", i + 1);
+        seg->pos = (int64_t) i * 500000;
+        seg->size = 500000;
+        seg->index_size = 0;
+        seg->duration = 180000 + (i % 3);
+        seg->num = i + 1;
+        seg->next = NULL;
+        if (last)
+            last->next = seg;
+        else
+            head = seg;
+        last = seg;
+    }
+
+    for (seg = head; seg; seg = seg->next)
+        sum += seg->duration;
+
+    return sum;
+}
+
+static int64_t run_table(unsigned int n)
+{
+    YPSegmentTable table;
+    int64_t sum = 0;
+    unsigned int i;
+
+    yp_segtable_init(&table);
+
+    for (i = 0; i < n; i++) {
+        if (yp_segtable_append(&table, 180000 + (i % 3), (int64_t) i * 500000, 500000, i + 1) < 0)
+            return -1;
+    }
+
+    for (i = 0; i < table.nb_segments; i++)
+        sum += table.duration[i];
+
+    return sum;
+}
+
+static void bench(const char *name, int64_t (*run)(unsigned int), unsigned int n)
+{
+    int fd[2];
+    pid_t pid;
+    double result[2];
+
+    if (pipe(fd) < 0)
+        exit(1);
+
+    pid = fork();
+
+    if (pid == 0) {
+        long base = peak_rss_kb();
+        double start = now();
+        int64_t sum = run(n);
+
+        result[0] = now() - start;
+        result[1] = (double) (peak_rss_kb() - base);
+
+        if (sum < 0)
+            result[0] = -1;
+
+        if (write(fd[1], result, sizeof(result)) != sizeof(result))
+            _exit(1);
+        _exit(0);
+    }
+
+    close(fd[1]);
+
+    if (read(fd[0], result, sizeof(result)) != sizeof(result) || result[0] < 0) {
+        fprintf(stderr, "%s: run failed\n", name);
+        exit(1);
+    }
+
+    waitpid(pid, NULL, 0);
+    close(fd[0]);
+
+    printf("%-6s segments=%u time_s=%.3f peak_rss_mb=%.1f bytes_per_segment=%.1f\n",
+           name, n, result[0], result[1] / 1024, result[1] * 1024 / n);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int n = argc > 1 ? (unsigned int) strtoul(argv[1], NULL, 10) : 1000000;
+
+    bench("list", run_list, n);
+    bench("table", run_table, n);
+
+    return 0;
+}
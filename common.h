@@ -3,6 +3,25 @@
 
 #include <libavformat/avformat.h>
 
+#include "writer.h"
+#include "sink.h"
+#include "stats.h"
+
+// Part of a stream packaged on its own, see shard.c. Timestamps are in the
+// input stream time base.
+typedef struct YPTimeRange {
+    // Keyframe the range starts on, AV_NOPTS_VALUE for start of stream
+    int64_t start_dts;
+    // Start of the first segment, the pts of the keyframe above
+    int64_t start_pts;
+    // Keyframe the next range starts on, AV_NOPTS_VALUE for end of stream
+    int64_t end_dts;
+    int64_t end_pts;
+    // Number of segments written before this range
+    int first_segment;
+    int write_init;
+} YPTimeRange;
+
 typedef struct YPInputStream {
     const char *filename;
     AVFormatContext *ctx;
@@ -12,6 +31,9 @@ typedef struct YPInputStream {
     unsigned int set_id; // Adaptation set
     unsigned int stream_id; // Representation
     unsigned int period_id; // Period
+    const YPTimeRange *range; // NULL to package the whole stream
+    YPStreamStats *stats; // NULL unless stats are collected
+    int in_band_ps; // Parameter sets may also come with samples (avc3)
 } YPInputStream;
 
 typedef struct YPOutputStream {
@@ -20,12 +42,38 @@ typedef struct YPOutputStream {
 
 typedef struct YPConfig {
     YPInputStream **instreams;
+    unsigned int nb_instreams;
     char *outdir;
     char *index_fname;
     char *profile;
     int min_buffer;
     int seg_duration;
+    // Duration of CMAF chunks in milliseconds, 0 writes whole segments
+    int chunk_duration;
+    // Background writer segments are handed to, NULL to write them inline
+    YPWriter *writer;
+    // Where segments and manifests go. Muxers write files below
+    // sink->root themselves when it is set, see sink.h.
+    YPSink *sink;
+    // Timings and counters, NULL unless --stats-json is given
+    YPStats *stats;
     int verbose;
+    int threads;
+    int shards;
+    int live;
+    // Read local inputs through memory mappings instead of read()
+    int mmap;
+    // Demux on a thread of its own, see readahead.h. Bytes and
+    // microseconds read ahead of muxing, 0 for no limit.
+    int read_ahead;
+    int64_t read_ahead_bytes;
+    int64_t read_ahead_duration;
+    // Write stream-copied fragments without the mp4 muxer
+    int native_fragments;
+    // Re-encode the frames of a GOP from a segment boundary on when the
+    // next keyframe is more than smart_cut_tolerance ms late, see smartcut.h
+    int smart_cut;
+    int smart_cut_tolerance;
     int has_video;
     int has_audio;
     int single_file;
@@ -36,12 +84,24 @@ typedef struct YPConfig {
 typedef struct YPIndexHandlerClass {
     void *opaque;
     int (*init)(struct YPIndexHandlerClass *self, YPConfig *config);
+    // Byte range of the initialization segment within filename
+    int (*add_init_segment)(struct YPIndexHandlerClass *self,
+                            YPInputStream *instream,
+                            char *filename,
+                            int64_t pos,
+                            int64_t size);
+    // Byte range of the segment index (sidx) in single file mode
+    int (*set_index_range)(struct YPIndexHandlerClass *self,
+                           YPInputStream *instream,
+                           int64_t pos,
+                           int64_t size);
+    // duration is in the time base of the instream
     int (*add_segment)(struct YPIndexHandlerClass 
                       *self, YPInputStream *instream,
                       char *filename,
                       int64_t pos,
                       int64_t size,
-                      double duration,
+                      int64_t duration,
                       int num);
     int (*finalize)(struct YPIndexHandlerClass *self);
 } YPIndexHandlerClass;
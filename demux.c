@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+
+#include <libavutil/dict.h>
+#include <libavutil/time.h>
+#include <libavformat/avformat.h>
+
+#include "demux.h"
+#include "log.h"
+#include "mmapio.h"
+#include "readahead.h"
+#include "utils.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+void yp_demuxer_interrupt(void)
+{
+    interrupted = 1;
+}
+
+static int interrupt_cb(void *opaque)
+{
+    return interrupted;
+}
+
+YPDemuxer* yp_demuxer(const char *filename)
+{
+    YPDemuxer *demuxer = (YPDemuxer *) malloc(sizeof(YPDemuxer));
+
+    if (demuxer) {
+        demuxer->filename = strdup(filename);
+        demuxer->live = 0;
+        demuxer->mmap = 0;
+        demuxer->read_ahead = 0;
+        demuxer->read_ahead_bytes = 0;
+        demuxer->read_ahead_duration = 0;
+        demuxer->pb = NULL;
+        demuxer->cache_dir = NULL;
+        demuxer->sidecar = NULL;
+        demuxer->ctx = NULL;
+        demuxer->nb_outputs = 0;
+        demuxer->outputs = NULL;
+        demuxer->instreams = NULL;
+
+        if (demuxer->filename)
+            return demuxer;
+
+        free(demuxer);
+    }
+
+    return NULL;
+}
+
+int yp_demuxer_open(YPDemuxer *demuxer)
+{
+    int ret = 0;
+    AVFormatContext *ifmt_ctx = NULL;
+    AVDictionary *opts = NULL;
+
+    yp_log(YP_LOG_DEMUX, YP_LOG_INFO, "Opening input file %s\n", demuxer->filename);
+
+    ifmt_ctx = avformat_alloc_context();
+
+    if (ifmt_ctx == NULL) {
+        return AVERROR(ENOMEM);
+    }
+
+    // A blocked read on a pipe or socket must not keep us from writing
+    // the final manifest on SIGINT/SIGTERM
+    ifmt_ctx->interrupt_callback.callback = &interrupt_cb;
+
+    if (demuxer->live) {
+        // Hand packets over as soon as they are read and keep probing
+        // short, there is no point in waiting for data to pile up
+        ifmt_ctx->flags |= AVFMT_FLAG_NOBUFFER;
+        av_dict_set(&opts, "probesize", "500000", 0);
+        av_dict_set(&opts, "analyzeduration", "1000000", 0);
+    }
+
+    if (demuxer->mmap && !demuxer->live && !is_url(demuxer->filename)) {
+        if (yp_mmap_open(&demuxer->pb, demuxer->filename) < 0)
+            yp_log(YP_LOG_DEMUX, YP_LOG_INFO, "Cannot map '%s', reading it through the file protocol\n",
+                   demuxer->filename);
+        else
+            ifmt_ctx->pb = demuxer->pb;
+    }
+
+    // avformat_open_input() frees ifmt_ctx on failure
+    ret = avformat_open_input(&ifmt_ctx, demuxer->filename, 0, &opts);
+    av_dict_free(&opts);
+
+    if (ret < 0) {
+        yp_log(YP_LOG_DEMUX, YP_LOG_ERROR, "could not open input file '%s'\n", demuxer->filename);
+        yp_mmap_close(&demuxer->pb);
+        return ret;
+    }
+
+    if (demuxer->cache_dir && !demuxer->live && !is_url(demuxer->filename))
+        demuxer->sidecar = yp_sidecar_load(demuxer->cache_dir, demuxer->filename);
+
+    if (demuxer->sidecar && yp_sidecar_apply(demuxer->sidecar, ifmt_ctx) == 0) {
+        yp_log(YP_LOG_DEMUX, YP_LOG_INFO, "Using cached stream information of %s\n", demuxer->filename);
+    } else {
+        if (demuxer->sidecar) {
+            yp_sidecar_free(demuxer->sidecar);
+            demuxer->sidecar = NULL;
+        }
+
+        if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
+            yp_log(YP_LOG_DEMUX, YP_LOG_ERROR, "failed to retrieve input stream information\n");
+            avformat_close_input(&ifmt_ctx);
+            yp_mmap_close(&demuxer->pb);
+            return ret;
+        }
+
+        // Keyframes are added by the sharded mode, which indexes them
+        if (demuxer->cache_dir && !demuxer->live && !is_url(demuxer->filename))
+            yp_sidecar_save(demuxer->cache_dir, demuxer->filename, ifmt_ctx, NULL);
+    }
+
+    if (ifmt_ctx->nb_streams == 0) {
+        yp_log(YP_LOG_DEMUX, YP_LOG_ERROR, "input file '%s' has no streams\n", demuxer->filename);
+        avformat_close_input(&ifmt_ctx);
+        yp_mmap_close(&demuxer->pb);
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+
+    av_dump_format(ifmt_ctx, 0, demuxer->filename, 0);
+
+    AVDictionaryEntry *tag = NULL;
+    while ((tag = av_dict_get(ifmt_ctx->metadata, "", tag, AV_DICT_IGNORE_SUFFIX)))
+        yp_log(YP_LOG_DEMUX, YP_LOG_DEBUG, "%s=%s\n", tag->key, tag->value);
+
+    demuxer->ctx = ifmt_ctx;
+
+    return ret;
+}
+
+int yp_demuxer_add_output(YPDemuxer *demuxer, YPInputStream *instream, YPMuxerClass *muxer)
+{
+    YPMuxerClass **outputs;
+    YPInputStream **instreams;
+    unsigned int n = demuxer->nb_outputs + 1;
+
+    if (instream->stream_idx < 0 || (unsigned int) instream->stream_idx >= demuxer->ctx->nb_streams) {
+        yp_log(YP_LOG_DEMUX, YP_LOG_ERROR, "no stream #%d in input file '%s'\n",
+               instream->stream_idx, demuxer->filename);
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+
+    outputs = realloc(demuxer->outputs, n * sizeof(YPMuxerClass*));
+
+    if (outputs == NULL) {
+        return -1;
+    }
+
+    demuxer->outputs = outputs;
+
+    instreams = realloc(demuxer->instreams, n * sizeof(YPInputStream*));
+
+    if (instreams == NULL) {
+        return -1;
+    }
+
+    demuxer->instreams = instreams;
+
+    demuxer->outputs[demuxer->nb_outputs] = muxer;
+    demuxer->instreams[demuxer->nb_outputs] = instream;
+    demuxer->nb_outputs = n;
+
+    return 0;
+}
+
+int yp_demuxer_run(YPDemuxer *demuxer)
+{
+    int ret = 0;
+    unsigned int i, j;
+    unsigned int nb_consumers;
+    int64_t start;
+    int64_t read_time;
+    AVPacket pkt;
+    AVFormatContext *ctx = demuxer->ctx;
+    YPReadAhead *ra = NULL;
+    // Time spent reading packets, per output
+    int64_t *demux_time = (int64_t *) calloc(FFMAX(demuxer->nb_outputs, 1), sizeof(int64_t));
+
+    if (demux_time == NULL) {
+        return -1;
+    }
+
+    // Let libavformat skip streams no representation was built from, so
+    // that we don't pay for reading packets we would throw away anyway.
+    for (i = 0; i < ctx->nb_streams; i++) {
+        ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    for (j = 0; j < demuxer->nb_outputs; j++) {
+        ctx->streams[demuxer->instreams[j]->stream_idx]->discard = AVDISCARD_DEFAULT;
+    }
+
+    if (demuxer->read_ahead) {
+        ra = yp_read_ahead(ctx, demuxer->read_ahead_bytes, demuxer->read_ahead_duration);
+
+        if (ra == NULL) {
+            free(demux_time);
+            return -1;
+        }
+    }
+
+    while (1) {
+        if (ra) {
+            ret = yp_read_ahead_get(ra, &pkt, &read_time);
+        } else {
+            start = av_gettime_relative();
+            ret = av_read_frame(ctx, &pkt);
+            read_time = av_gettime_relative() - start;
+        }
+
+        if (ret < 0) {
+            if (interrupted)
+                yp_log(YP_LOG_DEMUX, YP_LOG_INFO, "Interrupted, closing %s\n", demuxer->filename);
+            else
+                yp_log(YP_LOG_DEMUX, YP_LOG_INFO, "No frame left\n");
+            ret = 0;
+            break;
+        }
+
+        // Representations sharing a stream share the cost of reading it
+        nb_consumers = 0;
+        for (j = 0; j < demuxer->nb_outputs; j++) {
+            if (pkt.stream_index == demuxer->instreams[j]->stream_idx)
+                nb_consumers++;
+        }
+
+        // Fan the packet out to every muxer built from this stream
+        for (j = 0; j < demuxer->nb_outputs; j++) {
+            if (pkt.stream_index != demuxer->instreams[j]->stream_idx)
+                continue;
+
+            demux_time[j] += read_time / nb_consumers;
+
+            ret = demuxer->outputs[j]->handle_packet(demuxer->outputs[j],
+                                                     demuxer->instreams[j],
+                                                     &pkt);
+            if (ret < 0) break;
+        }
+
+        av_packet_unref(&pkt);
+
+        if (ret < 0) break;
+    }
+
+    if (ra) {
+        YPReadAheadStats stats;
+
+        yp_read_ahead_free(ra, &stats);
+        // Reader stalls mean muxing is the bottleneck, muxer stalls I/O
+        yp_log(YP_LOG_DEMUX, YP_LOG_INFO, "Read-ahead of %s: %"PRIu64" packets, queued max %u packets "
+               "(%"PRId64" bytes, %.3f s), reader waited %"PRIu64" times (%.3f s), "
+               "muxer waited %"PRIu64" times (%.3f s)\n",
+               demuxer->filename, stats.nb_packets, stats.max_packets, stats.max_bytes,
+               stats.max_duration / 1000000.0,
+               stats.nb_read_stalls, stats.read_stall_time / 1000000.0,
+               stats.nb_get_stalls, stats.get_stall_time / 1000000.0);
+    }
+
+    for (j = 0; j < demuxer->nb_outputs; j++) {
+        // e.g. the last segment or the sidx of a single file not written
+        if (demuxer->outputs[j]->finalize(demuxer->outputs[j]) < 0 && ret >= 0)
+            ret = -1;
+
+        if (demuxer->instreams[j]->stats) {
+            YPStreamStats stats;
+
+            yp_stream_stats_init(&stats);
+            stats.demux_time = demux_time[j];
+            yp_stats_merge(demuxer->instreams[j]->stats, &stats);
+        }
+    }
+
+    free(demux_time);
+
+    return ret;
+}
+
+void yp_demuxer_free(YPDemuxer *demuxer)
+{
+    if (demuxer->ctx != NULL)
+        avformat_close_input(&demuxer->ctx);
+
+    // Custom I/O is left open by avformat_close_input()
+    yp_mmap_close(&demuxer->pb);
+
+    if (demuxer->sidecar)
+        yp_sidecar_free(demuxer->sidecar);
+
+    free(demuxer->filename);
+    free(demuxer->outputs);
+    free(demuxer->instreams);
+    free(demuxer);
+}
@@ -0,0 +1,43 @@
+#ifndef YP_DEMUX_H_
+#define YP_DEMUX_H_
+
+#include "common.h"
+#include "sidecar.h"
+
+// One demuxer per unique input file. Every representation taken from that
+// file registers its muxer here, and a single read loop feeds them all.
+typedef struct YPDemuxer {
+    char *filename;
+    // Input is a pipe or socket fed in real time
+    int live;
+    // Read a local input through a memory mapping
+    int mmap;
+    // Read on a thread of its own, up to read_ahead_bytes bytes or
+    // read_ahead_duration microseconds ahead of muxing, 0 for no limit
+    int read_ahead;
+    int64_t read_ahead_bytes;
+    int64_t read_ahead_duration;
+    // Custom I/O of ctx when the input is mapped, NULL otherwise
+    AVIOContext *pb;
+    // Directory of probe and keyframe index sidecars, NULL to always probe
+    const char *cache_dir;
+    // Sidecar found in cache_dir, NULL if there was none or it was outdated
+    YPSidecar *sidecar;
+    AVFormatContext *ctx;
+    unsigned int nb_outputs;
+    // Parallel arrays: outputs[i] consumes packets of instreams[i]
+    YPMuxerClass **outputs;
+    YPInputStream **instreams;
+} YPDemuxer;
+
+YPDemuxer* yp_demuxer(const char *filename);
+int yp_demuxer_open(YPDemuxer *demuxer);
+int yp_demuxer_add_output(YPDemuxer *demuxer, YPInputStream *instream, YPMuxerClass *muxer);
+int yp_demuxer_run(YPDemuxer *demuxer);
+void yp_demuxer_free(YPDemuxer *demuxer);
+
+// Make every running demuxer stop reading as if its input had ended.
+// Async-signal-safe.
+void yp_demuxer_interrupt(void);
+
+#endif // YP_DEMUX_H_
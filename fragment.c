@@ -0,0 +1,406 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavutil/intreadwrite.h>
+#include <libavformat/avformat.h>
+
+#include "fragment.h"
+
+// Box flags, see ISO/IEC 14496-12 8.8.7 and 8.8.8
+#define TFHD_DEFAULT_DURATION       0x000008
+#define TFHD_DEFAULT_SIZE           0x000010
+#define TFHD_DEFAULT_FLAGS          0x000020
+#define TFHD_DEFAULT_BASE_IS_MOOF   0x020000
+
+#define TRUN_DATA_OFFSET            0x000001
+#define TRUN_FIRST_SAMPLE_FLAGS     0x000004
+#define TRUN_SAMPLE_DURATION        0x000100
+#define TRUN_SAMPLE_SIZE            0x000200
+#define TRUN_SAMPLE_FLAGS           0x000400
+#define TRUN_SAMPLE_CTS             0x000800
+
+#define SAMPLE_DEPENDS_NO           0x02000000
+#define SAMPLE_DEPENDS_YES          0x01000000
+#define SAMPLE_IS_NON_SYNC          0x00010000
+
+// Offsets of the fields filled in per fragment
+#define SIDX_REFERENCE_ID   12
+#define SIDX_TIMESCALE      16
+#define SIDX_PRESENTATION   20
+#define SIDX_REF_SIZE       40
+#define SIDX_REF_DURATION   44
+#define SIDX_REF_SAP        48
+#define MOOF_SIZE           52
+#define MFHD_SEQUENCE       72
+#define TRAF_SIZE           76
+#define TFHD_TRACK_ID       96
+#define TFHD_DURATION       100
+#define TFHD_SIZE           104
+#define TFHD_FLAGS          108
+#define TFDT_TIME           124
+#define TRUN_SIZE           132
+#define TRUN_FLAGS          141
+#define TRUN_COUNT          144
+#define TRUN_DATA_OFFSET_AT 148
+
+#define SIDX_BOX_SIZE       52
+#define MFHD_BOX_SIZE       16
+#define TFHD_BOX_SIZE       28
+#define TFDT_BOX_SIZE       20
+#define TRUN_HEADER_SIZE    20
+
+// sidx with a single reference, moof, mfhd, traf, tfhd with default
+// duration, size and flags, tfdt and the fixed part of trun, as the mp4
+// muxer writes them with movflags dash. Sample entries and the mdat header
+// follow.
+static const uint8_t box_template[] = {
+    0, 0, 0, SIDX_BOX_SIZE, 's', 'i', 'd', 'x', 1, 0, 0, 0,
+    0, 0, 0, 0,                 // reference_ID
+    0, 0, 0, 0,                 // timescale
+    0, 0, 0, 0, 0, 0, 0, 0,     // earliest_presentation_time
+    0, 0, 0, 0, 0, 0, 0, 0,     // first_offset
+    0, 0, 0, 1,                 // reserved, reference_count
+    0, 0, 0, 0,                 // referenced_size
+    0, 0, 0, 0,                 // subsegment_duration
+    0, 0, 0, 0,                 // starts_with_SAP
+    0, 0, 0, 0, 'm', 'o', 'o', 'f',
+    0, 0, 0, MFHD_BOX_SIZE, 'm', 'f', 'h', 'd', 0, 0, 0, 0,
+    0, 0, 0, 0,                 // sequence_number
+    0, 0, 0, 0, 't', 'r', 'a', 'f',
+    0, 0, 0, TFHD_BOX_SIZE, 't', 'f', 'h', 'd', 0,
+    (TFHD_DEFAULT_BASE_IS_MOOF | TFHD_DEFAULT_FLAGS | TFHD_DEFAULT_SIZE | TFHD_DEFAULT_DURATION) >> 16,
+    0, TFHD_DEFAULT_FLAGS | TFHD_DEFAULT_SIZE | TFHD_DEFAULT_DURATION,
+    0, 0, 0, 0,                 // track_ID
+    0, 0, 0, 0,                 // default_sample_duration
+    0, 0, 0, 0,                 // default_sample_size
+    0, 0, 0, 0,                 // default_sample_flags
+    0, 0, 0, TFDT_BOX_SIZE, 't', 'f', 'd', 't', 1, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,     // baseMediaDecodeTime
+    0, 0, 0, 0, 't', 'r', 'u', 'n', 0,
+    0, 0, 0,                    // flags
+    0, 0, 0, 0,                 // sample_count
+    0, 0, 0, 0,                 // data_offset
+};
+
+int yp_fragment_supported(const AVFormatContext *ctx, const AVStream *st)
+{
+    // Samples from mp4 are already in the form the mp4 muxer stores them
+    if (ctx->iformat == NULL || (strstr(ctx->iformat->name, "mp4") == NULL &&
+                                 strstr(ctx->iformat->name, "mov") == NULL))
+        return 0;
+
+    switch (st->codecpar->codec_id) {
+    case AV_CODEC_ID_H264:
+    case AV_CODEC_ID_HEVC:
+    case AV_CODEC_ID_AAC:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int yp_fragment_writer_init(YPFragmentWriter *w, AVRational time_base,
+                            enum AVMediaType codec_type, unsigned int sequence,
+                            int discont)
+{
+    // The mp4 muxer picks 1/timescale time bases
+    if (time_base.num != 1)
+        return AVERROR(EINVAL);
+
+    w->track_id = 1;
+    w->timescale = time_base.den;
+    w->is_video = codec_type == AVMEDIA_TYPE_VIDEO;
+    w->sequence = sequence;
+    w->discont = discont;
+    w->start_dts = AV_NOPTS_VALUE;
+    w->frag_start = 0;
+    w->track_duration = 0;
+    w->end_pts = AV_NOPTS_VALUE;
+    w->has_cts = 0;
+    w->nb_samples = 0;
+    w->nb_alloc = 0;
+    w->samples = NULL;
+    w->packets = NULL;
+    w->header = NULL;
+    w->header_alloc = 0;
+    w->iov = NULL;
+    yp_packet_pool_init(&w->pool);
+
+    return 0;
+}
+
+static int grow(YPFragmentWriter *w)
+{
+    unsigned int nb_alloc = w->nb_alloc ? w->nb_alloc * 2 : 256;
+    YPFragmentSample *samples;
+    AVPacket **packets;
+    struct iovec *iov;
+
+    samples = realloc(w->samples, nb_alloc * sizeof(YPFragmentSample));
+    if (samples == NULL)
+        return AVERROR(ENOMEM);
+    w->samples = samples;
+
+    packets = realloc(w->packets, nb_alloc * sizeof(AVPacket*));
+    if (packets == NULL)
+        return AVERROR(ENOMEM);
+    w->packets = packets;
+
+    // Room for the box headers in front of the payloads
+    iov = realloc(w->iov, (nb_alloc + 1) * sizeof(struct iovec));
+    if (iov == NULL)
+        return AVERROR(ENOMEM);
+    w->iov = iov;
+
+    w->nb_alloc = nb_alloc;
+
+    return 0;
+}
+
+int yp_fragment_add(YPFragmentWriter *w, const AVPacket *pkt)
+{
+    YPFragmentSample *s;
+    int64_t dts = pkt->dts;
+    int64_t pts = pkt->pts;
+    int ret;
+
+    if (w->nb_samples == 0 && w->start_dts != AV_NOPTS_VALUE) {
+        // First sample of a later fragment. Like the mp4 muxer, start it
+        // where the previous one ended, and in dash mode move its pts to
+        // the end of the previous one too, so that sidx entries follow
+        // each other without gap or overlap.
+        dts = w->start_dts + w->track_duration;
+        pts = pkt->dts + w->end_pts - dts;
+    }
+
+    if (w->start_dts == AV_NOPTS_VALUE) {
+        w->start_dts = pkt->dts;
+
+        if (w->discont) {
+            // Edit list mode: pretend the stream started at pts 0, with
+            // earlier fragments already written
+            w->frag_start = pkt->pts;
+            w->start_dts = pkt->dts - pkt->pts;
+            w->discont = 0;
+        }
+    }
+
+    if (w->nb_samples == w->nb_alloc && (ret = grow(w)) < 0)
+        return ret;
+
+    // Packets are reused from one fragment to the next
+    if ((w->packets[w->nb_samples] = yp_packet_pool_get(&w->pool)) == NULL)
+        return AVERROR(ENOMEM);
+
+    if ((ret = av_packet_ref(w->packets[w->nb_samples], pkt)) < 0) {
+        yp_packet_pool_put(&w->pool, &w->packets[w->nb_samples]);
+        return ret;
+    }
+
+    s = &w->samples[w->nb_samples++];
+    s->dts = dts;
+    s->cts = pts - pkt->dts;
+    s->size = pkt->size;
+    s->sync = !!(pkt->flags & AV_PKT_FLAG_KEY);
+
+    if (pts != pkt->dts)
+        w->has_cts = 1;
+
+    w->track_duration = pkt->dts - w->start_dts + pkt->duration;
+
+    if (w->end_pts == AV_NOPTS_VALUE || s->dts + s->cts + pkt->duration > w->end_pts)
+        w->end_pts = s->dts + s->cts + pkt->duration;
+
+    return 0;
+}
+
+// The last sample lasts until the end of the track so far
+static int64_t sample_duration(const YPFragmentWriter *w, unsigned int i)
+{
+    if (i + 1 < w->nb_samples)
+        return w->samples[i + 1].dts - w->samples[i].dts;
+
+    return w->track_duration + w->start_dts - w->samples[i].dts;
+}
+
+static uint32_t sample_flags(const YPFragmentSample *s)
+{
+    return s->sync ? SAMPLE_DEPENDS_NO : SAMPLE_DEPENDS_YES | SAMPLE_IS_NON_SYNC;
+}
+
+int yp_fragment_build(YPFragmentWriter *w, struct iovec **iov, int *nb_iov, int64_t *size)
+{
+    const YPFragmentSample *s = w->samples;
+    unsigned int n = w->nb_samples;
+    unsigned int i;
+    uint32_t trun_flags = TRUN_DATA_OFFSET;
+    uint32_t default_flags;
+    int64_t default_duration;
+    int64_t mdat_size = 0;
+    int64_t presentation_time;
+    int64_t duration;
+    size_t entry_size = 0;
+    size_t trun_size, traf_size, moof_size, header_size;
+    uint8_t *p;
+
+    *nb_iov = 0;
+    *size = 0;
+
+    if (n == 0)
+        return 0;
+
+    // Defaults are taken from the first sample, flags from the second one
+    // since the first is usually the only sync sample
+    default_duration = sample_duration(w, 0);
+    if (n > 1)
+        default_flags = sample_flags(&s[1]);
+    else
+        default_flags = w->is_video ? SAMPLE_DEPENDS_YES | SAMPLE_IS_NON_SYNC : SAMPLE_DEPENDS_NO;
+
+    for (i = 0; i < n; i++) {
+        if (sample_duration(w, i) != default_duration)
+            trun_flags |= TRUN_SAMPLE_DURATION;
+        if (s[i].size != s[0].size)
+            trun_flags |= TRUN_SAMPLE_SIZE;
+        if (i > 0 && sample_flags(&s[i]) != default_flags)
+            trun_flags |= TRUN_SAMPLE_FLAGS;
+        mdat_size += s[i].size;
+    }
+
+    if (!(trun_flags & TRUN_SAMPLE_FLAGS) && sample_flags(&s[0]) != default_flags)
+        trun_flags |= TRUN_FIRST_SAMPLE_FLAGS;
+    if (w->has_cts)
+        trun_flags |= TRUN_SAMPLE_CTS;
+
+    if (trun_flags & TRUN_SAMPLE_DURATION) entry_size += 4;
+    if (trun_flags & TRUN_SAMPLE_SIZE) entry_size += 4;
+    if (trun_flags & TRUN_SAMPLE_FLAGS) entry_size += 4;
+    if (trun_flags & TRUN_SAMPLE_CTS) entry_size += 4;
+
+    trun_size = TRUN_HEADER_SIZE + (trun_flags & TRUN_FIRST_SAMPLE_FLAGS ? 4 : 0) + n * entry_size;
+    traf_size = 8 + TFHD_BOX_SIZE + TFDT_BOX_SIZE + trun_size;
+    moof_size = 8 + MFHD_BOX_SIZE + traf_size;
+    header_size = SIDX_BOX_SIZE + moof_size + 8;
+
+    if (header_size > w->header_alloc) {
+        uint8_t *header = realloc(w->header, header_size);
+
+        if (header == NULL)
+            return AVERROR(ENOMEM);
+
+        w->header = header;
+        w->header_alloc = header_size;
+    }
+
+    p = w->header;
+    memcpy(p, box_template, sizeof(box_template));
+
+    presentation_time = w->start_dts + w->frag_start + s[0].cts;
+    duration = w->end_pts - (s[0].dts + s[0].cts);
+
+    // Presentation before 0 is cut by the edit list
+    if (presentation_time < 0) {
+        duration += presentation_time;
+        presentation_time = 0;
+    }
+
+    AV_WB32(p + SIDX_REFERENCE_ID, w->track_id);
+    AV_WB32(p + SIDX_TIMESCALE, w->timescale);
+    AV_WB64(p + SIDX_PRESENTATION, presentation_time);
+    AV_WB32(p + SIDX_REF_SIZE, (moof_size + 8 + mdat_size) & 0x7fffffff);
+    AV_WB32(p + SIDX_REF_DURATION, duration);
+    AV_WB32(p + SIDX_REF_SAP, (uint32_t) s[0].sync << 31);
+    AV_WB32(p + MOOF_SIZE, moof_size);
+    AV_WB32(p + MFHD_SEQUENCE, w->sequence);
+    AV_WB32(p + TRAF_SIZE, traf_size);
+    AV_WB32(p + TFHD_TRACK_ID, w->track_id);
+    AV_WB32(p + TFHD_DURATION, default_duration);
+    AV_WB32(p + TFHD_SIZE, s[0].size);
+    AV_WB32(p + TFHD_FLAGS, default_flags);
+    AV_WB64(p + TFDT_TIME, w->frag_start);
+    AV_WB32(p + TRUN_SIZE, trun_size);
+    AV_WB24(p + TRUN_FLAGS, trun_flags);
+    AV_WB32(p + TRUN_COUNT, n);
+    AV_WB32(p + TRUN_DATA_OFFSET_AT, moof_size + 8);
+
+    p += sizeof(box_template);
+
+    if (trun_flags & TRUN_FIRST_SAMPLE_FLAGS) {
+        AV_WB32(p, sample_flags(&s[0]));
+        p += 4;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (trun_flags & TRUN_SAMPLE_DURATION) {
+            AV_WB32(p, sample_duration(w, i));
+            p += 4;
+        }
+        if (trun_flags & TRUN_SAMPLE_SIZE) {
+            AV_WB32(p, s[i].size);
+            p += 4;
+        }
+        if (trun_flags & TRUN_SAMPLE_FLAGS) {
+            AV_WB32(p, sample_flags(&s[i]));
+            p += 4;
+        }
+        if (trun_flags & TRUN_SAMPLE_CTS) {
+            AV_WB32(p, s[i].cts);
+            p += 4;
+        }
+    }
+
+    AV_WB32(p, mdat_size + 8);
+    memcpy(p + 4, "mdat", 4);
+
+    w->iov[0].iov_base = w->header;
+    w->iov[0].iov_len = header_size;
+
+    for (i = 0; i < n; i++) {
+        w->iov[i + 1].iov_base = w->packets[i]->data;
+        w->iov[i + 1].iov_len = w->packets[i]->size;
+    }
+
+    *iov = w->iov;
+    *nb_iov = n + 1;
+    *size = header_size + mdat_size;
+
+    return 0;
+}
+
+void yp_fragment_next(YPFragmentWriter *w)
+{
+    unsigned int i;
+
+    if (w->nb_samples == 0)
+        return;
+
+    w->frag_start += w->start_dts + w->track_duration - w->samples[0].dts;
+    w->sequence++;
+
+    for (i = 0; i < w->nb_samples; i++)
+        yp_packet_pool_put(&w->pool, &w->packets[i]);
+
+    w->nb_samples = 0;
+}
+
+void yp_fragment_writer_free(YPFragmentWriter *w)
+{
+    unsigned int i;
+
+    for (i = 0; i < w->nb_samples; i++)
+        av_packet_free(&w->packets[i]);
+
+    yp_packet_pool_uninit(&w->pool);
+
+    free(w->samples);
+    free(w->packets);
+    free(w->header);
+    free(w->iov);
+    w->samples = NULL;
+    w->packets = NULL;
+    w->header = NULL;
+    w->iov = NULL;
+    w->nb_samples = 0;
+    w->nb_alloc = 0;
+}
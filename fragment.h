@@ -0,0 +1,66 @@
+#ifndef YP_FRAGMENT_H_
+#define YP_FRAGMENT_H_
+
+#include <sys/uio.h>
+
+#include "common.h"
+#include "packetpool.h"
+
+// Sample as recorded in the trun box, times in the track timescale
+typedef struct YPFragmentSample {
+    int64_t dts;
+    int64_t cts;
+    int size;
+    int sync;
+} YPFragmentSample;
+
+// Writes the sidx/moof/mdat boxes of a single track fragmented mp4 stream
+// the way the mp4 muxer does with movflags frag_custom+dash, for
+// stream-copied samples. Packets are kept by reference until the fragment
+// is written, the payload is never copied into a fragment buffer.
+typedef struct YPFragmentWriter {
+    unsigned int track_id;
+    int timescale;
+    int is_video;
+    // mfhd sequence number of the next fragment
+    unsigned int sequence;
+    // Continue the decode timeline of an earlier run at the first packet,
+    // like movflags frag_discont
+    int discont;
+    // Track timeline, with the same meaning as in the mp4 muxer
+    int64_t start_dts;
+    int64_t frag_start;
+    int64_t track_duration;
+    int64_t end_pts;
+    // Set for good once a sample has pts != dts
+    int has_cts;
+    // Samples of the pending fragment
+    unsigned int nb_samples;
+    unsigned int nb_alloc;
+    YPFragmentSample *samples;
+    AVPacket **packets;
+    // Where packets come from and go back to once written
+    YPPacketPool pool;
+    // Box headers followed by the payload of every sample, ready for writev()
+    uint8_t *header;
+    size_t header_alloc;
+    struct iovec *iov;
+} YPFragmentWriter;
+
+// Whether samples of this stream can be written unchanged. The mp4 muxer
+// rewrites some bitstreams, e.g. Annex B H.264 or ADTS AAC.
+int yp_fragment_supported(const AVFormatContext *ctx, const AVStream *st);
+int yp_fragment_writer_init(YPFragmentWriter *w, AVRational time_base,
+                            enum AVMediaType codec_type, unsigned int sequence,
+                            int discont);
+// pkt must be in the track timescale, it is referenced, not copied
+int yp_fragment_add(YPFragmentWriter *w, const AVPacket *pkt);
+// Lay out the pending fragment: iov[0] holds the boxes up to the mdat
+// payload, the other entries the sample payloads. *nb_iov is 0 when there
+// is nothing to write.
+int yp_fragment_build(YPFragmentWriter *w, struct iovec **iov, int *nb_iov, int64_t *size);
+// Drop the pending samples once written and move on to the next fragment
+void yp_fragment_next(YPFragmentWriter *w);
+void yp_fragment_writer_free(YPFragmentWriter *w);
+
+#endif // YP_FRAGMENT_H_
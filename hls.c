@@ -0,0 +1,432 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <libavutil/mathematics.h>
+
+#include "hls.h"
+#include "segtable.h"
+#include "strbuf.h"
+#include "utils.h"
+#include "log.h"
+
+#define HLS_VERSION         7
+#define HLS_AUDIO_GROUP     "audio"
+
+// Media playlist of one representation
+typedef struct HLSPlaylist {
+    int id;
+    int is_video;
+    int is_audio;
+    char codecs[100];
+    int width;
+    int height;
+    AVRational frame_rate;
+    // Segment durations are counted in the time base of the stream
+    AVRational time_base;
+    int64_t bit_rate;
+    int64_t init_pos;
+    int64_t init_size;
+    YPSegmentTable segments;
+    int64_t max_duration;   // ms
+    int64_t total_duration; // ms
+    int64_t total_size;
+    int64_t peak_bit_rate;
+} HLSPlaylist;
+
+typedef struct HLSContext {
+    YPSink *sink;
+    int single_file;
+    int live;
+    // Target duration floor in live mode, playlists are rewritten long
+    // before the longest segment is known
+    int seg_duration;
+    int ended;
+    int master_written;
+    unsigned int nb_playlists;
+    HLSPlaylist *playlists;
+    // Playlist text, reused by every update
+    YPStrBuf out;
+    // Serializes add_segment calls coming from concurrent muxers
+    pthread_mutex_t lock;
+} HLSContext;
+
+static void hls_free(HLSContext *hls)
+{
+    unsigned int i;
+
+    for (i = 0; i < hls->nb_playlists; i++)
+        yp_segtable_free(&hls->playlists[i].segments);
+    free(hls->playlists);
+    pthread_mutex_destroy(&hls->lock);
+    yp_strbuf_free(&hls->out);
+    free(hls);
+}
+
+static int hls_init(YPIndexHandlerClass *self, YPConfig *config)
+{
+    HLSContext *hls = malloc(sizeof(HLSContext));
+    unsigned int i;
+
+    if (hls == NULL)
+        return -1;
+
+    hls->sink = config->sink;
+    hls->single_file = config->single_file;
+    hls->live = config->live;
+    hls->seg_duration = config->seg_duration;
+    hls->ended = 0;
+    hls->master_written = 0;
+    hls->nb_playlists = 0;
+    yp_strbuf_init(&hls->out);
+    pthread_mutex_init(&hls->lock, NULL);
+
+    hls->playlists = calloc(config->nb_instreams, sizeof(HLSPlaylist));
+
+    if (hls->playlists == NULL) {
+        hls_free(hls);
+        return -2;
+    }
+
+    for (i = 0; i < config->nb_instreams; i++) {
+        YPInputStream *instream = config->instreams[i];
+        AVStream *st = instream->ctx->streams[instream->stream_idx];
+        HLSPlaylist *pl = &hls->playlists[hls->nb_playlists++];
+
+        pl->id = instream->stream_id;
+        pl->is_video = instream->is_video;
+        pl->is_audio = instream->is_audio;
+        set_rfc6381_codec_name(st->codecpar, pl->codecs, sizeof(pl->codecs));
+        if (instream->in_band_ps)
+            memcpy(pl->codecs, "avc3", 4);
+        pl->width = st->codecpar->width;
+        pl->height = st->codecpar->height;
+        pl->frame_rate = st->avg_frame_rate;
+        pl->time_base = st->time_base;
+        pl->bit_rate = st->codecpar->bit_rate;
+        yp_segtable_init(&pl->segments);
+    }
+
+    self->opaque = hls;
+    return 0;
+}
+
+static HLSPlaylist *hls_find_playlist(HLSContext *hls, YPInputStream *instream)
+{
+    unsigned int i;
+
+    for (i = 0; i < hls->nb_playlists; i++) {
+        if (hls->playlists[i].id == instream->stream_id)
+            return &hls->playlists[i];
+    }
+
+    return NULL;
+}
+
+// "<size>@<pos>" byte range attribute value
+static void put_byterange(YPStrBuf *out, int64_t pos, int64_t size)
+{
+    yp_strbuf_put_int(out, size);
+    yp_strbuf_puts(out, "@");
+    yp_strbuf_put_int(out, pos);
+}
+
+// Peak bit rate as far as known: players pick variants from BANDWIDTH and
+// streams often don't declare one
+static int64_t playlist_bandwidth(const HLSPlaylist *pl)
+{
+    return FFMAX(pl->bit_rate, pl->peak_bit_rate);
+}
+
+static int hls_write(HLSContext *hls, const char *name)
+{
+    int ret;
+
+    if (hls->out.error) {
+        yp_log(YP_LOG_HLS, YP_LOG_ERROR, "Out of memory while generating %s\n", name);
+        return AVERROR(ENOMEM);
+    }
+
+    if ((ret = yp_sink_put(hls->sink, name, hls->out.data, hls->out.len)) < 0) {
+        yp_log(YP_LOG_HLS, YP_LOG_ERROR, "Could not publish playlist %s\n", name);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Write the media playlist of pl for the segments known so far. Must be
+ * called with hls->lock held.
+ */
+static int hls_write_media_playlist(HLSContext *hls, HLSPlaylist *pl)
+{
+    YPStrBuf *out = &hls->out;
+    const YPSegmentTable *t = &pl->segments;
+    char filename[64];
+    int64_t target;
+    unsigned int i;
+
+    // Every EXTINF rounded to the nearest second must fit in the target
+    // duration, which must not change from one live update to the next
+    target = FFMAX((pl->max_duration + 500) / 1000, 1);
+    if (hls->live)
+        target = FFMAX(target, (hls->seg_duration + 999) / 1000);
+
+    yp_strbuf_reset(out);
+    yp_strbuf_puts(out, "#EXTM3U\n");
+    yp_strbuf_puts(out, "#EXT-X-VERSION:");
+    yp_strbuf_put_int(out, HLS_VERSION);
+    yp_strbuf_puts(out, "\n#EXT-X-TARGETDURATION:");
+    yp_strbuf_put_int(out, target);
+    yp_strbuf_puts(out, "\n#EXT-X-MEDIA-SEQUENCE:0\n");
+    yp_strbuf_puts(out, hls->live ? "#EXT-X-PLAYLIST-TYPE:EVENT\n" : "#EXT-X-PLAYLIST-TYPE:VOD\n");
+    yp_strbuf_puts(out, "#EXT-X-INDEPENDENT-SEGMENTS\n");
+
+    // Same layout as the muxer, relative to the playlist
+    if (hls->single_file) {
+        yp_strbuf_puts(out, "#EXT-X-MAP:URI=\"media.mp4\",BYTERANGE=\"");
+        put_byterange(out, pl->init_pos, pl->init_size);
+        yp_strbuf_puts(out, "\"\n");
+    } else {
+        yp_strbuf_puts(out, "#EXT-X-MAP:URI=\"init.mp4\"\n");
+    }
+
+    for (i = 0; i < t->nb_segments; i++) {
+        yp_strbuf_puts(out, "#EXTINF:");
+        yp_strbuf_put_milli(out, av_rescale_q(t->duration[i], pl->time_base, (AVRational) { 1, 1000 }));
+        yp_strbuf_puts(out, ",\n");
+
+        if (hls->single_file) {
+            yp_strbuf_puts(out, "#EXT-X-BYTERANGE:");
+            put_byterange(out, t->pos[i], t->size[i]);
+            yp_strbuf_puts(out, "\nmedia.mp4\n");
+        } else {
+            yp_strbuf_puts(out, "seg-");
+            yp_strbuf_put_int(out, t->num[i]);
+            yp_strbuf_puts(out, ".m4s\n");
+        }
+    }
+
+    if (hls->ended)
+        yp_strbuf_puts(out, "#EXT-X-ENDLIST\n");
+
+    snprintf(filename, sizeof(filename), "%d/playlist.m3u8", pl->id);
+
+    return hls_write(hls, filename);
+}
+
+static void hls_output_stream_inf(YPStrBuf *out, const HLSPlaylist *pl,
+                                  const HLSPlaylist *audio)
+{
+    int64_t bandwidth = playlist_bandwidth(pl);
+    int64_t average = pl->total_duration ? pl->total_size * 8000 / pl->total_duration : 0;
+
+    // A variant is played along with the audio rendition: advertise both
+    if (audio) {
+        bandwidth += playlist_bandwidth(audio);
+        if (average)
+            average += audio->total_duration ? audio->total_size * 8000 / audio->total_duration : 0;
+    }
+
+    yp_strbuf_puts(out, "#EXT-X-STREAM-INF:BANDWIDTH=");
+    yp_strbuf_put_int(out, bandwidth);
+
+    if (average) {
+        yp_strbuf_puts(out, ",AVERAGE-BANDWIDTH=");
+        yp_strbuf_put_int(out, average);
+    }
+
+    yp_strbuf_puts(out, ",CODECS=\"");
+    yp_strbuf_puts(out, pl->codecs);
+
+    if (audio) {
+        yp_strbuf_puts(out, ",");
+        yp_strbuf_puts(out, audio->codecs);
+    }
+
+    yp_strbuf_puts(out, "\"");
+
+    if (pl->is_video) {
+        yp_strbuf_puts(out, ",RESOLUTION=");
+        yp_strbuf_put_int(out, pl->width);
+        yp_strbuf_puts(out, "x");
+        yp_strbuf_put_int(out, pl->height);
+
+        if (pl->frame_rate.num > 0 && pl->frame_rate.den > 0) {
+            yp_strbuf_puts(out, ",FRAME-RATE=");
+            yp_strbuf_put_milli(out, av_rescale(pl->frame_rate.num, 1000, pl->frame_rate.den));
+        }
+    }
+
+    if (audio)
+        yp_strbuf_puts(out, ",AUDIO=\""HLS_AUDIO_GROUP"\"");
+
+    yp_strbuf_puts(out, "\n");
+    yp_strbuf_put_int(out, pl->id);
+    yp_strbuf_puts(out, "/playlist.m3u8\n");
+}
+
+/**
+ * Write the master playlist: one variant per video representation, with
+ * the audio representations as renditions of a single group. Audio only
+ * presentations get one variant per audio representation instead. Must be
+ * called with hls->lock held.
+ */
+static int hls_write_master_playlist(HLSContext *hls)
+{
+    YPStrBuf *out = &hls->out;
+    const HLSPlaylist *audio = NULL;
+    int has_video = 0;
+    unsigned int i;
+
+    for (i = 0; i < hls->nb_playlists; i++) {
+        const HLSPlaylist *pl = &hls->playlists[i];
+
+        has_video |= pl->is_video;
+
+        // Variants must be able to carry the most demanding rendition
+        if (pl->is_audio && (!audio || playlist_bandwidth(pl) > playlist_bandwidth(audio)))
+            audio = pl;
+    }
+
+    yp_strbuf_reset(out);
+    yp_strbuf_puts(out, "#EXTM3U\n");
+    yp_strbuf_puts(out, "#EXT-X-VERSION:");
+    yp_strbuf_put_int(out, HLS_VERSION);
+    yp_strbuf_puts(out, "\n#EXT-X-INDEPENDENT-SEGMENTS\n");
+
+    if (has_video) {
+        int is_default = 1;
+
+        for (i = 0; i < hls->nb_playlists; i++) {
+            const HLSPlaylist *pl = &hls->playlists[i];
+
+            if (!pl->is_audio)
+                continue;
+
+            yp_strbuf_puts(out, "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\""HLS_AUDIO_GROUP"\",NAME=\"");
+            yp_strbuf_put_int(out, pl->id);
+            yp_strbuf_puts(out, is_default ? "\",DEFAULT=YES" : "\",DEFAULT=NO");
+            yp_strbuf_puts(out, ",AUTOSELECT=YES,URI=\"");
+            yp_strbuf_put_int(out, pl->id);
+            yp_strbuf_puts(out, "/playlist.m3u8\"\n");
+            is_default = 0;
+        }
+    }
+
+    for (i = 0; i < hls->nb_playlists; i++) {
+        const HLSPlaylist *pl = &hls->playlists[i];
+
+        if (has_video && pl->is_video)
+            hls_output_stream_inf(out, pl, audio);
+        else if (!has_video && pl->is_audio)
+            hls_output_stream_inf(out, pl, NULL);
+    }
+
+    return hls_write(hls, "master.m3u8");
+}
+
+static int hls_add_init_segment(YPIndexHandlerClass *self, YPInputStream *instream,
+                                char *filename, int64_t pos, int64_t size)
+{
+    HLSContext *hls = self->opaque;
+    HLSPlaylist *pl = hls_find_playlist(hls, instream);
+
+    if (pl == NULL)
+        return -1;
+
+    pthread_mutex_lock(&hls->lock);
+    pl->init_pos = pos;
+    pl->init_size = size;
+    pthread_mutex_unlock(&hls->lock);
+
+    return 0;
+}
+
+static int hls_add_segment(YPIndexHandlerClass *self, YPInputStream *instream, char *filename,
+                           int64_t pos, int64_t size, int64_t duration, int num)
+{
+    HLSContext *hls = self->opaque;
+    HLSPlaylist *pl = hls_find_playlist(hls, instream);
+    int64_t ms;
+    int ret;
+
+    if (pl == NULL)
+        return -1;
+
+    ms = av_rescale_q(duration, pl->time_base, (AVRational) { 1, 1000 });
+
+    pthread_mutex_lock(&hls->lock);
+
+    ret = yp_segtable_append(&pl->segments, duration, pos, size, num);
+
+    if (ret >= 0) {
+        pl->max_duration = FFMAX(pl->max_duration, ms);
+        pl->total_duration += ms;
+        pl->total_size += size;
+        if (ms > 0)
+            pl->peak_bit_rate = FFMAX(pl->peak_bit_rate, size * 8000 / ms);
+
+        // Publish the segment right away, the master playlist only once
+        // the directories of the representations exist
+        if (hls->live) {
+            ret = hls_write_media_playlist(hls, pl);
+
+            if (ret >= 0 && !hls->master_written) {
+                ret = hls_write_master_playlist(hls);
+                hls->master_written = ret >= 0;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&hls->lock);
+
+    return ret;
+}
+
+static int hls_finalize(YPIndexHandlerClass *self)
+{
+    HLSContext *hls = self->opaque;
+    unsigned int i;
+    int ret = 0;
+
+    pthread_mutex_lock(&hls->lock);
+
+    hls->ended = 1;
+
+    for (i = 0; i < hls->nb_playlists && ret >= 0; i++)
+        ret = hls_write_media_playlist(hls, &hls->playlists[i]);
+
+    // Bandwidths are exact now that every segment is known
+    if (ret >= 0)
+        ret = hls_write_master_playlist(hls);
+
+    pthread_mutex_unlock(&hls->lock);
+
+    return ret;
+}
+
+YPIndexHandlerClass* yp_hls_generator(void)
+{
+    YPIndexHandlerClass *ih = (YPIndexHandlerClass *) malloc(sizeof(YPIndexHandlerClass));
+
+    if (ih) {
+        ih->opaque = NULL;
+        ih->init = &hls_init;
+        ih->add_init_segment = &hls_add_init_segment;
+        ih->set_index_range = NULL;
+        ih->add_segment = &hls_add_segment;
+        ih->finalize = &hls_finalize;
+        return ih;
+    }
+
+    return NULL;
+}
+
+void yp_hls_generator_free(YPIndexHandlerClass *self)
+{
+    if (self->opaque != NULL)
+        hls_free((HLSContext *) self->opaque);
+    free(self);
+}
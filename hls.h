@@ -0,0 +1,20 @@
+#ifndef YP_HLS_H_
+#define YP_HLS_H_
+
+#include "common.h"
+
+/**
+ * Index handler writing fMP4 HLS playlists for the same segments as the
+ * MPD: master.m3u8 in the output directory and a media playlist
+ * <id>/playlist.m3u8 next to the files of every representation. Segments
+ * are listed by file, with EXT-X-MAP pointing at init.mp4, or as byte
+ * ranges of media.mp4 in single file mode. Live playlists are rewritten on
+ * every new segment.
+ *
+ * Representation ids are those of the MPD generator, which must be
+ * initialized first, see yp_index_list().
+ */
+YPIndexHandlerClass* yp_hls_generator(void);
+void yp_hls_generator_free(YPIndexHandlerClass *self);
+
+#endif // YP_HLS_H_
@@ -0,0 +1,706 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "sink.h"
+#include "log.h"
+
+// Objects sent back to back on one connection before reading the answers
+#define MAX_BATCH       16
+#define MAX_ATTEMPTS    3
+// Muxers wait once this much is waiting for upload
+#define MAX_QUEUED_BYTES (64 << 20)
+#define IO_TIMEOUT      30 // seconds
+
+typedef struct Upload {
+    char *name;
+    uint8_t *data;
+    int size;
+    YPWriteDone done;
+    void *opaque;
+    int status;
+    struct Upload *next;
+} Upload;
+
+struct HTTPSink;
+
+// Upload thread with its connection, kept open from one batch to the next,
+// and the objects waiting for it
+typedef struct Uploader {
+    struct HTTPSink *sink;
+    pthread_t thread;
+    pthread_cond_t upload_available;
+    Upload *head;
+    Upload *tail;
+    int fd;
+    char buf[4096];
+    int buf_pos;
+    int buf_len;
+} Uploader;
+
+typedef struct HTTPSink {
+    char host[256];
+    char port[8];
+    // Path objects are put below, without trailing slash
+    char path[1024];
+    const char *method;
+    // PUT is idempotent: its requests can be pipelined, and sent again
+    // when the connection drops before the answer comes
+    int pipeline;
+    YPSinkObjects objects;
+    pthread_mutex_t lock;
+    pthread_cond_t room_available;
+    pthread_cond_t idle;
+    int64_t queued_bytes;
+    unsigned int nb_queued;
+    unsigned int nb_active;
+    int stop;
+    // First failed upload, returned by flush() and close() from then on
+    int error;
+    Uploader *uploaders;
+    unsigned int nb_uploaders;
+    uint64_t nb_objects;
+    uint64_t nb_bytes;
+    uint64_t nb_requests;
+    uint64_t nb_batches;
+    uint64_t nb_connections;
+    uint64_t nb_retries;
+    uint64_t nb_failures;
+} HTTPSink;
+
+// Set on upload threads: they call done callbacks, which may store more
+// objects, and must never wait for room in the queue they drain
+static __thread int is_uploader;
+
+static int parse_url(HTTPSink *h, const char *url)
+{
+    const char *host, *port, *path;
+    size_t len;
+
+    if (strncmp(url, "http://", 7))
+        return AVERROR(EINVAL);
+
+    host = url + 7;
+    path = strchr(host, '/');
+    if (path == NULL)
+        path = host + strlen(host);
+    port = memchr(host, ':', path - host);
+
+    len = (port ? port : path) - host;
+    if (len == 0 || len >= sizeof(h->host))
+        return AVERROR(EINVAL);
+    memcpy(h->host, host, len);
+    h->host[len] = '\0';
+
+    if (port) {
+        len = path - port - 1;
+        if (len == 0 || len >= sizeof(h->port))
+            return AVERROR(EINVAL);
+        memcpy(h->port, port + 1, len);
+        h->port[len] = '\0';
+    } else {
+        strcpy(h->port, "80");
+    }
+
+    snprintf(h->path, sizeof(h->path), "%s", path);
+    len = strlen(h->path);
+    while (len > 0 && h->path[len - 1] == '/')
+        h->path[--len] = '\0';
+
+    return 0;
+}
+
+static int uploader_connect(Uploader *u)
+{
+    HTTPSink *h = u->sink;
+    struct addrinfo hints = { 0 }, *res, *ai;
+    struct timeval tv = { IO_TIMEOUT, 0 };
+    int one = 1;
+    int ret;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((ret = getaddrinfo(h->host, h->port, &hints, &res)) != 0) {
+        yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Could not resolve %s: %s\n", h->host, gai_strerror(ret));
+        return AVERROR(EHOSTUNREACH);
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        u->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+        if (u->fd < 0)
+            continue;
+
+        if (connect(u->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+
+        close(u->fd);
+        u->fd = -1;
+    }
+
+    freeaddrinfo(res);
+
+    if (u->fd < 0) {
+        yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Could not connect to %s:%s\n", h->host, h->port);
+        return AVERROR(ECONNREFUSED);
+    }
+
+    setsockopt(u->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(u->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(u->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    u->buf_pos = u->buf_len = 0;
+
+    pthread_mutex_lock(&h->lock);
+    h->nb_connections++;
+    pthread_mutex_unlock(&h->lock);
+
+    return 0;
+}
+
+static void uploader_disconnect(Uploader *u)
+{
+    if (u->fd >= 0)
+        close(u->fd);
+    u->fd = -1;
+}
+
+static const char *content_type(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    if (ext == NULL)
+        return "application/octet-stream";
+    if (!strcmp(ext, ".mpd"))
+        return "application/dash+xml";
+    if (!strcmp(ext, ".m3u8"))
+        return "application/vnd.apple.mpegurl";
+    if (!strcmp(ext, ".m4s"))
+        return "video/iso.segment";
+    if (!strcmp(ext, ".mp4"))
+        return "video/mp4";
+    return "application/octet-stream";
+}
+
+// Send the request for up, headers and body in as few system calls as
+// the socket allows
+static int send_request(Uploader *u, const Upload *up)
+{
+    HTTPSink *h = u->sink;
+    char header[2048];
+    struct iovec iov[2];
+    struct msghdr msg = { 0 };
+    int len;
+    ssize_t n;
+
+    len = snprintf(header, sizeof(header),
+                   "%s %s/%s HTTP/1.1\r\n"
+                   "Host: %s:%s\r\n"
+                   "Content-Type: %s\r\n"
+                   "Content-Length: %d\r\n"
+                   "\r\n",
+                   h->method, h->path, up->name, h->host, h->port,
+                   content_type(up->name), up->size);
+
+    if (len >= (int) sizeof(header))
+        return AVERROR(ENAMETOOLONG);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = len;
+    iov[1].iov_base = up->data;
+    iov[1].iov_len = up->size;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (msg.msg_iovlen > 0) {
+        n = sendmsg(u->fd, &msg, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+
+        while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static int fill_buffer(Uploader *u)
+{
+    ssize_t n;
+
+    do {
+        n = recv(u->fd, u->buf, sizeof(u->buf), 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0)
+        return n < 0 ? AVERROR(errno) : AVERROR_EOF;
+
+    u->buf_pos = 0;
+    u->buf_len = (int) n;
+
+    return 0;
+}
+
+// Read a CRLF terminated line, without its end
+static int read_line(Uploader *u, char *line, int size)
+{
+    int len = 0, ret;
+
+    for (;;) {
+        char c;
+
+        if (u->buf_pos == u->buf_len && (ret = fill_buffer(u)) < 0)
+            return ret;
+
+        c = u->buf[u->buf_pos++];
+
+        if (c == '\n')
+            break;
+        if (c != '\r' && len < size - 1)
+            line[len++] = c;
+    }
+
+    line[len] = '\0';
+
+    return len;
+}
+
+static int skip_bytes(Uploader *u, int64_t n)
+{
+    int ret;
+
+    while (n > 0) {
+        int chunk;
+
+        if (u->buf_pos == u->buf_len && (ret = fill_buffer(u)) < 0)
+            return ret;
+
+        chunk = (int) FFMIN(n, u->buf_len - u->buf_pos);
+        u->buf_pos += chunk;
+        n -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * Read the answer to one request and return its status code. *keep_alive
+ * is cleared when the server closes the connection after it.
+ */
+static int read_response(Uploader *u, int *keep_alive)
+{
+    char line[1024];
+    int64_t content_length = -1;
+    int chunked = 0;
+    int status, ret;
+
+    if ((ret = read_line(u, line, sizeof(line))) < 0)
+        return ret;
+
+    if (sscanf(line, "HTTP/1.%*d %d", &status) != 1)
+        return AVERROR_INVALIDDATA;
+
+    *keep_alive = strncmp(line, "HTTP/1.0", 8) != 0;
+
+    while ((ret = read_line(u, line, sizeof(line))) > 0) {
+        if (!strncasecmp(line, "Content-Length:", 15))
+            content_length = strtoll(line + 15, NULL, 10);
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line + 18, "chunked"))
+            chunked = 1;
+        else if (!strncasecmp(line, "Connection:", 11))
+            *keep_alive = strstr(line + 11, "close") == NULL;
+    }
+
+    if (ret < 0)
+        return ret;
+
+    if (chunked) {
+        int64_t size;
+
+        do {
+            if ((ret = read_line(u, line, sizeof(line))) < 0)
+                return ret;
+            size = strtoll(line, NULL, 16);
+            if ((ret = skip_bytes(u, size)) < 0 ||
+                    (size > 0 && (ret = read_line(u, line, sizeof(line))) < 0))
+                return ret;
+        } while (size > 0);
+
+        // Trailers
+        while ((ret = read_line(u, line, sizeof(line))) > 0)
+            ;
+        if (ret < 0)
+            return ret;
+    } else if (content_length > 0) {
+        if ((ret = skip_bytes(u, content_length)) < 0)
+            return ret;
+    } else if (content_length < 0) {
+        // Body up to the end of the connection, nothing we care about
+        *keep_alive = 0;
+    }
+
+    return status;
+}
+
+/**
+ * Upload a batch of objects over the connection of u, reconnecting as
+ * needed. With pipelining every request of the batch is sent before the
+ * first answer is read. Objects left without an answer when the
+ * connection drops are sent again.
+ */
+static void upload_batch(Uploader *u, Upload **batch, int nb)
+{
+    HTTPSink *h = u->sink;
+    int failures = 0, i, first = 0;
+    int keep_alive = 1;
+    int ret = 0;
+
+    while (first < nb && failures < MAX_ATTEMPTS) {
+        int start = first, sent = first;
+
+        if (u->fd < 0 && (ret = uploader_connect(u)) < 0) {
+            av_usleep(100000 << failures++);
+            continue;
+        }
+
+        while (first < nb) {
+            // Keep the whole batch in flight, one request without
+            // pipelining
+            while (sent < nb && (sent == first || h->pipeline)) {
+                if ((ret = send_request(u, batch[sent])) < 0)
+                    break;
+                sent++;
+            }
+
+            if (sent == first)
+                break;
+
+            if ((ret = read_response(u, &keep_alive)) < 0)
+                break;
+
+            pthread_mutex_lock(&h->lock);
+            h->nb_requests++;
+            pthread_mutex_unlock(&h->lock);
+
+            if (ret < 200 || ret > 299) {
+                yp_log(YP_LOG_SINK, YP_LOG_ERROR, "%s %s/%s: HTTP status %d\n",
+                       h->method, h->path, batch[first]->name, ret);
+                batch[first]->status = AVERROR(EIO);
+            } else {
+                batch[first]->status = 0;
+            }
+
+            first++;
+
+            if (!keep_alive)
+                break;
+        }
+
+        // Answers still owed on this connection will never come: send
+        // those requests again on a new one
+        if (ret < 0 || !keep_alive || first < nb) {
+            uploader_disconnect(u);
+            keep_alive = 1;
+
+            if (first < nb) {
+                pthread_mutex_lock(&h->lock);
+                h->nb_retries += sent - first;
+                pthread_mutex_unlock(&h->lock);
+            }
+        }
+
+        // A server closing the connection after every answer still
+        // makes progress
+        if (first == start)
+            failures++;
+    }
+
+    for (i = first; i < nb; i++) {
+        yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Could not upload %s/%s: %s\n",
+               h->path, batch[i]->name, av_err2str(ret < 0 ? ret : AVERROR(EIO)));
+        batch[i]->status = ret < 0 ? ret : AVERROR(EIO);
+    }
+}
+
+// Objects of one directory, e.g. the segments of a representation, go
+// through the same uploader, so that they are stored and announced in the
+// order they were closed
+static Uploader *uploader_for(HTTPSink *h, const char *name)
+{
+    const char *end = strrchr(name, '/');
+    unsigned int key = 0;
+
+    for (; end && name < end; name++)
+        key = key * 31 + (unsigned char) *name;
+
+    return &h->uploaders[key % h->nb_uploaders];
+}
+
+static void *uploader_thread(void *arg)
+{
+    Uploader *u = arg;
+    HTTPSink *h = u->sink;
+    Upload *batch[MAX_BATCH];
+    int nb, i, status;
+
+    is_uploader = 1;
+
+    pthread_mutex_lock(&h->lock);
+
+    for (;;) {
+        while (u->head == NULL && !h->stop)
+            pthread_cond_wait(&u->upload_available, &h->lock);
+
+        if (u->head == NULL)
+            break;
+
+        // POST isn't pipelined, one object at a time still reuses the
+        // connection
+        for (nb = 0; u->head && nb < (h->pipeline ? MAX_BATCH : 1); nb++) {
+            batch[nb] = u->head;
+            u->head = u->head->next;
+            h->queued_bytes -= batch[nb]->size;
+            h->nb_queued--;
+        }
+        if (u->head == NULL)
+            u->tail = NULL;
+
+        h->nb_active++;
+        h->nb_batches++;
+        pthread_cond_broadcast(&h->room_available);
+        pthread_mutex_unlock(&h->lock);
+
+        upload_batch(u, batch, nb);
+
+        for (i = 0; i < nb; i++) {
+            Upload *up = batch[i];
+
+            pthread_mutex_lock(&h->lock);
+            if (up->status < 0) {
+                h->nb_failures++;
+                if (h->error >= 0)
+                    h->error = up->status;
+            } else {
+                h->nb_objects++;
+                h->nb_bytes += up->size;
+            }
+            // Once an object is missing, those stored after it aren't
+            // announced either: segment lists have no holes
+            status = h->error < 0 ? h->error : up->status;
+            pthread_mutex_unlock(&h->lock);
+
+            if (up->done)
+                up->done(up->opaque, status);
+
+            free(up->name);
+            av_free(up->data);
+            free(up);
+        }
+
+        pthread_mutex_lock(&h->lock);
+        h->nb_active--;
+        if (h->nb_queued == 0 && h->nb_active == 0)
+            pthread_cond_broadcast(&h->idle);
+    }
+
+    pthread_mutex_unlock(&h->lock);
+
+    uploader_disconnect(u);
+
+    return NULL;
+}
+
+static int http_open(YPSink *self, AVIOContext **pb, const char *name)
+{
+    HTTPSink *h = self->opaque;
+
+    return yp_sink_objects_open(&h->objects, pb, name);
+}
+
+static int http_close(YPSink *self, AVIOContext *pb, YPWriteDone done, void *opaque)
+{
+    HTTPSink *h = self->opaque;
+    char *name = yp_sink_objects_remove(&h->objects, pb);
+    uint8_t *data = NULL;
+    int size = avio_close_dyn_buf(pb, &data);
+    Upload *up;
+    Uploader *u;
+    int error;
+
+    pthread_mutex_lock(&h->lock);
+    error = h->error;
+    pthread_mutex_unlock(&h->lock);
+
+    // The run fails with the first object that could not be stored
+    if (name == NULL || error < 0 || (up = malloc(sizeof(Upload))) == NULL) {
+        int ret = name == NULL ? AVERROR(EINVAL) : error < 0 ? error : AVERROR(ENOMEM);
+
+        free(name);
+        av_free(data);
+        if (done)
+            done(opaque, ret);
+        return ret;
+    }
+
+    up->name = name;
+    up->data = data;
+    up->size = size;
+    up->done = done;
+    up->opaque = opaque;
+    up->status = 0;
+    up->next = NULL;
+    u = uploader_for(h, name);
+
+    pthread_mutex_lock(&h->lock);
+
+    while (!is_uploader && h->queued_bytes > 0 && h->queued_bytes + size > MAX_QUEUED_BYTES)
+        pthread_cond_wait(&h->room_available, &h->lock);
+
+    if (u->tail)
+        u->tail->next = up;
+    else
+        u->head = up;
+    u->tail = up;
+    h->queued_bytes += size;
+    h->nb_queued++;
+
+    pthread_cond_signal(&u->upload_available);
+    pthread_mutex_unlock(&h->lock);
+
+    return 0;
+}
+
+static int http_flush(YPSink *self)
+{
+    HTTPSink *h = self->opaque;
+    int ret;
+
+    pthread_mutex_lock(&h->lock);
+    while (h->nb_queued > 0 || h->nb_active > 0)
+        pthread_cond_wait(&h->idle, &h->lock);
+    ret = h->error;
+    pthread_mutex_unlock(&h->lock);
+
+    return ret;
+}
+
+static void http_free(YPSink *self)
+{
+    HTTPSink *h = self->opaque;
+    unsigned int i;
+
+    pthread_mutex_lock(&h->lock);
+    h->stop = 1;
+    for (i = 0; i < h->nb_uploaders; i++)
+        pthread_cond_broadcast(&h->uploaders[i].upload_available);
+    pthread_mutex_unlock(&h->lock);
+
+    // Whatever is queued still goes out
+    for (i = 0; i < h->nb_uploaders; i++) {
+        pthread_join(h->uploaders[i].thread, NULL);
+        pthread_cond_destroy(&h->uploaders[i].upload_available);
+    }
+
+    yp_log(YP_LOG_SINK, YP_LOG_INFO, "Uploaded %"PRIu64" objects, %"PRIu64" bytes in %"PRIu64" requests, "
+           "%"PRIu64" batches over %"PRIu64" connections, %"PRIu64" retries, %"PRIu64" failures\n",
+           h->nb_objects, h->nb_bytes, h->nb_requests, h->nb_batches, h->nb_connections,
+           h->nb_retries, h->nb_failures);
+
+    yp_sink_objects_uninit(&h->objects);
+    pthread_cond_destroy(&h->room_available);
+    pthread_cond_destroy(&h->idle);
+    pthread_mutex_destroy(&h->lock);
+    free(h->uploaders);
+    free(h);
+    free(self);
+}
+
+YPSink* yp_sink_http(const char *base_url, const char *method, unsigned int nb_connections)
+{
+    YPSink *sink = malloc(sizeof(YPSink));
+    HTTPSink *h = calloc(1, sizeof(HTTPSink));
+    unsigned int i;
+
+    if (sink == NULL || h == NULL)
+        goto fail;
+
+    if (parse_url(h, base_url) < 0) {
+        yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Invalid upload URL '%s', expected http://host[:port][/path]\n",
+               base_url);
+        goto fail;
+    }
+
+    h->method = method;
+    h->pipeline = !strcmp(method, "PUT");
+    h->nb_uploaders = FFMAX(nb_connections, 1);
+    h->uploaders = calloc(h->nb_uploaders, sizeof(Uploader));
+
+    if (h->uploaders == NULL)
+        goto fail;
+
+    yp_sink_objects_init(&h->objects);
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->room_available, NULL);
+    pthread_cond_init(&h->idle, NULL);
+
+    for (i = 0; i < h->nb_uploaders; i++) {
+        h->uploaders[i].sink = h;
+        h->uploaders[i].fd = -1;
+        pthread_cond_init(&h->uploaders[i].upload_available, NULL);
+
+        if (pthread_create(&h->uploaders[i].thread, NULL, uploader_thread, &h->uploaders[i]) != 0) {
+            // Threads started so far are enough
+            pthread_cond_destroy(&h->uploaders[i].upload_available);
+            h->nb_uploaders = i;
+            break;
+        }
+    }
+
+    sink->opaque = h;
+    sink->root = NULL;
+    sink->open = &http_open;
+    sink->close = &http_close;
+    sink->flush = &http_flush;
+    sink->free = &http_free;
+
+    if (h->nb_uploaders == 0) {
+        http_free(sink);
+        return NULL;
+    }
+
+    return sink;
+
+fail:
+    if (h)
+        free(h->uploaders);
+    free(h);
+    free(sink);
+    return NULL;
+}
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "indexlist.h"
+
+typedef struct IndexList {
+    YPIndexHandlerClass **handlers;
+    unsigned int nb_handlers;
+} IndexList;
+
+static int list_init(YPIndexHandlerClass *self, YPConfig *config)
+{
+    IndexList *list = self->opaque;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < list->nb_handlers; i++) {
+        if ((ret = list->handlers[i]->init(list->handlers[i], config)) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+// Every handler gets the call even if an earlier one failed, the first
+// error is returned
+static int list_add_init_segment(YPIndexHandlerClass *self, YPInputStream *instream,
+                                 char *filename, int64_t pos, int64_t size)
+{
+    IndexList *list = self->opaque;
+    unsigned int i;
+    int ret = 0, err;
+
+    for (i = 0; i < list->nb_handlers; i++) {
+        YPIndexHandlerClass *h = list->handlers[i];
+
+        if (h->add_init_segment &&
+                (err = h->add_init_segment(h, instream, filename, pos, size)) < 0 && ret >= 0)
+            ret = err;
+    }
+
+    return ret;
+}
+
+static int list_set_index_range(YPIndexHandlerClass *self, YPInputStream *instream,
+                                int64_t pos, int64_t size)
+{
+    IndexList *list = self->opaque;
+    unsigned int i;
+    int ret = 0, err;
+
+    for (i = 0; i < list->nb_handlers; i++) {
+        YPIndexHandlerClass *h = list->handlers[i];
+
+        if (h->set_index_range &&
+                (err = h->set_index_range(h, instream, pos, size)) < 0 && ret >= 0)
+            ret = err;
+    }
+
+    return ret;
+}
+
+static int list_add_segment(YPIndexHandlerClass *self, YPInputStream *instream,
+                            char *filename, int64_t pos, int64_t size,
+                            int64_t duration, int num)
+{
+    IndexList *list = self->opaque;
+    unsigned int i;
+    int ret = 0, err;
+
+    for (i = 0; i < list->nb_handlers; i++) {
+        YPIndexHandlerClass *h = list->handlers[i];
+
+        if ((err = h->add_segment(h, instream, filename, pos, size, duration, num)) < 0 &&
+                ret >= 0)
+            ret = err;
+    }
+
+    return ret;
+}
+
+static int list_finalize(YPIndexHandlerClass *self)
+{
+    IndexList *list = self->opaque;
+    unsigned int i;
+    int ret = 0, err;
+
+    for (i = 0; i < list->nb_handlers; i++) {
+        if ((err = list->handlers[i]->finalize(list->handlers[i])) < 0 && ret >= 0)
+            ret = err;
+    }
+
+    return ret;
+}
+
+YPIndexHandlerClass* yp_index_list(YPIndexHandlerClass **handlers, unsigned int nb_handlers)
+{
+    YPIndexHandlerClass *ih = malloc(sizeof(YPIndexHandlerClass));
+    IndexList *list = malloc(sizeof(IndexList));
+
+    if (ih == NULL || list == NULL ||
+            (list->handlers = malloc(nb_handlers * sizeof(*list->handlers))) == NULL) {
+        free(list);
+        free(ih);
+        return NULL;
+    }
+
+    memcpy(list->handlers, handlers, nb_handlers * sizeof(*list->handlers));
+    list->nb_handlers = nb_handlers;
+
+    ih->opaque = list;
+    ih->init = &list_init;
+    ih->add_init_segment = &list_add_init_segment;
+    ih->set_index_range = &list_set_index_range;
+    ih->add_segment = &list_add_segment;
+    ih->finalize = &list_finalize;
+
+    return ih;
+}
+
+void yp_index_list_free(YPIndexHandlerClass *self)
+{
+    IndexList *list = self->opaque;
+
+    free(list->handlers);
+    free(list);
+    free(self);
+}
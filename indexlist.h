@@ -0,0 +1,16 @@
+#ifndef YP_INDEXLIST_H_
+#define YP_INDEXLIST_H_
+
+#include "common.h"
+
+/**
+ * Index handler forwarding every call to each of handlers in turn, so that
+ * muxers feed several manifest formats from a single packaging pass.
+ * handlers are initialized in order: the MPD generator goes first, as it
+ * assigns the representation ids the others use. They are not freed with
+ * the list.
+ */
+YPIndexHandlerClass* yp_index_list(YPIndexHandlerClass **handlers, unsigned int nb_handlers);
+void yp_index_list_free(YPIndexHandlerClass *self);
+
+#endif // YP_INDEXLIST_H_
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+
+#include "kfindex.h"
+
+YPKeyframeIndex* yp_kfindex(int stream_idx, AVRational time_base)
+{
+    YPKeyframeIndex *index = (YPKeyframeIndex *) malloc(sizeof(YPKeyframeIndex));
+
+    if (index) {
+        index->stream_idx = stream_idx;
+        index->time_base = time_base;
+        index->first_pts = AV_NOPTS_VALUE;
+        index->first_dts = AV_NOPTS_VALUE;
+        index->end_pts = AV_NOPTS_VALUE;
+        index->nb_keyframes = 0;
+        index->nb_alloc = 0;
+        index->keyframes = NULL;
+
+        return index;
+    }
+
+    return NULL;
+}
+
+YPKeyframeIndex* yp_kfindex_copy(const YPKeyframeIndex *index)
+{
+    YPKeyframeIndex *copy = yp_kfindex(index->stream_idx, index->time_base);
+
+    if (copy == NULL)
+        return NULL;
+
+    copy->first_pts = index->first_pts;
+    copy->first_dts = index->first_dts;
+    copy->end_pts = index->end_pts;
+
+    if (index->nb_keyframes > 0) {
+        copy->keyframes = malloc(index->nb_keyframes * sizeof(YPKeyframe));
+
+        if (copy->keyframes == NULL) {
+            yp_kfindex_free(copy);
+            return NULL;
+        }
+
+        memcpy(copy->keyframes, index->keyframes, index->nb_keyframes * sizeof(YPKeyframe));
+        copy->nb_keyframes = index->nb_keyframes;
+        copy->nb_alloc = index->nb_keyframes;
+    }
+
+    return copy;
+}
+
+int yp_kfindex_add(YPKeyframeIndex *index, const AVPacket *pkt)
+{
+    YPKeyframe *kf;
+
+    if (index->first_pts == AV_NOPTS_VALUE) {
+        index->first_pts = pkt->pts;
+        index->first_dts = pkt->dts;
+    }
+
+    if (index->end_pts == AV_NOPTS_VALUE || pkt->pts + pkt->duration > index->end_pts)
+        index->end_pts = pkt->pts + pkt->duration;
+
+    if (!(pkt->flags & AV_PKT_FLAG_KEY))
+        return 0;
+
+    if (index->nb_keyframes == index->nb_alloc) {
+        unsigned int nb_alloc = index->nb_alloc ? index->nb_alloc * 2 : 256;
+        YPKeyframe *keyframes = realloc(index->keyframes, nb_alloc * sizeof(YPKeyframe));
+
+        if (keyframes == NULL) {
+            return -1;
+        }
+
+        index->keyframes = keyframes;
+        index->nb_alloc = nb_alloc;
+    }
+
+    kf = &index->keyframes[index->nb_keyframes++];
+    kf->pts = pkt->pts;
+    kf->dts = pkt->dts;
+    kf->pos = pkt->pos;
+    kf->duration = pkt->duration;
+
+    return 0;
+}
+
+int yp_kfindex_scan(AVFormatContext *ctx, YPKeyframeIndex **indexes)
+{
+    int ret = 0;
+    unsigned int i;
+    AVPacket pkt;
+
+    for (i = 0; i < ctx->nb_streams; i++) {
+        ctx->streams[i]->discard = indexes[i] ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    while (av_read_frame(ctx, &pkt) >= 0) {
+        if (pkt.stream_index < (int) ctx->nb_streams && indexes[pkt.stream_index])
+            ret = yp_kfindex_add(indexes[pkt.stream_index], &pkt);
+
+        av_packet_unref(&pkt);
+
+        if (ret < 0) break;
+    }
+
+    return ret;
+}
+
+void yp_kfindex_free(YPKeyframeIndex *index)
+{
+    free(index->keyframes);
+    free(index);
+}
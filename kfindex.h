@@ -0,0 +1,35 @@
+#ifndef YP_KFINDEX_H_
+#define YP_KFINDEX_H_
+
+#include "common.h"
+
+typedef struct YPKeyframe {
+    int64_t pts;
+    int64_t dts;
+    int64_t pos;
+    int64_t duration;
+} YPKeyframe;
+
+// Keyframes of one input stream, in decode order and in stream time base
+typedef struct YPKeyframeIndex {
+    int stream_idx;
+    AVRational time_base;
+    // Timestamps of the first packet of the stream
+    int64_t first_pts;
+    int64_t first_dts;
+    // Largest pts + duration seen, i.e. the end of the stream
+    int64_t end_pts;
+    unsigned int nb_keyframes;
+    unsigned int nb_alloc;
+    YPKeyframe *keyframes;
+} YPKeyframeIndex;
+
+YPKeyframeIndex* yp_kfindex(int stream_idx, AVRational time_base);
+YPKeyframeIndex* yp_kfindex_copy(const YPKeyframeIndex *index);
+int yp_kfindex_add(YPKeyframeIndex *index, const AVPacket *pkt);
+// Read ctx to the end and fill indexes[i] for every non NULL entry. indexes
+// must hold ctx->nb_streams entries.
+int yp_kfindex_scan(AVFormatContext *ctx, YPKeyframeIndex **indexes);
+void yp_kfindex_free(YPKeyframeIndex *index);
+
+#endif // YP_KFINDEX_H_
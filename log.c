@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#define LOG_RING_SIZE   4096
+#define LOG_LINE_SIZE   256
+
+int yp_log_levels[YP_LOG_NB_MODULES] = {
+    YP_LOG_INFO, YP_LOG_INFO, YP_LOG_INFO, YP_LOG_INFO, YP_LOG_INFO, YP_LOG_INFO,
+    YP_LOG_INFO, YP_LOG_INFO, YP_LOG_INFO, YP_LOG_INFO,
+};
+
+static const char *module_names[YP_LOG_NB_MODULES] = {
+    "main", "demux", "muxer", "mpd", "shard", "writer", "serve",
+    "transcode", "hls", "sink",
+};
+
+static const char *level_names[] = {
+    "error", "warning", "info", "debug", "trace",
+};
+
+// Fixed size lines, so that logging never allocates. Longer messages are
+// truncated.
+typedef struct LogRing {
+    pthread_mutex_t lock;
+    pthread_cond_t line_available;
+    pthread_t thread;
+    int running;
+    int quit;
+    unsigned int head;
+    unsigned int count;
+    // Lines lost because the drain thread fell behind
+    unsigned long dropped;
+    char lines[LOG_RING_SIZE][LOG_LINE_SIZE];
+} LogRing;
+
+static LogRing ring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .line_available = PTHREAD_COND_INITIALIZER,
+};
+
+static void *drain_thread(void *opaque)
+{
+    // Copied out so that stdout is written without the lock held
+    static char batch[64][LOG_LINE_SIZE];
+    unsigned int i, n;
+    unsigned long dropped;
+
+    while (1) {
+        pthread_mutex_lock(&ring.lock);
+
+        while (ring.count == 0 && !ring.quit)
+            pthread_cond_wait(&ring.line_available, &ring.lock);
+
+        if (ring.count == 0) {
+            // Later lines go straight to stdout
+            ring.running = 0;
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+
+        for (n = 0; n < 64 && ring.count > 0; n++) {
+            memcpy(batch[n], ring.lines[ring.head], LOG_LINE_SIZE);
+            ring.head = (ring.head + 1) % LOG_RING_SIZE;
+            ring.count--;
+        }
+
+        dropped = ring.dropped;
+        ring.dropped = 0;
+
+        pthread_mutex_unlock(&ring.lock);
+
+        if (dropped > 0)
+            fprintf(stdout, "[log] %lu messages dropped\n", dropped);
+
+        for (i = 0; i < n; i++)
+            fputs(batch[i], stdout);
+    }
+
+    fflush(stdout);
+
+    return NULL;
+}
+
+void yp_log_write(int module, int level, const char *fmt, ...)
+{
+    char line[LOG_LINE_SIZE];
+    int prefix;
+    int len;
+    va_list args;
+
+    prefix = snprintf(line, sizeof(line), "[%s] ", module_names[module]);
+
+    va_start(args, fmt);
+    len = prefix + vsnprintf(line + prefix, sizeof(line) - prefix, fmt, args);
+    va_end(args);
+
+    // Keep truncated lines on a line of their own
+    if (len >= LOG_LINE_SIZE)
+        line[LOG_LINE_SIZE - 2] = '\n';
+
+    if (level <= YP_LOG_WARNING) {
+        fputs(line, stderr);
+        return;
+    }
+
+    pthread_mutex_lock(&ring.lock);
+
+    if (!ring.running) {
+        pthread_mutex_unlock(&ring.lock);
+        fputs(line, stdout);
+        return;
+    }
+
+    if (ring.count == LOG_RING_SIZE) {
+        // Never hold the caller back for a log line
+        ring.dropped++;
+    } else {
+        memcpy(ring.lines[(ring.head + ring.count) % LOG_RING_SIZE], line, LOG_LINE_SIZE);
+        ring.count++;
+        pthread_cond_signal(&ring.line_available);
+    }
+
+    pthread_mutex_unlock(&ring.lock);
+}
+
+static int parse_level(const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; i <= YP_LOG_TRACE; i++) {
+        if (strlen(level_names[i]) == len && !strncmp(name, level_names[i], len))
+            return i;
+    }
+
+    return -1;
+}
+
+int yp_log_set_levels(const char *spec)
+{
+    const char *entry = spec;
+    const char *end;
+    const char *eq;
+    int level;
+    int i;
+
+    while (*entry) {
+        end = strchr(entry, ',');
+        if (end == NULL)
+            end = entry + strlen(entry);
+
+        eq = memchr(entry, '=', end - entry);
+
+        if (eq == NULL) {
+            if ((level = parse_level(entry, end - entry)) < 0)
+                return -1;
+
+            for (i = 0; i < YP_LOG_NB_MODULES; i++)
+                yp_log_levels[i] = level;
+        } else {
+            if ((level = parse_level(eq + 1, end - eq - 1)) < 0)
+                return -1;
+
+            for (i = 0; i < YP_LOG_NB_MODULES; i++) {
+                if (strlen(module_names[i]) == (size_t) (eq - entry) &&
+                        !strncmp(entry, module_names[i], eq - entry))
+                    break;
+            }
+
+            if (i == YP_LOG_NB_MODULES)
+                return -1;
+
+            yp_log_levels[i] = level;
+        }
+
+        entry = *end ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+int yp_log_start(void)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&ring.lock);
+
+    if (!ring.running) {
+        ring.quit = 0;
+
+        if (pthread_create(&ring.thread, NULL, drain_thread, NULL) != 0)
+            ret = -1;
+        else
+            ring.running = 1;
+    }
+
+    pthread_mutex_unlock(&ring.lock);
+
+    return ret;
+}
+
+void yp_log_stop(void)
+{
+    pthread_mutex_lock(&ring.lock);
+
+    if (!ring.running) {
+        pthread_mutex_unlock(&ring.lock);
+        return;
+    }
+
+    ring.quit = 1;
+    pthread_cond_signal(&ring.line_available);
+    pthread_mutex_unlock(&ring.lock);
+
+    pthread_join(ring.thread, NULL);
+}
@@ -0,0 +1,48 @@
+#ifndef YP_LOG_H_
+#define YP_LOG_H_
+
+enum {
+    YP_LOG_ERROR,
+    YP_LOG_WARNING,
+    YP_LOG_INFO,
+    YP_LOG_DEBUG,
+    YP_LOG_TRACE,
+};
+
+enum {
+    YP_LOG_MAIN,
+    YP_LOG_DEMUX,
+    YP_LOG_MUXER,
+    YP_LOG_MPD,
+    YP_LOG_SHARD,
+    YP_LOG_WRITER,
+    YP_LOG_SERVE,
+    YP_LOG_TRANSCODE,
+    YP_LOG_HLS,
+    YP_LOG_SINK,
+    YP_LOG_NB_MODULES,
+};
+
+// Most verbose level enabled for each module
+extern int yp_log_levels[YP_LOG_NB_MODULES];
+
+// Disabled messages cost a load and a compare: arguments are not even
+// evaluated. Errors and warnings go straight to stderr, everything else
+// through a ring buffer drained by a background thread once
+// yp_log_start() was called.
+#define yp_log(module, level, ...) \
+    do { \
+        if ((level) <= yp_log_levels[module]) \
+            yp_log_write(module, level, __VA_ARGS__); \
+    } while (0)
+
+void yp_log_write(int module, int level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+// spec is a comma separated list of "<level>" (all modules) and
+// "<module>=<level>" entries, e.g. "warning,muxer=trace"
+int yp_log_set_levels(const char *spec);
+int yp_log_start(void);
+// Write out what is left in the ring buffer and stop the drain thread
+void yp_log_stop(void);
+
+#endif // YP_LOG_H_
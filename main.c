@@ -2,8 +2,23 @@
 #include "third_party/argtable3.h"
 #include "muxer.h"
 #include "mpd.h"
+#include "hls.h"
+#include "indexlist.h"
+#include "demux.h"
+#include "shard.h"
+#include "serve.h"
+#include "transcode.h"
+#include "smartcut.h"
+#include "threadpool.h"
+#include "writer.h"
+#include "stats.h"
+#include "log.h"
 #include "utils.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
 #include <libavutil/dict.h>
 #include <libavutil/avassert.h>
 #include <libavutil/channel_layout.h>
@@ -11,87 +26,12 @@
 #include <libavutil/mathematics.h>
 #include <libavutil/timestamp.h>
 #include <libavutil/intreadwrite.h>
+#include <libavutil/time.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
 
-static int open_input_file(YPInputStream *instream)
-{
-    int ret;
-    unsigned int i;
-    AVFormatContext *ifmt_ctx = NULL;
-
-    ret = 0;
-    printf("Opening input file");
-    printf("%s\n", instream->filename);
-
-    /*
-     * avformat_open_input() will do the avformat_alloc_context() for us!
-     */
-    if ((ret = avformat_open_input(&ifmt_ctx, instream->filename, 0, 0)) < 0) {
-        fprintf(stderr, "could not open input file '%s'\n", instream->filename);
-        // TODO: free ressources
-        return -1;
-    }
-
-    if ((ret = avformat_find_stream_info(ifmt_ctx, 0)) < 0) {
-        fprintf(stderr, "failed to retrieve input stream information");
-        // TODO: free ressources
-        return -1;
-    }
-
-    av_dump_format(ifmt_ctx, 0, instream->filename, 0);
-    
-    AVDictionaryEntry *tag = NULL;
-    while ((tag = av_dict_get(ifmt_ctx->metadata, "", tag, AV_DICT_IGNORE_SUFFIX)))
-        printf("%s=%s\n", tag->key, tag->value);
-
-    char tag_str[64];
-
-    AV_WL32(&tag_str, ifmt_ctx->streams[1]->codecpar->codec_tag);
-    tag_str[4] = '\0';
-
-    printf ("Profile: %d\n", ifmt_ctx->streams[0]->codecpar->profile);
-    printf ("Level: %d\n", ifmt_ctx->streams[0]->codecpar->level);
-    printf ("Codec tag: %d\n", ifmt_ctx->streams[0]->codecpar->codec_tag);
-    printf ("Codec tag string: %s\n", tag_str);
-    
-    // MPEG-4 Part 15 "Advanced Video Coding (AVC) file format
-    // 5.2.4.1.1 Syntax 
-    //
-    // aligned(8) class AVCDecoderConfigurationRecord { 
-    //     unsigned int(8) configurationVersion = 1; 
-    //     unsigned int(8) AVCProfileIndication; 
-    //     unsigned int(8) profile_compatibility; 
-    //     unsigned int(8) AVCLevelIndication;  
-    //     bit(6) reserved = ‘111111’b;
-    //     unsigned int(2) lengthSizeMinusOne;  
-    //     bit(3) reserved = ‘111’b;
-    //     unsigned int(5) numOfSequenceParameterSets; 
-    //     for (i=0; i< numOfSequenceParameterSets;  i++) { 
-    //         unsigned int(16) sequenceParameterSetLength ; 
-    //     bit(8*sequenceParameterSetLength) sequenceParameterSetNALUnit; 
-    // } 
-    //  unsigned int(8) numOfPictureParameterSets; 
-    //  for (i=0; i< numOfPictureParameterSets;  i++) { 
-    //       unsigned int(16) pictureParameterSetLength; 
-    //  bit(8*pictureParameterSetLength) pictureParameterSetNALUnit; 
-    //  } 
-    // }
-    printf ("%02x%02x%02x\n\n",
-            ifmt_ctx->streams[0]->codecpar->extradata[1],
-            ifmt_ctx->streams[0]->codecpar->extradata[2],
-            ifmt_ctx->streams[0]->codecpar->extradata[3]);
-
-    // TODO: assert nb_streams > 0
-
-    instream->ctx = ifmt_ctx;
-
-    return ret;
-}
-
-
 // TODO
 // - Rename this method to sort stream
 // - sort stream into adaptation set
@@ -120,32 +60,22 @@ static int tag_streams(YPInputStream** instreams, int n)
     return 0;
 }
 
-static int feed_muxer(YPMuxerClass *muxer, YPInputStream *instream)
+static void handle_signal(int sig)
 {
-    int ret = 0;
-    AVPacket pkt;
-
-    while (1) {
-        ret = av_read_frame(instream->ctx, &pkt);
-
-        if (ret < 0) {
-            printf("No frame left\n");
-            break;
-        }
-
-        // TODO:
-        // Rescale timing infos here (timescales, and durations)
-
-        if (pkt.stream_index == instream->stream_idx) {
-            ret = muxer->handle_packet(muxer, instream, &pkt);
-        }
+    // Stop reading, the manifest still gets finalized
+    yp_demuxer_interrupt();
+}
 
-        if (ret < 0) break;
+static int demux_job(void *arg)
+{
+    YPDemuxer *demuxer = arg;
+    int ret;
 
-        av_packet_unref(&pkt);
-    }
+    yp_log(YP_LOG_MAIN, YP_LOG_INFO, "Feed data from %s into %u muxer(s)\n", demuxer->filename, demuxer->nb_outputs);
+    ret = yp_demuxer_run(demuxer);
 
-    muxer->finalize(muxer);
+    if (ret < 0)
+        yp_log(YP_LOG_MAIN, YP_LOG_ERROR, "Packaging %s failed\n", demuxer->filename);
 
     return ret;
 }
@@ -155,28 +85,89 @@ int main(int argc, char **argv)
     int ret, i;
     YPConfig config;
     YPIndexHandlerClass *manifest = NULL;
+    YPIndexHandlerClass *mpd = NULL;
+    YPIndexHandlerClass *playlists = NULL;
     YPMuxerClass **muxers = NULL;
+    YPDemuxer **demuxers = NULL;
+    YPThreadPool *pool = NULL;
+    YPMuxerClass **transcoders = NULL;
+    YPMuxerClass **smartcuts = NULL;
+    YPRung *rungs = NULL;
+    unsigned int nb_demuxers = 0;
+    unsigned int nb_transcoders = 0;
+    unsigned int nb_smartcuts = 0;
+    unsigned int nb_rungs = 0;
+    unsigned int max_instreams;
+    unsigned int j, k;
+
+    // "ypackager serve ...": package on request instead, see serve.c
+    if (argc > 1 && !strcmp(argv[1], "serve"))
+        return yp_serve_main(argc - 1, argv + 1);
 
     config.instreams = NULL;
+    config.nb_instreams = 0;
+    config.writer = NULL;
+    config.sink = NULL;
+    config.stats = NULL;
 
     const char *prog_name = "ypackager";
-    struct arg_file *infiles = arg_filen("i", NULL, NULL, 1, argc+2, "input file(s)");
-    //struct arg_lit *outdir = arg_lit1("o", "out", "output directory");
+    struct arg_file *infiles = arg_filen("i", NULL, "<file>[#<stream>]", 1, argc+2, "input file(s), optionally followed by a stream index");
+    struct arg_str *outdir = arg_str0("o", "out", "<dir>", "output directory (default: current directory)");
+    struct arg_str *sink_type = arg_str0(NULL, "sink", "<type>", "dir: files below -o (default), tar: archive -o, http or http-post: upload to -o, an http:// URL, over reused connections");
+    struct arg_int *upload_connections = arg_int0(NULL, "upload-connections", "<n>", "connections of the http sinks (default: 4)");
     struct arg_int *segment_duration = arg_int1(NULL, "segment-duration", NULL, "max. segment duration in milliseconds"); 
+    struct arg_int *chunk_duration = arg_int0(NULL, "chunk-duration", NULL, "split segments into CMAF chunks of this many milliseconds, written as soon as they are complete");
+    struct arg_int *threads = arg_int0(NULL, "threads", "<n>", "package up to n inputs concurrently (default: 1)");
+    struct arg_int *io_threads = arg_int0(NULL, "io-threads", "<n>", "write segments from n background threads (default: 0, write inline)");
+    struct arg_int *io_queue = arg_int0(NULL, "io-queue", "<n>", "max. writes queued before muxing waits (default: 64)");
+    struct arg_int *io_queue_mb = arg_int0(NULL, "io-queue-mb", "<n>", "max. megabytes queued before muxing waits (default: 64)");
+    struct arg_lit *use_fsync = arg_lit0(NULL, "fsync", "fsync segment files before announcing them");
+    struct arg_lit *use_mmap = arg_lit0(NULL, "mmap", "read local input files through memory mappings");
+    struct arg_int *read_ahead_mb = arg_int0(NULL, "read-ahead-mb", "<n>", "demux on a separate thread, up to n megabytes ahead of muxing");
+    struct arg_int *read_ahead_ms = arg_int0(NULL, "read-ahead-ms", "<n>", "demux on a separate thread, up to n milliseconds of media ahead of muxing");
+    struct arg_lit *native_fragments = arg_lit0(NULL, "native-fragments", "write H.264, HEVC and AAC fragments from mp4 inputs without the libavformat mp4 muxer");
+    struct arg_str *index_cache = arg_str0(NULL, "index-cache", "<dir>", "keep stream information and keyframe indexes of inputs in dir to skip probing when they are packaged again");
+    struct arg_str *ladder = arg_str0(NULL, "ladder", "<spec>", "decode every video input once and encode it to H.264 at these heights and kbit/s, e.g. 1080:5000,720:2800,480:1200");
+    struct arg_int *smart_cut = arg_int0(NULL, "smart-cut", "<ms>", "re-encode H.264 frames from a segment boundary to the next keyframe when it is more than ms late, instead of making the segment longer");
+    struct arg_int *shards = arg_int0(NULL, "shards", "<n>", "split every stream into up to n keyframe aligned ranges packaged in parallel");
+    struct arg_str *stats_json = arg_str0(NULL, "stats-json", "<file>", "write per representation timings and throughput to file as JSON");
+    struct arg_str *log_level = arg_str0(NULL, "log-level", "<spec>", "log level, globally and per module, e.g. warning,muxer=trace (default: info)");
     struct arg_lit *help = arg_lit0("h", "help", "print help and exit");
     struct arg_lit *version = arg_lit0(NULL, "version", "print version and exit");
     struct arg_lit *single_file = arg_lit0(NULL, "single-file", "write segments into single file.");
     struct arg_lit *segment_template = arg_lit0(NULL, "segment-template", "use segment template");
     struct arg_lit *segment_timeline = arg_lit0(NULL, "segment-timeline", "use segment timeline");
+    struct arg_lit *live = arg_lit0(NULL, "live", "package a live input (pipe, '-' for stdin, udp:// or tcp://) and keep a dynamic manifest up to date");
+    struct arg_lit *hls = arg_lit0(NULL, "hls", "also write fMP4 HLS playlists, master.m3u8 and <id>/playlist.m3u8, from the same segments");
     struct arg_end *end = arg_end(20);
 
     void *argtable[] = {
         infiles,
-        //outdir,
+        outdir,
+        sink_type,
+        upload_connections,
         segment_duration,
+        chunk_duration,
         single_file,
         segment_template,
         segment_timeline,
+        live,
+        hls,
+        threads,
+        io_threads,
+        io_queue,
+        io_queue_mb,
+        use_fsync,
+        use_mmap,
+        read_ahead_mb,
+        read_ahead_ms,
+        native_fragments,
+        index_cache,
+        ladder,
+        smart_cut,
+        shards,
+        stats_json,
+        log_level,
         help,
         version,
         end
@@ -184,6 +175,8 @@ int main(int argc, char **argv)
 
     int nerrors;
     int exit_code = 0;
+    // Set once a segment could not be packaged, written or uploaded
+    int missing = 0;
     
     nerrors = arg_parse(argc, argv, argtable);
 
@@ -216,14 +209,106 @@ int main(int argc, char **argv)
         goto exit;
     }
 
+    if (log_level->count > 0 && yp_log_set_levels(log_level->sval[0]) < 0) {
+        fprintf(stderr, "%s: invalid log level '%s'\n", prog_name, log_level->sval[0]);
+        exit_code = -1;
+        goto exit;
+    }
+
+    // From here on, info and more verbose messages are written from a
+    // background thread
+    yp_log_start();
+
     /* Initialize libavcodec, and register all codecs and formats. */
     av_register_all();
-    
+    avformat_network_init();
+
     // Configure --------------------
     config.single_file = single_file->count;
     config.segment_template = segment_template->count;
     config.segment_timeline = segment_timeline->count;
     config.seg_duration = segment_duration->ival[0];
+    config.threads = threads->count > 0 ? threads->ival[0] : 1;
+    config.shards = shards->count > 0 ? shards->ival[0] : 1;
+    config.live = live->count;
+    config.mmap = use_mmap->count;
+    config.read_ahead = read_ahead_mb->count > 0 || read_ahead_ms->count > 0;
+    config.read_ahead_bytes = read_ahead_mb->count > 0 ? FFMAX(read_ahead_mb->ival[0], 0) * (int64_t) 1024 * 1024 : 0;
+    config.read_ahead_duration = read_ahead_ms->count > 0 ? FFMAX(read_ahead_ms->ival[0], 0) * (int64_t) 1000 : 0;
+    config.native_fragments = native_fragments->count;
+    config.smart_cut = smart_cut->count;
+    config.smart_cut_tolerance = smart_cut->count > 0 ? FFMAX(smart_cut->ival[0], 0) : 0;
+    config.chunk_duration = chunk_duration->count > 0 ? chunk_duration->ival[0] : 0;
+
+    if (config.chunk_duration > 0 && config.shards > 1) {
+        // Ranges number their fragments assuming one per segment
+        fprintf(stderr, "%s: --chunk-duration can't be combined with --shards\n", prog_name);
+        exit_code = -1;
+        goto exit;
+    }
+
+    if (ladder->count > 0 && yp_ladder_parse(ladder->sval[0], &rungs, &nb_rungs) < 0) {
+        fprintf(stderr, "%s: invalid ladder '%s'\n", prog_name, ladder->sval[0]);
+        exit_code = -1;
+        goto exit;
+    }
+
+    if ((nb_rungs > 0 || config.smart_cut) && config.shards > 1) {
+        // Ranges are stream-copied from inputs of their own, cut where the
+        // keyframe index says
+        fprintf(stderr, "%s: --ladder and --smart-cut can't be combined with --shards\n", prog_name);
+        exit_code = -1;
+        goto exit;
+    }
+
+    if (config.live) {
+        // A growing presentation can't be described with $Number$ alone or
+        // by a sidx written once the file is complete
+        if (config.single_file || config.shards > 1) {
+            fprintf(stderr, "%s: --live can't be combined with --single-file or --shards\n", prog_name);
+            exit_code = -1;
+            goto exit;
+        }
+        config.segment_timeline = 1;
+    }
+
+    if (config.single_file && config.shards > 1) {
+        // Ranges would have to write into the same file and share one sidx
+        fprintf(stderr, "%s: --shards can't be combined with --single-file\n", prog_name);
+        exit_code = -1;
+        goto exit;
+    }
+    config.outdir = outdir->count > 0 ? (char *) outdir->sval[0] : ".";
+
+    // Failing to create it only costs probing again next time, see
+    // yp_sidecar_save()
+    if (index_cache->count > 0)
+        mkdir_p(index_cache->sval[0]);
+
+    config.sink = yp_sink_create(sink_type->count > 0 ? sink_type->sval[0] : "dir", config.outdir,
+                                 upload_connections->count > 0 ? upload_connections->ival[0] : 4);
+
+    if (config.sink == NULL) {
+        exit_code = -1;
+        goto exit;
+    }
+
+    if (io_threads->count > 0 && io_threads->ival[0] > 0) {
+        if (config.sink->root == NULL || is_url(config.outdir)) {
+            // Uploads go through libavformat or the sink, see muxer.c
+            yp_log(YP_LOG_MAIN, YP_LOG_INFO, "Writing to %s inline, --io-threads only applies to local files\n", config.outdir);
+        } else {
+            config.writer = yp_writer(io_threads->ival[0],
+                                      io_queue->count > 0 ? io_queue->ival[0] : 64,
+                                      (int64_t) (io_queue_mb->count > 0 ? io_queue_mb->ival[0] : 64) << 20,
+                                      use_fsync->count);
+
+            if (config.writer == NULL) {
+                exit_code = -1;
+                goto exit;
+            }
+        }
+    }
     config.min_buffer = config.seg_duration * 2;
     config.verbose = 1;
     config.index_fname = "init.mp4";
@@ -231,37 +316,163 @@ int main(int argc, char **argv)
     config.has_audio = 0;
     //config.has_subtitle = 0;
 
-    printf("Create instreams and muxer\n"); 
-    config.instreams = (YPInputStream **) malloc(infiles->count * sizeof(YPInputStream*));
-    muxers = (YPMuxerClass **) malloc(infiles->count * sizeof(YPMuxerClass*));
-    manifest = yp_mpd_generator();
+    yp_log(YP_LOG_MAIN, YP_LOG_DEBUG, "Create instreams and muxer\n"); 
+    // A transcoded video input makes one representation per rung
+    max_instreams = infiles->count * FFMAX(nb_rungs, 1);
+    config.instreams = (YPInputStream **) calloc(max_instreams, sizeof(YPInputStream*));
+    muxers = (YPMuxerClass **) calloc(max_instreams, sizeof(YPMuxerClass*));
+    // At most one demuxer per -i entry, usually far less
+    demuxers = (YPDemuxer **) calloc(infiles->count, sizeof(YPDemuxer*));
+    transcoders = (YPMuxerClass **) calloc(infiles->count, sizeof(YPMuxerClass*));
+    smartcuts = (YPMuxerClass **) calloc(infiles->count, sizeof(YPMuxerClass*));
+    manifest = mpd = yp_mpd_generator();
+
+    // Both formats are fed by the same muxers, the MPD generator goes first
+    // as it assigns representation ids
+    if (mpd != NULL && hls->count > 0) {
+        YPIndexHandlerClass *handlers[2];
+
+        playlists = yp_hls_generator();
+        handlers[0] = mpd;
+        handlers[1] = playlists;
+        manifest = playlists ? yp_index_list(handlers, 2) : NULL;
+    }
 
-    if (manifest == NULL) {
+    if (manifest == NULL || config.instreams == NULL || muxers == NULL || demuxers == NULL ||
+            transcoders == NULL || smartcuts == NULL) {
         exit_code = -1;
         goto exit;
     }
 
     for (i = 0; i < infiles->count; i++) {
-        printf("filname: %s - duration: %d\n", infiles->filename[i], *segment_duration->ival);
-        config.instreams[i] = (YPInputStream *) malloc(sizeof(YPInputStream));
-        config.instreams[i]->filename = *infiles->filename;
-        config.instreams[i]->stream_idx = 0; // TODO: write utility function to parse stream idx
-        config.instreams[i]->is_video = 0;
-        config.instreams[i]->is_audio = 0;
-        printf("Opening instream\n");
-        // TODO: Handle could not open file
-        open_input_file(config.instreams[i]);
-        
-        AVStream *st = config.instreams[i]->ctx->streams[config.instreams[i]->stream_idx];
+        char filename[1024];
+        int stream_idx;
+        YPDemuxer *demuxer = NULL;
+
+        yp_log(YP_LOG_MAIN, YP_LOG_DEBUG, "filname: %s - duration: %d\n", infiles->filename[i], *segment_duration->ival);
+
+        if (parse_input_spec(infiles->filename[i], filename, sizeof(filename), &stream_idx) < 0) {
+            yp_log(YP_LOG_MAIN, YP_LOG_ERROR, "invalid input '%s'\n", infiles->filename[i]);
+            exit_code = -1;
+            goto exit;
+        }
+
+        if (!strcmp(filename, "-"))
+            snprintf(filename, sizeof(filename), "pipe:0");
+
+        // Open every input file once, whatever the number of streams we
+        // take from it
+        for (j = 0; j < nb_demuxers; j++) {
+            if (!strcmp(demuxers[j]->filename, filename)) {
+                demuxer = demuxers[j];
+                break;
+            }
+        }
+
+        if (demuxer == NULL) {
+            yp_log(YP_LOG_MAIN, YP_LOG_DEBUG, "Opening instream\n");
+            demuxer = yp_demuxer(filename);
+
+            if (demuxer == NULL) {
+                exit_code = -1;
+                goto exit;
+            }
+
+            demuxer->live = config.live;
+            demuxer->mmap = config.mmap;
+            demuxer->read_ahead = config.read_ahead;
+            demuxer->read_ahead_bytes = config.read_ahead_bytes;
+            demuxer->read_ahead_duration = config.read_ahead_duration;
+            demuxer->cache_dir = index_cache->count > 0 ? index_cache->sval[0] : NULL;
+            demuxers[nb_demuxers++] = demuxer;
+
+            if (yp_demuxer_open(demuxer) < 0) {
+                exit_code = -1;
+                goto exit;
+            }
+        }
+
+        AVStream *st = demuxer->ctx->streams[stream_idx];
+
+        if (nb_rungs > 0 && st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            // Decoded once, then scaled and encoded for every rung, each of
+            // which is packaged like an input stream of its own
+            YPMuxerClass *transcoder = yp_transcoder(&config, demuxer, stream_idx, rungs, nb_rungs);
+
+            if (transcoder == NULL) {
+                exit_code = -1;
+                goto exit;
+            }
+
+            transcoders[nb_transcoders++] = transcoder;
+
+            for (k = 0; k < nb_rungs; k++) {
+                YPInputStream *instream = (YPInputStream *) malloc(sizeof(YPInputStream));
+                YPMuxerClass *muxer = config.native_fragments ? yp_fmp4_native_muxer() : yp_fmp4_muxer();
+
+                config.instreams[config.nb_instreams] = instream;
+                muxers[config.nb_instreams++] = muxer;
+
+                if (instream == NULL || muxer == NULL) {
+                    exit_code = -1;
+                    goto exit;
+                }
+
+                muxer->index = manifest;
+                yp_transcoder_add_output(transcoder, k, instream, muxer);
+            }
+
+            config.has_video = 1;
+            continue;
+        }
+
+        YPInputStream *instream = (YPInputStream *) malloc(sizeof(YPInputStream));
+
+        if (instream == NULL) {
+            exit_code = -1;
+            goto exit;
+        }
+
+        config.instreams[config.nb_instreams] = instream;
+        instream->filename = demuxer->filename;
+        instream->ctx = demuxer->ctx;
+        instream->stream_idx = stream_idx;
+        instream->is_video = 0;
+        instream->is_audio = 0;
+        instream->range = NULL;
+        instream->stats = NULL;
+        instream->in_band_ps = 0;
+
+        yp_log(YP_LOG_MAIN, YP_LOG_DEBUG, "Creating muxer for stream\n");
+        YPMuxerClass *muxer = config.native_fragments ? yp_fmp4_native_muxer() : yp_fmp4_muxer();
+        muxers[config.nb_instreams++] = muxer;
+
+        if (muxer == NULL) {
+            exit_code = -1;
+            goto exit;
+        }
+
+        muxer->index = manifest;
+
+        // Packets go through the smart cut stage, which hands them on to
+        // the muxer
+        if (config.smart_cut && st->codecpar->codec_id == AV_CODEC_ID_H264) {
+            if ((smartcuts[nb_smartcuts] = yp_smartcut(&config, instream, muxer)) == NULL) {
+                exit_code = -1;
+                goto exit;
+            }
+            muxer = smartcuts[nb_smartcuts++];
+        }
+
+        if (yp_demuxer_add_output(demuxer, instream, muxer) < 0) {
+            exit_code = -1;
+            goto exit;
+        }
 
         if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
             config.has_video = 1;
         if (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
             config.has_audio = 1;
-
-        printf("Creating muxer for stream\n");
-        muxers[i] = yp_fmp4_muxer();
-        muxers[i]->index = manifest;
     }
 
     // TODO: assert has_video + has_audio > 0
@@ -270,55 +481,191 @@ int main(int argc, char **argv)
     // This method should sort stream by periods and
     // type.
     // Maybe return an array of period?
-    tag_streams(config.instreams, infiles->count); 
+    tag_streams(config.instreams, config.nb_instreams);
     // Configure end -----------------
 
     // Init index handle --------------
-    manifest->init(manifest, &config);
+    if (manifest->init(manifest, &config) < 0) {
+        yp_log(YP_LOG_MAIN, YP_LOG_ERROR, "Could not set up the manifest\n");
+        exit_code = -1;
+        goto exit;
+    }
     // End ----------------------------
 
-    // Init muxers --------------------
-    for (i = 0; i < infiles->count; i++) {
-        // TODO: handle muxer erros
-        printf("Init muxer for instream %d\n", i);
-        ret = muxers[i]->init(muxers[i], &config, i);
+    if (stats_json->count > 0) {
+        config.stats = yp_stats(config.nb_instreams);
+
+        if (config.stats == NULL) {
+            exit_code = -1;
+            goto exit;
+        }
+
+        // Representation ids are only known once the manifest is set up
+        for (j = 0; j < config.nb_instreams; j++) {
+            config.stats->streams[j].stream_id = config.instreams[j]->stream_id;
+            config.stats->streams[j].filename = config.instreams[j]->filename;
+            config.stats->streams[j].stream_idx = config.instreams[j]->stream_idx;
+            config.instreams[j]->stats = &config.stats->streams[j];
+        }
+
+        config.stats->start_time = av_gettime_relative();
     }
-    // Init muxers end ----------------
 
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if (config.shards > 1) {
+        // Each representation is cut into time ranges that are muxed
+        // independently. yp_shard_package() runs its own muxers.
+        if (yp_shard_package(&config, demuxers, nb_demuxers, manifest) < 0)
+            missing = 1;
+    } else {
+        // Init muxers --------------------
+        for (j = 0; j < config.nb_instreams; j++) {
+            // TODO: handle muxer erros
+            yp_log(YP_LOG_MAIN, YP_LOG_DEBUG, "Init muxer for instream %u\n", j);
+            ret = muxers[j]->init(muxers[j], &config, j);
+        }
+        // Init muxers end ----------------
 
-    // feed muxers --------------------
-    for (i = 0; i < infiles->count; i++) {
-        // TODO: handle muxer erros
-        printf("Feed data into muxer for instream %d\n", i);
-        ret = feed_muxer(muxers[i], config.instreams[i]);
+
+        // feed muxers --------------------
+        // Each input is read once and its packets are dispatched to every
+        // muxer registered on it. Inputs share no muxer state, so with
+        // --threads they are packaged side by side on a worker pool. Live
+        // inputs never end, so each of them needs a thread of its own.
+        if ((config.threads > 1 || config.live) && nb_demuxers > 1) {
+            pool = yp_threadpool(config.live ? nb_demuxers :
+                                 FFMIN((unsigned int) config.threads, nb_demuxers));
+
+            if (pool == NULL) {
+                exit_code = -1;
+                goto exit;
+            }
+
+            for (j = 0; j < nb_demuxers; j++) {
+                if (yp_threadpool_submit(pool, demux_job, demuxers[j]) < 0)
+                    exit_code = -1;
+            }
+
+            // A run that failed, even only finalizing, leaves segments
+            // or the index of a single file out
+            if (yp_threadpool_wait(pool) < 0)
+                missing = 1;
+        } else {
+            for (j = 0; j < nb_demuxers; j++) {
+                if (demux_job(demuxers[j]) < 0)
+                    missing = 1;
+            }
+        }
+        // feed muxers end ----------------
+    }
+
+    if (config.writer) {
+        YPWriterStats stats;
+
+        // Segments only reach the manifest once written
+        if (yp_writer_flush(config.writer) < 0)
+            missing = 1;
+
+        yp_writer_get_stats(config.writer, &stats);
+        yp_log(YP_LOG_MAIN, YP_LOG_INFO, "Writer: %"PRIu64" writes, %"PRIu64" bytes, queue depth max %u (%"PRId64" bytes), "
+               "latency avg %.3f ms max %.3f ms, write avg %.3f ms max %.3f ms, %"PRIu64" stalls\n",
+               stats.nb_jobs, stats.nb_bytes, stats.max_queue_depth, stats.max_queue_bytes,
+               stats.nb_jobs ? stats.total_latency / 1000.0 / stats.nb_jobs : 0.0,
+               stats.max_latency / 1000.0,
+               stats.nb_jobs ? stats.total_write_time / 1000.0 / stats.nb_jobs : 0.0,
+               stats.max_write_time / 1000.0,
+               stats.nb_stalls);
+    }
+
+    // Segments uploaded in the background are only announced once stored
+    if (config.sink->flush(config.sink) < 0)
+        missing = 1;
+
+    // No final manifest that would hide a segment which never made it
+    if (missing) {
+        exit_code = -1;
+    } else {
+        manifest->finalize(manifest);
+
+        if (config.sink->flush(config.sink) < 0)
+            exit_code = -1;
     }
-    // feed muxers end ----------------
 
-    manifest->finalize(manifest);
+    if (config.stats) {
+        config.stats->end_time = av_gettime_relative();
+
+        if (yp_stats_write_json(config.stats, stats_json->sval[0]) < 0)
+            exit_code = -1;
+    }
 
 exit:
-    if (manifest != NULL)
-        yp_mpd_generator_free(manifest);
+    if (config.stats != NULL)
+        yp_stats_free(config.stats);
+
+    if (config.writer != NULL)
+        yp_writer_free(config.writer);
+
+    if (pool != NULL)
+        yp_threadpool_free(pool);
+
+    // Uploads still in flight announce their segments to the manifest
+    if (config.sink != NULL)
+        yp_sink_free(config.sink);
+
+    if (manifest != NULL && manifest != mpd)
+        yp_index_list_free(manifest);
+
+    if (playlists != NULL)
+        yp_hls_generator_free(playlists);
+
+    if (mpd != NULL)
+        yp_mpd_generator_free(mpd);
 
     if (muxers != NULL) {
-        for (i = 0; i < infiles->count; i++) {
-            if (muxers[i])
-                yp_muxer_free(muxers[i]);      
+        for (j = 0; j < config.nb_instreams; j++) {
+            if (muxers[j])
+                yp_muxer_free(muxers[j]);      
         }
         free(muxers);
     }
 
+    if (transcoders != NULL) {
+        for (j = 0; j < nb_transcoders; j++) {
+            yp_transcoder_free(transcoders[j]);
+        }
+        free(transcoders);
+    }
+
+    if (smartcuts != NULL) {
+        for (j = 0; j < nb_smartcuts; j++) {
+            yp_smartcut_free(smartcuts[j]);
+        }
+        free(smartcuts);
+    }
+
+    free(rungs);
+
+    if (demuxers != NULL) {
+        for (j = 0; j < nb_demuxers; j++) {
+            yp_demuxer_free(demuxers[j]);
+        }
+        free(demuxers);
+    }
+
     if (config.instreams != NULL) {
-        printf("freeing count: %d\n", infiles->count);
-        for (i = 0; i < infiles->count; i++) {
-            if (config.instreams[i]){
-                printf("free single %p\n", config.instreams[i]);
-                free(config.instreams[i]);
+        yp_log(YP_LOG_MAIN, YP_LOG_DEBUG, "freeing count: %u\n", config.nb_instreams);
+        for (j = 0; j < config.nb_instreams; j++) {
+            if (config.instreams[j]){
+                yp_log(YP_LOG_MAIN, YP_LOG_DEBUG, "free single %p\n", config.instreams[j]);
+                free(config.instreams[j]);
             }
         }
         free(config.instreams);
     }
     arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+    yp_log_stop();
     return exit_code;
 
 
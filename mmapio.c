@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavformat/avio.h>
+
+#include "mmapio.h"
+
+// Large reads, e.g. whole mdat samples, bypass this buffer and are copied
+// directly into the packet
+#define MMAP_BUFFER_SIZE    (256 * 1024)
+#define MMAP_READAHEAD      (16 * 1024 * 1024)
+
+typedef struct MmapFile {
+    uint8_t *data;
+    int64_t size;
+    int64_t pos;
+    // End of the range last passed to madvise(MADV_WILLNEED)
+    int64_t readahead_end;
+    long page_size;
+} MmapFile;
+
+// Keep a window of MMAP_READAHEAD bytes ahead of the read position in
+// flight, asking for more once half of it is consumed
+static void readahead(MmapFile *f)
+{
+    int64_t start, len;
+
+    if (f->readahead_end - f->pos > MMAP_READAHEAD / 2 || f->readahead_end >= f->size)
+        return;
+
+    start = FFMAX(f->pos, f->readahead_end) & ~((int64_t) f->page_size - 1);
+    len = FFMIN(start + MMAP_READAHEAD, f->size) - start;
+
+    madvise(f->data + start, len, MADV_WILLNEED);
+    f->readahead_end = start + len;
+}
+
+static int read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    MmapFile *f = opaque;
+    int64_t n = FFMIN((int64_t) buf_size, f->size - f->pos);
+
+    if (n <= 0)
+        return AVERROR_EOF;
+
+    memcpy(buf, f->data + f->pos, n);
+    f->pos += n;
+
+    readahead(f);
+
+    return (int) n;
+}
+
+static int64_t seek(void *opaque, int64_t offset, int whence)
+{
+    MmapFile *f = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return f->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = f->pos + offset;
+        break;
+    case SEEK_END:
+        pos = f->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (pos < 0)
+        return AVERROR(EINVAL);
+
+    // Start a new readahead window at the new position
+    f->pos = pos;
+    f->readahead_end = FFMIN(pos, f->size);
+    readahead(f);
+
+    return pos;
+}
+
+int yp_mmap_open(AVIOContext **pb, const char *filename)
+{
+    MmapFile *f;
+    struct stat st;
+    uint8_t *buffer;
+    void *data;
+    int fd;
+
+    *pb = NULL;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return AVERROR(errno);
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return AVERROR(EINVAL);
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file open
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return AVERROR(errno);
+
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    f = malloc(sizeof(MmapFile));
+    buffer = av_malloc(MMAP_BUFFER_SIZE);
+
+    if (f == NULL || buffer == NULL)
+        goto fail;
+
+    f->data = data;
+    f->size = st.st_size;
+    f->pos = 0;
+    f->readahead_end = 0;
+    f->page_size = sysconf(_SC_PAGESIZE);
+
+    *pb = avio_alloc_context(buffer, MMAP_BUFFER_SIZE, 0, f, read_packet, NULL, seek);
+
+    if (*pb == NULL)
+        goto fail;
+
+    readahead(f);
+
+    return 0;
+
+fail:
+    av_free(buffer);
+    free(f);
+    munmap(data, st.st_size);
+    return AVERROR(ENOMEM);
+}
+
+void yp_mmap_close(AVIOContext **pb)
+{
+    MmapFile *f;
+
+    if (*pb == NULL)
+        return;
+
+    f = (*pb)->opaque;
+    munmap(f->data, f->size);
+    free(f);
+
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
@@ -0,0 +1,15 @@
+#ifndef YP_MMAPIO_H_
+#define YP_MMAPIO_H_
+
+#include <libavformat/avio.h>
+
+// Read-only AVIOContext over a memory mapped local file. Reads are copied
+// straight out of the page cache, without a read() system call per buffer,
+// and the kernel is asked to read ahead of the demuxer.
+//
+// Fails with AVERROR(EINVAL) for anything but a non-empty regular file, in
+// which case the caller can fall back to the default file protocol.
+int yp_mmap_open(AVIOContext **pb, const char *filename);
+void yp_mmap_close(AVIOContext **pb);
+
+#endif // YP_MMAPIO_H_
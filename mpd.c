@@ -3,143 +3,58 @@
 #define ISOBMFF_LIVE_PROFILE      "urn:mpeg:dash:profile:isoff-live:2011"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 #include <libavutil/avstring.h>
 #include <libavutil/intreadwrite.h>
+#include <libavutil/time.h>
 
 #include "mpd.h"
+#include "strbuf.h"
+#include "timeline.h"
+#include "utils.h"
+#include "log.h"
 
-static void mpd_output_representation(AVIOContext *out, YPRepresentation *representation);
-static void mpd_output_segment_template(AVIOContext *out, int duration, int timescale);
+static void mpd_output_representation(YPStrBuf *out, YPMPD *mpd, YPRepresentation *representation);
+static void mpd_output_segment_template(YPStrBuf *out, YPMPD *mpd, int duration, int timescale);
+static void mpd_output_segment_timeline(YPStrBuf *out, YPMPD *mpd, YPRepresentation *representation);
 
 
-static void set_rfc6381_codec_name(AVCodecParameters *codec_par, char *buf, int size)
+static void mpd_free_representations(YPRepresentation **reps, unsigned int nb_reps)
 {
-    AV_WL32(buf, codec_par->codec_tag);
-    buf[4] = '\0';
-    av_strlcatf(buf, size, ".%02x%02x%02x",
-            codec_par->extradata[1],  // profile_idc
-            codec_par->extradata[2],  // profile compatibility
-            codec_par->extradata[3]); // level_idc
-}
-
-static int sec_to_iso_duration(AVIOContext *out, double seconds)
-{
-    double seconds_in_min = 60;
-    double seconds_in_hour = seconds_in_min * 60;
-    double seconds_in_day = seconds_in_hour * 24;
-    double seconds_in_month = seconds_in_day * 30;
-    double seconds_in_year = seconds_in_month * 365;
-    double years, months, days, hours, minutes = 0;
-    
-    if (seconds <= 0) {
-        // TODO
-        return -1;
-    }
-
-    avio_printf(out, "P");
-
-    years = floor(seconds / seconds_in_year);
-
-    if (years > 0) {
-        avio_printf(out, "%.fY", years);
-        seconds -= years * seconds_in_year;
-    }
-
-    months = floor(seconds / seconds_in_month);
-
-    if (seconds > 0 && months > 0) {
-        avio_printf(out, "%.fM", months);
-        seconds -= months * seconds_in_month;
-    }
-
-    days = floor(seconds / seconds_in_day);
-
-    if (seconds > 0 && days > 0) {
-        avio_printf(out, "%.fD", days);
-        seconds -= days * seconds_in_day;
-    }
-
-    avio_printf(out, "T");
-
-    hours = floor(seconds / seconds_in_hour);
-
-    if (seconds > 0 && hours > 0) {
-        avio_printf(out, "%.fH", hours);
-        seconds -= hours * seconds_in_hour;
-    }
-
-    minutes = floor(seconds / seconds_in_min);
-
-    if (seconds > 0 && minutes > 0) {
-        avio_printf(out, "%.fM", minutes);
-        seconds -= minutes * seconds_in_min;
-    }
-
-    if (seconds > 0) {
-        avio_printf(out, "%.fS", seconds);
-    }
-
-    return 0;
-}
-
-static void mpd_free_segments(YPSegment *segments)
-{
-    //int nb_segments = (int) sizeof(segments)/sizeof(YPSegment*);
-    //int i;
-
-    YPSegment *temp;
-    YPSegment *curr = segments;
-
-    while (curr != NULL) {
-        temp = curr->next;
-        free(curr);
-        curr = temp;
-    }
-
-    //for (i = 0; i < nb_segments; i++) {
-    //    free(segments[i]);
-    //}
-    //free(segments);
-}
-
-static void mpd_free_representations(YPRepresentation **reps)
-{
-    int nb_reps = (int) sizeof(reps)/sizeof(YPRepresentation*);
-    int i;
+    unsigned int i;
 
     for (i = 0; i < nb_reps; i++) {
-        if (reps[i]->segments != NULL) {
-            mpd_free_segments(reps[i]->segments);
-        }
+        yp_segtable_free(&reps[i]->segments);
+        yp_timeline_free(&reps[i]->timeline);
         free(reps[i]);
     }
     free(reps);
 
 }
 
-static void mpd_free_asets(YPAdaptationSet **asets)
+static void mpd_free_asets(YPAdaptationSet **asets, unsigned int nb_asets)
 {
-    int nb_asets = (int) sizeof(asets)/sizeof(YPAdaptationSet*);
-    int i;
+    unsigned int i;
 
     for (i = 0; i < nb_asets; i++) {
         if (asets[i]->representations != NULL) {
-            mpd_free_representations(asets[i]->representations);
+            mpd_free_representations(asets[i]->representations, asets[i]->nb_reps);
         }
         free(asets[i]);
     }
     free(asets);
 }
 
-static void mpd_free_periods(YPPeriod **periods)
+static void mpd_free_periods(YPPeriod **periods, unsigned int nb_periods)
 {
-    int nb_periods = (int) sizeof(periods)/sizeof(YPPeriod*);
-    int i;
+    unsigned int i;
 
     for (i = 0; i < nb_periods; i++) {
         if (periods[i]->asets != NULL) {
-            mpd_free_asets(periods[i]->asets);
+            mpd_free_asets(periods[i]->asets, periods[i]->nb_asets);
         }
         free(periods[i]);
     }
@@ -148,8 +63,10 @@ static void mpd_free_periods(YPPeriod **periods)
 
 static void mpd_free(YPMPD *mpd) {
     if (mpd->periods != NULL) {
-        mpd_free_periods(mpd->periods);
+        mpd_free_periods(mpd->periods, mpd->nb_periods);
     }
+    pthread_mutex_destroy(&mpd->lock);
+    yp_strbuf_free(&mpd->out);
     free(mpd);
 }
 
@@ -166,13 +83,20 @@ static YPRepresentation *mpd_init_representation(const YPInputStream *instream)
     rep->id = instream->stream_id;
     rep->bandwidth = st->codecpar->bit_rate;
     set_rfc6381_codec_name(st->codecpar, rep->codecs, sizeof(rep->codecs));
+    if (instream->in_band_ps)
+        memcpy(rep->codecs, "avc3", 4);
     rep->height = st->codecpar->height;
     rep->width = st->codecpar->width;
     rep->avg_frame_rate = st->avg_frame_rate;
+    rep->time_base = st->time_base;
     rep->nb_segments = 0;
     rep->total_duration = 0;
-    rep->segments =  NULL;
-    rep->last_segment = NULL;
+    yp_segtable_init(&rep->segments);
+    yp_timeline_init(&rep->timeline);
+    rep->init_pos = 0;
+    rep->init_size = 0;
+    rep->index_pos = 0;
+    rep->index_size = 0;
 
     return rep;
 }
@@ -192,6 +116,7 @@ static YPAdaptationSet *mpd_init_aset(const unsigned int id,
     aset->content_type = content_type;
     aset->bit_stream_switching = "true";
     aset->mime_type = mime_type;
+    aset->nb_reps = 0;
     aset->representations = malloc(nb_reps * sizeof(YPRepresentation*));
 
     if (aset->representations == NULL) {
@@ -216,7 +141,7 @@ static int mpd_init(YPIndexHandlerClass *self, YPConfig *config)
 
     nb_periods = 1; // No support of multiperiod yet
     nb_asets = config->has_video + config->has_audio;
-    nb_reps = (unsigned int) sizeof(config->instreams)/sizeof(YPInputStream*);
+    nb_reps = config->nb_instreams;
     nb_video_reps = nb_audio_reps = 0;
 
     for (i = 0; i < nb_reps; i++) {
@@ -230,17 +155,26 @@ static int mpd_init(YPIndexHandlerClass *self, YPConfig *config)
     }
 
     // Init mpd
+    mpd->outdir = config->outdir;
+    mpd->sink = config->sink;
     mpd->single_file = config->single_file;
     mpd->segment_template = config->segment_template;
     mpd->segment_timeline = config->segment_timeline;
     mpd->profiles = "live";
     mpd->min_buffer_time = config->min_buffer;
     mpd->max_segment_duration = config->seg_duration;
-    mpd->type = "static"; // No live support yet
-    mpd->min_update_period = 0;
+    mpd->live = config->live;
+    mpd->chunk_duration = config->chunk_duration;
+    mpd->stats = config->stats;
+    mpd->type = config->live ? "dynamic" : "static";
+    // Players should come back for the manifest once per new segment
+    mpd->min_update_period = config->live ? config->seg_duration : 0;
+    mpd->availability_start_time = time(NULL);
     mpd->time_shift_buffer_depth = 0;
     mpd->nb_periods = 0;
     mpd->periods = NULL;
+    yp_strbuf_init(&mpd->out);
+    pthread_mutex_init(&mpd->lock, NULL);
 
     mpd->periods = (YPPeriod **) malloc(nb_periods * sizeof(YPPeriod*));
     
@@ -298,8 +232,7 @@ static int mpd_init(YPIndexHandlerClass *self, YPConfig *config)
                     goto fail;
                 }
 
-                mpd->periods[0]->asets[aset_id]->representations[i] = rep;
-                mpd->periods[0]->asets[aset_id]->nb_reps++;
+                aset->representations[aset->nb_reps++] = rep;
             }
         }
         aset_id++;
@@ -321,7 +254,7 @@ static int mpd_init(YPIndexHandlerClass *self, YPConfig *config)
             YPInputStream *instream = config->instreams[i];
 
             if (instream->is_audio) {
-                    instream->set_id = aset_id;
+                instream->set_id = aset_id;
                 instream->stream_id = rep_id++;
 
                 rep = mpd_init_representation(instream);
@@ -330,9 +263,9 @@ static int mpd_init(YPIndexHandlerClass *self, YPConfig *config)
                     ret = -6;
                     goto fail;
                 }
+
+                aset->representations[aset->nb_reps++] = rep;
             }
-            mpd->periods[0]->asets[aset_id]->representations[i] = rep;
-            mpd->periods[0]->asets[aset_id]->nb_reps++;
         }
         aset_id++;
     }
@@ -345,148 +278,352 @@ fail:
     return ret;
 }
 
-static int mpd_finalize(YPIndexHandlerClass *self)
+static void write_utc_time(YPStrBuf *out, time_t t)
 {
-    AVIOContext *out = NULL;
-    YPMPD *mpd = (YPMPD *) self->opaque;
-    char filename[1024];
+    char buf[32];
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    yp_strbuf_puts(out, buf);
+}
+
+/**
+ * Build the manifest for the segments known so far in mpd->out, which is
+ * reused from one update to the next. Must be called with mpd->lock held.
+ */
+static int mpd_build_manifest(YPMPD *mpd)
+{
+    YPStrBuf *out = &mpd->out;
     int i, j;
-    int ret = 0;
     double total_duration = mpd->periods[0]->asets[0]->representations[0]->total_duration;
     YPAdaptationSet *adaptation_set = NULL;
     YPRepresentation *representation = NULL;
 
-    snprintf(filename, sizeof(filename), "manifest.mpd");
-    ret = avio_open(&out, filename, AVIO_FLAG_WRITE);
-
-    if (ret < 0) {
-        printf("Could not open manifest for writing");
-        return ret;
+    yp_strbuf_reset(out);
+
+    yp_strbuf_puts(out, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+    yp_strbuf_puts(out, "<MPD xmlns=\""MPD_NS"\" ");
+    if (mpd->single_file)
+        yp_strbuf_puts(out, "profiles=\""ISOBMFF_ON_DEMAND_PROFILE"\" ");
+    else
+        yp_strbuf_puts(out, "profiles=\""ISOBMFF_LIVE_PROFILE"\" ");
+    yp_strbuf_puts(out, "minBufferTime=\"");
+    yp_strbuf_put_duration(out, mpd->min_buffer_time);
+    yp_strbuf_puts(out, "\"  ");
+    if (!strcmp(mpd->type, "dynamic")) {
+        yp_strbuf_puts(out, "availabilityStartTime=\"");
+        write_utc_time(out, mpd->availability_start_time);
+        yp_strbuf_puts(out, "\"  ");
+        yp_strbuf_puts(out, "publishTime=\"");
+        write_utc_time(out, time(NULL));
+        yp_strbuf_puts(out, "\"  ");
+        yp_strbuf_puts(out, "minimumUpdatePeriod=\"");
+        yp_strbuf_put_duration(out, mpd->min_update_period);
+        yp_strbuf_puts(out, "\"  ");
+    } else {
+        yp_strbuf_puts(out, "mediaPresentationDuration=\"");
+        yp_strbuf_put_duration(out, llround(total_duration * 1000));
+        yp_strbuf_puts(out, "\"  ");
     }
+    yp_strbuf_puts(out, "maxSegmentDuration=\"");
+    yp_strbuf_put_duration(out, mpd->max_segment_duration);
+    yp_strbuf_puts(out, "\"  ");
+    yp_strbuf_puts(out, "type=\"");
+    yp_strbuf_puts(out, mpd->type);
+    yp_strbuf_puts(out, "\">\n");
 
-    avio_printf(out, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
-    avio_printf(out, "<MPD xmlns=\""MPD_NS"\" ");
-    avio_printf(out, "profiles=\""ISOBMFF_LIVE_PROFILE"\" ");
-    avio_printf(out, "minBufferTime=\"");
-    sec_to_iso_duration(out, (double) (mpd->min_buffer_time/1000));
-    avio_printf(out, "\"  ");
-    avio_printf(out, "mediaPresentationDuration=\"");
-    sec_to_iso_duration(out, total_duration);
-    avio_printf(out, "\"  ");
-    avio_printf(out, "maxSegmentDuration=\"");
-    sec_to_iso_duration(out, (double) (mpd->max_segment_duration/1000));
-    avio_printf(out, "\"  ");
-    avio_printf(out, "tpye=\"static\">\n");
+    yp_strbuf_puts(out, "\t<!-- Created with Yoda Packager -->\n");
 
-    avio_printf(out, "\t<!-- Created with Yoda Packager -->\n");
-
-    avio_printf(out, "\t<Period id=\"%d\">\n", mpd->periods[0]->id);
+    yp_strbuf_puts(out, "\t<Period id=\"");
+    yp_strbuf_put_int(out, mpd->periods[0]->id);
+    // Without a start, a dynamic Period is only early available
+    if (!strcmp(mpd->type, "dynamic"))
+        yp_strbuf_puts(out, "\" start=\"PT0S");
+    yp_strbuf_puts(out, "\">\n");
 
 
     for (i = 0; i < mpd->periods[0]->nb_asets; i++) {
         adaptation_set = mpd->periods[0]->asets[i];
 
-        avio_printf(out, "\t\t<AdaptationSet ");
-        avio_printf(out, "id=\"%d\"  ", adaptation_set->id);
-        avio_printf(out, "contentType=\"%s\"  ", adaptation_set->content_type);
-        avio_printf(out, "mimeType=\"%s\" ", adaptation_set->mime_type);
-        avio_printf(out, "segmentAlignment=\"true\" ");
-        avio_printf(out, "startWithSAP=\"1\">\n");
+        yp_strbuf_puts(out, "\t\t<AdaptationSet ");
+        yp_strbuf_puts(out, "id=\"");
+        yp_strbuf_put_int(out, adaptation_set->id);
+        yp_strbuf_puts(out, "\"  contentType=\"");
+        yp_strbuf_puts(out, adaptation_set->content_type);
+        yp_strbuf_puts(out, "\"  mimeType=\"");
+        yp_strbuf_puts(out, adaptation_set->mime_type);
+        yp_strbuf_puts(out, "\" ");
+        yp_strbuf_puts(out, "segmentAlignment=\"true\" ");
+        yp_strbuf_puts(out, "startWithSAP=\"1\">\n");
        
         // TODO: only do this right after adaptation tag simpel
         // For timeline etc do it add representation level
-        mpd_output_segment_template(out, mpd->max_segment_duration, 1000);
+        // Single file representations are addressed through SegmentBase,
+        // timelines are specific to each representation
+        if (!mpd->single_file && !mpd->segment_timeline)
+            mpd_output_segment_template(out, mpd, mpd->max_segment_duration, 1000);
 
         for (j = 0; j < adaptation_set->nb_reps; j++) {
             representation = adaptation_set->representations[j];
-            mpd_output_representation(out, representation);
+            mpd_output_representation(out, mpd, representation);
         }
 
-        avio_printf(out, "\t\t</AdaptationSet>\n");
+        yp_strbuf_puts(out, "\t\t</AdaptationSet>\n");
     }
 
-    avio_printf(out, "\t</Period>\n");
+    yp_strbuf_puts(out, "\t</Period>\n");
     
-    avio_printf(out, "</MPD>\n");
+    yp_strbuf_puts(out, "</MPD>\n");
+
+    if (out->error) {
+        yp_log(YP_LOG_MPD, YP_LOG_ERROR, "Out of memory while generating the manifest\n");
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
 
-    avio_flush(out);
-    avio_close(out);
+/**
+ * Hand the manifest to the sink, which replaces the previous one in a
+ * single step. Must be called with mpd->lock held.
+ */
+static int mpd_write_manifest(YPMPD *mpd)
+{
+    YPStrBuf *out = &mpd->out;
+    int ret = 0;
+    int64_t start = av_gettime_relative();
 
-    YPSegment *segments = mpd->periods[0]->asets[0]->representations[0]->segments;
-    YPSegment *curr_seg = segments;
+    if ((ret = mpd_build_manifest(mpd)) < 0)
+        return ret;
 
-    // while(curr_seg != NULL) {
-    //     fprintf(stdout, "segment: file: %s pos: %" PRId64 " size %" PRId64 " duration %f  num %d\n",
-    //         curr_seg->filename, curr_seg->pos, curr_seg->size, curr_seg->duration, curr_seg->num);
-    //     curr_seg = curr_seg->next;
-    // }
+    if ((ret = yp_sink_put(mpd->sink, "manifest.mpd", out->data, out->len)) < 0) {
+        yp_log(YP_LOG_MPD, YP_LOG_ERROR, "Could not publish manifest.mpd\n");
+        return ret;
+    }
 
-    // printf("Total duration: %f\n", mpd->periods[0]->asets[0]->representations[0]->total_duration);
+    if (mpd->stats)
+        yp_stats_add_manifest(mpd->stats, av_gettime_relative() - start);
 
     return 0;
 }
 
+static int mpd_finalize(YPIndexHandlerClass *self)
+{
+    YPMPD *mpd = (YPMPD *) self->opaque;
+    int ret;
+
+    pthread_mutex_lock(&mpd->lock);
+
+    // The stream is over: a live presentation turns into an on-demand one
+    mpd->type = "static";
+    ret = mpd_write_manifest(mpd);
+
+    pthread_mutex_unlock(&mpd->lock);
+
+    return ret;
+}
+
+
+/**
+ * With chunked output the first chunk of a segment is available once its
+ * own duration has elapsed, long before the whole segment is. Let clients
+ * request segments that much earlier.
+ */
+static void mpd_output_availability(YPStrBuf *out, YPMPD *mpd)
+{
+    if (mpd->chunk_duration <= 0 || mpd->chunk_duration >= mpd->max_segment_duration)
+        return;
+
+    yp_strbuf_puts(out, "availabilityTimeOffset=\"");
+    yp_strbuf_put_milli(out, mpd->max_segment_duration - mpd->chunk_duration);
+    yp_strbuf_puts(out, "\" ");
+    yp_strbuf_puts(out, "availabilityTimeComplete=\"false\" ");
+}
 
-static void mpd_output_segment_template(AVIOContext *out, int duration, int timescale)
+static void mpd_output_segment_template(YPStrBuf *out, YPMPD *mpd, int duration, int timescale)
 {
-    avio_printf(out, "\t\t\t<SegmentTemplate ");
-    avio_printf(out, "initialization=\"init.mp4\" ");
-    avio_printf(out, "media=\"seg-$Number$.m4s\" ");
-    avio_printf(out, "startNumber=\"1\" ");
-    avio_printf(out, "duration=\"%d\" ", duration); // TODO!!
-    avio_printf(out, "timescale=\"%d\" />\n", timescale);
+    yp_strbuf_puts(out, "\t\t\t<SegmentTemplate ");
+    mpd_output_availability(out, mpd);
+    yp_strbuf_puts(out, "initialization=\"$RepresentationID$/init.mp4\" ");
+    yp_strbuf_puts(out, "media=\"$RepresentationID$/seg-$Number$.m4s\" ");
+    yp_strbuf_puts(out, "startNumber=\"1\" ");
+    yp_strbuf_puts(out, "duration=\""); // TODO!!
+    yp_strbuf_put_int(out, duration);
+    yp_strbuf_puts(out, "\" timescale=\"");
+    yp_strbuf_put_int(out, timescale);
+    yp_strbuf_puts(out, "\" />\n");
 
     // TODO: add segment timeline option
 }
 
-static void mpd_output_representation(AVIOContext *out, YPRepresentation *representation)
+/**
+ * Write a SegmentTemplate whose SegmentTimeline lists the exact duration of
+ * every segment, in the time base of the stream. Consecutive segments of
+ * equal duration are folded into a single S element with a repeat count.
+ * S elements that can't change anymore are kept from the previous update.
+ */
+static void mpd_output_segment_timeline(YPStrBuf *out, YPMPD *mpd, YPRepresentation *representation)
 {
-    avio_printf(out, "\t\t\t<Representation ");
-    avio_printf(out, "id=\"%d\"  ", representation->id);
-    avio_printf(out, "codecs=\"%s\" ", representation->codecs);
-    avio_printf(out, "width=\"%d\" ", representation->width);
-    avio_printf(out, "height=\"%d\" ", representation->height);
-    avio_printf(out, "frameRate=\"%d/%d\" ", representation->avg_frame_rate.num, representation->avg_frame_rate.den);
-    avio_printf(out, "bandwidth=\"%"PRId64"\" />\n", representation->bandwidth);
+    // The MPD timescale is a plain integer: fold the time base numerator
+    // into durations instead
+    int64_t scale = representation->time_base.num;
+
+    yp_strbuf_puts(out, "\t\t\t\t<SegmentTemplate ");
+    mpd_output_availability(out, mpd);
+    yp_strbuf_puts(out, "timescale=\"");
+    yp_strbuf_put_int(out, representation->time_base.den);
+    yp_strbuf_puts(out, "\" ");
+    yp_strbuf_puts(out, "initialization=\"$RepresentationID$/init.mp4\" ");
+    yp_strbuf_puts(out, "media=\"$RepresentationID$/seg-$Number$.m4s\" ");
+    yp_strbuf_puts(out, "startNumber=\"1\">\n");
+    yp_strbuf_puts(out, "\t\t\t\t\t<SegmentTimeline>\n");
+
+    yp_timeline_write(out, &representation->timeline, &representation->segments, scale);
+
+    yp_strbuf_puts(out, "\t\t\t\t\t</SegmentTimeline>\n");
+    yp_strbuf_puts(out, "\t\t\t\t</SegmentTemplate>\n");
+}
+
+// "<first>-<last>" byte range attribute value
+static void put_range(YPStrBuf *out, int64_t pos, int64_t size)
+{
+    yp_strbuf_put_int(out, pos);
+    yp_strbuf_puts(out, "-");
+    yp_strbuf_put_int(out, pos + size - 1);
+}
+
+static void mpd_output_segment_base(YPStrBuf *out, YPRepresentation *representation)
+{
+    // Same layout as the muxer: <id>/media.mp4 relative to the manifest
+    yp_strbuf_puts(out, "\t\t\t\t<BaseURL>");
+    yp_strbuf_put_int(out, representation->id);
+    yp_strbuf_puts(out, "/media.mp4</BaseURL>\n");
+    yp_strbuf_puts(out, "\t\t\t\t<SegmentBase ");
+    yp_strbuf_puts(out, "indexRange=\"");
+    put_range(out, representation->index_pos, representation->index_size);
+    yp_strbuf_puts(out, "\">\n");
+    yp_strbuf_puts(out, "\t\t\t\t\t<Initialization ");
+    yp_strbuf_puts(out, "range=\"");
+    put_range(out, representation->init_pos, representation->init_size);
+    yp_strbuf_puts(out, "\" />\n");
+    yp_strbuf_puts(out, "\t\t\t\t</SegmentBase>\n");
+}
+
+static void mpd_output_representation(YPStrBuf *out, YPMPD *mpd, YPRepresentation *representation)
+{
+    yp_strbuf_puts(out, "\t\t\t<Representation ");
+    yp_strbuf_puts(out, "id=\"");
+    yp_strbuf_put_int(out, representation->id);
+    yp_strbuf_puts(out, "\"  codecs=\"");
+    yp_strbuf_puts(out, representation->codecs);
+    yp_strbuf_puts(out, "\" width=\"");
+    yp_strbuf_put_int(out, representation->width);
+    yp_strbuf_puts(out, "\" height=\"");
+    yp_strbuf_put_int(out, representation->height);
+    yp_strbuf_puts(out, "\" frameRate=\"");
+    yp_strbuf_put_int(out, representation->avg_frame_rate.num);
+    yp_strbuf_puts(out, "/");
+    yp_strbuf_put_int(out, representation->avg_frame_rate.den);
+    yp_strbuf_puts(out, "\" bandwidth=\"");
+    yp_strbuf_put_int(out, representation->bandwidth);
+
+    if (!mpd->single_file && !mpd->segment_timeline) {
+        yp_strbuf_puts(out, "\" />\n");
+        return;
+    }
+
+    yp_strbuf_puts(out, "\">\n");
+
+    if (mpd->single_file)
+        mpd_output_segment_base(out, representation);
+    else
+        mpd_output_segment_timeline(out, mpd, representation);
+
+    yp_strbuf_puts(out, "\t\t\t</Representation>\n");
 }
 
 static void mpd_output_segments(void)
 {
 }
 
-static int mpd_add_segment(YPIndexHandlerClass *self, YPInputStream *instream, char *filename, int64_t pos, int64_t size, double duration, int num)
+static YPRepresentation *mpd_find_representation(YPAdaptationSet *aset, unsigned int id)
+{
+    unsigned int i;
+
+    for (i = 0; i < aset->nb_reps; i++) {
+        if (aset->representations[i]->id == (int) id)
+            return aset->representations[i];
+    }
+
+    return NULL;
+}
+
+static int mpd_add_init_segment(YPIndexHandlerClass *self, YPInputStream *instream, char *filename, int64_t pos, int64_t size)
 {
-    printf("segment: file: %s pos: %" PRId64 " size %" PRId64 " duration %.2f num %d\n",
+    YPMPD *mpd = (YPMPD*) self->opaque;
+    YPRepresentation* representation = mpd_find_representation(mpd->periods[0]->asets[instream->set_id],
+                                                                instream->stream_id);
+
+    if (representation == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mpd->lock);
+    representation->init_pos = pos;
+    representation->init_size = size;
+    pthread_mutex_unlock(&mpd->lock);
+
+    return 0;
+}
+
+static int mpd_set_index_range(YPIndexHandlerClass *self, YPInputStream *instream, int64_t pos, int64_t size)
+{
+    YPMPD *mpd = (YPMPD*) self->opaque;
+    YPRepresentation* representation = mpd_find_representation(mpd->periods[0]->asets[instream->set_id],
+                                                                instream->stream_id);
+
+    if (representation == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mpd->lock);
+    representation->index_pos = pos;
+    representation->index_size = size;
+    pthread_mutex_unlock(&mpd->lock);
+
+    return 0;
+}
+
+static int mpd_add_segment(YPIndexHandlerClass *self, YPInputStream *instream, char *filename, int64_t pos, int64_t size, int64_t duration, int num)
+{
+    yp_log(YP_LOG_MPD, YP_LOG_DEBUG, "segment: file: %s pos: %" PRId64 " size %" PRId64 " duration %" PRId64 " num %d\n",
             filename, pos, size, duration, num);
     YPMPD *mpd = (YPMPD*) self->opaque;
     int ret = 0;
     unsigned int aset_id = instream->set_id;
-    unsigned int rep_id = instream->stream_id;
-    YPRepresentation* representation = mpd->periods[0]->asets[aset_id]->representations[rep_id];
-    YPSegment *segment = (YPSegment *) malloc(sizeof(YPSegment));
-
-    // TODO: handle malloc error
-
-    strlcpy(segment->filename, filename, sizeof(segment->filename));
-    segment->pos = pos;
-    segment->size = size;
-    segment->index_size = 0;
-    segment->duration = duration;
-    segment->num = num;
-    segment->next = NULL;
-   
-    representation->nb_segments++;
-    representation->total_duration += segment->duration;
-
-    if (representation->segments == NULL) {
-        representation->segments = segment;
-        representation->last_segment = segment;
-        return 0;
+    YPRepresentation* representation = mpd_find_representation(mpd->periods[0]->asets[aset_id],
+                                                                instream->stream_id);
+
+    if (representation == NULL) {
+        return -1;
     }
-   
-    representation->last_segment->next = segment;
-    representation->last_segment = segment;
-    return 0;
+
+    pthread_mutex_lock(&mpd->lock);
+
+    ret = yp_segtable_append(&representation->segments, duration, pos, size, num);
+
+    if (ret >= 0) {
+        representation->nb_segments++;
+        representation->total_duration += duration * av_q2d(representation->time_base);
+
+        // Publish the segment right away
+        if (mpd->live)
+            ret = mpd_write_manifest(mpd);
+    }
+
+    pthread_mutex_unlock(&mpd->lock);
+    return ret;
 }
 
 static int write_to_file(void)
@@ -499,7 +636,10 @@ YPIndexHandlerClass* yp_mpd_generator(void)
     YPIndexHandlerClass *ih = (YPIndexHandlerClass *) malloc(sizeof(YPIndexHandlerClass));
 
     if (ih) {
+        ih->opaque = NULL;
         ih->init = &mpd_init;
+        ih->add_init_segment = &mpd_add_init_segment;
+        ih->set_index_range = &mpd_set_index_range;
         ih->add_segment = &mpd_add_segment;
         ih->finalize = &mpd_finalize;
         return ih;
@@ -508,6 +648,18 @@ YPIndexHandlerClass* yp_mpd_generator(void)
     return NULL;
 }
 
+const YPStrBuf* yp_mpd_render(YPIndexHandlerClass *self)
+{
+    YPMPD *mpd = (YPMPD *) self->opaque;
+    int ret;
+
+    pthread_mutex_lock(&mpd->lock);
+    ret = mpd_build_manifest(mpd);
+    pthread_mutex_unlock(&mpd->lock);
+
+    return ret < 0 ? NULL : &mpd->out;
+}
+
 void yp_mpd_generator_free(YPIndexHandlerClass *self)
 {
     if (self->opaque != NULL) {
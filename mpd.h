@@ -1,17 +1,13 @@
 #ifndef YP_MPD_H_
 #define YP_MPD_H_
 
-#include "common.h"
+#include <pthread.h>
+#include <time.h>
 
-typedef struct YPSegment {
-    char filename[1024];
-    int64_t pos;
-    int64_t size;
-    int64_t index_size;
-    double duration;
-    int num;
-    struct YPSegment *next;
-} YPSegment;
+#include "common.h"
+#include "segtable.h"
+#include "strbuf.h"
+#include "timeline.h"
 
 typedef struct YPRepresentation {
     int id;
@@ -20,10 +16,17 @@ typedef struct YPRepresentation {
     int height;
     int width;
     AVRational avg_frame_rate;
+    // Time base of the packaged stream, segment durations are counted in it
+    AVRational time_base;
     unsigned int nb_segments;
     double total_duration;
-    YPSegment *segments;
-    YPSegment *last_segment;
+    YPSegmentTable segments;
+    YPTimelineCache timeline;
+    // Byte ranges of the init segment and, in single file mode, of the sidx
+    int64_t init_pos;
+    int64_t init_size;
+    int64_t index_pos;
+    int64_t index_size;
 } YPRepresentation;
 
 typedef struct YPAdaptationSet {
@@ -43,20 +46,35 @@ typedef struct YPPeriod {
 } YPPeriod;
 
 typedef struct YPMPD {
+    const char *outdir;
+    // Where manifest.mpd goes
+    YPSink *sink;
     int single_file;
     int segment_template;
     int segment_timeline;
     char *profiles;
     int min_buffer_time;
     int max_segment_duration;
+    // CMAF chunk duration in milliseconds, 0 when segments aren't chunked
+    int chunk_duration;
+    int live;
     char *type;
+    time_t availability_start_time;
     int min_update_period;
     int time_shift_buffer_depth;
     unsigned int nb_periods;
     YPPeriod **periods;
+    YPStats *stats;
+    // Manifest text, reused by every update
+    YPStrBuf out;
+    // Serializes add_segment calls coming from concurrent muxers
+    pthread_mutex_t lock;
 } YPMPD;
 
 YPIndexHandlerClass* yp_mpd_generator(void);
+// Manifest for the segments added so far, without writing it out. Valid
+// until the next update.
+const YPStrBuf* yp_mpd_render(YPIndexHandlerClass *self);
 void yp_mpd_generator_free(YPIndexHandlerClass *self);
 
 #endif // YP_MPD_H_
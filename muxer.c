@@ -2,18 +2,27 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include <libavutil/avassert.h>
 #include <libavutil/channel_layout.h>
 #include <libavutil/opt.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/timestamp.h>
+#include <libavutil/time.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
 
 #include "common.h"
+#include "utils.h"
+#include "log.h"
+#include "fragment.h"
 
 #define STREAM_DURATION   10.0
 #define STREAM_FRAME_RATE 25 /* 25 images/s */
@@ -23,6 +32,34 @@
 
 #define IO_BUFFER_SIZE    32768
 
+// POSIX minimum is 16, Linux and the BSDs allow 1024
+#ifndef IOV_MAX
+#define IOV_MAX           1024
+#endif
+
+// sidx version 1 with no reference, see ISO/IEC 14496-12 8.16.3
+#define SIDX_HEADER_SIZE  40
+#define SIDX_REF_SIZE     12
+// References reserved when the input duration is unknown
+#define SIDX_DEFAULT_REFS 16384
+
+typedef struct SegmentRef {
+    int64_t size;
+    // In output stream time base
+    int64_t duration;
+} SegmentRef;
+
+// Segment waiting for the writer before it can be added to the index
+typedef struct SegmentDone {
+    YPIndexHandlerClass *index;
+    YPInputStream *instream;
+    char filename[1024];
+    int64_t pos;
+    int64_t size;
+    int64_t duration;
+    int num;
+} SegmentDone;
+
 typedef struct OutputStream {
     YPInputStream *instream;
     AVFormatContext *avfctx;
@@ -34,14 +71,59 @@ typedef struct OutputStream {
     int64_t first_pts;
     int64_t curr_pts;
     int64_t last_pts;
+    // Largest pts + duration written so far
+    int64_t end_pts;
     int64_t segment_duration;
     double last_segment_duration;
+    // Same as last_segment_duration, in input stream time base
+    int64_t last_segment_ts;
     double duration;
     int init_segment_end;
     int segment_written;
     int segment_num;
-    const char *segment_name_pattern;
+    // Representation output directory, e.g. <outdir>/<stream_id>
+    char dirname[1024];
+    char segment_name_pattern[1024];
+    char init_filename[1024];
     int single_file;
+    // Single file mode: room for the sidx box reserved after the init
+    // segment, and the segments it will reference
+    int64_t index_pos;
+    int64_t index_size;
+    unsigned int nb_refs;
+    unsigned int max_refs;
+    SegmentRef *refs;
+    const YPTimeRange *range;
+    // Byte position of the current segment in the muxer output
+    int64_t segment_pos;
+    // Chunked output: every chunk_duration microseconds the pending frames
+    // are flushed as a moof/mdat pair and pushed to the segment file
+    int64_t chunk_duration;
+    int64_t chunk_start_pts;
+    // Wall clock time the first frame of the pending chunk came in
+    int64_t chunk_start_time;
+    unsigned int nb_chunks;
+    int64_t chunk_latency_total;
+    int64_t chunk_latency_max;
+    // Options for opening output files, e.g. the HTTP method
+    AVDictionary *io_opts;
+    // Asynchronous mode: os->out is a memory buffer whose content is handed
+    // to the writer, which writes it to file
+    YPWriter *writer;
+    YPWriterFile *file;
+    unsigned int writer_key;
+    // Native fragments: samples bypass the mp4 muxer, which only writes
+    // the init segment, and frag_pos stands in for its output position
+    int native;
+    YPFragmentWriter frag;
+    int64_t frag_pos;
+    // Inline local segment files are written with writev() on fd
+    int use_fd;
+    int fd;
+    // Sink without a root directory, files are named relative to it
+    YPSink *sink;
+    // Merged into instream->stats by fmp4_finalize()
+    YPStreamStats stats;
     // bandwidth
     // is_video
     // is_audio
@@ -53,7 +135,7 @@ static void log_packet(const AVFormatContext *fmt_ctx, const AVPacket *pkt, cons
 {
     AVRational *time_base = &fmt_ctx->streams[pkt->stream_index]->time_base;
 
-    printf("%s: pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
+    yp_log(YP_LOG_MUXER, YP_LOG_TRACE, "%s: pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
            tag,
            av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
            av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
@@ -69,62 +151,413 @@ static int write_buffer(void *opaque, uint8_t *buf, int buf_size)
     return buf_size;
 }
 
+static int open_output(OutputStream *os, const char *filename)
+{
+    AVDictionary *opts = NULL;
+    int ret;
+
+    if (os->use_fd) {
+        os->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return os->fd < 0 ? AVERROR(errno) : 0;
+    }
+
+    if (os->sink)
+        return os->sink->open(os->sink, &os->out, filename);
+
+    if (os->writer) {
+        os->file = yp_writer_open(os->writer, filename, os->writer_key);
+
+        if (os->file == NULL) {
+            return -1;
+        }
+
+        return avio_open_dyn_buf(&os->out);
+    }
+
+    av_dict_copy(&opts, os->io_opts, 0);
+    ret = os->avfctx->io_open(os->avfctx, &os->out, filename, AVIO_FLAG_WRITE, &opts);
+    av_dict_free(&opts);
+
+    return ret;
+}
+
+/**
+ * Asynchronous mode: queue what os->out buffered so far for writing at
+ * offset (-1 to append) and start a new buffer.
+ */
+static int submit_output(OutputStream *os, int64_t offset, YPWriteDone done, void *opaque)
+{
+    uint8_t *data = NULL;
+    int size = avio_close_dyn_buf(os->out, &data);
+    int ret;
+
+    os->out = NULL;
+
+    if ((ret = yp_writer_write(os->writer, os->file, data, size, offset, done, opaque)) < 0) {
+        return ret;
+    }
+
+    return avio_open_dyn_buf(&os->out);
+}
+
+// done is called once the file is closed, from an I/O thread in
+// asynchronous mode
+static int close_output(OutputStream *os, YPWriteDone done, void *opaque)
+{
+    uint8_t *data = NULL;
+    int size;
+    int ret = 0;
+
+    if (os->writer) {
+        size = avio_close_dyn_buf(os->out, &data);
+        ret = yp_writer_write(os->writer, os->file, data, size, -1, NULL, NULL);
+
+        if (ret >= 0)
+            ret = yp_writer_close(os->writer, os->file, done, opaque);
+        else if (done)
+            done(opaque, ret);
+
+        os->file = NULL;
+    } else if (os->sink) {
+        ret = os->sink->close(os->sink, os->out, done, opaque);
+    } else if (os->fd >= 0) {
+        if (close(os->fd) < 0)
+            ret = AVERROR(errno);
+
+        os->fd = -1;
+
+        if (done)
+            done(opaque, ret);
+    } else {
+        os->avfctx->io_close(os->avfctx, os->out);
+
+        if (done)
+            done(opaque, 0);
+    }
+
+    os->out = NULL;
+
+    return ret;
+}
+
+// Byte position in the muxer output, not counting the reserved sidx
+static int64_t output_tell(OutputStream *os)
+{
+    return os->native ? os->frag_pos : avio_tell(os->avfctx->pb);
+}
+
+// writev() all of iov, which is modified on partial writes
+static int write_iov(int fd, struct iovec *iov, int nb_iov)
+{
+    ssize_t n;
+
+    while (nb_iov > 0) {
+        n = writev(fd, iov, FFMIN(nb_iov, IOV_MAX));
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+
+        // Resume after the last byte written, possibly mid-entry
+        while (nb_iov > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            nb_iov--;
+        }
+
+        if (nb_iov > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Native fragments: write the pending samples as one sidx/moof/mdat
+ * fragment. The payloads go out from the packet buffers, with writev() to
+ * the segment file or through os->out.
+ */
+static int write_fragment(OutputStream *os)
+{
+    struct iovec *iov;
+    int nb_iov;
+    int64_t size;
+    int i;
+    int ret;
+
+    if ((ret = yp_fragment_build(&os->frag, &iov, &nb_iov, &size)) < 0)
+        return ret;
+
+    if (os->fd >= 0) {
+        if ((ret = write_iov(os->fd, iov, nb_iov)) < 0) {
+            yp_log(YP_LOG_MUXER, YP_LOG_ERROR, "Could not write segment %d: %s\n",
+                   os->segment_num + 1, av_err2str(ret));
+            return ret;
+        }
+    } else if (os->out) {
+        for (i = 0; i < nb_iov; i++)
+            avio_write(os->out, iov[i].iov_base, (int) iov[i].iov_len);
+    }
+
+    os->frag_pos += size;
+    yp_fragment_next(&os->frag);
+
+    return 0;
+}
+
+static void segment_done(void *opaque, int status)
+{
+    SegmentDone *sd = opaque;
+
+    // Only announce segments that made it to their file
+    if (status >= 0)
+        sd->index->add_segment(sd->index, sd->instream, sd->filename,
+                               sd->pos, sd->size, sd->duration, sd->num);
+    free(sd);
+}
+
+/**
+ * Flush the frames buffered in the mp4 muxer as one fragment and push it
+ * all the way to the output, opening the next segment file if needed. In
+ * chunked mode a segment is made of several of these.
+ */
+static int flush_chunk(OutputStream *os)
+{
+    int ret = 0;
+    char filename[1024];
+    int64_t latency;
+
+    if (!os->single_file && os->out == NULL && os->fd < 0) {
+        snprintf(filename, sizeof(filename), os->segment_name_pattern, os->segment_num + 1);
+
+        if ((ret = open_output(os, filename)) < 0) {
+            return ret;
+        }
+    }
+
+    if (os->native) {
+        if ((ret = write_fragment(os)) < 0)
+            return ret;
+    } else {
+        av_write_frame(os->avfctx, NULL);
+        avio_flush(os->avfctx->pb);
+    }
+
+    // Don't let the chunk sit in the file or HTTP buffer either
+    if (os->writer) {
+        if ((ret = submit_output(os, -1, NULL, NULL)) < 0)
+            return ret;
+    } else if (os->out) {
+        avio_flush(os->out);
+    }
+
+    if (os->chunk_duration > 0 && os->chunk_start_time != AV_NOPTS_VALUE) {
+        latency = av_gettime_relative() - os->chunk_start_time;
+        os->nb_chunks++;
+        os->chunk_latency_total += latency;
+        os->chunk_latency_max = FFMAX(os->chunk_latency_max, latency);
+        yp_log(YP_LOG_MUXER, YP_LOG_DEBUG, "Chunk of segment %d written, first byte latency %.3f ms\n",
+               os->segment_num + 1, latency / 1000.0);
+    }
+
+    os->chunk_start_time = AV_NOPTS_VALUE;
+
+    return ret;
+}
+
 static int flush_buffer(YPMuxerClass *self, OutputStream *os)
 {
     int ret = 0;
     char filename[1024];
     int64_t pos;
     int64_t size;
-    int duration;
     AVStream *st;
+    SegmentDone *sd;
 
-    snprintf(filename, sizeof(filename), os->segment_name_pattern, os->segment_num);
-        
-    // Open segment file for writing
-    ret = os->avfctx->io_open(os->avfctx, &os->out, filename, AVIO_FLAG_WRITE, NULL);
-
-    if (ret < 0) {
+    // Write the last chunk of the segment
+    if ((ret = flush_chunk(os)) < 0) {
         return ret;
     }
 
-    // Get segment start position in bytes
-    pos = avio_tell(os->avfctx->pb);
+    // Segments are numbered from 1, as announced by the manifest startNumber
+    os->segment_num++;
 
-    // flush muxer buffer
-    av_write_frame(os->avfctx, NULL);
-    avio_flush(os->avfctx->pb);
+    if (os->single_file) {
+        // Fragments are appended to the file opened in fmp4_init()
+        snprintf(filename, sizeof(filename), "%s", os->init_filename);
+    } else {
+        snprintf(filename, sizeof(filename), os->segment_name_pattern, os->segment_num);
+    }
 
-    os->segment_written = 0;
+    pos = os->segment_pos;
+    os->segment_pos = output_tell(os);
 
-    // close file
-    os->avfctx->io_close(os->avfctx, os->out);
+    os->segment_written = 0;
 
-    size = avio_tell(os->avfctx->pb) - pos;
+    size = os->segment_pos - pos;
     st = os->instream->ctx->streams[os->instream->stream_idx];
 
-    os->segment_num++;
+    if (os->single_file) {
+        if (os->nb_refs == os->max_refs) {
+            yp_log(YP_LOG_MUXER, YP_LOG_ERROR, "Too many segments for the reserved sidx (%u)\n", os->max_refs);
+            return -1;
+        }
+
+        os->refs[os->nb_refs].size = size;
+        os->refs[os->nb_refs].duration = av_rescale_q(os->last_segment_ts, st->time_base,
+                                                      os->avfctx->streams[0]->time_base);
+        os->nb_refs++;
+
+        // The muxer doesn't know about the sidx space we wrote in between
+        pos += os->index_size;
+    }
 
-    // printf("Segment written, segment duration: %f\n", os->last_segment_duration);
+    // Add segment to index, once it is written
+    sd = (SegmentDone *) malloc(sizeof(SegmentDone));
+
+    if (sd == NULL) {
+        return -1;
+    }
+
+    sd->index = self->index;
+    sd->instream = os->instream;
+    snprintf(sd->filename, sizeof(sd->filename), "%s", filename);
+    sd->pos = pos;
+    sd->size = size;
+    sd->duration = os->last_segment_ts;
+    sd->num = os->segment_num;
+
+    if (!os->single_file) {
+        ret = close_output(os, segment_done, sd);
+    } else if (os->writer) {
+        // Empty write: completes after the last chunk of the segment
+        ret = yp_writer_write(os->writer, os->file, NULL, 0, -1, segment_done, sd);
+    } else {
+        segment_done(sd, 0);
+    }
 
-    // Add segment to index
-    self->index->add_segment(
-            self->index,
-            os->instream,
-            filename,
-            pos, size,
-            os->last_segment_duration,
-            os->segment_num);
     return ret;
 }
 
-static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
+/**
+ * Single file mode: reserve room for the sidx box right after the init
+ * segment. The box can only be written once every segment is known, but
+ * it has to precede the fragments it references.
+ */
+static int reserve_index(OutputStream *os)
+{
+    static const uint8_t zeros[4096] = { 0 };
+    int64_t duration = AV_NOPTS_VALUE;
+    int64_t left;
+    AVStream *st = os->instream->ctx->streams[os->instream->stream_idx];
+
+    if (st->duration != AV_NOPTS_VALUE)
+        duration = av_rescale_q(st->duration, st->time_base, AV_TIME_BASE_Q);
+    else if (os->instream->ctx->duration != AV_NOPTS_VALUE)
+        duration = os->instream->ctx->duration;
+
+    // Segments only get cut once they reach the configured duration, so
+    // this bounds their number. Keep some slack for rounding.
+    if (duration != AV_NOPTS_VALUE && os->segment_duration > 0)
+        os->max_refs = (unsigned int) (duration / os->segment_duration) * 2 + 16;
+    else
+        os->max_refs = SIDX_DEFAULT_REFS;
+
+    os->refs = malloc(os->max_refs * sizeof(SegmentRef));
+
+    if (os->refs == NULL) {
+        return -1;
+    }
+
+    os->index_pos = os->init_segment_end;
+    os->index_size = SIDX_HEADER_SIZE + (int64_t) SIDX_REF_SIZE * os->max_refs;
+
+    for (left = os->index_size; left > 0; left -= FFMIN(left, sizeof(zeros)))
+        avio_write(os->out, zeros, (int) FFMIN(left, sizeof(zeros)));
+
+    return 0;
+}
+
+/**
+ * Write the sidx box and pad what is left of the reserved space with a free
+ * box.
+ */
+static int write_index(YPMuxerClass *self, OutputStream *os)
+{
+    unsigned int i;
+    int64_t sidx_size = SIDX_HEADER_SIZE + (int64_t) SIDX_REF_SIZE * os->nb_refs;
+    int64_t free_size = os->index_size - sidx_size;
+    int64_t earliest_pts = 0;
+    AVRational time_base = os->avfctx->streams[0]->time_base;
+    AVStream *st = os->instream->ctx->streams[os->instream->stream_idx];
+
+    // First segment's presentation time, nonzero with an edit list or a
+    // B-frame offset
+    if (os->first_pts != AV_NOPTS_VALUE)
+        earliest_pts = FFMAX(av_rescale_q(os->first_pts, st->time_base, time_base), 0);
+
+    if (os->writer) {
+        // Queue the last bytes, the box then goes to its place on its own
+        if (submit_output(os, -1, NULL, NULL) < 0)
+            return -1;
+    } else {
+        avio_flush(os->out);
+
+        if (avio_seek(os->out, os->index_pos, SEEK_SET) < 0) {
+            yp_log(YP_LOG_MUXER, YP_LOG_ERROR, "Could not seek back to the segment index\n");
+            return -1;
+        }
+    }
+
+    avio_wb32(os->out, (unsigned int) sidx_size);
+    avio_write(os->out, (const unsigned char *) "sidx", 4);
+    avio_wb32(os->out, 1 << 24); // version 1, no flags
+    avio_wb32(os->out, 1); // reference_ID: our single track
+    avio_wb32(os->out, time_base.den / time_base.num); // timescale
+    avio_wb64(os->out, earliest_pts); // earliest_presentation_time
+    avio_wb64(os->out, free_size); // first_offset: skip the padding
+    avio_wb16(os->out, 0); // reserved
+    avio_wb16(os->out, os->nb_refs);
+
+    for (i = 0; i < os->nb_refs; i++) {
+        avio_wb32(os->out, (unsigned int) os->refs[i].size & 0x7fffffff); // reference_type 0: media
+        avio_wb32(os->out, (unsigned int) os->refs[i].duration);
+        avio_wb32(os->out, 1U << 31 | 1 << 28); // starts_with_SAP, SAP_type 1
+    }
+
+    if (free_size > 0) {
+        avio_wb32(os->out, (unsigned int) free_size);
+        avio_write(os->out, (const unsigned char *) "free", 4);
+    }
+
+    if (os->writer) {
+        if (submit_output(os, os->index_pos, NULL, NULL) < 0)
+            return -1;
+    } else {
+        avio_flush(os->out);
+    }
+
+    if (self->index->set_index_range)
+        self->index->set_index_range(self->index, os->instream, os->index_pos, sidx_size);
+
+    return 0;
+}
+
+/**
+ * Set up the mp4 muxer, which writes the init segment and, unless native is
+ * set and the stream allows it, the fragments too.
+ */
+static int fmp4_open(YPMuxerClass *self, YPConfig *config, int instream_index, int native)
 {
     AVFormatContext *ofmt_ctx = NULL;
     AVFormatContext *ifmt_ctx = NULL;
     AVOutputFormat *oformat = NULL;
     AVStream *st = NULL; // stream for output
     AVDictionary *opts = NULL;
-    char init_filename[1024];
     int ret = 0;
     OutputStream *os = malloc(sizeof(OutputStream));
 
@@ -136,15 +569,63 @@ static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
     os->segment_num = 0;
     os->segment_duration = config->seg_duration * 1000; // microseconds
     //printf("SEG DURAION: %" PRId64 " \n\n\n", os->segment_duration);
-    os->segment_name_pattern = "seg-%d.m4s";
     os->segment_written = 0;
     os->init_segment_end = 0;
     os->first_pts = AV_NOPTS_VALUE;
     os->curr_pts = AV_NOPTS_VALUE;
     os->last_pts = AV_NOPTS_VALUE;
+    os->end_pts = AV_NOPTS_VALUE;
     os->duration = 0;
     os->instream = config->instreams[instream_index];
     os->single_file = config->single_file;
+    os->index_pos = 0;
+    os->index_size = 0;
+    os->nb_refs = 0;
+    os->max_refs = 0;
+    os->refs = NULL;
+    os->range = os->instream->range;
+    os->segment_pos = 0;
+    os->chunk_duration = (int64_t) config->chunk_duration * 1000; // microseconds
+    os->chunk_start_pts = AV_NOPTS_VALUE;
+    os->chunk_start_time = AV_NOPTS_VALUE;
+    os->nb_chunks = 0;
+    os->chunk_latency_total = 0;
+    os->chunk_latency_max = 0;
+    os->io_opts = NULL;
+    // Objects that don't end up as files can't be written by the writer
+    os->sink = config->sink && !config->sink->root ? config->sink : NULL;
+    os->writer = os->sink ? NULL : config->writer;
+    os->file = NULL;
+    // Keeps all files of this muxer on one I/O thread, in order
+    os->writer_key = os->instream->stream_id;
+    os->native = 0;
+    os->frag_pos = 0;
+    os->use_fd = 0;
+    os->fd = -1;
+    yp_stream_stats_init(&os->stats);
+
+    if (os->range) {
+        os->segment_num = os->range->first_segment;
+        os->writer_key += os->range->first_segment;
+    }
+
+    // Every representation gets its own directory so that several
+    // representations packaged from one input don't overwrite each other
+    if (os->sink)
+        snprintf(os->dirname, sizeof(os->dirname), "%u", os->instream->stream_id);
+    else
+        snprintf(os->dirname, sizeof(os->dirname), "%s/%u", config->outdir, os->instream->stream_id);
+    snprintf(os->segment_name_pattern, sizeof(os->segment_name_pattern), "%s/seg-%%d.m4s", os->dirname);
+
+    if (os->sink) {
+        // Nothing to create
+    } else if (is_url(config->outdir)) {
+        // Uploaded with chunked transfer encoding, which lets the origin
+        // serve a segment while it is being written
+        av_dict_set(&os->io_opts, "method", "PUT", 0);
+    } else {
+        mkdir_p(os->dirname);
+    }
 
     ifmt_ctx = os->instream->ctx;
 
@@ -156,7 +637,7 @@ static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
     oformat = av_guess_format("mp4", NULL, NULL);
 
     if (!oformat) {
-        fprintf(stderr, "Could not find an appropriate muxer\n");
+        yp_log(YP_LOG_MUXER, YP_LOG_ERROR, "Could not find an appropriate muxer\n");
         // TODO: free ressources
         return AVERROR_MUXER_NOT_FOUND;
     }
@@ -164,7 +645,7 @@ static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
     ofmt_ctx = avformat_alloc_context();
 
     if (!ofmt_ctx) {
-        fprintf(stderr, "Could not create output context\n");
+        yp_log(YP_LOG_MUXER, YP_LOG_ERROR, "Could not create output context\n");
         // TODO: free ressources
         return -1;
     }
@@ -190,7 +671,7 @@ static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
     st = avformat_new_stream(ofmt_ctx, NULL);
 
     if (!st) {
-        fprintf(stderr, "Could not create new stream\n");
+        yp_log(YP_LOG_MUXER, YP_LOG_ERROR, "Could not create new stream\n");
         // TODO: free resources
         return -1;
     }
@@ -205,6 +686,10 @@ static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
     // rather than copying it from input format context.
     st->codecpar->codec_tag = 0;
 
+    // Samples may carry parameter sets the init segment doesn't have
+    if (os->instream->in_band_ps && st->codecpar->codec_id == AV_CODEC_ID_H264)
+        st->codecpar->codec_tag = MKTAG('a', 'v', 'c', '3');
+
     st->sample_aspect_ratio = os->instream->ctx->streams[os->instream->stream_idx]->sample_aspect_ratio;
     st->time_base = os->instream->ctx->streams[os->instream->stream_idx]->time_base;
     av_dict_copy(&st->metadata, os->instream->ctx->streams[os->instream->stream_idx]->metadata, 0);
@@ -214,15 +699,34 @@ static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
     //    printf("Codec name = %s\n", cd->name);
     //}
     
-    snprintf(init_filename, sizeof(init_filename), "%s", "init.mp4");
-    ret = ofmt_ctx->io_open(ofmt_ctx, &os->out, init_filename, AVIO_FLAG_WRITE, NULL);
+    if (os->single_file) {
+        // Init segment, sidx and every fragment go to the same file
+        snprintf(os->init_filename, sizeof(os->init_filename), "%s/media.mp4", os->dirname);
+    } else {
+        snprintf(os->init_filename, sizeof(os->init_filename), "%s/%s", os->dirname, config->index_fname);
+    }
 
-    if (ret < 0) {
-        return ret;
+    if (os->range == NULL || os->range->write_init) {
+        ret = open_output(os, os->init_filename);
+
+        if (ret < 0) {
+            return ret;
+        }
+    } else {
+        // Another range writes the init segment, ours is dropped in
+        // write_buffer()
+        os->out = NULL;
     }
 
     // Set option for the mp4 muxer
-    av_dict_set(&opts, "movflags", "frag_custom+dash+delay_moov", 0);
+    if (os->range && os->range->start_dts != AV_NOPTS_VALUE) {
+        // Starting mid-stream: make the muxer take decode times and
+        // fragment sequence numbers from where the serial run would be
+        av_dict_set(&opts, "movflags", "frag_custom+dash+delay_moov+frag_discont", 0);
+        av_dict_set_int(&opts, "fragment_index", os->range->first_segment + 1, 0);
+    } else {
+        av_dict_set(&opts, "movflags", "frag_custom+dash+delay_moov", 0);
+    }
 
     // Allocate the output stream private data and initialize the codec, but do
     // not write the header. May optionally be used before
@@ -231,12 +735,12 @@ static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
     // If using this function do not pass the same option to
     // avformat_write_header()
     if ((ret = avformat_init_output(ofmt_ctx, &opts)) < 0) {
-        fprintf(stderr, "Error occurred when opening output file\n");
+        yp_log(YP_LOG_MUXER, YP_LOG_ERROR, "Error occurred when opening output file\n");
         return ret;
     }
 
     if ((ret = avformat_write_header(ofmt_ctx, NULL)) < 0) {
-        fprintf(stderr, "Error occurred when opening output file\n");
+        yp_log(YP_LOG_MUXER, YP_LOG_ERROR, "Error occurred when opening output file\n");
         //goto end;
         return ret;
     }
@@ -244,11 +748,43 @@ static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
     avio_flush(ofmt_ctx->pb);
     av_dict_free(&opts);
 
+    if (native) {
+        // Same sequence numbers and decode times as the mp4 muxer options
+        // above, in the timescale it picked for the track
+        if (!yp_fragment_supported(ifmt_ctx, ifmt_ctx->streams[os->instream->stream_idx]) ||
+                yp_fragment_writer_init(&os->frag, st->time_base, st->codecpar->codec_type,
+                                        os->range && os->range->start_dts != AV_NOPTS_VALUE ?
+                                        os->range->first_segment + 1 : 1,
+                                        os->range && os->range->start_dts != AV_NOPTS_VALUE) < 0) {
+            yp_log(YP_LOG_MUXER, YP_LOG_INFO, "Stream #%d: %s samples go through the mp4 muxer\n",
+                   os->instream->stream_idx, avcodec_get_name(st->codecpar->codec_id));
+        } else {
+            os->native = 1;
+            os->use_fd = !os->writer && !os->sink && !os->single_file && !is_url(config->outdir);
+        }
+    }
+
     self->opaque = (void*) os;
 
     return 0;
 }
 
+static int fmp4_init(YPMuxerClass *self, YPConfig *config, int instream_index)
+{
+    return fmp4_open(self, config, instream_index, 0);
+}
+
+static int fmp4_native_init(YPMuxerClass *self, YPConfig *config, int instream_index)
+{
+    return fmp4_open(self, config, instream_index, 1);
+}
+
+int yp_segment_duration_reached(int64_t segment_start, int64_t pts,
+                                AVRational time_base, int64_t segment_duration)
+{
+    return av_compare_ts(pts - segment_start, time_base,
+                         segment_duration, AV_TIME_BASE_Q) >= 0;
+}
 
 static int is_keyframe(AVPacket *pkt)
 {
@@ -262,43 +798,59 @@ static int is_keyframe(AVPacket *pkt)
 static int fmp4_handle_packet(YPMuxerClass *self, YPInputStream *instream, AVPacket *pkt)
 {
     int ret = 0;
+    int cut = 0;
     int i;
+    int64_t start;
     char seg_filename[1024];
     AVStream *st;
+    AVPacket opkt;
     OutputStream *os = self->opaque;
 
     //log_packet(os->instream->ctx, pkt, "in");
 
     if (os->first_pts == AV_NOPTS_VALUE) {
         os->first_pts = pkt->pts;
-        os->last_pts = pkt->pts;
+        os->last_pts = os->range ? os->range->start_pts : pkt->pts;
     }
 
     os->curr_pts = pkt->pts + pkt->duration;
 
+    if (os->end_pts == AV_NOPTS_VALUE || os->curr_pts > os->end_pts)
+        os->end_pts = os->curr_pts;
+
     // We still need to write initialization file for this stream
     // We use av_write_frame() call on our mp4 muxer for this purpose
     if (!os->init_segment_end) {
         // Passing NULL here will cause the muxer to immediatly flush data
         // buffered within it
         av_write_frame(os->avfctx, NULL);
+        avio_flush(os->avfctx->pb);
         // Now set the byte range boundary of the init file
         os->init_segment_end = avio_tell(os->avfctx->pb);
-        // Close init file handler
-        os->avfctx->io_close(os->avfctx, os->out);
-        // TODO: inform indexer about init range lenght for this stream
-        // bzw. representation
+
+        if (os->out && self->index->add_init_segment)
+            self->index->add_init_segment(self->index, os->instream, os->init_filename,
+                                          0, os->init_segment_end);
+
+        if (os->single_file) {
+            if ((ret = reserve_index(os)) < 0)
+                return ret;
+        } else if (os->out) {
+            // Close init file handler
+            close_output(os, NULL, NULL);
+        }
+
+        os->segment_pos = os->init_segment_end;
+        os->frag_pos = os->init_segment_end;
     }
 
     i = os->instream->stream_idx;
     st = os->instream->ctx->streams[i];
     
-    printf("Packet: duration since last pts %" PRId64  "\n", pkt->pts - os->last_pts);
-    printf("Packets Duration in seconds since last %f\n", (double)(pkt->pts - os->last_pts)*
-                st->time_base.num/st->time_base.den);
-
-    printf("Configure segment duration in microseconds %f\n", (double)os->segment_duration);
-    printf("Comparison: %i\n", av_compare_ts(pkt->pts - os->last_pts, st->time_base, os->segment_duration, AV_TIME_BASE_Q));
+    yp_log(YP_LOG_MUXER, YP_LOG_TRACE, "Packet: %" PRId64 " since segment start (%f s), segment duration %" PRId64 " us\n",
+           pkt->pts - os->last_pts,
+           (double)(pkt->pts - os->last_pts)*st->time_base.num/st->time_base.den,
+           os->segment_duration);
 
     // Generate segments here:
     // Packets containing key frame will have the AV_PKT_FLAG_KEY flag set:
@@ -308,49 +860,124 @@ static int fmp4_handle_packet(YPMuxerClass *self, YPInputStream *instream, AVPac
     // if we have configured duration but no key frame set exit on error: New
     // segments must start with keyframe!
     if (/*pkt->flags & AV_PKT_FLAG_KEY && */os->segment_written &&
-            av_compare_ts(pkt->pts - os->last_pts, st->time_base,
-                            os->segment_duration, AV_TIME_BASE_Q) >= 0) {
-        printf("Checking for key frame....\n");
+            yp_segment_duration_reached(os->last_pts, pkt->pts, st->time_base,
+                                        os->segment_duration)) {
         if (pkt->flags & AV_PKT_FLAG_KEY) {
-            printf("Key frame hit! %" PRId64  "\n", pkt->pts - os->last_pts);
-            printf("%f\n", (double)(pkt->pts - os->last_pts)*st->time_base.num/st->time_base.den);
-            printf("%f\n", (double)os->segment_duration);
-
+            os->last_segment_ts = pkt->pts - os->last_pts;
             os->last_segment_duration = (double) (pkt->pts - os->last_pts)*st->time_base.num/st->time_base.den;
-            printf("Last segment duration: %f\n", os->last_segment_duration);
+            yp_log(YP_LOG_MUXER, YP_LOG_DEBUG, "Key frame hit, segment duration: %f\n",
+                   os->last_segment_duration);
 
+            start = av_gettime_relative();
             ret = flush_buffer(self, os);
-            os->last_pts = os->curr_pts;
+            yp_stream_stats_add_flush(&os->stats, av_gettime_relative() - start);
+            // The new segment starts with this keyframe
+            os->last_pts = pkt->pts;
+            cut = 1;
             if (ret < 0) return ret;
 
         } else {
             // TODO:
             // Look for a way to generate key frame pkt from pkt
-            printf("New media segment should always start with a key frame\n");
+            yp_log(YP_LOG_MUXER, YP_LOG_TRACE, "New media segment should always start with a key frame\n");
         }
     }
 
+    // Chunks don't need to start with a keyframe, only segments do
+    if (!cut && os->chunk_duration > 0 && os->chunk_start_time != AV_NOPTS_VALUE &&
+            yp_segment_duration_reached(os->chunk_start_pts, pkt->pts, st->time_base,
+                                        os->chunk_duration)) {
+        if ((ret = flush_chunk(os)) < 0)
+            return ret;
+    }
+
+    if (os->chunk_start_time == AV_NOPTS_VALUE) {
+        os->chunk_start_time = av_gettime_relative();
+        os->chunk_start_pts = pkt->pts;
+    }
+
     // TODO: Update curr_pts here instead?
 
     os->segment_written = 1;
+
+    // The demuxer hands the same packet to every muxer built from this
+    // stream, so work on a shallow copy: retarget it to our single output
+    // stream and rescale it into the timebase the mp4 muxer picked.
+    opkt = *pkt;
+    opkt.stream_index = 0;
+    av_packet_rescale_ts(&opkt, st->time_base, os->avfctx->streams[0]->time_base);
+
     // Write packets to mp4 muxer
     // TODO: check ff_write_chained() method impl. for best practice
-    ret = av_write_frame(os->avfctx, pkt);
+    start = av_gettime_relative();
+    if (os->native)
+        ret = yp_fragment_add(&os->frag, &opkt);
+    else
+        ret = av_write_frame(os->avfctx, &opkt);
+    os->stats.mux_time += av_gettime_relative() - start;
+    os->stats.nb_packets++;
+    os->stats.nb_bytes += pkt->size;
 
     return ret;
 }
 
 static int fmp4_finalize(YPMuxerClass *self)
 {
+    int ret = 0;
+    int64_t end_pts;
+    int64_t start;
+    AVStream *st;
     OutputStream *os = self->opaque;
 
+    // Flush the last segment: it never sees the keyframe that would close it
+    if (os->segment_written) {
+        st = os->instream->ctx->streams[os->instream->stream_idx];
+        // A range knows where the next keyframe is, so its last segment gets
+        // the same duration it has in a whole-stream run
+        end_pts = os->range && os->range->end_pts != AV_NOPTS_VALUE ?
+                  os->range->end_pts : os->end_pts;
+        os->last_segment_ts = end_pts - os->last_pts;
+        os->last_segment_duration = (double) (end_pts - os->last_pts)*st->time_base.num/st->time_base.den;
+        start = av_gettime_relative();
+        ret = flush_buffer(self, os);
+        yp_stream_stats_add_flush(&os->stats, av_gettime_relative() - start);
+    }
+
+    if (os->single_file && os->out) {
+        if (ret >= 0)
+            ret = write_index(self, os);
+        close_output(os, NULL, NULL);
+    }
+
+    if (os->nb_chunks > 0) {
+        yp_log(YP_LOG_MUXER, YP_LOG_INFO, "Stream #%d: %u chunks, first byte latency avg %.3f ms, max %.3f ms\n",
+               os->instream->stream_idx, os->nb_chunks,
+               os->chunk_latency_total / 1000.0 / os->nb_chunks,
+               os->chunk_latency_max / 1000.0);
+    }
+
     // TODO: free all allocted resources
     //av_free(ofmt_ctx->pb);
     //avformat_free_context(ifmt_ctx);
     avformat_free_context(os->avfctx);
     //avformat_close_input(&ifmt_ctx);
+    if (os->native) {
+        os->stats.nb_shell_allocs += os->frag.pool.nb_allocs;
+        os->stats.nb_shell_reuses += os->frag.pool.nb_gets - os->frag.pool.nb_allocs;
+    }
+
+    if (os->instream->stats)
+        yp_stats_merge(os->instream->stats, &os->stats);
+    else
+        free(os->stats.flush_latencies);
+
+    if (os->native)
+        yp_fragment_writer_free(&os->frag);
+
+    av_dict_free(&os->io_opts);
+    free(os->refs);
     free(os);
-    return 0;
+    return ret;
 }
 
 // Constructor
@@ -370,6 +997,17 @@ YPMuxerClass* yp_fmp4_muxer(void)
     return NULL;
 }
 
+// Same output as yp_fmp4_muxer(), with fragments written by YPFragmentWriter
+YPMuxerClass* yp_fmp4_native_muxer(void)
+{
+    YPMuxerClass *muxer = yp_fmp4_muxer();
+
+    if (muxer)
+        muxer->init = &fmp4_native_init;
+
+    return muxer;
+}
+
 // Destructor
 void yp_muxer_free(YPMuxerClass *muxer)
 {
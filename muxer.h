@@ -1,7 +1,12 @@
 #ifndef YP_MUXER_H_
 #define YP_MUXER_H_
 
+#include "common.h"
+
 YPMuxerClass* yp_fmp4_muxer(void);
+YPMuxerClass* yp_fmp4_native_muxer(void);
 void yp_muxer_free(YPMuxerClass *muxer);
+int yp_segment_duration_reached(int64_t segment_start, int64_t pts,
+                                AVRational time_base, int64_t segment_duration);
 
 #endif // YP_MUXER_H_
@@ -0,0 +1,65 @@
+#include <stdlib.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "packetpool.h"
+
+void yp_packet_pool_init(YPPacketPool *pool)
+{
+    pool->packets = NULL;
+    pool->nb_packets = 0;
+    pool->nb_alloc = 0;
+    pool->nb_gets = 0;
+    pool->nb_allocs = 0;
+}
+
+AVPacket* yp_packet_pool_get(YPPacketPool *pool)
+{
+    AVPacket *pkt;
+
+    pool->nb_gets++;
+
+    if (pool->nb_packets > 0)
+        return pool->packets[--pool->nb_packets];
+
+    if ((pkt = av_packet_alloc()) != NULL)
+        pool->nb_allocs++;
+
+    return pkt;
+}
+
+void yp_packet_pool_put(YPPacketPool *pool, AVPacket **pkt)
+{
+    if (*pkt == NULL)
+        return;
+
+    if (pool->nb_packets == pool->nb_alloc) {
+        unsigned int nb_alloc = pool->nb_alloc ? pool->nb_alloc * 2 : 64;
+        AVPacket **packets = realloc(pool->packets, nb_alloc * sizeof(AVPacket*));
+
+        if (packets == NULL) {
+            av_packet_free(pkt);
+            return;
+        }
+
+        pool->packets = packets;
+        pool->nb_alloc = nb_alloc;
+    }
+
+    av_packet_unref(*pkt);
+    pool->packets[pool->nb_packets++] = *pkt;
+    *pkt = NULL;
+}
+
+void yp_packet_pool_uninit(YPPacketPool *pool)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool->nb_packets; i++)
+        av_packet_free(&pool->packets[i]);
+
+    free(pool->packets);
+    pool->packets = NULL;
+    pool->nb_packets = 0;
+    pool->nb_alloc = 0;
+}
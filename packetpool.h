@@ -0,0 +1,30 @@
+#ifndef YP_PACKETPOOL_H_
+#define YP_PACKETPOOL_H_
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+// AVPacket structs given back are kept for later gets instead of being
+// freed, so that stages holding on to packets stop allocating them once the
+// pool has as many as they ever hold at once. Only the structs are reused:
+// payloads are unreferenced on put. Not thread-safe, every stage has its
+// own.
+typedef struct YPPacketPool {
+    AVPacket **packets;
+    unsigned int nb_packets;
+    unsigned int nb_alloc;
+    // Structs handed out, and how many of them had to be allocated
+    uint64_t nb_gets;
+    uint64_t nb_allocs;
+} YPPacketPool;
+
+void yp_packet_pool_init(YPPacketPool *pool);
+// Blank packet, NULL if one had to be allocated and that failed
+AVPacket* yp_packet_pool_get(YPPacketPool *pool);
+// Unreference *pkt and keep it for a later get. *pkt is set to NULL, and
+// may be NULL already.
+void yp_packet_pool_put(YPPacketPool *pool, AVPacket **pkt);
+void yp_packet_pool_uninit(YPPacketPool *pool);
+
+#endif // YP_PACKETPOOL_H_
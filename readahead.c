@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <libavutil/time.h>
+#include <libavformat/avformat.h>
+
+#include "readahead.h"
+#include "log.h"
+
+// Power of two, head and tail keep counting past it
+#define READ_AHEAD_SLOTS 1024
+
+typedef struct Slot {
+    AVPacket pkt;
+    int64_t read_time;
+    // Only used by the reader, to know what is queued
+    int size;
+    int64_t dts;
+} Slot;
+
+struct YPReadAhead {
+    AVFormatContext *ctx;
+    AVIOInterruptCB interrupt_cb;
+    int64_t max_bytes;
+    int64_t max_duration;
+    pthread_t thread;
+    // Packets are written at head by the reader and taken at tail by the
+    // consumer. Each side only ever stores its own index.
+    atomic_uint head;
+    atomic_uint tail;
+    // Set by the reader once head is final, status tells why
+    atomic_int done;
+    int status;
+    // Set on free to stop the reader
+    atomic_int quit;
+    // Lock and condition are only used to sleep once one side has to wait
+    // for the other, so that the other side knows whether to wake it
+    atomic_int nb_waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Reader side: tail as last seen and what is queued up to head
+    unsigned int reclaimed;
+    int64_t queued_bytes;
+    int64_t last_dts;
+    // Consumer side: next slot to take
+    unsigned int next;
+    YPReadAheadStats stats;
+    Slot slots[READ_AHEAD_SLOTS];
+};
+
+static int interrupt_cb(void *opaque)
+{
+    YPReadAhead *ra = opaque;
+
+    if (atomic_load(&ra->quit))
+        return 1;
+
+    return ra->interrupt_cb.callback ? ra->interrupt_cb.callback(ra->interrupt_cb.opaque) : 0;
+}
+
+static void wake(YPReadAhead *ra)
+{
+    if (atomic_load(&ra->nb_waiting) == 0)
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+// Whether the reader may read another packet, after accounting for the
+// ones the consumer took since last time
+static int has_room(YPReadAhead *ra, unsigned int head)
+{
+    unsigned int tail = atomic_load(&ra->tail);
+    const Slot *oldest;
+
+    for (; ra->reclaimed != tail; ra->reclaimed++)
+        ra->queued_bytes -= ra->slots[ra->reclaimed % READ_AHEAD_SLOTS].size;
+
+    // Whatever the limits, keep at least one packet going
+    if (head == tail)
+        return 1;
+
+    if (head - tail == READ_AHEAD_SLOTS)
+        return 0;
+
+    if (ra->max_bytes > 0 && ra->queued_bytes >= ra->max_bytes)
+        return 0;
+
+    oldest = &ra->slots[tail % READ_AHEAD_SLOTS];
+    if (ra->max_duration > 0 && oldest->dts != AV_NOPTS_VALUE && ra->last_dts != AV_NOPTS_VALUE &&
+        ra->last_dts - oldest->dts >= ra->max_duration)
+        return 0;
+
+    return 1;
+}
+
+static void *read_thread(void *opaque)
+{
+    YPReadAhead *ra = opaque;
+    unsigned int head = 0;
+    int64_t start;
+    int ret = 0;
+
+    while (!atomic_load(&ra->quit)) {
+        Slot *slot = &ra->slots[head % READ_AHEAD_SLOTS];
+
+        if (!has_room(ra, head)) {
+            start = av_gettime_relative();
+
+            pthread_mutex_lock(&ra->lock);
+            atomic_fetch_add(&ra->nb_waiting, 1);
+            while (!atomic_load(&ra->quit) && !has_room(ra, head))
+                pthread_cond_wait(&ra->cond, &ra->lock);
+            atomic_fetch_sub(&ra->nb_waiting, 1);
+            pthread_mutex_unlock(&ra->lock);
+
+            ra->stats.nb_read_stalls++;
+            ra->stats.read_stall_time += av_gettime_relative() - start;
+            continue;
+        }
+
+        start = av_gettime_relative();
+        ret = av_read_frame(ra->ctx, &slot->pkt);
+        slot->read_time = av_gettime_relative() - start;
+
+        if (ret < 0)
+            break;
+
+        slot->size = slot->pkt.size;
+        slot->dts = slot->pkt.dts != AV_NOPTS_VALUE ? slot->pkt.dts : slot->pkt.pts;
+        if (slot->dts != AV_NOPTS_VALUE) {
+            slot->dts = av_rescale_q(slot->dts, ra->ctx->streams[slot->pkt.stream_index]->time_base,
+                                     AV_TIME_BASE_Q);
+            if (ra->last_dts == AV_NOPTS_VALUE || slot->dts > ra->last_dts)
+                ra->last_dts = slot->dts;
+        }
+        ra->queued_bytes += slot->size;
+
+        atomic_store(&ra->head, ++head);
+        wake(ra);
+
+        ra->stats.nb_packets++;
+        ra->stats.max_packets = FFMAX(ra->stats.max_packets, head - ra->reclaimed);
+        ra->stats.max_bytes = FFMAX(ra->stats.max_bytes, ra->queued_bytes);
+        if (slot->dts != AV_NOPTS_VALUE) {
+            const Slot *oldest = &ra->slots[ra->reclaimed % READ_AHEAD_SLOTS];
+            if (oldest->dts != AV_NOPTS_VALUE)
+                ra->stats.max_duration = FFMAX(ra->stats.max_duration, ra->last_dts - oldest->dts);
+        }
+    }
+
+    ra->status = ret < 0 ? ret : AVERROR_EXIT;
+    atomic_store(&ra->done, 1);
+    wake(ra);
+
+    return NULL;
+}
+
+YPReadAhead* yp_read_ahead(AVFormatContext *ctx, int64_t max_bytes, int64_t max_duration)
+{
+    unsigned int i;
+    YPReadAhead *ra = (YPReadAhead *) calloc(1, sizeof(YPReadAhead));
+
+    if (ra == NULL) {
+        return NULL;
+    }
+
+    ra->ctx = ctx;
+    ra->max_bytes = max_bytes;
+    ra->max_duration = max_duration;
+    ra->last_dts = AV_NOPTS_VALUE;
+    atomic_init(&ra->head, 0);
+    atomic_init(&ra->tail, 0);
+    atomic_init(&ra->done, 0);
+    atomic_init(&ra->quit, 0);
+    atomic_init(&ra->nb_waiting, 0);
+
+    for (i = 0; i < READ_AHEAD_SLOTS; i++) {
+        av_init_packet(&ra->slots[i].pkt);
+        ra->slots[i].pkt.data = NULL;
+        ra->slots[i].pkt.size = 0;
+    }
+
+    // A read blocked on a live input must not keep free from returning
+    ra->interrupt_cb = ctx->interrupt_callback;
+    ctx->interrupt_callback.callback = &interrupt_cb;
+    ctx->interrupt_callback.opaque = ra;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    if (pthread_create(&ra->thread, NULL, read_thread, ra) != 0) {
+        yp_log(YP_LOG_DEMUX, YP_LOG_ERROR, "could not start the read-ahead thread\n");
+        ctx->interrupt_callback = ra->interrupt_cb;
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        free(ra);
+        return NULL;
+    }
+
+    return ra;
+}
+
+static int available(YPReadAhead *ra)
+{
+    // done first: once it is set, head is final
+    return atomic_load(&ra->done) || atomic_load(&ra->head) != ra->next;
+}
+
+int yp_read_ahead_get(YPReadAhead *ra, AVPacket *pkt, int64_t *read_time)
+{
+    Slot *slot;
+
+    if (!available(ra)) {
+        int64_t start = av_gettime_relative();
+
+        pthread_mutex_lock(&ra->lock);
+        atomic_fetch_add(&ra->nb_waiting, 1);
+        while (!available(ra))
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        atomic_fetch_sub(&ra->nb_waiting, 1);
+        pthread_mutex_unlock(&ra->lock);
+
+        ra->stats.nb_get_stalls++;
+        ra->stats.get_stall_time += av_gettime_relative() - start;
+    }
+
+    if (atomic_load(&ra->head) == ra->next)
+        return ra->status;
+
+    slot = &ra->slots[ra->next % READ_AHEAD_SLOTS];
+    av_packet_move_ref(pkt, &slot->pkt);
+    *read_time = slot->read_time;
+
+    atomic_store(&ra->tail, ++ra->next);
+    wake(ra);
+
+    return 0;
+}
+
+void yp_read_ahead_free(YPReadAhead *ra, YPReadAheadStats *stats)
+{
+    unsigned int i;
+
+    atomic_store(&ra->quit, 1);
+
+    pthread_mutex_lock(&ra->lock);
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_join(ra->thread, NULL);
+
+    ra->ctx->interrupt_callback = ra->interrupt_cb;
+
+    for (i = 0; i < READ_AHEAD_SLOTS; i++)
+        av_packet_unref(&ra->slots[i].pkt);
+
+    if (stats)
+        *stats = ra->stats;
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra);
+}
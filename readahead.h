@@ -0,0 +1,40 @@
+#ifndef YP_READAHEAD_H_
+#define YP_READAHEAD_H_
+
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+// Demuxes an input on a thread of its own, so that reading and muxing
+// overlap. Packets are handed to the single consumer through a bounded
+// ring that only takes a lock when one side has to wait for the other.
+typedef struct YPReadAhead YPReadAhead;
+
+typedef struct YPReadAheadStats {
+    uint64_t nb_packets;
+    // Largest number of packets and bytes, and longest duration in
+    // microseconds, waiting in the ring at once
+    unsigned int max_packets;
+    int64_t max_bytes;
+    int64_t max_duration;
+    // Reads that found the ring full and waited for the consumer, and gets
+    // that found it empty and waited for the reader. Times in microseconds.
+    uint64_t nb_read_stalls;
+    int64_t read_stall_time;
+    uint64_t nb_get_stalls;
+    int64_t get_stall_time;
+} YPReadAheadStats;
+
+// The reader stops once max_bytes bytes or packets spanning max_duration
+// microseconds are queued, whichever comes first. 0 means no limit besides
+// the number of slots of the ring.
+YPReadAhead* yp_read_ahead(AVFormatContext *ctx, int64_t max_bytes, int64_t max_duration);
+// Move the next packet into pkt, along with the time spent reading it.
+// Returns the error that ended reading, AVERROR_EOF at the end of input,
+// once every packet read before it was taken.
+int yp_read_ahead_get(YPReadAhead *ra, AVPacket *pkt, int64_t *read_time);
+// Stop reading and drop the packets left in the ring. stats, if not NULL,
+// receives the counters.
+void yp_read_ahead_free(YPReadAhead *ra, YPReadAheadStats *stats);
+
+#endif // YP_READAHEAD_H_
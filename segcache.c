@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "segcache.h"
+
+// Hash buckets per shard
+#define NB_BUCKETS  1024
+
+typedef struct CacheShard {
+    pthread_mutex_t lock;
+    // Signaled whenever a render of this shard completes
+    pthread_cond_t rendered;
+    YPCacheEntry *buckets[NB_BUCKETS];
+    // Rendered entries, most recently used first
+    YPCacheEntry *head;
+    YPCacheEntry *tail;
+    int64_t max_bytes;
+    YPSegmentCacheStats stats;
+} CacheShard;
+
+struct YPSegmentCache {
+    unsigned int nb_shards;
+    CacheShard *shards;
+};
+
+// FNV-1a
+static uint32_t hash_key(const char *key)
+{
+    uint32_t h = 2166136261u;
+
+    while (*key) {
+        h ^= (uint8_t) *key++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static YPCacheEntry** bucket_of(CacheShard *shard, const YPSegmentCache *cache, uint32_t hash)
+{
+    return &shard->buckets[(hash / cache->nb_shards) % NB_BUCKETS];
+}
+
+static void entry_free(YPCacheEntry *e)
+{
+    av_free((void *) e->data);
+    free(e->key);
+    free(e);
+}
+
+static void lru_unlink(CacheShard *shard, YPCacheEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        shard->head = e->next;
+
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        shard->tail = e->prev;
+
+    e->prev = e->next = NULL;
+}
+
+static void lru_push(CacheShard *shard, YPCacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = shard->head;
+
+    if (shard->head)
+        shard->head->prev = e;
+    else
+        shard->tail = e;
+
+    shard->head = e;
+}
+
+static void hash_unlink(YPCacheEntry **bucket, YPCacheEntry *e)
+{
+    YPCacheEntry **p;
+
+    for (p = bucket; *p; p = &(*p)->hash_next) {
+        if (*p == e) {
+            *p = e->hash_next;
+            break;
+        }
+    }
+
+    e->hash_next = NULL;
+}
+
+/**
+ * Take e out of the cache. It is freed now if nobody holds a reference,
+ * by the last yp_segcache_release() otherwise.
+ */
+static void drop(YPSegmentCache *cache, CacheShard *shard, YPCacheEntry *e)
+{
+    hash_unlink(bucket_of(shard, cache, e->hash), e);
+
+    if (e->status > 0) {
+        lru_unlink(shard, e);
+        shard->stats.nb_entries--;
+        shard->stats.nb_bytes -= e->size;
+    }
+
+    e->cached = 0;
+
+    if (e->refs == 0)
+        entry_free(e);
+}
+
+YPSegmentCache* yp_segcache(int64_t max_bytes, unsigned int nb_shards)
+{
+    YPSegmentCache *cache;
+    unsigned int i;
+
+    if (nb_shards == 0)
+        nb_shards = 1;
+
+    if ((cache = calloc(1, sizeof(YPSegmentCache))) == NULL)
+        return NULL;
+
+    if ((cache->shards = calloc(nb_shards, sizeof(CacheShard))) == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->nb_shards = nb_shards;
+
+    for (i = 0; i < nb_shards; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        pthread_cond_init(&cache->shards[i].rendered, NULL);
+        cache->shards[i].max_bytes = max_bytes / nb_shards;
+    }
+
+    return cache;
+}
+
+int yp_segcache_get(YPSegmentCache *cache, const char *key, YPRenderFunc render,
+                    void *opaque, YPCacheEntry **entry)
+{
+    uint32_t hash = hash_key(key);
+    CacheShard *shard = &cache->shards[hash % cache->nb_shards];
+    YPCacheEntry **bucket = bucket_of(shard, cache, hash);
+    YPCacheEntry *e;
+    uint8_t *data = NULL;
+    int64_t start, elapsed;
+    int size = 0;
+    int ret;
+
+    pthread_mutex_lock(&shard->lock);
+
+    for (e = *bucket; e; e = e->hash_next) {
+        if (e->hash == hash && !strcmp(e->key, key))
+            break;
+    }
+
+    if (e && e->status > 0) {
+        shard->stats.nb_hits++;
+        e->refs++;
+        lru_unlink(shard, e);
+        lru_push(shard, e);
+        pthread_mutex_unlock(&shard->lock);
+        *entry = e;
+        return 0;
+    }
+
+    if (e) {
+        // Being rendered, wait for it
+        shard->stats.nb_coalesced++;
+        e->refs++;
+        start = av_gettime_relative();
+
+        while (e->status == 0)
+            pthread_cond_wait(&shard->rendered, &shard->lock);
+
+        elapsed = av_gettime_relative() - start;
+        shard->stats.total_wait_time += elapsed;
+        shard->stats.max_wait_time = FFMAX(shard->stats.max_wait_time, elapsed);
+        ret = e->status;
+        pthread_mutex_unlock(&shard->lock);
+
+        if (ret < 0) {
+            yp_segcache_release(cache, e);
+            return ret;
+        }
+
+        *entry = e;
+        return 0;
+    }
+
+    shard->stats.nb_misses++;
+
+    if ((e = calloc(1, sizeof(YPCacheEntry))) == NULL || (e->key = strdup(key)) == NULL) {
+        free(e);
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    // Visible to concurrent requests, not part of the LRU list until rendered
+    e->hash = hash;
+    e->refs = 1;
+    e->cached = 1;
+    e->hash_next = *bucket;
+    *bucket = e;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    start = av_gettime_relative();
+    ret = render(opaque, &data, &size);
+    elapsed = av_gettime_relative() - start;
+
+    pthread_mutex_lock(&shard->lock);
+
+    shard->stats.total_render_time += elapsed;
+    shard->stats.max_render_time = FFMAX(shard->stats.max_render_time, elapsed);
+
+    if (ret < 0 || data == NULL) {
+        shard->stats.nb_failures++;
+        av_free(data);
+        e->status = ret < 0 ? ret : -1;
+        ret = e->status;
+        hash_unlink(bucket, e);
+        e->cached = 0;
+    } else {
+        e->data = data;
+        e->size = size;
+        e->status = 1;
+        ret = 0;
+
+        if (size > shard->max_bytes) {
+            // Served to the requests at hand only
+            hash_unlink(bucket, e);
+            e->cached = 0;
+        } else {
+            lru_push(shard, e);
+            shard->stats.nb_entries++;
+            shard->stats.nb_bytes += size;
+
+            while (shard->stats.nb_bytes > shard->max_bytes) {
+                shard->stats.nb_evictions++;
+                drop(cache, shard, shard->tail);
+            }
+        }
+    }
+
+    pthread_cond_broadcast(&shard->rendered);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (ret < 0) {
+        yp_segcache_release(cache, e);
+        return ret;
+    }
+
+    *entry = e;
+    return 0;
+}
+
+void yp_segcache_release(YPSegmentCache *cache, YPCacheEntry *entry)
+{
+    CacheShard *shard = &cache->shards[entry->hash % cache->nb_shards];
+    int unused;
+
+    pthread_mutex_lock(&shard->lock);
+    unused = --entry->refs == 0 && !entry->cached;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (unused)
+        entry_free(entry);
+}
+
+void yp_segcache_get_stats(YPSegmentCache *cache, YPSegmentCacheStats *stats)
+{
+    unsigned int i;
+
+    memset(stats, 0, sizeof(YPSegmentCacheStats));
+
+    for (i = 0; i < cache->nb_shards; i++) {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->nb_hits += shard->stats.nb_hits;
+        stats->nb_misses += shard->stats.nb_misses;
+        stats->nb_coalesced += shard->stats.nb_coalesced;
+        stats->nb_evictions += shard->stats.nb_evictions;
+        stats->nb_failures += shard->stats.nb_failures;
+        stats->nb_entries += shard->stats.nb_entries;
+        stats->nb_bytes += shard->stats.nb_bytes;
+        stats->total_render_time += shard->stats.total_render_time;
+        stats->max_render_time = FFMAX(stats->max_render_time, shard->stats.max_render_time);
+        stats->total_wait_time += shard->stats.total_wait_time;
+        stats->max_wait_time = FFMAX(stats->max_wait_time, shard->stats.max_wait_time);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void yp_segcache_free(YPSegmentCache *cache)
+{
+    unsigned int i;
+
+    for (i = 0; i < cache->nb_shards; i++) {
+        CacheShard *shard = &cache->shards[i];
+
+        while (shard->head)
+            drop(cache, shard, shard->head);
+
+        pthread_cond_destroy(&shard->rendered);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(cache->shards);
+    free(cache);
+}
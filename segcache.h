@@ -0,0 +1,64 @@
+#ifndef YP_SEGCACHE_H_
+#define YP_SEGCACHE_H_
+
+#include <stdint.h>
+
+// Byte-budgeted LRU cache of rendered segments. Keys are split over shards
+// with their own lock and LRU list, each holding an equal share of the
+// budget. A miss renders the segment once, concurrent requests for the
+// same key wait for that render instead of starting their own.
+typedef struct YPSegmentCache YPSegmentCache;
+
+typedef struct YPCacheEntry {
+    // Valid while a reference is held
+    const uint8_t *data;
+    int size;
+    // Private
+    char *key;
+    uint32_t hash;
+    // 1 once rendered, negative if the render failed, 0 while rendering
+    int status;
+    unsigned int refs;
+    int cached;
+    struct YPCacheEntry *hash_next;
+    struct YPCacheEntry *prev;
+    struct YPCacheEntry *next;
+} YPCacheEntry;
+
+// Render the segment of a missed key into *data, allocated with
+// av_malloc(), which the cache then owns. Returns a negative value on
+// failure.
+typedef int (*YPRenderFunc)(void *opaque, uint8_t **data, int *size);
+
+typedef struct YPSegmentCacheStats {
+    uint64_t nb_hits;
+    uint64_t nb_misses;
+    // Misses that waited for the render of another request
+    uint64_t nb_coalesced;
+    uint64_t nb_evictions;
+    uint64_t nb_failures;
+    unsigned int nb_entries;
+    int64_t nb_bytes;
+    // Times in microseconds. Render time is spent by the rendering request,
+    // wait time by the coalesced ones.
+    int64_t total_render_time;
+    int64_t max_render_time;
+    int64_t total_wait_time;
+    int64_t max_wait_time;
+} YPSegmentCacheStats;
+
+YPSegmentCache* yp_segcache(int64_t max_bytes, unsigned int nb_shards);
+/**
+ * Look key up, calling render on a miss. On success *entry holds a
+ * reference to the rendered segment, release it with yp_segcache_release().
+ * A failed render is not cached, every request waiting on it fails with
+ * it and the next one renders again.
+ */
+int yp_segcache_get(YPSegmentCache *cache, const char *key, YPRenderFunc render,
+                    void *opaque, YPCacheEntry **entry);
+void yp_segcache_release(YPSegmentCache *cache, YPCacheEntry *entry);
+void yp_segcache_get_stats(YPSegmentCache *cache, YPSegmentCacheStats *stats);
+// Every reference must have been released
+void yp_segcache_free(YPSegmentCache *cache);
+
+#endif // YP_SEGCACHE_H_
@@ -0,0 +1,69 @@
+#include <stdlib.h>
+
+#include "segtable.h"
+
+#define SEGTABLE_MIN_ALLOC 64
+
+void yp_segtable_init(YPSegmentTable *table)
+{
+    table->nb_segments = 0;
+    table->nb_alloc = 0;
+    table->start = NULL;
+    table->duration = NULL;
+    table->pos = NULL;
+    table->size = NULL;
+    table->num = NULL;
+}
+
+static int grow(void **column, size_t elem_size, unsigned int nb_alloc)
+{
+    void *p = realloc(*column, elem_size * nb_alloc);
+
+    if (p == NULL) {
+        return -1;
+    }
+
+    *column = p;
+    return 0;
+}
+
+int yp_segtable_append(YPSegmentTable *table, int64_t duration, int64_t pos,
+                       int64_t size, int num)
+{
+    unsigned int i = table->nb_segments;
+
+    if (i == table->nb_alloc) {
+        unsigned int nb_alloc = table->nb_alloc ? table->nb_alloc * 2 : SEGTABLE_MIN_ALLOC;
+
+        // Columns that grew stay valid if a later one fails, nb_alloc is
+        // only bumped once they all did
+        if (grow((void **) &table->start, sizeof(*table->start), nb_alloc) < 0 ||
+                grow((void **) &table->duration, sizeof(*table->duration), nb_alloc) < 0 ||
+                grow((void **) &table->pos, sizeof(*table->pos), nb_alloc) < 0 ||
+                grow((void **) &table->size, sizeof(*table->size), nb_alloc) < 0 ||
+                grow((void **) &table->num, sizeof(*table->num), nb_alloc) < 0) {
+            return -1;
+        }
+
+        table->nb_alloc = nb_alloc;
+    }
+
+    table->start[i] = i > 0 ? table->start[i - 1] + table->duration[i - 1] : 0;
+    table->duration[i] = duration;
+    table->pos[i] = pos;
+    table->size[i] = size;
+    table->num[i] = num;
+    table->nb_segments++;
+
+    return 0;
+}
+
+void yp_segtable_free(YPSegmentTable *table)
+{
+    free(table->start);
+    free(table->duration);
+    free(table->pos);
+    free(table->size);
+    free(table->num);
+    yp_segtable_init(table);
+}
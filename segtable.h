@@ -0,0 +1,25 @@
+#ifndef YP_SEGTABLE_H_
+#define YP_SEGTABLE_H_
+
+#include <stdint.h>
+
+// Segments of one representation, stored column by column. Times are in
+// the representation time base. File names are not stored: they follow
+// from the segment template and num.
+typedef struct YPSegmentTable {
+    unsigned int nb_segments;
+    unsigned int nb_alloc;
+    int64_t *start;
+    int64_t *duration;
+    int64_t *pos;
+    int64_t *size;
+    int32_t *num;
+} YPSegmentTable;
+
+void yp_segtable_init(YPSegmentTable *table);
+// Append a segment starting where the previous one ends
+int yp_segtable_append(YPSegmentTable *table, int64_t duration, int64_t pos,
+                       int64_t size, int num);
+void yp_segtable_free(YPSegmentTable *table);
+
+#endif // YP_SEGTABLE_H_
@@ -0,0 +1,1233 @@
+// memmem(), strcasestr()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
+
+#include "third_party/argtable3.h"
+#include "serve.h"
+#include "demux.h"
+#include "kfindex.h"
+#include "shard.h"
+#include "mpd.h"
+#include "segcache.h"
+#include "threadpool.h"
+#include "log.h"
+#include "utils.h"
+
+#define MAX_REQUEST_SIZE    8192
+// Idle keep-alive connections are closed after this many microseconds
+#define KEEPALIVE_TIMEOUT   5000000
+#define MAX_STATS_SIZE      1024
+
+// A representation of a title and the segments a whole-stream run would
+// cut it into
+typedef struct ServeRep {
+    YPInputStream instream;
+    YPTimeRange *segments;
+    unsigned int nb_segments;
+} ServeRep;
+
+// Input file below the root, probed, indexed and described by a manifest
+// on its first request
+typedef struct ServeTitle {
+    // Path relative to the root, as found in URLs
+    char path[1024];
+    // Part of segment cache keys, a replaced file doesn't hit old segments
+    time_t mtime;
+    YPDemuxer *demuxer;
+    unsigned int nb_reps;
+    ServeRep *reps;
+    char *manifest;
+    size_t manifest_size;
+    // Requests using the title, which can't be evicted before they are done
+    unsigned int refs;
+    int64_t last_used;
+    struct ServeTitle *next;
+} ServeTitle;
+
+typedef struct ServeContext {
+    // Template of the configuration of every packaging run
+    YPConfig config;
+    const char *root;
+    const char *cache_dir;
+    unsigned int max_titles;
+    YPThreadPool *pool;
+    YPSegmentCache *cache;
+    // Connections handed back by workers once their request is answered
+    int wake[2];
+    pthread_mutex_t lock;
+    ServeTitle *titles;
+    unsigned int nb_titles;
+    uint64_t nb_requests;
+    uint64_t nb_errors;
+    uint64_t nb_segments;
+    int64_t segment_time_total;
+    int64_t segment_time_max;
+    int64_t segment_cpu_total;
+} ServeContext;
+
+typedef struct ServeConn {
+    ServeContext *s;
+    int fd;
+    int64_t last_active;
+    // Bytes read past the current request, from pipelining clients
+    size_t len;
+    char buf[MAX_REQUEST_SIZE];
+} ServeConn;
+
+typedef struct ServeResponse {
+    int status;
+    const char *type;
+    const uint8_t *body;
+    size_t size;
+    // Owned body, freed once sent
+    uint8_t *data;
+    // Title or cache entry body points into, released once sent
+    ServeTitle *title;
+    YPCacheEntry *entry;
+    char timing[128];
+} ServeResponse;
+
+// Segment to package on a cache miss
+typedef struct RenderRequest {
+    ServeContext *s;
+    ServeRep *rep;
+    unsigned int seg;
+    int init;
+    const char *name;
+    ServeResponse *res;
+} RenderRequest;
+
+static volatile sig_atomic_t stopped = 0;
+
+static void handle_signal(int sig)
+{
+    stopped = 1;
+}
+
+static int discard_add_segment(YPIndexHandlerClass *self, YPInputStream *instream,
+                               char *filename, int64_t pos, int64_t size,
+                               int64_t duration, int num)
+{
+    return 0;
+}
+
+static void title_free(ServeTitle *t)
+{
+    unsigned int i;
+
+    for (i = 0; i < t->nb_reps; i++)
+        free(t->reps[i].segments);
+
+    if (t->demuxer)
+        yp_demuxer_free(t->demuxer);
+
+    free(t->reps);
+    free(t->manifest);
+    free(t);
+}
+
+/**
+ * Describe the title with the manifest of a whole-stream run. Segment
+ * durations come from the keyframe index, the segments themselves are only
+ * packaged when requested.
+ */
+static int title_describe(ServeContext *s, ServeTitle *t, YPKeyframeIndex **indexes)
+{
+    int ret = 0;
+    unsigned int i, k;
+    YPConfig config = s->config;
+    YPIndexHandlerClass *mpd = NULL;
+    YPInputStream **instreams = calloc(t->nb_reps, sizeof(YPInputStream*));
+    const YPStrBuf *manifest;
+
+    if (instreams == NULL) {
+        return -1;
+    }
+
+    config.instreams = instreams;
+    config.nb_instreams = t->nb_reps;
+    config.has_video = 0;
+    config.has_audio = 0;
+
+    for (i = 0; i < t->nb_reps; i++) {
+        instreams[i] = &t->reps[i].instream;
+        config.has_video |= instreams[i]->is_video;
+        config.has_audio |= instreams[i]->is_audio;
+    }
+
+    // Assigns representation ids
+    if ((mpd = yp_mpd_generator()) == NULL || (ret = mpd->init(mpd, &config)) < 0) {
+        ret = -1;
+        goto end;
+    }
+
+    for (i = 0; i < t->nb_reps && ret >= 0; i++) {
+        ServeRep *rep = &t->reps[i];
+        const YPKeyframeIndex *index = indexes[rep->instream.stream_idx];
+
+        if (index->first_pts == AV_NOPTS_VALUE) {
+            yp_log(YP_LOG_SERVE, YP_LOG_ERROR, "Stream #%d of %s has no packets\n",
+                   rep->instream.stream_idx, t->path);
+            ret = -1;
+            break;
+        }
+
+        if ((ret = yp_shard_plan_segments(index, (int64_t) config.seg_duration * 1000,
+                                          &rep->segments, &rep->nb_segments)) < 0)
+            break;
+
+        mpd->add_init_segment(mpd, &rep->instream, "init.mp4", 0, 0);
+
+        for (k = 0; k < rep->nb_segments && ret >= 0; k++) {
+            // A range may start before its segment, which starts where the
+            // previous one ends
+            int64_t start_pts = k > 0 ? rep->segments[k - 1].end_pts : index->first_pts;
+            int64_t end_pts = k + 1 < rep->nb_segments ? rep->segments[k].end_pts : index->end_pts;
+
+            ret = mpd->add_segment(mpd, &rep->instream, "", 0, 0, end_pts - start_pts, k + 1);
+        }
+    }
+
+    if (ret < 0 || (manifest = yp_mpd_render(mpd)) == NULL) {
+        ret = -1;
+        goto end;
+    }
+
+    if ((t->manifest = malloc(manifest->len)) == NULL) {
+        ret = -1;
+        goto end;
+    }
+
+    memcpy(t->manifest, manifest->data, manifest->len);
+    t->manifest_size = manifest->len;
+
+end:
+    if (mpd)
+        yp_mpd_generator_free(mpd);
+    free(instreams);
+    return ret;
+}
+
+static ServeTitle* title_open(ServeContext *s, const char *path)
+{
+    char filename[2048];
+    struct stat st;
+    unsigned int i;
+    AVFormatContext *ctx = NULL;
+    YPInputStream **instreams = NULL;
+    YPKeyframeIndex **indexes = NULL;
+    ServeTitle *t;
+    int ret = -1;
+
+    snprintf(filename, sizeof(filename), "%s/%s", s->root, path);
+
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    if ((t = calloc(1, sizeof(ServeTitle))) == NULL)
+        return NULL;
+
+    snprintf(t->path, sizeof(t->path), "%s", path);
+    t->mtime = st.st_mtime;
+
+    if ((t->demuxer = yp_demuxer(filename)) == NULL)
+        goto end;
+
+    t->demuxer->mmap = s->config.mmap;
+    t->demuxer->cache_dir = s->cache_dir;
+
+    if (yp_demuxer_open(t->demuxer) < 0)
+        goto end;
+
+    ctx = t->demuxer->ctx;
+
+    // Every video and audio stream makes a representation
+    if ((t->reps = calloc(ctx->nb_streams, sizeof(ServeRep))) == NULL ||
+            (instreams = calloc(ctx->nb_streams, sizeof(YPInputStream*))) == NULL ||
+            (indexes = calloc(ctx->nb_streams, sizeof(YPKeyframeIndex*))) == NULL)
+        goto end;
+
+    for (i = 0; i < ctx->nb_streams; i++) {
+        enum AVMediaType type = ctx->streams[i]->codecpar->codec_type;
+        YPInputStream *instream = &t->reps[t->nb_reps].instream;
+
+        if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO)
+            continue;
+
+        instream->filename = t->demuxer->filename;
+        instream->ctx = ctx;
+        instream->stream_idx = i;
+        instream->is_video = type == AVMEDIA_TYPE_VIDEO;
+        instream->is_audio = type == AVMEDIA_TYPE_AUDIO;
+        instream->range = NULL;
+        instream->stats = NULL;
+        instream->in_band_ps = 0;
+        instreams[t->nb_reps++] = instream;
+    }
+
+    if (t->nb_reps == 0) {
+        yp_log(YP_LOG_SERVE, YP_LOG_ERROR, "%s has no audio or video stream\n", path);
+        goto end;
+    }
+
+    if (yp_shard_index(t->demuxer, instreams, t->nb_reps, indexes) < 0 ||
+            title_describe(s, t, indexes) < 0)
+        goto end;
+
+    ret = 0;
+
+end:
+    if (indexes) {
+        for (i = 0; i < ctx->nb_streams; i++) {
+            if (indexes[i])
+                yp_kfindex_free(indexes[i]);
+        }
+    }
+    free(indexes);
+    free(instreams);
+
+    if (ret < 0) {
+        title_free(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+/**
+ * Title at path, opened on first use. The least recently used titles are
+ * dropped past s->max_titles. Release with title_put().
+ */
+static ServeTitle* title_get(ServeContext *s, const char *path)
+{
+    ServeTitle *t, *found = NULL;
+    ServeTitle **p, **lru;
+
+    pthread_mutex_lock(&s->lock);
+
+    for (t = s->titles; t; t = t->next) {
+        if (!strcmp(t->path, path))
+            break;
+    }
+
+    if (t) {
+        t->refs++;
+        t->last_used = av_gettime_relative();
+        pthread_mutex_unlock(&s->lock);
+        return t;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    // Probing and indexing can take a while, don't hold other titles back
+    if ((t = title_open(s, path)) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&s->lock);
+
+    // Someone else may have opened it meanwhile
+    for (found = s->titles; found; found = found->next) {
+        if (!strcmp(found->path, path))
+            break;
+    }
+
+    if (found) {
+        title_free(t);
+        t = found;
+    } else {
+        t->next = s->titles;
+        s->titles = t;
+        s->nb_titles++;
+
+        while (s->nb_titles > s->max_titles) {
+            lru = NULL;
+
+            for (p = &s->titles; *p; p = &(*p)->next) {
+                if ((*p)->refs == 0 && (lru == NULL || (*p)->last_used < (*lru)->last_used))
+                    lru = p;
+            }
+
+            if (lru == NULL)
+                break;
+
+            found = *lru;
+            *lru = found->next;
+            s->nb_titles--;
+            title_free(found);
+        }
+    }
+
+    t->refs++;
+    t->last_used = av_gettime_relative();
+
+    pthread_mutex_unlock(&s->lock);
+
+    return t;
+}
+
+static void title_put(ServeContext *s, ServeTitle *t)
+{
+    pthread_mutex_lock(&s->lock);
+    t->refs--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int64_t thread_cpu_time(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+        return 0;
+
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Run the fmp4 muxer over segment seg of rep into memory and hand out the
+ * file called name. The run may start a few segments earlier, those are
+ * dropped. The init segment comes from a run over the first packet of the
+ * first segment.
+ */
+static int package(ServeContext *s, ServeRep *rep, unsigned int seg, int init,
+                   const char *name, ServeResponse *res)
+{
+    int ret, size;
+    YPSink *sink = yp_sink_mem();
+    char object[1100];
+    YPConfig config = s->config;
+    YPInputStream instream = rep->instream;
+    YPInputStream *instreams[1] = { &instream };
+    YPIndexHandlerClass index = { 0 };
+    int64_t start = av_gettime_relative();
+    int64_t cpu = thread_cpu_time();
+    int64_t elapsed;
+
+    index.add_segment = &discard_add_segment;
+    instream.range = &rep->segments[seg];
+    config.instreams = instreams;
+    config.nb_instreams = 1;
+    config.sink = sink;
+
+    if (sink == NULL)
+        return AVERROR(ENOMEM);
+
+    ret = yp_shard_run(&config, &instream, &index, init ? 1 : 0);
+
+    // Objects are named like files below the output directory
+    snprintf(object, sizeof(object), "%u/%s", instream.stream_id, name);
+
+    if (ret >= 0 && yp_sink_mem_take(sink, object, &res->data, &size) >= 0)
+        res->size = size;
+
+    yp_sink_free(sink);
+
+    if (res->data == NULL) {
+        yp_log(YP_LOG_SERVE, YP_LOG_ERROR, "Packaging %s of stream #%d of %s failed\n",
+               name, rep->instream.stream_idx, rep->instream.filename);
+        return -1;
+    }
+
+    elapsed = av_gettime_relative() - start;
+    cpu = thread_cpu_time() - cpu;
+
+    snprintf(res->timing, sizeof(res->timing), "package;dur=%.3f, cpu;dur=%.3f",
+             elapsed / 1000.0, cpu / 1000.0);
+
+    pthread_mutex_lock(&s->lock);
+    s->nb_segments++;
+    s->segment_time_total += elapsed;
+    s->segment_time_max = FFMAX(s->segment_time_max, elapsed);
+    s->segment_cpu_total += cpu;
+    pthread_mutex_unlock(&s->lock);
+
+    return 0;
+}
+
+static int render_segment(void *opaque, uint8_t **data, int *size)
+{
+    RenderRequest *r = opaque;
+
+    if (package(r->s, r->rep, r->seg, r->init, r->name, r->res) < 0)
+        return -1;
+
+    // Owned by the cache from now on
+    *data = r->res->data;
+    *size = r->res->size;
+    r->res->data = NULL;
+
+    return 0;
+}
+
+/**
+ * Serve segment seg of rep from the segment cache, packaging it on a miss.
+ * Requests for a segment being packaged wait for that run.
+ */
+static int get_segment(ServeContext *s, ServeTitle *t, ServeRep *rep, unsigned int seg,
+                       int init, const char *name, ServeResponse *res)
+{
+    char key[1200];
+    RenderRequest r = { s, rep, seg, init, name, res };
+    int ret;
+
+    // (input, representation, segment), 0 is the init segment
+    snprintf(key, sizeof(key), "%s\n%"PRId64"\n%d\n%u", t->path, (int64_t) t->mtime,
+             rep->instream.stream_id, init ? 0 : seg + 1);
+
+    if ((ret = yp_segcache_get(s->cache, key, &render_segment, &r, &res->entry)) < 0)
+        return ret;
+
+    res->body = res->entry->data;
+    res->size = res->entry->size;
+
+    // Packaged by this request if it has timings
+    if (res->timing[0])
+        av_strlcat(res->timing, ", cache;desc=miss", sizeof(res->timing));
+    else
+        av_strlcpy(res->timing, "cache;desc=hit", sizeof(res->timing));
+
+    return 0;
+}
+
+// Server and cache counters, as JSON
+static int render_stats(ServeContext *s, ServeResponse *res)
+{
+    YPSegmentCacheStats cs;
+    uint64_t nb_requests, nb_errors, nb_segments;
+    uint64_t lookups;
+    int len;
+
+    if ((res->data = av_malloc(MAX_STATS_SIZE)) == NULL)
+        return -1;
+
+    yp_segcache_get_stats(s->cache, &cs);
+    lookups = cs.nb_hits + cs.nb_misses + cs.nb_coalesced;
+
+    pthread_mutex_lock(&s->lock);
+    nb_requests = s->nb_requests;
+    nb_errors = s->nb_errors;
+    nb_segments = s->nb_segments;
+    pthread_mutex_unlock(&s->lock);
+
+    len = snprintf((char *) res->data, MAX_STATS_SIZE,
+                   "{\n"
+                   "  \"requests\": %"PRIu64",\n"
+                   "  \"errors\": %"PRIu64",\n"
+                   "  \"packaged\": %"PRIu64",\n"
+                   "  \"cache\": {\n"
+                   "    \"hits\": %"PRIu64",\n"
+                   "    \"misses\": %"PRIu64",\n"
+                   "    \"coalesced\": %"PRIu64",\n"
+                   "    \"hit_ratio\": %.4f,\n"
+                   "    \"evictions\": %"PRIu64",\n"
+                   "    \"failures\": %"PRIu64",\n"
+                   "    \"entries\": %u,\n"
+                   "    \"bytes\": %"PRId64",\n"
+                   "    \"render_time_avg_ms\": %.3f,\n"
+                   "    \"render_time_max_ms\": %.3f,\n"
+                   "    \"wait_time_avg_ms\": %.3f,\n"
+                   "    \"wait_time_max_ms\": %.3f\n"
+                   "  }\n"
+                   "}\n",
+                   nb_requests, nb_errors, nb_segments,
+                   cs.nb_hits, cs.nb_misses, cs.nb_coalesced,
+                   lookups ? (double) (cs.nb_hits + cs.nb_coalesced) / lookups : 0.0,
+                   cs.nb_evictions, cs.nb_failures, cs.nb_entries, cs.nb_bytes,
+                   cs.nb_misses ? cs.total_render_time / 1000.0 / cs.nb_misses : 0.0,
+                   cs.max_render_time / 1000.0,
+                   cs.nb_coalesced ? cs.total_wait_time / 1000.0 / cs.nb_coalesced : 0.0,
+                   cs.max_wait_time / 1000.0);
+
+    res->status = 200;
+    res->type = "application/json";
+    res->body = res->data;
+    res->size = FFMIN(len, MAX_STATS_SIZE - 1);
+
+    return 0;
+}
+
+static void set_error(ServeResponse *res, int status)
+{
+    res->status = status;
+    res->type = "text/plain";
+
+    switch (status) {
+    case 400: res->body = (const uint8_t *) "Bad Request\n"; break;
+    case 404: res->body = (const uint8_t *) "Not Found\n"; break;
+    case 405: res->body = (const uint8_t *) "Method Not Allowed\n"; break;
+    default: res->body = (const uint8_t *) "Internal Server Error\n"; break;
+    }
+
+    res->size = strlen((const char *) res->body);
+}
+
+// Decode %XX escapes. Fails on malformed escapes and NUL bytes.
+static int url_decode(char *dst, size_t size, const char *src, size_t len)
+{
+    size_t i, n = 0;
+    unsigned int c;
+
+    for (i = 0; i < len; i++) {
+        if (n + 1 >= size)
+            return -1;
+
+        if (src[i] == '%') {
+            if (i + 2 >= len || sscanf(src + i + 1, "%2x", &c) != 1 || c == 0)
+                return -1;
+            dst[n++] = (char) c;
+            i += 2;
+        } else {
+            dst[n++] = src[i];
+        }
+    }
+
+    dst[n] = '\0';
+
+    return 0;
+}
+
+// Reject empty components and anything that would leave the root
+static int valid_title_path(const char *path)
+{
+    const char *p = path;
+    const char *end;
+    size_t len;
+
+    if (*p == '\0')
+        return 0;
+
+    while (*p) {
+        end = strchr(p, '/');
+        len = end ? (size_t) (end - p) : strlen(p);
+
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && !strncmp(p, "..", 2)))
+            return 0;
+
+        p += len;
+        if (*p == '/')
+            p++;
+    }
+
+    return 1;
+}
+
+/**
+ * Map the request path onto a title and build the response:
+ *   /stats
+ *   /<title>/manifest.mpd
+ *   /<title>/<representation>/init.mp4
+ *   /<title>/<representation>/seg-<n>.m4s
+ */
+static void route(ServeContext *s, const char *target, size_t len, ServeResponse *res)
+{
+    char path[2048];
+    char seg_name[64];
+    char *name, *dir, *end;
+    unsigned long rep_id, num = 0;
+    unsigned int i;
+    ServeRep *rep = NULL;
+    ServeTitle *t;
+    int init;
+
+    if (url_decode(path, sizeof(path), target, len) < 0 || path[0] != '/') {
+        set_error(res, 400);
+        return;
+    }
+
+    if (!strcmp(path, "/stats")) {
+        if (render_stats(s, res) < 0)
+            set_error(res, 500);
+        return;
+    }
+
+    if ((name = strrchr(path, '/')) == NULL || name == path) {
+        set_error(res, 404);
+        return;
+    }
+
+    *name++ = '\0';
+
+    if (!strcmp(name, "manifest.mpd")) {
+        if (!valid_title_path(path + 1) || (t = title_get(s, path + 1)) == NULL) {
+            set_error(res, 404);
+            return;
+        }
+
+        res->status = 200;
+        res->type = "application/dash+xml";
+        res->body = (const uint8_t *) t->manifest;
+        res->size = t->manifest_size;
+        res->title = t;
+        return;
+    }
+
+    init = !strcmp(name, "init.mp4");
+
+    if (!init) {
+        if (strncmp(name, "seg-", 4) || (num = strtoul(name + 4, &end, 10)) == 0 ||
+                strcmp(end, ".m4s")) {
+            set_error(res, 404);
+            return;
+        }
+
+        // As the muxer names it, e.g. without leading zeros
+        snprintf(seg_name, sizeof(seg_name), "seg-%lu.m4s", num);
+        name = seg_name;
+    }
+
+    // Representation directory
+    if ((dir = strrchr(path, '/')) == NULL || dir == path) {
+        set_error(res, 404);
+        return;
+    }
+
+    *dir++ = '\0';
+    rep_id = strtoul(dir, &end, 10);
+
+    if (*dir == '\0' || *end != '\0' || !valid_title_path(path + 1) ||
+            (t = title_get(s, path + 1)) == NULL) {
+        set_error(res, 404);
+        return;
+    }
+
+    for (i = 0; i < t->nb_reps; i++) {
+        if (t->reps[i].instream.stream_id == rep_id)
+            rep = &t->reps[i];
+    }
+
+    if (rep == NULL || num > rep->nb_segments) {
+        set_error(res, 404);
+    } else if (get_segment(s, t, rep, init ? 0 : (unsigned int) num - 1, init, name, res) < 0) {
+        set_error(res, 500);
+    } else {
+        res->status = 200;
+        res->type = init ? "video/mp4" : "video/iso.segment";
+    }
+
+    title_put(s, t);
+}
+
+// Send everything, without SIGPIPE if the client went away
+static int send_all(int fd, struct iovec *iov, int nb_iov)
+{
+    struct msghdr msg = { 0 };
+    ssize_t n;
+
+    while (nb_iov > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nb_iov;
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (nb_iov > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            nb_iov--;
+        }
+
+        if (nb_iov > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static const char* status_text(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    default: return "Internal Server Error";
+    }
+}
+
+static int send_response(int fd, const ServeResponse *res, int head, int keep_alive)
+{
+    char header[512];
+    struct iovec iov[2];
+    int len;
+
+    len = snprintf(header, sizeof(header),
+                   "HTTP/1.1 %d %s\r\n"
+                   "Server: ypackager\r\n"
+                   "Content-Type: %s\r\n"
+                   "Content-Length: %zu\r\n"
+                   "Access-Control-Allow-Origin: *\r\n"
+                   "Timing-Allow-Origin: *\r\n"
+                   "%s%s%s"
+                   "Connection: %s\r\n"
+                   "\r\n",
+                   res->status, status_text(res->status), res->type, res->size,
+                   res->timing[0] ? "Server-Timing: " : "", res->timing,
+                   res->timing[0] ? "\r\n" : "",
+                   keep_alive ? "keep-alive" : "close");
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = len;
+    iov[1].iov_base = (void *) res->body;
+    iov[1].iov_len = res->size;
+
+    return send_all(fd, iov, head || res->size == 0 ? 1 : 2);
+}
+
+/**
+ * Answer the request at the start of c->buf, which holds a complete header.
+ * Returns the size of the request, or a negative value if the connection
+ * must be closed.
+ */
+static int handle_request(ServeConn *c, size_t header_size)
+{
+    ServeContext *s = c->s;
+    ServeResponse res = { 0 };
+    char *line_end = memchr(c->buf, '\r', header_size);
+    char *method = c->buf;
+    char *target, *version, *query;
+    size_t target_len;
+    int head = 0;
+    int keep_alive;
+    int ret;
+
+    target = memchr(method, ' ', line_end - method);
+    version = target ? memchr(target + 1, ' ', line_end - target - 1) : NULL;
+
+    if (version == NULL) {
+        set_error(&res, 400);
+        send_response(c->fd, &res, 0, 0);
+        return -1;
+    }
+
+    target++;
+    version++;
+    target_len = version - 1 - target;
+
+    if ((query = memchr(target, '?', target_len)) != NULL)
+        target_len = query - target;
+
+    // HTTP/1.0 clients have to ask for keep-alive
+    c->buf[header_size - 1] = '\0';
+    keep_alive = strncmp(version, "HTTP/1.0", 8) ?
+                 strcasestr(c->buf, "\r\nConnection: close") == NULL :
+                 strcasestr(c->buf, "\r\nConnection: keep-alive") != NULL;
+
+    if (!strncmp(method, "HEAD ", 5)) {
+        head = 1;
+    } else if (strncmp(method, "GET ", 4)) {
+        // Whatever body follows is not worth parsing
+        set_error(&res, 405);
+        send_response(c->fd, &res, 0, 0);
+        return -1;
+    }
+
+    route(s, target, target_len, &res);
+
+    if (res.status != 200) {
+        yp_log(YP_LOG_SERVE, YP_LOG_DEBUG, "%d %.*s\n", res.status, (int) target_len, target);
+        pthread_mutex_lock(&s->lock);
+        s->nb_errors++;
+        pthread_mutex_unlock(&s->lock);
+    } else {
+        yp_log(YP_LOG_SERVE, YP_LOG_DEBUG, "200 %.*s %zu bytes %s\n", (int) target_len, target,
+               res.size, res.timing);
+    }
+
+    ret = send_response(c->fd, &res, head, keep_alive);
+
+    if (res.title)
+        title_put(s, res.title);
+    if (res.entry)
+        yp_segcache_release(s->cache, res.entry);
+    av_free(res.data);
+
+    pthread_mutex_lock(&s->lock);
+    s->nb_requests++;
+    pthread_mutex_unlock(&s->lock);
+
+    return ret < 0 || !keep_alive ? -1 : (int) header_size;
+}
+
+static void conn_close(ServeConn *c)
+{
+    close(c->fd);
+    free(c);
+}
+
+/**
+ * Worker job: read and answer the requests of a connection that became
+ * readable, then hand it back to the accept loop to wait for the next one.
+ */
+static int serve_connection(void *arg)
+{
+    ServeConn *c = arg;
+    char *end;
+    ssize_t n;
+    int ret;
+
+    while (1) {
+        end = c->len >= 4 ? memmem(c->buf, c->len, "\r\n\r\n", 4) : NULL;
+
+        if (end) {
+            if ((ret = handle_request(c, end + 4 - c->buf)) < 0) {
+                conn_close(c);
+                return 0;
+            }
+
+            c->len -= ret;
+            memmove(c->buf, c->buf + ret, c->len);
+            c->last_active = av_gettime_relative();
+
+            // Wait for the next request without holding a worker
+            if (c->len == 0)
+                break;
+            continue;
+        }
+
+        if (c->len == sizeof(c->buf)) {
+            ServeResponse res = { 0 };
+
+            set_error(&res, 400);
+            send_response(c->fd, &res, 0, 0);
+            conn_close(c);
+            return 0;
+        }
+
+        // Bounded by SO_RCVTIMEO
+        n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            conn_close(c);
+            return 0;
+        }
+
+        c->len += n;
+    }
+
+    if (write(c->s->wake[1], &c, sizeof(c)) != sizeof(c))
+        conn_close(c);
+
+    return 0;
+}
+
+static int listen_on(const char *host, int port)
+{
+    struct sockaddr_in addr;
+    int fd;
+    int on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        yp_log(YP_LOG_SERVE, YP_LOG_ERROR, "Invalid address '%s'\n", host);
+        return -1;
+    }
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        yp_log(YP_LOG_SERVE, YP_LOG_ERROR, "Cannot listen on %s:%d: %s\n", host, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Accept connections and watch the idle ones. A connection is handed to a
+ * worker when a request comes in and comes back through s->wake once it
+ * is answered, so that workers only ever wait on packaging, never on
+ * clients.
+ */
+static int accept_loop(ServeContext *s, int lfd)
+{
+    ServeConn **conns = NULL;
+    struct pollfd *fds = NULL;
+    unsigned int nb_conns = 0, nb_alloc = 0;
+    unsigned int i, n;
+    struct timeval tv = { KEEPALIVE_TIMEOUT / 1000000, 0 };
+    int on = 1;
+    int64_t now;
+    ServeConn *c;
+    int fd;
+
+    while (!stopped) {
+        if (nb_alloc < nb_conns + 2) {
+            nb_alloc = (nb_conns + 2) * 2;
+            conns = realloc(conns, nb_alloc * sizeof(ServeConn*));
+            fds = realloc(fds, nb_alloc * sizeof(struct pollfd));
+
+            if (conns == NULL || fds == NULL)
+                return -1;
+        }
+
+        fds[0].fd = lfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = s->wake[0];
+        fds[1].events = POLLIN;
+
+        for (i = 0; i < nb_conns; i++) {
+            fds[i + 2].fd = conns[i]->fd;
+            fds[i + 2].events = POLLIN;
+        }
+
+        if (poll(fds, nb_conns + 2, 1000) < 0 && errno != EINTR)
+            return -1;
+
+        now = av_gettime_relative();
+
+        // Readable or idle for too long: compact what is left
+        for (i = 0, n = 0; i < nb_conns; i++) {
+            c = conns[i];
+
+            if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (yp_threadpool_submit(s->pool, serve_connection, c) < 0)
+                    conn_close(c);
+            } else if (now - c->last_active > KEEPALIVE_TIMEOUT) {
+                conn_close(c);
+            } else {
+                conns[n++] = c;
+            }
+        }
+
+        nb_conns = n;
+
+        // The rest waits for the next round if there is no room left
+        if (fds[1].revents & POLLIN) {
+            while (nb_conns < nb_alloc && read(s->wake[0], &c, sizeof(c)) == sizeof(c))
+                conns[nb_conns++] = c;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if ((fd = accept(lfd, NULL, NULL)) < 0)
+                continue;
+
+            if ((c = malloc(sizeof(ServeConn))) == NULL) {
+                close(fd);
+                continue;
+            }
+
+            // Slow clients can only hold a worker that long
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+            c->s = s;
+            c->fd = fd;
+            c->len = 0;
+            c->last_active = now;
+
+            if (nb_conns < nb_alloc)
+                conns[nb_conns++] = c;
+            else
+                conn_close(c);
+        }
+    }
+
+    for (i = 0; i < nb_conns; i++)
+        conn_close(conns[i]);
+
+    free(conns);
+    free(fds);
+
+    return 0;
+}
+
+int yp_serve_main(int argc, char **argv)
+{
+    const char *prog_name = "ypackager serve";
+    ServeContext s;
+    ServeTitle *t;
+    ServeConn *c;
+    YPSegmentCacheStats cs;
+    struct sigaction sa;
+    int lfd = -1;
+    int exit_code = 0;
+    int nerrors;
+
+    struct arg_str *root = arg_str0(NULL, "root", "<dir>", "serve media files below dir (default: current directory)");
+    struct arg_str *host = arg_str0(NULL, "host", "<addr>", "address to listen on (default: 127.0.0.1)");
+    struct arg_int *port = arg_int0("p", "port", "<n>", "port to listen on (default: 8080)");
+    struct arg_int *segment_duration = arg_int0(NULL, "segment-duration", "<ms>", "max. segment duration in milliseconds (default: 4000)");
+    struct arg_int *threads = arg_int0(NULL, "threads", "<n>", "package up to n segments concurrently (default: 4)");
+    struct arg_int *max_titles = arg_int0(NULL, "max-titles", "<n>", "keep up to n probed and indexed files in memory (default: 64)");
+    struct arg_int *cache_mb = arg_int0(NULL, "cache-mb", "<n>", "keep up to n MiB of packaged segments in memory, 0 to only share segments being packaged (default: 512)");
+    struct arg_int *cache_shards = arg_int0(NULL, "cache-shards", "<n>", "split the segment cache into n independently locked parts (default: 16)");
+    struct arg_str *index_cache = arg_str0(NULL, "index-cache", "<dir>", "keep stream information and keyframe indexes of inputs in dir");
+    struct arg_lit *use_mmap = arg_lit0(NULL, "mmap", "read input files through memory mappings");
+    struct arg_lit *native_fragments = arg_lit0(NULL, "native-fragments", "write H.264, HEVC and AAC fragments from mp4 inputs without the libavformat mp4 muxer");
+    struct arg_str *log_level = arg_str0(NULL, "log-level", "<spec>", "log level, globally and per module, e.g. warning,serve=debug (default: info)");
+    struct arg_lit *help = arg_lit0("h", "help", "print help and exit");
+    struct arg_end *end = arg_end(20);
+
+    void *argtable[] = {
+        root,
+        host,
+        port,
+        segment_duration,
+        threads,
+        max_titles,
+        cache_mb,
+        cache_shards,
+        index_cache,
+        use_mmap,
+        native_fragments,
+        log_level,
+        help,
+        end
+    };
+
+    memset(&s, 0, sizeof(s));
+    s.wake[0] = s.wake[1] = -1;
+    pthread_mutex_init(&s.lock, NULL);
+
+    nerrors = arg_parse(argc, argv, argtable);
+
+    if (arg_nullcheck(argtable) != 0) {
+        printf("%s: insufficient memory\n", prog_name);
+        exit_code = -1;
+        goto exit;
+    }
+
+    if (help->count > 0) {
+        printf("Usage: %s", prog_name);
+        arg_print_syntax(stdout, argtable, "\n");
+        arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+        goto exit;
+    }
+
+    if (nerrors > 0) {
+        arg_print_errors(stdout, end, prog_name);
+        printf("Try '%s --help' for more information.\n", prog_name);
+        exit_code = -1;
+        goto exit;
+    }
+
+    if (log_level->count > 0 && yp_log_set_levels(log_level->sval[0]) < 0) {
+        fprintf(stderr, "%s: invalid log level '%s'\n", prog_name, log_level->sval[0]);
+        exit_code = -1;
+        goto exit;
+    }
+
+    yp_log_start();
+    av_register_all();
+
+    s.root = root->count > 0 ? root->sval[0] : ".";
+    s.cache_dir = index_cache->count > 0 ? index_cache->sval[0] : NULL;
+    s.max_titles = max_titles->count > 0 && max_titles->ival[0] > 0 ? max_titles->ival[0] : 64;
+
+    // Packaging runs are whole-segment, template addressed runs of a single
+    // representation, see package()
+    s.config.outdir = "";
+    s.config.index_fname = "init.mp4";
+    s.config.seg_duration = segment_duration->count > 0 ? segment_duration->ival[0] : 4000;
+    s.config.min_buffer = s.config.seg_duration * 2;
+    s.config.segment_timeline = 1;
+    s.config.mmap = use_mmap->count;
+    s.config.native_fragments = native_fragments->count;
+
+    if (s.cache_dir)
+        mkdir_p(s.cache_dir);
+
+    if ((s.cache = yp_segcache((int64_t) (cache_mb->count > 0 && cache_mb->ival[0] >= 0 ? cache_mb->ival[0] : 512) << 20,
+                               cache_shards->count > 0 && cache_shards->ival[0] > 0 ? cache_shards->ival[0] : 16)) == NULL ||
+            pipe(s.wake) < 0 || fcntl(s.wake[0], F_SETFL, O_NONBLOCK) < 0 ||
+            (s.pool = yp_threadpool(threads->count > 0 && threads->ival[0] > 0 ? threads->ival[0] : 4)) == NULL ||
+            (lfd = listen_on(host->count > 0 ? host->sval[0] : "127.0.0.1",
+                             port->count > 0 ? port->ival[0] : 8080)) < 0) {
+        exit_code = -1;
+        goto exit;
+    }
+
+    // No SA_RESTART: poll() has to return for the loop to see the flag
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    yp_log(YP_LOG_SERVE, YP_LOG_INFO, "Serving %s on %s:%d\n", s.root,
+           host->count > 0 ? host->sval[0] : "127.0.0.1", port->count > 0 ? port->ival[0] : 8080);
+
+    if (accept_loop(&s, lfd) < 0)
+        exit_code = -1;
+
+    close(lfd);
+
+    // Connections being answered come back through the wake pipe
+    yp_threadpool_wait(s.pool);
+    close(s.wake[1]);
+    s.wake[1] = -1;
+
+    while (read(s.wake[0], &c, sizeof(c)) == sizeof(c))
+        conn_close(c);
+
+    yp_log(YP_LOG_SERVE, YP_LOG_INFO, "%"PRIu64" requests, %"PRIu64" errors, %"PRIu64" files packaged, "
+           "latency avg %.3f ms max %.3f ms, cpu avg %.3f ms\n",
+           s.nb_requests, s.nb_errors, s.nb_segments,
+           s.nb_segments ? s.segment_time_total / 1000.0 / s.nb_segments : 0.0,
+           s.segment_time_max / 1000.0,
+           s.nb_segments ? s.segment_cpu_total / 1000.0 / s.nb_segments : 0.0);
+
+    yp_segcache_get_stats(s.cache, &cs);
+    yp_log(YP_LOG_SERVE, YP_LOG_INFO, "Segment cache: %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" coalesced, "
+           "%"PRIu64" evictions, %u entries, %"PRId64" bytes, wait avg %.3f ms max %.3f ms\n",
+           cs.nb_hits, cs.nb_misses, cs.nb_coalesced, cs.nb_evictions, cs.nb_entries, cs.nb_bytes,
+           cs.nb_coalesced ? cs.total_wait_time / 1000.0 / cs.nb_coalesced : 0.0,
+           cs.max_wait_time / 1000.0);
+
+exit:
+    if (s.pool)
+        yp_threadpool_free(s.pool);
+    if (s.cache)
+        yp_segcache_free(s.cache);
+
+    while ((t = s.titles) != NULL) {
+        s.titles = t->next;
+        title_free(t);
+    }
+
+    if (s.wake[0] >= 0)
+        close(s.wake[0]);
+    if (s.wake[1] >= 0)
+        close(s.wake[1]);
+
+    pthread_mutex_destroy(&s.lock);
+    arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+    yp_log_stop();
+
+    return exit_code;
+}
@@ -0,0 +1,14 @@
+#ifndef YP_SERVE_H_
+#define YP_SERVE_H_
+
+// Just-in-time packaging server: "ypackager serve --root <dir>" answers
+//   /<file>/manifest.mpd
+//   /<file>/<representation>/init.mp4
+//   /<file>/<representation>/seg-<n>.m4s
+// for every media file below dir, packaging only what is requested. Packaged
+// segments are kept in a memory cache. /stats reports server and cache
+// counters as JSON.
+// argv[0] is "serve".
+int yp_serve_main(int argc, char **argv);
+
+#endif // YP_SERVE_H_
@@ -0,0 +1,556 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+#include "shard.h"
+#include "muxer.h"
+#include "threadpool.h"
+#include "log.h"
+#include "mmapio.h"
+#include "utils.h"
+
+typedef struct ShardSegment {
+    char filename[1024];
+    int64_t pos;
+    int64_t size;
+    int64_t duration;
+    int num;
+} ShardSegment;
+
+typedef struct ShardJob {
+    // Representation as registered on the demuxer
+    YPInputStream *orig;
+    // Copy of it restricted to range, with a config listing only that copy
+    YPInputStream instream;
+    YPInputStream *instreams[1];
+    YPConfig config;
+    YPTimeRange range;
+    // Records the segments of the range until they can be replayed in order
+    YPIndexHandlerClass collector;
+    int has_init;
+    char init_filename[1024];
+    int64_t init_pos;
+    int64_t init_size;
+    unsigned int nb_segments;
+    unsigned int nb_alloc;
+    ShardSegment *segments;
+} ShardJob;
+
+static int collector_init(YPIndexHandlerClass *self, YPConfig *config)
+{
+    return 0;
+}
+
+static int collector_add_init_segment(YPIndexHandlerClass *self, YPInputStream *instream,
+                                      char *filename, int64_t pos, int64_t size)
+{
+    ShardJob *job = self->opaque;
+
+    job->has_init = 1;
+    snprintf(job->init_filename, sizeof(job->init_filename), "%s", filename);
+    job->init_pos = pos;
+    job->init_size = size;
+
+    return 0;
+}
+
+static int collector_add_segment(YPIndexHandlerClass *self, YPInputStream *instream,
+                                 char *filename, int64_t pos, int64_t size,
+                                 int64_t duration, int num)
+{
+    ShardJob *job = self->opaque;
+    ShardSegment *seg;
+
+    if (job->nb_segments == job->nb_alloc) {
+        unsigned int nb_alloc = job->nb_alloc ? job->nb_alloc * 2 : 64;
+        ShardSegment *segments = realloc(job->segments, nb_alloc * sizeof(ShardSegment));
+
+        if (segments == NULL) {
+            return -1;
+        }
+
+        job->segments = segments;
+        job->nb_alloc = nb_alloc;
+    }
+
+    seg = &job->segments[job->nb_segments++];
+    snprintf(seg->filename, sizeof(seg->filename), "%s", filename);
+    seg->pos = pos;
+    seg->size = size;
+    seg->duration = duration;
+    seg->num = num;
+
+    return 0;
+}
+
+static int collector_finalize(YPIndexHandlerClass *self)
+{
+    return 0;
+}
+
+int yp_shard_plan(const YPKeyframeIndex *index, int64_t segment_duration,
+                  unsigned int nb_shards, YPTimeRange **ranges, unsigned int *nb_ranges)
+{
+    unsigned int i, n = 0;
+    int segment_num = 0;
+    int64_t segment_start = index->first_pts;
+    int64_t span = index->end_pts - index->first_pts;
+    YPTimeRange *r = (YPTimeRange *) malloc(FFMAX(nb_shards, 1) * sizeof(YPTimeRange));
+
+    if (r == NULL) {
+        return -1;
+    }
+
+    r[0].start_dts = AV_NOPTS_VALUE;
+    r[0].start_pts = index->first_pts;
+    r[0].end_dts = AV_NOPTS_VALUE;
+    r[0].end_pts = AV_NOPTS_VALUE;
+    r[0].first_segment = 0;
+    r[0].write_init = 1;
+
+    // Replay the segmentation of fmp4_handle_packet() over the keyframes
+    for (i = 0; i < index->nb_keyframes; i++) {
+        const YPKeyframe *kf = &index->keyframes[i];
+
+        // The first packet of the stream never closes a segment
+        if (kf->dts == index->first_dts)
+            continue;
+
+        if (!yp_segment_duration_reached(segment_start, kf->pts, index->time_base,
+                                         segment_duration))
+            continue;
+
+        segment_num++;
+
+        // A range starting here gets its decode time from the keyframe pts
+        // (frag_discont), while a whole-stream run counts it from the first
+        // dts. Only split where both agree.
+        if (n + 1 < nb_shards &&
+                kf->pts - index->first_pts >= span * (n + 1) / nb_shards &&
+                kf->pts - kf->dts == -index->first_dts) {
+            r[n].end_dts = kf->dts;
+            r[n].end_pts = kf->pts;
+            n++;
+            r[n].start_dts = kf->dts;
+            r[n].start_pts = kf->pts;
+            r[n].end_dts = AV_NOPTS_VALUE;
+            r[n].end_pts = AV_NOPTS_VALUE;
+            r[n].first_segment = segment_num;
+            r[n].write_init = 0;
+        }
+
+        segment_start = kf->pts;
+    }
+
+    *ranges = r;
+    *nb_ranges = n + 1;
+
+    return 0;
+}
+
+int yp_shard_plan_segments(const YPKeyframeIndex *index, int64_t segment_duration,
+                           YPTimeRange **ranges, unsigned int *nb_ranges)
+{
+    unsigned int i, n = 1;
+    unsigned int nb_alloc = 64;
+    int64_t segment_start = index->first_pts;
+    // Last boundary a range may start from
+    unsigned int start = 0;
+    YPTimeRange *r = (YPTimeRange *) malloc(nb_alloc * sizeof(YPTimeRange));
+
+    if (r == NULL) {
+        return -1;
+    }
+
+    r[0].start_dts = AV_NOPTS_VALUE;
+    r[0].start_pts = index->first_pts;
+    r[0].end_dts = AV_NOPTS_VALUE;
+    r[0].end_pts = AV_NOPTS_VALUE;
+    r[0].first_segment = 0;
+    r[0].write_init = 1;
+
+    // Same cuts as yp_shard_plan(), at every segment boundary
+    for (i = 0; i < index->nb_keyframes; i++) {
+        const YPKeyframe *kf = &index->keyframes[i];
+
+        if (kf->dts == index->first_dts)
+            continue;
+
+        if (!yp_segment_duration_reached(segment_start, kf->pts, index->time_base,
+                                         segment_duration))
+            continue;
+
+        if (n == nb_alloc) {
+            YPTimeRange *tmp = realloc(r, nb_alloc * 2 * sizeof(YPTimeRange));
+
+            if (tmp == NULL) {
+                free(r);
+                return -1;
+            }
+
+            r = tmp;
+            nb_alloc *= 2;
+        }
+
+        r[n - 1].end_dts = kf->dts;
+        r[n - 1].end_pts = kf->pts;
+
+        // Where yp_shard_plan() would not split either, the range starts
+        // at the last boundary where it would, and packages the segments
+        // in between again
+        if (kf->pts - kf->dts == -index->first_dts)
+            start = n;
+
+        if (start == n) {
+            r[n].start_dts = kf->dts;
+            r[n].start_pts = kf->pts;
+        } else {
+            r[n].start_dts = r[start].start_dts;
+            r[n].start_pts = r[start].start_pts;
+        }
+        r[n].end_dts = AV_NOPTS_VALUE;
+        r[n].end_pts = AV_NOPTS_VALUE;
+        r[n].first_segment = start;
+        r[n].write_init = 0;
+        n++;
+
+        segment_start = kf->pts;
+    }
+
+    *ranges = r;
+    *nb_ranges = n;
+
+    return 0;
+}
+
+int yp_shard_run(YPConfig *config, YPInputStream *instream, YPIndexHandlerClass *index,
+                 int max_packets)
+{
+    int ret = 0;
+    unsigned int i;
+    AVFormatContext *ctx = NULL;
+    AVIOContext *pb = NULL;
+    YPMuxerClass *muxer = NULL;
+    AVPacket pkt;
+    int stream_idx = instream->stream_idx;
+    int64_t start_dts = instream->range ? instream->range->start_dts : AV_NOPTS_VALUE;
+    int64_t end_dts = instream->range ? instream->range->end_dts : AV_NOPTS_VALUE;
+    int nb_packets = 0;
+    int64_t start = 0;
+    YPStreamStats stats;
+
+    yp_stream_stats_init(&stats);
+
+    // Stream parameters come from the already probed demuxer context the
+    // instream points to, this one is only used to read packets.
+    // Every shard maps the input on its own, the mappings share the page
+    // cache. Inputs that cannot be mapped were already reported by the
+    // demuxer.
+    if (config->mmap && !is_url(instream->filename) &&
+            yp_mmap_open(&pb, instream->filename) == 0) {
+        if ((ctx = avformat_alloc_context()) == NULL) {
+            yp_mmap_close(&pb);
+            return AVERROR(ENOMEM);
+        }
+
+        ctx->pb = pb;
+    }
+
+    if ((ret = avformat_open_input(&ctx, instream->filename, 0, 0)) < 0) {
+        yp_log(YP_LOG_SHARD, YP_LOG_ERROR, "could not open input file '%s'\n", instream->filename);
+        yp_mmap_close(&pb);
+        return ret;
+    }
+
+    for (i = 0; i < ctx->nb_streams; i++) {
+        ctx->streams[i]->discard = (int) i == stream_idx ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    if (start_dts != AV_NOPTS_VALUE) {
+        ret = av_seek_frame(ctx, stream_idx, start_dts, AVSEEK_FLAG_BACKWARD);
+
+        if (ret < 0) {
+            yp_log(YP_LOG_SHARD, YP_LOG_ERROR, "could not seek to %" PRId64 " in '%s'\n",
+                   start_dts, instream->filename);
+            goto end;
+        }
+    }
+
+    muxer = config->native_fragments ? yp_fmp4_native_muxer() : yp_fmp4_muxer();
+
+    if (muxer == NULL) {
+        ret = -1;
+        goto end;
+    }
+
+    muxer->index = index;
+
+    if ((ret = muxer->init(muxer, config, 0)) < 0) {
+        goto end;
+    }
+
+    while (1) {
+        start = av_gettime_relative();
+        if (av_read_frame(ctx, &pkt) < 0)
+            break;
+        stats.demux_time += av_gettime_relative() - start;
+
+        if (pkt.stream_index != stream_idx ||
+                (start_dts != AV_NOPTS_VALUE && pkt.dts < start_dts)) {
+            av_packet_unref(&pkt);
+            continue;
+        }
+
+        if (end_dts != AV_NOPTS_VALUE && pkt.dts >= end_dts) {
+            av_packet_unref(&pkt);
+            break;
+        }
+
+        ret = muxer->handle_packet(muxer, instream, &pkt);
+        av_packet_unref(&pkt);
+
+        if (ret < 0 || (max_packets > 0 && ++nb_packets == max_packets)) break;
+    }
+
+    if (muxer->finalize(muxer) < 0 && ret >= 0)
+        ret = -1;
+
+end:
+    if (instream->stats)
+        yp_stats_merge(instream->stats, &stats);
+
+    if (muxer)
+        yp_muxer_free(muxer);
+    avformat_close_input(&ctx);
+    yp_mmap_close(&pb);
+    return ret;
+}
+
+static int shard_job(void *arg)
+{
+    ShardJob *job = arg;
+
+    return yp_shard_run(&job->config, &job->instream, &job->collector, 0);
+}
+
+static int add_jobs(YPConfig *config, YPInputStream *instream, const YPKeyframeIndex *index,
+                    ShardJob **jobs, unsigned int *nb_jobs)
+{
+    unsigned int i;
+    YPTimeRange *ranges = NULL;
+    unsigned int nb_ranges = 0;
+    ShardJob *j;
+
+    if (yp_shard_plan(index, (int64_t) config->seg_duration * 1000,
+                      config->shards, &ranges, &nb_ranges) < 0) {
+        return -1;
+    }
+
+    yp_log(YP_LOG_SHARD, YP_LOG_INFO, "Stream #%d of %s: %u range(s)\n", instream->stream_idx, instream->filename, nb_ranges);
+
+    j = realloc(*jobs, (*nb_jobs + nb_ranges) * sizeof(ShardJob));
+
+    if (j == NULL) {
+        free(ranges);
+        return -1;
+    }
+
+    *jobs = j;
+
+    for (i = 0; i < nb_ranges; i++) {
+        ShardJob *job = &(*jobs)[(*nb_jobs)++];
+
+        job->orig = instream;
+        job->instream = *instream;
+        job->range = ranges[i];
+        job->config = *config;
+        job->config.nb_instreams = 1;
+        job->collector.init = &collector_init;
+        job->collector.add_init_segment = &collector_add_init_segment;
+        // Single file output can't be sharded, see main()
+        job->collector.set_index_range = NULL;
+        job->collector.add_segment = &collector_add_segment;
+        job->has_init = 0;
+        job->collector.finalize = &collector_finalize;
+        job->nb_segments = 0;
+        job->nb_alloc = 0;
+        job->segments = NULL;
+    }
+
+    free(ranges);
+    return 0;
+}
+
+int yp_shard_index(YPDemuxer *demuxer, YPInputStream **instreams, unsigned int nb_instreams,
+                   YPKeyframeIndex **indexes)
+{
+    int ret = 0;
+    unsigned int j;
+    AVFormatContext *ctx = demuxer->ctx;
+    // An earlier run may have indexed every stream we need already
+    int cached = demuxer->sidecar != NULL;
+
+    for (j = 0; j < nb_instreams && cached; j++) {
+        if (yp_sidecar_kfindex(demuxer->sidecar, instreams[j]->stream_idx) == NULL)
+            cached = 0;
+    }
+
+    for (j = 0; j < nb_instreams; j++) {
+        int idx = instreams[j]->stream_idx;
+
+        if (indexes[idx] == NULL) {
+            if (cached)
+                indexes[idx] = yp_kfindex_copy(yp_sidecar_kfindex(demuxer->sidecar, idx));
+            else
+                indexes[idx] = yp_kfindex(idx, ctx->streams[idx]->time_base);
+
+            if (indexes[idx] == NULL) {
+                return -1;
+            }
+        }
+    }
+
+    if (cached) {
+        yp_log(YP_LOG_SHARD, YP_LOG_INFO, "Using cached keyframe index of %s\n", demuxer->filename);
+        return 0;
+    }
+
+    yp_log(YP_LOG_SHARD, YP_LOG_INFO, "Indexing keyframes of %s\n", demuxer->filename);
+
+    if ((ret = yp_kfindex_scan(ctx, indexes)) < 0) {
+        return ret;
+    }
+
+    if (demuxer->cache_dir) {
+        // Keep what the sidecar knew about streams not indexed this time
+        for (j = 0; j < ctx->nb_streams && demuxer->sidecar; j++) {
+            if (indexes[j] == NULL && yp_sidecar_kfindex(demuxer->sidecar, j))
+                indexes[j] = yp_kfindex_copy(yp_sidecar_kfindex(demuxer->sidecar, j));
+        }
+
+        yp_sidecar_save(demuxer->cache_dir, demuxer->filename, ctx, indexes);
+    }
+
+    return 0;
+}
+
+int yp_shard_package(YPConfig *config, YPDemuxer **demuxers, unsigned int nb_demuxers,
+                     YPIndexHandlerClass *index)
+{
+    int ret = 0;
+    unsigned int i, j, k;
+    ShardJob *jobs = NULL;
+    unsigned int nb_jobs = 0;
+    int64_t pos = 0;
+    YPThreadPool *pool = NULL;
+    YPKeyframeIndex **indexes = NULL;
+
+    // Build the keyframe index of every packaged stream, one pass per input
+    for (i = 0; i < nb_demuxers && ret >= 0; i++) {
+        YPDemuxer *demuxer = demuxers[i];
+        AVFormatContext *ctx = demuxer->ctx;
+
+        indexes = (YPKeyframeIndex **) calloc(ctx->nb_streams, sizeof(YPKeyframeIndex*));
+
+        if (indexes == NULL) {
+            ret = -1;
+            break;
+        }
+
+        if ((ret = yp_shard_index(demuxer, demuxer->instreams, demuxer->nb_outputs, indexes)) < 0)
+            goto next;
+
+        for (j = 0; j < demuxer->nb_outputs; j++) {
+            YPInputStream *instream = demuxer->instreams[j];
+
+            if ((ret = add_jobs(config, instream, indexes[instream->stream_idx],
+                                &jobs, &nb_jobs)) < 0)
+                goto next;
+        }
+
+next:
+        for (j = 0; j < ctx->nb_streams; j++) {
+            if (indexes[j])
+                yp_kfindex_free(indexes[j]);
+        }
+        free(indexes);
+    }
+
+    if (ret < 0) {
+        goto end;
+    }
+
+    // jobs won't move anymore, point them at themselves
+    for (k = 0; k < nb_jobs; k++) {
+        ShardJob *job = &jobs[k];
+
+        job->instream.range = &job->range;
+        job->instreams[0] = &job->instream;
+        job->config.instreams = job->instreams;
+        job->collector.opaque = job;
+    }
+
+    pool = yp_threadpool(FFMAX(config->threads, 1));
+
+    if (pool == NULL) {
+        ret = -1;
+        goto end;
+    }
+
+    for (k = 0; k < nb_jobs; k++) {
+        if ((ret = yp_threadpool_submit(pool, shard_job, &jobs[k])) < 0)
+            break;
+    }
+
+    if (yp_threadpool_wait(pool) < 0)
+        ret = -1;
+
+    // Collectors are filled as segments get written
+    if (config->writer && yp_writer_flush(config->writer) < 0)
+        ret = -1;
+    if (config->sink && config->sink->flush(config->sink) < 0)
+        ret = -1;
+
+    if (ret < 0) {
+        goto end;
+    }
+
+    // Hand segments to the real index in the order a whole-stream run
+    // would have. Every range muxer counts bytes from its own start, so
+    // positions past the first range are rebuilt from the running total.
+    for (k = 0; k < nb_jobs && ret >= 0; k++) {
+        ShardJob *job = &jobs[k];
+        int first_range = k == 0 || jobs[k - 1].orig != job->orig;
+
+        if (job->has_init && index->add_init_segment)
+            ret = index->add_init_segment(index, job->orig, job->init_filename,
+                                          job->init_pos, job->init_size);
+
+        for (j = 0; j < job->nb_segments && ret >= 0; j++) {
+            ShardSegment *seg = &job->segments[j];
+
+            if (!first_range)
+                seg->pos = pos;
+
+            ret = index->add_segment(index, job->orig, seg->filename,
+                                     seg->pos, seg->size, seg->duration, seg->num);
+            if (ret < 0) break;
+
+            pos = seg->pos + seg->size;
+        }
+    }
+
+end:
+    if (pool)
+        yp_threadpool_free(pool);
+
+    for (k = 0; k < nb_jobs; k++) {
+        free(jobs[k].segments);
+    }
+    free(jobs);
+
+    return ret;
+}
@@ -0,0 +1,41 @@
+#ifndef YP_SHARD_H_
+#define YP_SHARD_H_
+
+#include "common.h"
+#include "demux.h"
+#include "kfindex.h"
+
+// Split a stream into at most nb_shards keyframe aligned ranges. Range
+// boundaries are picked among the segment boundaries a whole-stream run
+// would produce, so packaging every range on its own yields the very same
+// segments.
+int yp_shard_plan(const YPKeyframeIndex *index, int64_t segment_duration,
+                  unsigned int nb_shards, YPTimeRange **ranges, unsigned int *nb_ranges);
+
+// One range per segment a whole-stream run would produce, the first one
+// also writing the init segment. A range ends with its segment, but may
+// start segments earlier, at a boundary yp_shard_plan() would split at:
+// first_segment is then the segment it starts with.
+int yp_shard_plan_segments(const YPKeyframeIndex *index, int64_t segment_duration,
+                           YPTimeRange **ranges, unsigned int *nb_ranges);
+
+// Package instream->range of instream from an input context of its own and
+// report the segments to index. config->instreams[0] must be instream.
+// Stops after max_packets packets if max_packets > 0.
+int yp_shard_run(YPConfig *config, YPInputStream *instream, YPIndexHandlerClass *index,
+                 int max_packets);
+
+// Fill indexes (demuxer->ctx->nb_streams entries) with the keyframe index
+// of every stream instreams are built from. Taken from the sidecar of
+// demuxer when it has all of them, otherwise from a scan of the input, which
+// is saved to the cache directory.
+int yp_shard_index(YPDemuxer *demuxer, YPInputStream **instreams, unsigned int nb_instreams,
+                   YPKeyframeIndex **indexes);
+
+// Package every representation of the given inputs in config->shards ranges
+// on config->threads worker threads, then report segments to index in
+// order.
+int yp_shard_package(YPConfig *config, YPDemuxer **demuxers, unsigned int nb_demuxers,
+                     YPIndexHandlerClass *index);
+
+#endif // YP_SHARD_H_
@@ -0,0 +1,533 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+#include <libavformat/avformat.h>
+
+#include "sidecar.h"
+#include "strbuf.h"
+#include "log.h"
+
+#define SIDECAR_MAGIC   "YPSC"
+#define SIDECAR_VERSION 1
+
+// All numbers are stored little endian, signed ones as two's complement
+typedef struct Reader {
+    const uint8_t *p;
+    const uint8_t *end;
+    int error;
+} Reader;
+
+static void put_u32(YPStrBuf *buf, uint32_t v)
+{
+    uint8_t b[4];
+
+    AV_WL32(b, v);
+    yp_strbuf_append(buf, (const char *) b, sizeof(b));
+}
+
+static void put_i64(YPStrBuf *buf, int64_t v)
+{
+    uint8_t b[8];
+
+    AV_WL64(b, (uint64_t) v);
+    yp_strbuf_append(buf, (const char *) b, sizeof(b));
+}
+
+static void put_rational(YPStrBuf *buf, AVRational q)
+{
+    put_u32(buf, q.num);
+    put_u32(buf, q.den);
+}
+
+static const uint8_t* get_bytes(Reader *r, size_t n)
+{
+    const uint8_t *p = r->p;
+
+    if (r->error || (size_t) (r->end - r->p) < n) {
+        r->error = 1;
+        return NULL;
+    }
+
+    r->p += n;
+    return p;
+}
+
+static uint32_t get_u32(Reader *r)
+{
+    const uint8_t *p = get_bytes(r, 4);
+    return p ? AV_RL32(p) : 0;
+}
+
+static int32_t get_i32(Reader *r)
+{
+    return (int32_t) get_u32(r);
+}
+
+static int64_t get_i64(Reader *r)
+{
+    const uint8_t *p = get_bytes(r, 8);
+    return p ? (int64_t) AV_RL64(p) : 0;
+}
+
+static AVRational get_rational(Reader *r)
+{
+    AVRational q;
+
+    q.num = get_i32(r);
+    q.den = get_i32(r);
+    return q;
+}
+
+// The file a sidecar belongs to: its absolute path when it can be resolved
+static void sidecar_key(char *key, const char *filename)
+{
+    if (realpath(filename, key) == NULL)
+        snprintf(key, PATH_MAX, "%s", filename);
+}
+
+// <dir>/<file name>-<hash of the path>.ypidx, so that files of the same
+// name in different directories don't share a sidecar
+static void sidecar_path(char *path, int size, const char *dir, const char *key)
+{
+    const char *base = strrchr(key, '/');
+    const char *p;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (p = key; *p; p++) {
+        hash ^= (uint8_t) *p;
+        hash *= 0x100000001b3ULL;
+    }
+
+    snprintf(path, size, "%s/%s-%016" PRIx64 ".ypidx", dir, base ? base + 1 : key, hash);
+}
+
+static void put_header(YPStrBuf *buf, const char *key, const struct stat *st)
+{
+    yp_strbuf_append(buf, SIDECAR_MAGIC, 4);
+    put_u32(buf, SIDECAR_VERSION);
+    put_u32(buf, strlen(key));
+    yp_strbuf_puts(buf, key);
+    put_i64(buf, st->st_size);
+    put_i64(buf, st->st_mtim.tv_sec);
+    put_i64(buf, st->st_mtim.tv_nsec);
+}
+
+static void put_codecpar(YPStrBuf *buf, const AVCodecParameters *par)
+{
+    put_u32(buf, par->codec_type);
+    put_u32(buf, par->codec_id);
+    put_u32(buf, par->codec_tag);
+    put_u32(buf, par->format);
+    put_i64(buf, par->bit_rate);
+    put_u32(buf, par->bits_per_coded_sample);
+    put_u32(buf, par->bits_per_raw_sample);
+    put_u32(buf, par->profile);
+    put_u32(buf, par->level);
+    put_u32(buf, par->width);
+    put_u32(buf, par->height);
+    put_rational(buf, par->sample_aspect_ratio);
+    put_u32(buf, par->field_order);
+    put_u32(buf, par->color_range);
+    put_u32(buf, par->color_primaries);
+    put_u32(buf, par->color_trc);
+    put_u32(buf, par->color_space);
+    put_u32(buf, par->chroma_location);
+    put_u32(buf, par->video_delay);
+    put_i64(buf, par->channel_layout);
+    put_u32(buf, par->channels);
+    put_u32(buf, par->sample_rate);
+    put_u32(buf, par->block_align);
+    put_u32(buf, par->frame_size);
+    put_u32(buf, par->initial_padding);
+    put_u32(buf, par->trailing_padding);
+    put_u32(buf, par->seek_preroll);
+    put_u32(buf, par->extradata_size);
+    yp_strbuf_append(buf, (const char *) par->extradata, par->extradata_size);
+}
+
+static int get_codecpar(Reader *r, AVCodecParameters *par)
+{
+    const uint8_t *extradata;
+
+    par->codec_type = get_i32(r);
+    par->codec_id = get_i32(r);
+    par->codec_tag = get_u32(r);
+    par->format = get_i32(r);
+    par->bit_rate = get_i64(r);
+    par->bits_per_coded_sample = get_i32(r);
+    par->bits_per_raw_sample = get_i32(r);
+    par->profile = get_i32(r);
+    par->level = get_i32(r);
+    par->width = get_i32(r);
+    par->height = get_i32(r);
+    par->sample_aspect_ratio = get_rational(r);
+    par->field_order = get_i32(r);
+    par->color_range = get_i32(r);
+    par->color_primaries = get_i32(r);
+    par->color_trc = get_i32(r);
+    par->color_space = get_i32(r);
+    par->chroma_location = get_i32(r);
+    par->video_delay = get_i32(r);
+    par->channel_layout = (uint64_t) get_i64(r);
+    par->channels = get_i32(r);
+    par->sample_rate = get_i32(r);
+    par->block_align = get_i32(r);
+    par->frame_size = get_i32(r);
+    par->initial_padding = get_i32(r);
+    par->trailing_padding = get_i32(r);
+    par->seek_preroll = get_i32(r);
+    par->extradata_size = get_i32(r);
+
+    if (par->extradata_size < 0 || (extradata = get_bytes(r, par->extradata_size)) == NULL) {
+        par->extradata_size = 0;
+        return -1;
+    }
+
+    if (par->extradata_size > 0) {
+        par->extradata = av_mallocz(par->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+
+        if (par->extradata == NULL) {
+            par->extradata_size = 0;
+            return -1;
+        }
+
+        memcpy(par->extradata, extradata, par->extradata_size);
+    }
+
+    return 0;
+}
+
+static void put_kfindex(YPStrBuf *buf, const YPKeyframeIndex *index)
+{
+    unsigned int i;
+
+    put_i64(buf, index->first_pts);
+    put_i64(buf, index->first_dts);
+    put_i64(buf, index->end_pts);
+    put_u32(buf, index->nb_keyframes);
+
+    for (i = 0; i < index->nb_keyframes; i++) {
+        put_i64(buf, index->keyframes[i].pts);
+        put_i64(buf, index->keyframes[i].dts);
+        put_i64(buf, index->keyframes[i].pos);
+        put_i64(buf, index->keyframes[i].duration);
+    }
+}
+
+static YPKeyframeIndex* get_kfindex(Reader *r, int stream_idx, AVRational time_base)
+{
+    YPKeyframeIndex *index = yp_kfindex(stream_idx, time_base);
+    unsigned int i, n;
+
+    if (index == NULL)
+        return NULL;
+
+    index->first_pts = get_i64(r);
+    index->first_dts = get_i64(r);
+    index->end_pts = get_i64(r);
+    n = get_u32(r);
+
+    // Don't trust n with an allocation before knowing the entries are there
+    if (r->error || (size_t) (r->end - r->p) / 32 < n)
+        goto fail;
+
+    if (n > 0) {
+        index->keyframes = malloc(n * sizeof(YPKeyframe));
+
+        if (index->keyframes == NULL)
+            goto fail;
+    }
+
+    index->nb_alloc = n;
+
+    for (i = 0; i < n; i++) {
+        index->keyframes[i].pts = get_i64(r);
+        index->keyframes[i].dts = get_i64(r);
+        index->keyframes[i].pos = get_i64(r);
+        index->keyframes[i].duration = get_i64(r);
+    }
+
+    index->nb_keyframes = n;
+
+    return index;
+
+fail:
+    yp_kfindex_free(index);
+    return NULL;
+}
+
+static int read_file(const char *path, uint8_t **data, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    long len;
+
+    if (f == NULL)
+        return -1;
+
+    if (fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0)
+        goto fail;
+
+    if ((*data = malloc(len > 0 ? len : 1)) == NULL)
+        goto fail;
+
+    if (fread(*data, 1, len, f) != (size_t) len) {
+        free(*data);
+        goto fail;
+    }
+
+    *size = len;
+    fclose(f);
+    return 0;
+
+fail:
+    fclose(f);
+    return -1;
+}
+
+YPSidecar* yp_sidecar_load(const char *dir, const char *filename)
+{
+    char key[PATH_MAX];
+    char path[PATH_MAX];
+    struct stat st;
+    uint8_t *data = NULL;
+    size_t size = 0;
+    Reader r;
+    YPSidecar *sidecar = NULL;
+    const uint8_t *magic;
+    const uint8_t *stored_key;
+    uint32_t key_len;
+    unsigned int i;
+
+    if (stat(filename, &st) < 0)
+        return NULL;
+
+    sidecar_key(key, filename);
+    sidecar_path(path, sizeof(path), dir, key);
+
+    if (read_file(path, &data, &size) < 0)
+        return NULL;
+
+    r.p = data;
+    r.end = data + size;
+    r.error = 0;
+
+    magic = get_bytes(&r, 4);
+
+    if (magic == NULL || memcmp(magic, SIDECAR_MAGIC, 4) || get_u32(&r) != SIDECAR_VERSION)
+        goto stale;
+
+    key_len = get_u32(&r);
+    stored_key = get_bytes(&r, key_len);
+
+    if (stored_key == NULL || key_len != strlen(key) || memcmp(stored_key, key, key_len) ||
+            get_i64(&r) != st.st_size ||
+            get_i64(&r) != st.st_mtim.tv_sec ||
+            get_i64(&r) != st.st_mtim.tv_nsec)
+        goto stale;
+
+    sidecar = calloc(1, sizeof(YPSidecar));
+
+    if (sidecar == NULL)
+        goto fail;
+
+    sidecar->start_time = get_i64(&r);
+    sidecar->duration = get_i64(&r);
+    sidecar->bit_rate = get_i64(&r);
+    sidecar->nb_streams = get_u32(&r);
+
+    if (r.error || sidecar->nb_streams > size)
+        goto stale;
+
+    sidecar->streams = calloc(sidecar->nb_streams, sizeof(YPSidecarStream));
+
+    if (sidecar->streams == NULL && sidecar->nb_streams > 0) {
+        sidecar->nb_streams = 0;
+        goto fail;
+    }
+
+    for (i = 0; i < sidecar->nb_streams; i++) {
+        YPSidecarStream *s = &sidecar->streams[i];
+
+        if ((s->codecpar = avcodec_parameters_alloc()) == NULL)
+            goto fail;
+
+        if (get_codecpar(&r, s->codecpar) < 0)
+            goto stale;
+
+        s->time_base = get_rational(&r);
+        s->avg_frame_rate = get_rational(&r);
+        s->r_frame_rate = get_rational(&r);
+        s->sample_aspect_ratio = get_rational(&r);
+        s->start_time = get_i64(&r);
+        s->duration = get_i64(&r);
+        s->nb_frames = get_i64(&r);
+
+        if (get_u32(&r) && (s->kfindex = get_kfindex(&r, i, s->time_base)) == NULL)
+            goto stale;
+    }
+
+    if (r.error)
+        goto stale;
+
+    free(data);
+    return sidecar;
+
+stale:
+    yp_log(YP_LOG_DEMUX, YP_LOG_INFO, "Ignoring outdated index cache %s\n", path);
+fail:
+    if (sidecar)
+        yp_sidecar_free(sidecar);
+    free(data);
+    return NULL;
+}
+
+int yp_sidecar_apply(const YPSidecar *sidecar, AVFormatContext *ctx)
+{
+    unsigned int i;
+    int ret;
+
+    if (sidecar->nb_streams != ctx->nb_streams)
+        return -1;
+
+    // Reading the header already tells what the streams are, the sidecar
+    // must agree
+    for (i = 0; i < ctx->nb_streams; i++) {
+        const AVCodecParameters *par = sidecar->streams[i].codecpar;
+
+        if (par->codec_type != ctx->streams[i]->codecpar->codec_type ||
+                par->codec_id != ctx->streams[i]->codecpar->codec_id)
+            return -1;
+    }
+
+    for (i = 0; i < ctx->nb_streams; i++) {
+        const YPSidecarStream *s = &sidecar->streams[i];
+        AVStream *st = ctx->streams[i];
+
+        if ((ret = avcodec_parameters_copy(st->codecpar, s->codecpar)) < 0)
+            return ret;
+
+        st->time_base = s->time_base;
+        st->avg_frame_rate = s->avg_frame_rate;
+        st->r_frame_rate = s->r_frame_rate;
+        st->sample_aspect_ratio = s->sample_aspect_ratio;
+        st->start_time = s->start_time;
+        st->duration = s->duration;
+        st->nb_frames = s->nb_frames;
+    }
+
+    ctx->start_time = sidecar->start_time;
+    ctx->duration = sidecar->duration;
+    ctx->bit_rate = sidecar->bit_rate;
+
+    return 0;
+}
+
+const YPKeyframeIndex* yp_sidecar_kfindex(const YPSidecar *sidecar, int stream_idx)
+{
+    if (stream_idx < 0 || (unsigned int) stream_idx >= sidecar->nb_streams)
+        return NULL;
+
+    return sidecar->streams[stream_idx].kfindex;
+}
+
+int yp_sidecar_save(const char *dir, const char *filename, AVFormatContext *ctx,
+                    YPKeyframeIndex **indexes)
+{
+    char key[PATH_MAX];
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    struct stat st;
+    YPStrBuf buf;
+    FILE *f;
+    unsigned int i;
+    int ret = 0;
+
+    if (stat(filename, &st) < 0)
+        return -1;
+
+    sidecar_key(key, filename);
+    sidecar_path(path, sizeof(path), dir, key);
+
+    yp_strbuf_init(&buf);
+
+    put_header(&buf, key, &st);
+    put_i64(&buf, ctx->start_time);
+    put_i64(&buf, ctx->duration);
+    put_i64(&buf, ctx->bit_rate);
+    put_u32(&buf, ctx->nb_streams);
+
+    for (i = 0; i < ctx->nb_streams; i++) {
+        AVStream *s = ctx->streams[i];
+
+        put_codecpar(&buf, s->codecpar);
+        put_rational(&buf, s->time_base);
+        put_rational(&buf, s->avg_frame_rate);
+        put_rational(&buf, s->r_frame_rate);
+        put_rational(&buf, s->sample_aspect_ratio);
+        put_i64(&buf, s->start_time);
+        put_i64(&buf, s->duration);
+        put_i64(&buf, s->nb_frames);
+
+        if (indexes && indexes[i]) {
+            put_u32(&buf, 1);
+            put_kfindex(&buf, indexes[i]);
+        } else {
+            put_u32(&buf, 0);
+        }
+    }
+
+    if (buf.error) {
+        yp_strbuf_free(&buf);
+        return -1;
+    }
+
+    // Other runs may read or write the same sidecar concurrently: write a
+    // private copy and move it in place
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int) getpid());
+
+    if ((f = fopen(tmp_path, "wb")) == NULL) {
+        yp_log(YP_LOG_DEMUX, YP_LOG_WARNING, "Could not write index cache %s\n", tmp_path);
+        yp_strbuf_free(&buf);
+        return -1;
+    }
+
+    if (fwrite(buf.data, 1, buf.len, f) != buf.len)
+        ret = -1;
+
+    if (fclose(f) != 0)
+        ret = -1;
+
+    if (ret == 0 && rename(tmp_path, path) < 0)
+        ret = -1;
+
+    if (ret < 0) {
+        yp_log(YP_LOG_DEMUX, YP_LOG_WARNING, "Could not write index cache %s\n", path);
+        unlink(tmp_path);
+    }
+
+    yp_strbuf_free(&buf);
+
+    return ret;
+}
+
+void yp_sidecar_free(YPSidecar *sidecar)
+{
+    unsigned int i;
+
+    for (i = 0; i < sidecar->nb_streams; i++) {
+        avcodec_parameters_free(&sidecar->streams[i].codecpar);
+
+        if (sidecar->streams[i].kfindex)
+            yp_kfindex_free(sidecar->streams[i].kfindex);
+    }
+
+    free(sidecar->streams);
+    free(sidecar);
+}
@@ -0,0 +1,46 @@
+#ifndef YP_SIDECAR_H_
+#define YP_SIDECAR_H_
+
+#include "common.h"
+#include "kfindex.h"
+
+// What probing and indexing an input file found, saved in a cache
+// directory so that packaging the same file again can skip both.
+// A sidecar belongs to the file with the path, size and modification time
+// it was made from, and is ignored once any of them changes.
+typedef struct YPSidecarStream {
+    AVCodecParameters *codecpar;
+    AVRational time_base;
+    AVRational avg_frame_rate;
+    AVRational r_frame_rate;
+    AVRational sample_aspect_ratio;
+    int64_t start_time;
+    int64_t duration;
+    int64_t nb_frames;
+    // NULL if the stream was not indexed
+    YPKeyframeIndex *kfindex;
+} YPSidecarStream;
+
+typedef struct YPSidecar {
+    int64_t start_time;
+    int64_t duration;
+    int64_t bit_rate;
+    unsigned int nb_streams;
+    YPSidecarStream *streams;
+} YPSidecar;
+
+// NULL if dir holds no sidecar for filename, or an outdated or damaged one
+YPSidecar* yp_sidecar_load(const char *dir, const char *filename);
+// Restore the stream parameters of an input opened with
+// avformat_open_input(), in place of avformat_find_stream_info(). Fails
+// if the sidecar does not describe the streams of ctx.
+int yp_sidecar_apply(const YPSidecar *sidecar, AVFormatContext *ctx);
+// Keyframe index of stream stream_idx, NULL if none was saved
+const YPKeyframeIndex* yp_sidecar_kfindex(const YPSidecar *sidecar, int stream_idx);
+// Save the stream parameters of ctx and, if indexes is not NULL, the non
+// NULL entries of indexes (ctx->nb_streams of them) for filename
+int yp_sidecar_save(const char *dir, const char *filename, AVFormatContext *ctx,
+                    YPKeyframeIndex **indexes);
+void yp_sidecar_free(YPSidecar *sidecar);
+
+#endif // YP_SIDECAR_H_
@@ -0,0 +1,742 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <libavutil/dict.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "sink.h"
+#include "strbuf.h"
+#include "utils.h"
+#include "log.h"
+
+#define TAR_BLOCK_SIZE      512
+// Objects are small and many: let stdio turn them into large writes
+#define TAR_BUFFER_SIZE     (4 << 20)
+// Last member of an indexed archive, locating the index
+#define PACK_INDEX_NAME     "pack.idx"
+#define PACK_TRAILER_NAME   "pack.end"
+#define PACK_MAGIC          "YPPACK1"
+
+void yp_sink_objects_init(YPSinkObjects *objects)
+{
+    pthread_mutex_init(&objects->lock, NULL);
+    objects->head = NULL;
+}
+
+int yp_sink_objects_add(YPSinkObjects *objects, AVIOContext *pb, const char *name)
+{
+    YPSinkObject *obj = malloc(sizeof(YPSinkObject));
+
+    if (obj == NULL || (obj->name = strdup(name)) == NULL) {
+        free(obj);
+        return AVERROR(ENOMEM);
+    }
+
+    obj->pb = pb;
+
+    pthread_mutex_lock(&objects->lock);
+    obj->next = objects->head;
+    objects->head = obj;
+    pthread_mutex_unlock(&objects->lock);
+
+    return 0;
+}
+
+char* yp_sink_objects_remove(YPSinkObjects *objects, AVIOContext *pb)
+{
+    YPSinkObject **p, *obj = NULL;
+    char *name = NULL;
+
+    pthread_mutex_lock(&objects->lock);
+
+    for (p = &objects->head; *p; p = &(*p)->next) {
+        if ((*p)->pb == pb) {
+            obj = *p;
+            *p = obj->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&objects->lock);
+
+    if (obj) {
+        name = obj->name;
+        free(obj);
+    }
+
+    return name;
+}
+
+int yp_sink_objects_open(YPSinkObjects *objects, AVIOContext **pb, const char *name)
+{
+    int ret;
+
+    if ((ret = avio_open_dyn_buf(pb)) < 0)
+        return ret;
+
+    if ((ret = yp_sink_objects_add(objects, *pb, name)) < 0) {
+        uint8_t *data = NULL;
+
+        avio_close_dyn_buf(*pb, &data);
+        av_free(data);
+        *pb = NULL;
+    }
+
+    return ret;
+}
+
+void yp_sink_objects_uninit(YPSinkObjects *objects)
+{
+    YPSinkObject *obj, *next;
+
+    // Left open by a failed run
+    for (obj = objects->head; obj; obj = next) {
+        uint8_t *data = NULL;
+
+        next = obj->next;
+        avio_close_dyn_buf(obj->pb, &data);
+        av_free(data);
+        free(obj->name);
+        free(obj);
+    }
+
+    objects->head = NULL;
+    pthread_mutex_destroy(&objects->lock);
+}
+
+int yp_sink_put(YPSink *sink, const char *name, const char *data, size_t size)
+{
+    AVIOContext *pb = NULL;
+    int ret;
+
+    if (sink == NULL)
+        return AVERROR(EINVAL);
+
+    if ((ret = sink->open(sink, &pb, name)) < 0)
+        return ret;
+
+    avio_write(pb, (const unsigned char *) data, (int) size);
+
+    return sink->close(sink, pb, NULL, NULL);
+}
+
+void yp_sink_free(YPSink *sink)
+{
+    if (sink)
+        sink->free(sink);
+}
+
+static int sink_flush_nothing(YPSink *self)
+{
+    return 0;
+}
+
+// Directory -------------------------------------------------------------
+
+typedef struct DirSink {
+    char *root;
+    int url;
+    // Paths the open files are written to
+    YPSinkObjects objects;
+    // Tells temporary files of concurrent writers of one object apart
+    unsigned int nb_opened;
+} DirSink;
+
+static int dir_open(YPSink *self, AVIOContext **pb, const char *name)
+{
+    DirSink *d = self->opaque;
+    AVDictionary *opts = NULL;
+    char path[1024];
+    char tmp_path[1040];
+    char *slash;
+    unsigned int n;
+    int ret;
+
+    snprintf(path, sizeof(path), "%s/%s", d->root, name);
+
+    if (d->url) {
+        // An HTTP origin gets every object in a single request
+        av_dict_set(&opts, "method", "PUT", 0);
+        snprintf(tmp_path, sizeof(tmp_path), "%s", path);
+    } else {
+        if ((slash = strrchr(path, '/')) != NULL) {
+            *slash = '\0';
+            mkdir_p(path);
+            *slash = '/';
+        }
+        pthread_mutex_lock(&d->objects.lock);
+        n = d->nb_opened++;
+        pthread_mutex_unlock(&d->objects.lock);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%u.tmp", path, n);
+    }
+
+    ret = avio_open2(pb, tmp_path, AVIO_FLAG_WRITE, NULL, &opts);
+    av_dict_free(&opts);
+
+    if (ret < 0) {
+        yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Could not open %s: %s\n", tmp_path, av_err2str(ret));
+        return ret;
+    }
+
+    if ((ret = yp_sink_objects_add(&d->objects, *pb, tmp_path)) < 0) {
+        avio_closep(pb);
+        return ret;
+    }
+
+    return 0;
+}
+
+static int dir_close(YPSink *self, AVIOContext *pb, YPWriteDone done, void *opaque)
+{
+    DirSink *d = self->opaque;
+    char *tmp_path = yp_sink_objects_remove(&d->objects, pb);
+    char path[1040];
+    char *suffix;
+    int ret = 0;
+
+    avio_flush(pb);
+
+    if (pb->error < 0)
+        ret = pb->error;
+
+    avio_close(pb);
+
+    if (tmp_path == NULL) {
+        ret = AVERROR(EINVAL);
+    } else if (!d->url && ret >= 0) {
+        // Readers never see a partial object: drop ".<n>.tmp"
+        snprintf(path, sizeof(path), "%s", tmp_path);
+        *strrchr(path, '.') = '\0';
+        if ((suffix = strrchr(path, '.')) != NULL)
+            *suffix = '\0';
+
+        if (rename(tmp_path, path) < 0) {
+            ret = AVERROR(errno);
+            yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Could not publish %s\n", path);
+        }
+    } else if (!d->url) {
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+
+    if (done)
+        done(opaque, ret);
+
+    return ret;
+}
+
+static void dir_free(YPSink *self)
+{
+    DirSink *d = self->opaque;
+
+    // Left open by a failed run, these are not dynamic buffers
+    while (d->objects.head) {
+        AVIOContext *pb = d->objects.head->pb;
+
+        free(yp_sink_objects_remove(&d->objects, pb));
+        avio_close(pb);
+    }
+
+    yp_sink_objects_uninit(&d->objects);
+    free(d->root);
+    free(d);
+    free(self);
+}
+
+YPSink* yp_sink_dir(const char *root)
+{
+    YPSink *sink = malloc(sizeof(YPSink));
+    DirSink *d = malloc(sizeof(DirSink));
+
+    if (sink == NULL || d == NULL || (d->root = strdup(root)) == NULL) {
+        free(d);
+        free(sink);
+        return NULL;
+    }
+
+    d->url = is_url(root);
+    d->nb_opened = 0;
+    yp_sink_objects_init(&d->objects);
+
+    sink->opaque = d;
+    sink->root = d->root;
+    sink->open = &dir_open;
+    sink->close = &dir_close;
+    sink->flush = &sink_flush_nothing;
+    sink->free = &dir_free;
+
+    return sink;
+}
+
+// Memory ----------------------------------------------------------------
+
+typedef struct MemObject {
+    char *name;
+    uint8_t *data;
+    int size;
+    struct MemObject *next;
+} MemObject;
+
+typedef struct MemSink {
+    YPSinkObjects objects;
+    pthread_mutex_t lock;
+    MemObject *head;
+} MemSink;
+
+static int mem_open(YPSink *self, AVIOContext **pb, const char *name)
+{
+    MemSink *m = self->opaque;
+
+    return yp_sink_objects_open(&m->objects, pb, name);
+}
+
+static int mem_close(YPSink *self, AVIOContext *pb, YPWriteDone done, void *opaque)
+{
+    MemSink *m = self->opaque;
+    MemObject **p, *obj;
+    char *name = yp_sink_objects_remove(&m->objects, pb);
+    uint8_t *data = NULL;
+    int size = avio_close_dyn_buf(pb, &data);
+    int ret = 0;
+
+    if (name == NULL || (obj = malloc(sizeof(MemObject))) == NULL) {
+        ret = name ? AVERROR(ENOMEM) : AVERROR(EINVAL);
+        free(name);
+        av_free(data);
+        goto end;
+    }
+
+    obj->name = name;
+    obj->data = data;
+    obj->size = size;
+
+    pthread_mutex_lock(&m->lock);
+
+    for (p = &m->head; *p; p = &(*p)->next) {
+        if (!strcmp((*p)->name, name)) {
+            MemObject *old = *p;
+
+            *p = old->next;
+            free(old->name);
+            av_free(old->data);
+            free(old);
+            break;
+        }
+    }
+
+    obj->next = m->head;
+    m->head = obj;
+
+    pthread_mutex_unlock(&m->lock);
+
+end:
+    if (done)
+        done(opaque, ret);
+
+    return ret;
+}
+
+int yp_sink_mem_take(YPSink *self, const char *name, uint8_t **data, int *size)
+{
+    MemSink *m = self->opaque;
+    MemObject **p, *obj = NULL;
+
+    pthread_mutex_lock(&m->lock);
+
+    for (p = &m->head; *p; p = &(*p)->next) {
+        if (!strcmp((*p)->name, name)) {
+            obj = *p;
+            *p = obj->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&m->lock);
+
+    if (obj == NULL)
+        return AVERROR(ENOENT);
+
+    *data = obj->data;
+    *size = obj->size;
+    free(obj->name);
+    free(obj);
+
+    return 0;
+}
+
+static void mem_free(YPSink *self)
+{
+    MemSink *m = self->opaque;
+    MemObject *obj, *next;
+
+    for (obj = m->head; obj; obj = next) {
+        next = obj->next;
+        free(obj->name);
+        av_free(obj->data);
+        free(obj);
+    }
+
+    yp_sink_objects_uninit(&m->objects);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+    free(self);
+}
+
+YPSink* yp_sink_mem(void)
+{
+    YPSink *sink = malloc(sizeof(YPSink));
+    MemSink *m = malloc(sizeof(MemSink));
+
+    if (sink == NULL || m == NULL) {
+        free(m);
+        free(sink);
+        return NULL;
+    }
+
+    yp_sink_objects_init(&m->objects);
+    pthread_mutex_init(&m->lock, NULL);
+    m->head = NULL;
+
+    sink->opaque = m;
+    sink->root = NULL;
+    sink->open = &mem_open;
+    sink->close = &mem_close;
+    sink->flush = &sink_flush_nothing;
+    sink->free = &mem_free;
+
+    return sink;
+}
+
+// Tar archive -----------------------------------------------------------
+
+// Where the data of an object starts in the archive
+typedef struct PackEntry {
+    char *name;
+    int64_t offset;
+    int64_t size;
+    unsigned int seq;
+} PackEntry;
+
+typedef struct TarSink {
+    YPSinkObjects objects;
+    pthread_mutex_t lock;
+    FILE *f;
+    char *filename;
+    // Bytes written so far
+    int64_t pos;
+    PackEntry *entries;
+    unsigned int nb_entries;
+    unsigned int nb_alloc;
+    // First write error, returned by flush()
+    int error;
+    uint64_t nb_objects;
+    uint64_t nb_bytes;
+} TarSink;
+
+// Octal field of size bytes, NUL terminated
+static void tar_octal(char *field, int size, uint64_t value)
+{
+    snprintf(field, size, "%0*llo", size - 1, (unsigned long long) value);
+}
+
+/**
+ * Fill a ustar header for a regular file. Names longer than 100 bytes are
+ * split at a slash into the prefix field.
+ */
+static int tar_header(uint8_t *block, const char *name, uint64_t size)
+{
+    char *h = (char *) block;
+    size_t len = strlen(name);
+    const char *base = name;
+    unsigned int sum = 0;
+    int i;
+
+    memset(block, 0, TAR_BLOCK_SIZE);
+
+    if (len > 100) {
+        const char *slash = strchr(name + len - 101, '/');
+
+        if (slash == NULL || slash - name > 155)
+            return AVERROR(ENAMETOOLONG);
+
+        memcpy(h + 345, name, slash - name);
+        base = slash + 1;
+    }
+
+    memcpy(h, base, strlen(base));
+    tar_octal(h + 100, 8, 0644);
+    tar_octal(h + 108, 8, 0);
+    tar_octal(h + 116, 8, 0);
+    tar_octal(h + 124, 12, size);
+    tar_octal(h + 136, 12, (uint64_t) time(NULL));
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    // The checksum is computed with its own field set to spaces
+    memset(h + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += block[i];
+    snprintf(h + 148, 8, "%06o", sum);
+    h[155] = ' ';
+
+    return 0;
+}
+
+static int tar_open(YPSink *self, AVIOContext **pb, const char *name)
+{
+    TarSink *t = self->opaque;
+
+    return yp_sink_objects_open(&t->objects, pb, name);
+}
+
+/**
+ * Append a member and remember where its data is. Must be called with
+ * t->lock held.
+ */
+static int tar_append(TarSink *t, const char *name, const uint8_t *data, int64_t size)
+{
+    static const uint8_t zeros[TAR_BLOCK_SIZE] = { 0 };
+    uint8_t header[TAR_BLOCK_SIZE];
+    int pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    PackEntry *e;
+    int ret;
+
+    if ((ret = tar_header(header, name, size)) < 0)
+        return ret;
+
+    if (t->nb_entries == t->nb_alloc) {
+        unsigned int nb_alloc = t->nb_alloc ? t->nb_alloc * 2 : 256;
+
+        if ((e = realloc(t->entries, nb_alloc * sizeof(PackEntry))) == NULL)
+            return AVERROR(ENOMEM);
+
+        t->entries = e;
+        t->nb_alloc = nb_alloc;
+    }
+
+    e = &t->entries[t->nb_entries];
+
+    if ((e->name = strdup(name)) == NULL)
+        return AVERROR(ENOMEM);
+
+    if (fwrite(header, 1, sizeof(header), t->f) != sizeof(header) ||
+            fwrite(data, 1, size, t->f) != (size_t) size ||
+            fwrite(zeros, 1, pad, t->f) != (size_t) pad) {
+        free(e->name);
+        return AVERROR(EIO);
+    }
+
+    e->offset = t->pos + TAR_BLOCK_SIZE;
+    e->size = size;
+    e->seq = t->nb_entries++;
+    t->pos += TAR_BLOCK_SIZE + size + pad;
+
+    return 0;
+}
+
+static int tar_close(YPSink *self, AVIOContext *pb, YPWriteDone done, void *opaque)
+{
+    TarSink *t = self->opaque;
+    char *name = yp_sink_objects_remove(&t->objects, pb);
+    uint8_t *data = NULL;
+    int size = avio_close_dyn_buf(pb, &data);
+    int ret = name ? 0 : AVERROR(EINVAL);
+
+    if (ret >= 0) {
+        // Objects are appended whole, one at a time
+        pthread_mutex_lock(&t->lock);
+
+        if ((ret = tar_append(t, name, data, size)) >= 0) {
+            t->nb_objects++;
+            t->nb_bytes += size;
+        } else if (t->error >= 0) {
+            t->error = ret;
+        }
+
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    if (ret < 0)
+        yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Could not add %s to %s: %s\n",
+               name ? name : "?", t->filename, av_err2str(ret));
+
+    free(name);
+    av_free(data);
+
+    if (done)
+        done(opaque, ret);
+
+    return ret;
+}
+
+static int tar_flush(YPSink *self)
+{
+    TarSink *t = self->opaque;
+    int ret;
+
+    pthread_mutex_lock(&t->lock);
+    if (fflush(t->f) != 0 && t->error >= 0)
+        t->error = AVERROR(EIO);
+    ret = t->error;
+    pthread_mutex_unlock(&t->lock);
+
+    return ret;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const PackEntry *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+
+    if (cmp)
+        return cmp;
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * Append the index of the archive: one "<offset> <size> <name>" line per
+ * object, for its last version only, sorted by name. Offsets are those of
+ * the data, so readers can serve byte ranges straight from the archive.
+ * A fixed size trailer member, always the last one, tells where the index
+ * is. Must be called with t->lock held.
+ */
+static int tar_write_index(TarSink *t)
+{
+    YPStrBuf index;
+    char trailer[TAR_BLOCK_SIZE];
+    int64_t index_offset, index_size;
+    unsigned int i;
+    int ret;
+
+    qsort(t->entries, t->nb_entries, sizeof(PackEntry), compare_entries);
+
+    yp_strbuf_init(&index);
+
+    for (i = 0; i < t->nb_entries; i++) {
+        const PackEntry *e = &t->entries[i];
+
+        if (i + 1 < t->nb_entries && !strcmp(e->name, t->entries[i + 1].name))
+            continue;
+
+        yp_strbuf_put_int(&index, e->offset);
+        yp_strbuf_puts(&index, " ");
+        yp_strbuf_put_int(&index, e->size);
+        yp_strbuf_puts(&index, " ");
+        yp_strbuf_puts(&index, e->name);
+        yp_strbuf_puts(&index, "\n");
+    }
+
+    index_offset = t->pos + TAR_BLOCK_SIZE;
+    index_size = index.len;
+
+    if (index.error)
+        ret = AVERROR(ENOMEM);
+    else
+        ret = tar_append(t, PACK_INDEX_NAME, (const uint8_t *) index.data, index.len);
+
+    yp_strbuf_free(&index);
+
+    if (ret < 0)
+        return ret;
+
+    memset(trailer, 0, sizeof(trailer));
+    snprintf(trailer, sizeof(trailer), PACK_MAGIC " %"PRId64" %"PRId64"\n",
+             index_offset, index_size);
+
+    return tar_append(t, PACK_TRAILER_NAME, (const uint8_t *) trailer, sizeof(trailer));
+}
+
+static void tar_free(YPSink *self)
+{
+    static const uint8_t zeros[2 * TAR_BLOCK_SIZE] = { 0 };
+    TarSink *t = self->opaque;
+    unsigned int i;
+    int ret;
+
+    // End of archive: two empty blocks after the index
+    ret = tar_write_index(t);
+    if (ret >= 0 && fwrite(zeros, 1, sizeof(zeros), t->f) != sizeof(zeros))
+        ret = AVERROR(EIO);
+    if (fclose(t->f) != 0 && ret >= 0)
+        ret = AVERROR(EIO);
+
+    if (ret < 0)
+        yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Could not finish %s\n", t->filename);
+    else
+        yp_log(YP_LOG_SINK, YP_LOG_INFO, "%s: %"PRIu64" objects, %"PRIu64" bytes\n",
+               t->filename, t->nb_objects, t->nb_bytes);
+
+    for (i = 0; i < t->nb_entries; i++)
+        free(t->entries[i].name);
+    free(t->entries);
+
+    yp_sink_objects_uninit(&t->objects);
+    pthread_mutex_destroy(&t->lock);
+    free(t->filename);
+    free(t);
+    free(self);
+}
+
+YPSink* yp_sink_tar(const char *filename)
+{
+    YPSink *sink = malloc(sizeof(YPSink));
+    TarSink *t = malloc(sizeof(TarSink));
+
+    if (sink == NULL || t == NULL || (t->filename = strdup(filename)) == NULL) {
+        free(t);
+        free(sink);
+        return NULL;
+    }
+
+    if ((t->f = fopen(filename, "wb")) == NULL) {
+        yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Could not create %s: %s\n", filename, strerror(errno));
+        free(t->filename);
+        free(t);
+        free(sink);
+        return NULL;
+    }
+
+    setvbuf(t->f, NULL, _IOFBF, TAR_BUFFER_SIZE);
+    yp_sink_objects_init(&t->objects);
+    pthread_mutex_init(&t->lock, NULL);
+    t->pos = 0;
+    t->entries = NULL;
+    t->nb_entries = 0;
+    t->nb_alloc = 0;
+    t->error = 0;
+    t->nb_objects = 0;
+    t->nb_bytes = 0;
+
+    sink->opaque = t;
+    sink->root = NULL;
+    sink->open = &tar_open;
+    sink->close = &tar_close;
+    sink->flush = &tar_flush;
+    sink->free = &tar_free;
+
+    return sink;
+}
+
+YPSink* yp_sink_create(const char *type, const char *root, unsigned int nb_connections)
+{
+    if (!strcmp(type, "dir"))
+        return yp_sink_dir(root);
+    if (!strcmp(type, "tar"))
+        return yp_sink_tar(root);
+    if (!strcmp(type, "http"))
+        return yp_sink_http(root, "PUT", nb_connections);
+    if (!strcmp(type, "http-post"))
+        return yp_sink_http(root, "POST", nb_connections);
+
+    yp_log(YP_LOG_SINK, YP_LOG_ERROR, "Unknown sink '%s'\n", type);
+    return NULL;
+}
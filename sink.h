@@ -0,0 +1,82 @@
+#ifndef YP_SINK_H_
+#define YP_SINK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <libavformat/avio.h>
+
+#include "writer.h"
+
+/**
+ * Destination of everything a run produces: init segments, media segments
+ * and manifests. Objects are named relative to the root of the output,
+ * e.g. "0/init.mp4", "1/seg-12.m4s" or "manifest.mpd", and are written
+ * through an AVIOContext opened by the sink. An object replaces any
+ * earlier one of the same name once it is closed. Sinks are shared by all
+ * muxers and must be thread safe.
+ */
+typedef struct YPSink {
+    void *opaque;
+    // Local directory or URL objects end up below, as files the muxer may
+    // write itself. NULL if objects can only go through open() and close().
+    const char *root;
+    int (*open)(struct YPSink *self, AVIOContext **pb, const char *name);
+    // Finish the object written through pb. done is called once it is
+    // stored, with a negative status if that failed, possibly from another
+    // thread. It may be NULL.
+    int (*close)(struct YPSink *self, AVIOContext *pb, YPWriteDone done, void *opaque);
+    // Wait until every closed object is stored, returns the first error
+    int (*flush)(struct YPSink *self);
+    void (*free)(struct YPSink *self);
+} YPSink;
+
+// Files below root, a local directory or a URL written with HTTP PUT.
+// Local files are written next to their final name and renamed once
+// complete.
+YPSink* yp_sink_dir(const char *root);
+// Objects kept in memory until the sink is freed, see yp_sink_mem_take()
+YPSink* yp_sink_mem(void);
+// Hand out the data of object name, which the caller must av_free()
+int yp_sink_mem_take(YPSink *self, const char *name, uint8_t **data, int *size);
+// Objects appended to a tar archive as they are closed, in large writes.
+// Replaced objects appear several times, extraction keeps the last one.
+// Once freed, the archive ends with an index of where the data of every
+// object is, see tools/pack.py, so that it can be served from in place.
+YPSink* yp_sink_tar(const char *filename);
+// Objects uploaded to base_url with method ("PUT" or "POST") by
+// nb_connections threads, each reusing its own connection, see
+// httpsink.c. Objects of one directory are stored in the order they are
+// closed. After a failed upload, done callbacks only get errors and
+// close() fails.
+YPSink* yp_sink_http(const char *base_url, const char *method, unsigned int nb_connections);
+
+// Sink for "dir", "tar", "http" or "http-post" output to root
+YPSink* yp_sink_create(const char *type, const char *root, unsigned int nb_connections);
+// Store size bytes of data as object name. Like close(), this may return
+// before the object is stored: flush() waits for it.
+int yp_sink_put(YPSink *sink, const char *name, const char *data, size_t size);
+void yp_sink_free(YPSink *sink);
+
+// For sink implementations: names of the objects open() handed out an
+// AVIOContext for, until close() takes them back
+typedef struct YPSinkObject {
+    AVIOContext *pb;
+    char *name;
+    struct YPSinkObject *next;
+} YPSinkObject;
+
+typedef struct YPSinkObjects {
+    pthread_mutex_t lock;
+    YPSinkObject *head;
+} YPSinkObjects;
+
+void yp_sink_objects_init(YPSinkObjects *objects);
+int yp_sink_objects_add(YPSinkObjects *objects, AVIOContext *pb, const char *name);
+// Open a dynamic buffer as *pb for object name
+int yp_sink_objects_open(YPSinkObjects *objects, AVIOContext **pb, const char *name);
+// Name of the object written through pb, to be freed by the caller
+char* yp_sink_objects_remove(YPSinkObjects *objects, AVIOContext *pb);
+void yp_sink_objects_uninit(YPSinkObjects *objects);
+
+#endif // YP_SINK_H_
@@ -0,0 +1,594 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+
+#include "smartcut.h"
+#include "muxer.h"
+#include "packetpool.h"
+#include "stats.h"
+#include "log.h"
+
+typedef struct SmartCut {
+    YPInputStream *instream;
+    YPMuxerClass *muxer;
+    AVRational time_base;
+    // Microseconds, as the muxer counts it
+    int64_t segment_duration;
+    // Overshoot tolerated before re-encoding, in time_base
+    int64_t tolerance;
+    // Start of the segment being muxed, tracked the way the muxer does
+    int64_t segment_start;
+    // Size of the NAL unit length fields, 0 if packets are in Annex B
+    int nal_length_size;
+    AVCodecContext *dec;
+    // Packets of the current GOP, in decode order
+    AVPacket **gop;
+    unsigned int nb_gop;
+    unsigned int nb_alloc;
+    // Packets of the GOP and re-encoded ones come from here
+    YPPacketPool pool;
+    uint64_t nb_gops;
+    uint64_t nb_cut_gops;
+    uint64_t nb_frames;
+    uint64_t nb_reencoded;
+    int64_t reencode_time;
+} SmartCut;
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_frame_pts(const void *a, const void *b)
+{
+    return cmp_int64(&(*(AVFrame * const *) a)->pts, &(*(AVFrame * const *) b)->pts);
+}
+
+static int cmp_packet_pts(const void *a, const void *b)
+{
+    return cmp_int64(&(*(AVPacket * const *) a)->pts, &(*(AVPacket * const *) b)->pts);
+}
+
+// Hand pkt to the muxer, following where it cuts segments
+static int forward(SmartCut *sc, AVPacket *pkt)
+{
+    if (sc->segment_start == AV_NOPTS_VALUE) {
+        sc->segment_start = pkt->pts;
+    } else if ((pkt->flags & AV_PKT_FLAG_KEY) &&
+               yp_segment_duration_reached(sc->segment_start, pkt->pts, sc->time_base,
+                                           sc->segment_duration)) {
+        sc->segment_start = pkt->pts;
+    }
+
+    return sc->muxer->handle_packet(sc->muxer, sc->instream, pkt);
+}
+
+// Rewrite an Annex B packet with NAL unit length fields, as in the input
+static int annexb_to_mp4(AVPacket *pkt, int nal_length_size)
+{
+    AVPacket out;
+    const uint8_t *p = pkt->data;
+    const uint8_t *end = pkt->data + pkt->size;
+    const uint8_t *nal, *next;
+    uint8_t *dst;
+    int size = 0;
+    int pass, ret;
+
+    // Sizes first, then copy
+    for (pass = 0; pass < 2; pass++) {
+        p = pkt->data;
+        dst = pass ? out.data : NULL;
+
+        while (p + 3 <= end && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+            p++;
+
+        while (p + 3 <= end) {
+            nal = p + 3;
+            next = nal;
+
+            while (next + 3 <= end && !(next[0] == 0 && next[1] == 0 && next[2] == 1))
+                next++;
+            if (next + 3 > end)
+                next = end;
+
+            p = next;
+            // Zero byte of a four byte start code
+            while (next > nal && next[-1] == 0)
+                next--;
+
+            if (pass == 0) {
+                if (nal_length_size < 4 && next - nal >= 1 << (8 * nal_length_size))
+                    return AVERROR(EINVAL);
+                size += nal_length_size + (int) (next - nal);
+            } else {
+                if (nal_length_size == 4)
+                    AV_WB32(dst, next - nal);
+                else if (nal_length_size == 2)
+                    AV_WB16(dst, next - nal);
+                else
+                    AV_WB8(dst, next - nal);
+                memcpy(dst + nal_length_size, nal, next - nal);
+                dst += nal_length_size + (next - nal);
+            }
+        }
+
+        if (pass == 0 && (ret = av_new_packet(&out, size)) < 0)
+            return ret;
+    }
+
+    if ((ret = av_packet_copy_props(&out, pkt)) < 0) {
+        av_packet_unref(&out);
+        return ret;
+    }
+
+    av_packet_unref(pkt);
+    av_packet_move_ref(pkt, &out);
+
+    return 0;
+}
+
+// x264 profile limiting the encoder to what the stream declares, NULL if
+// x264 can't produce it
+static const char* x264_profile(int profile)
+{
+    switch (profile & ~FF_PROFILE_H264_CONSTRAINED) {
+    case FF_PROFILE_H264_BASELINE: return "baseline";
+    case FF_PROFILE_H264_MAIN: return "main";
+    case FF_PROFILE_H264_HIGH: return "high";
+    case FF_PROFILE_H264_HIGH_10: return "high10";
+    case FF_PROFILE_H264_HIGH_422: return "high422";
+    case FF_PROFILE_H264_HIGH_444_PREDICTIVE: return "high444";
+    default: return NULL;
+    }
+}
+
+// Whether the SPS of Annex B packet pkt declares the profile and level of
+// par, so that players set up for the init segment can decode it
+static int same_profile_level(const AVPacket *pkt, const AVCodecParameters *par)
+{
+    const uint8_t *p = pkt->data;
+    const uint8_t *end = pkt->data + pkt->size;
+
+    for (; p + 7 <= end; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1 && (p[3] & 0x1f) == 7)
+            return p[4] == (par->profile & 0xff) && p[6] == par->level;
+    }
+
+    return 0;
+}
+
+static AVCodecContext* open_encoder(SmartCut *sc, AVPacket **tail, unsigned int nb_tail)
+{
+    AVStream *st = sc->instream->ctx->streams[sc->instream->stream_idx];
+    AVCodecContext *enc;
+    AVCodec *codec;
+    const char *profile = x264_profile(st->codecpar->profile);
+    int64_t bytes = 0, duration;
+    unsigned int i;
+
+    if ((codec = avcodec_find_encoder_by_name("libx264")) == NULL) {
+        yp_log(YP_LOG_MUXER, YP_LOG_WARNING, "Smart cut needs libx264, segments wait for keyframes\n");
+        return NULL;
+    }
+
+    if (profile == NULL || st->codecpar->level <= 0) {
+        yp_log(YP_LOG_MUXER, YP_LOG_WARNING, "Smart cut can't match H.264 profile %d level %d, segments wait for keyframes\n",
+               st->codecpar->profile, st->codecpar->level);
+        return NULL;
+    }
+
+    if ((enc = avcodec_alloc_context3(codec)) == NULL)
+        return NULL;
+
+    // Same bitrate as the frames replaced
+    for (i = 0; i < nb_tail; i++)
+        bytes += tail[i]->size;
+    duration = tail[nb_tail - 1]->pts + FFMAX(tail[nb_tail - 1]->duration, 1) - tail[0]->pts;
+
+    enc->width = sc->dec->width;
+    enc->height = sc->dec->height;
+    enc->pix_fmt = sc->dec->pix_fmt;
+    enc->sample_aspect_ratio = sc->dec->sample_aspect_ratio;
+    enc->time_base = sc->time_base;
+    enc->framerate = st->avg_frame_rate;
+    enc->bit_rate = av_rescale(bytes * 8, sc->time_base.den, duration * sc->time_base.num);
+    enc->rc_max_rate = enc->bit_rate * 2;
+    enc->rc_buffer_size = (int) FFMIN(enc->bit_rate * 2, INT_MAX);
+    enc->gop_size = nb_tail + 1;
+    // Decode order is display order, so that the replaced decode times
+    // can be handed out in order
+    enc->max_b_frames = 0;
+    enc->thread_count = 0;
+    // Within what the init segment declares
+    enc->level = st->codecpar->level;
+
+    av_opt_set(enc->priv_data, "preset", "veryfast", 0);
+    av_opt_set(enc->priv_data, "profile", profile, 0);
+    av_opt_set(enc->priv_data, "forced-idr", "1", 0);
+    // In-band parameter sets that don't replace those of the init segment,
+    // which copied frames still refer to
+    av_opt_set(enc->priv_data, "x264-params", "sps-id=1:repeat-headers=1", 0);
+
+    if (avcodec_open2(enc, codec, NULL) < 0) {
+        avcodec_free_context(&enc);
+        return NULL;
+    }
+
+    return enc;
+}
+
+/**
+ * Replace tail, the packets of the GOP from the first one at or past the
+ * boundary on, with re-encoded ones. Frames at forced[] timestamps become
+ * IDR frames. Returns the number of packets in out, 0 if the GOP has to be
+ * stream-copied after all.
+ */
+static int reencode(SmartCut *sc, unsigned int first, const int64_t *forced, unsigned int nb_forced,
+                    AVPacket **out)
+{
+    AVPacket **tail = sc->gop + first;
+    unsigned int nb_tail = sc->nb_gop - first;
+    AVFrame **frames = calloc(nb_tail, sizeof(AVFrame*));
+    AVPacket **by_pts = malloc(nb_tail * sizeof(AVPacket*));
+    int64_t *dts = malloc(nb_tail * sizeof(int64_t));
+    int64_t *pts = malloc(nb_tail * sizeof(int64_t));
+    AVCodecContext *enc = NULL;
+    AVFrame *frame = av_frame_alloc();
+    unsigned int nb_frames = 0, nb_out = 0, i, k;
+    int ret = 0;
+
+    if (frames == NULL || by_pts == NULL || dts == NULL || pts == NULL || frame == NULL)
+        goto end;
+
+    for (i = 0; i < nb_tail; i++) {
+        by_pts[i] = tail[i];
+        dts[i] = tail[i]->dts;
+        pts[i] = tail[i]->pts;
+    }
+
+    qsort(by_pts, nb_tail, sizeof(AVPacket*), cmp_packet_pts);
+    qsort(dts, nb_tail, sizeof(int64_t), cmp_int64);
+    qsort(pts, nb_tail, sizeof(int64_t), cmp_int64);
+
+    // The whole GOP is needed to rebuild the frames of its tail
+    avcodec_flush_buffers(sc->dec);
+
+    for (i = 0; i <= sc->nb_gop; i++) {
+        if (avcodec_send_packet(sc->dec, i < sc->nb_gop ? sc->gop[i] : NULL) < 0)
+            goto end;
+
+        while (avcodec_receive_frame(sc->dec, frame) >= 0) {
+            frame->pts = frame->best_effort_timestamp;
+
+            if (nb_frames < nb_tail &&
+                    bsearch(&frame->pts, pts, nb_tail, sizeof(int64_t), cmp_int64)) {
+                frames[nb_frames++] = av_frame_clone(frame);
+                if (frames[nb_frames - 1] == NULL)
+                    goto end;
+            }
+            av_frame_unref(frame);
+        }
+    }
+
+    avcodec_flush_buffers(sc->dec);
+
+    if (nb_frames != nb_tail || (enc = open_encoder(sc, by_pts, nb_tail)) == NULL)
+        goto end;
+
+    qsort(frames, nb_frames, sizeof(AVFrame*), cmp_frame_pts);
+
+    for (i = 0, k = 0; i <= nb_frames; i++) {
+        if (i < nb_frames) {
+            while (k < nb_forced && forced[k] < frames[i]->pts)
+                k++;
+            frames[i]->pict_type = k < nb_forced && forced[k] == frames[i]->pts ?
+                                   AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        }
+
+        if (avcodec_send_frame(enc, i < nb_frames ? frames[i] : NULL) < 0)
+            goto end;
+
+        // The packet an EAGAIN left blank waits for the next frame
+        while (nb_out < nb_tail &&
+               (out[nb_out] != NULL || (out[nb_out] = yp_packet_pool_get(&sc->pool)) != NULL) &&
+               avcodec_receive_packet(enc, out[nb_out]) >= 0)
+            nb_out++;
+    }
+
+    if (nb_out < nb_tail)
+        yp_packet_pool_put(&sc->pool, &out[nb_out]);
+
+    if (nb_out != nb_tail)
+        goto end;
+
+    // x264 may still pick a lower profile, e.g. baseline for main
+    if (!same_profile_level(out[0], sc->instream->ctx->streams[sc->instream->stream_idx]->codecpar)) {
+        yp_log(YP_LOG_MUXER, YP_LOG_DEBUG, "Re-encoded GOP has another profile or level, copying it\n");
+        goto end;
+    }
+
+    for (i = 0; i < nb_out; i++) {
+        // The i-th smallest decode time is never past the i-th smallest
+        // presentation time, so this keeps pts >= dts and the decode
+        // times of the copied packets around untouched
+        out[i]->dts = dts[i];
+        out[i]->duration = by_pts[i]->duration;
+        out[i]->pos = -1;
+
+        if (sc->nal_length_size && annexb_to_mp4(out[i], sc->nal_length_size) < 0)
+            goto end;
+    }
+
+    ret = nb_out;
+
+end:
+    // With the blank one an error may have left behind
+    if (ret == 0) {
+        for (i = 0; i < nb_out + 1 && i < nb_tail; i++)
+            yp_packet_pool_put(&sc->pool, &out[i]);
+    }
+
+    for (i = 0; i < nb_frames; i++)
+        av_frame_free(&frames[i]);
+
+    avcodec_free_context(&enc);
+    av_frame_free(&frame);
+    free(frames);
+    free(by_pts);
+    free(dts);
+    free(pts);
+
+    return ret;
+}
+
+/**
+ * Forward the buffered GOP. end_pts is where the next GOP starts, or the
+ * end of the stream.
+ */
+static int flush_gop(SmartCut *sc, int64_t end_pts)
+{
+    AVPacket *key = sc->gop[0];
+    AVPacket **out = NULL;
+    int64_t *pts = NULL;
+    int64_t *forced = NULL;
+    int64_t start = sc->segment_start;
+    unsigned int nb_forced = 0, first = sc->nb_gop;
+    unsigned int i;
+    int nb_out = 0;
+    int ret = 0;
+    int64_t t;
+
+    sc->nb_gops++;
+    sc->nb_frames += sc->nb_gop;
+
+    if (!(key->flags & AV_PKT_FLAG_KEY) || sc->nb_gop < 2 || key->pts == AV_NOPTS_VALUE)
+        goto copy;
+
+    // Where the muxer puts the segment start once it gets the keyframe
+    if (start == AV_NOPTS_VALUE ||
+            yp_segment_duration_reached(start, key->pts, sc->time_base, sc->segment_duration))
+        start = key->pts;
+
+    if ((pts = malloc(sc->nb_gop * sizeof(int64_t))) == NULL ||
+            (forced = malloc(sc->nb_gop * sizeof(int64_t))) == NULL)
+        goto copy;
+
+    for (i = 0; i < sc->nb_gop; i++) {
+        // Frames shown before the keyframe refer to the previous GOP
+        if (sc->gop[i]->pts == AV_NOPTS_VALUE || sc->gop[i]->pts < key->pts)
+            goto copy;
+        pts[i] = sc->gop[i]->pts;
+    }
+
+    qsort(pts, sc->nb_gop, sizeof(int64_t), cmp_int64);
+
+    // Boundaries the muxer would cut at if these frames were keyframes
+    for (i = 1; i < sc->nb_gop; i++) {
+        if (yp_segment_duration_reached(start, pts[i], sc->time_base, sc->segment_duration)) {
+            forced[nb_forced++] = pts[i];
+            start = pts[i];
+        }
+    }
+
+    // Short enough a wait for the next keyframe
+    if (nb_forced == 0 || end_pts - forced[0] <= sc->tolerance)
+        goto copy;
+
+    // Copy what precedes, in decode order, the first packet shown at or
+    // after the boundary. Frames shown before the boundary but decoded
+    // after it are re-encoded along, ahead of the new IDR frame.
+    for (i = 0; i < sc->nb_gop; i++) {
+        if (sc->gop[i]->pts >= forced[0]) {
+            first = i;
+            break;
+        }
+    }
+
+    if ((out = calloc(sc->nb_gop - first, sizeof(AVPacket*))) == NULL)
+        goto copy;
+
+    t = av_gettime_relative();
+    nb_out = reencode(sc, first, forced, nb_forced, out);
+    sc->reencode_time += av_gettime_relative() - t;
+
+    if (nb_out == 0) {
+        yp_log(YP_LOG_MUXER, YP_LOG_DEBUG, "Stream #%d: re-encoding from %"PRId64" failed, copying the GOP\n",
+               sc->instream->stream_idx, forced[0]);
+        goto copy;
+    }
+
+    sc->nb_cut_gops++;
+    sc->nb_reencoded += nb_out;
+
+    for (i = 0; i < first && ret >= 0; i++)
+        ret = forward(sc, sc->gop[i]);
+
+    for (i = 0; i < (unsigned int) nb_out && ret >= 0; i++)
+        ret = forward(sc, out[i]);
+
+    goto end;
+
+copy:
+    for (i = 0; i < sc->nb_gop && ret >= 0; i++)
+        ret = forward(sc, sc->gop[i]);
+
+end:
+    for (i = 0; i < (unsigned int) nb_out; i++)
+        yp_packet_pool_put(&sc->pool, &out[i]);
+
+    for (i = 0; i < sc->nb_gop; i++)
+        yp_packet_pool_put(&sc->pool, &sc->gop[i]);
+    sc->nb_gop = 0;
+
+    free(out);
+    free(pts);
+    free(forced);
+
+    return ret;
+}
+
+static int smartcut_init(YPMuxerClass *self, YPConfig *config, int instream_index)
+{
+    // The muxer behind is initialized by its owner
+    return 0;
+}
+
+static int smartcut_handle_packet(YPMuxerClass *self, YPInputStream *instream, AVPacket *pkt)
+{
+    SmartCut *sc = self->opaque;
+    AVPacket **gop;
+    int ret;
+
+    if ((pkt->flags & AV_PKT_FLAG_KEY) && sc->nb_gop > 0 && (ret = flush_gop(sc, pkt->pts)) < 0)
+        return ret;
+
+    if (sc->nb_gop == sc->nb_alloc) {
+        if ((gop = realloc(sc->gop, (sc->nb_alloc * 2 + 64) * sizeof(AVPacket*))) == NULL)
+            return AVERROR(ENOMEM);
+        sc->gop = gop;
+        sc->nb_alloc = sc->nb_alloc * 2 + 64;
+    }
+
+    // The demuxer unreferences pkt once every output had it
+    if ((sc->gop[sc->nb_gop] = yp_packet_pool_get(&sc->pool)) == NULL)
+        return AVERROR(ENOMEM);
+
+    if ((ret = av_packet_ref(sc->gop[sc->nb_gop], pkt)) < 0) {
+        yp_packet_pool_put(&sc->pool, &sc->gop[sc->nb_gop]);
+        return ret;
+    }
+    sc->nb_gop++;
+
+    return 0;
+}
+
+static int smartcut_finalize(YPMuxerClass *self)
+{
+    SmartCut *sc = self->opaque;
+    int64_t end_pts = AV_NOPTS_VALUE;
+    unsigned int i;
+    int ret = 0;
+
+    if (sc->nb_gop > 0) {
+        for (i = 0; i < sc->nb_gop; i++)
+            end_pts = FFMAX(end_pts, sc->gop[i]->pts + sc->gop[i]->duration);
+        ret = flush_gop(sc, end_pts);
+    }
+
+    yp_log(YP_LOG_MUXER, YP_LOG_INFO, "Stream #%d: %"PRIu64" of %"PRIu64" GOPs cut, "
+           "%"PRIu64" of %"PRIu64" frames re-encoded in %.3f s\n",
+           sc->instream->stream_idx, sc->nb_cut_gops, sc->nb_gops,
+           sc->nb_reencoded, sc->nb_frames, sc->reencode_time / 1000000.0);
+
+    if (sc->instream->stats) {
+        YPStreamStats stats;
+
+        yp_stream_stats_init(&stats);
+        stats.nb_shell_allocs = sc->pool.nb_allocs;
+        stats.nb_shell_reuses = sc->pool.nb_gets - sc->pool.nb_allocs;
+        yp_stats_merge(sc->instream->stats, &stats);
+    }
+
+    if (sc->muxer->finalize(sc->muxer) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+YPMuxerClass* yp_smartcut(YPConfig *config, YPInputStream *instream, YPMuxerClass *muxer)
+{
+    AVStream *st = instream->ctx->streams[instream->stream_idx];
+    AVCodecParameters *par = st->codecpar;
+    YPMuxerClass *self;
+    SmartCut *sc;
+    AVCodec *codec;
+
+    if ((self = calloc(1, sizeof(YPMuxerClass))) == NULL)
+        return NULL;
+
+    if ((sc = calloc(1, sizeof(SmartCut))) == NULL) {
+        free(self);
+        return NULL;
+    }
+
+    self->opaque = sc;
+    self->index = muxer->index;
+    self->init = &smartcut_init;
+    self->handle_packet = &smartcut_handle_packet;
+    self->finalize = &smartcut_finalize;
+
+    sc->instream = instream;
+    sc->muxer = muxer;
+    // Re-encoded GOPs start with parameter sets of their own
+    instream->in_band_ps = 1;
+    sc->time_base = st->time_base;
+    sc->segment_duration = (int64_t) config->seg_duration * 1000;
+    sc->tolerance = av_rescale_q(config->smart_cut_tolerance, (AVRational) { 1, 1000 }, st->time_base);
+    sc->segment_start = AV_NOPTS_VALUE;
+    yp_packet_pool_init(&sc->pool);
+
+    // avcC: the length field size is in the low bits of byte 4
+    if (par->extradata_size >= 5 && par->extradata[0] == 1)
+        sc->nal_length_size = (par->extradata[4] & 3) + 1;
+
+    if ((codec = avcodec_find_decoder(par->codec_id)) == NULL ||
+            (sc->dec = avcodec_alloc_context3(codec)) == NULL ||
+            avcodec_parameters_to_context(sc->dec, par) < 0) {
+        yp_smartcut_free(self);
+        return NULL;
+    }
+
+    sc->dec->pkt_timebase = st->time_base;
+    sc->dec->thread_count = 0;
+
+    if (avcodec_open2(sc->dec, codec, NULL) < 0) {
+        yp_smartcut_free(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+void yp_smartcut_free(YPMuxerClass *self)
+{
+    SmartCut *sc = self->opaque;
+    unsigned int i;
+
+    for (i = 0; i < sc->nb_gop; i++)
+        av_packet_free(&sc->gop[i]);
+
+    yp_packet_pool_uninit(&sc->pool);
+    avcodec_free_context(&sc->dec);
+    free(sc->gop);
+    free(sc);
+    free(self);
+}
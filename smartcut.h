@@ -0,0 +1,21 @@
+#ifndef YP_SMARTCUT_H_
+#define YP_SMARTCUT_H_
+
+#include "common.h"
+
+/**
+ * Stage in front of the muxer of an H.264 stream, registered on the
+ * demuxer in its place. Packets are held back one GOP at a time. When a
+ * segment boundary falls inside a GOP and the next keyframe is more than
+ * config->smart_cut_tolerance milliseconds late, the frames from the
+ * boundary to the end of the GOP are decoded and re-encoded starting with
+ * an IDR frame, with their own in-band parameter sets and the profile and
+ * level of the stream. GOPs x264 can't match them for are copied. The
+ * stream is marked instream->in_band_ps, so that it gets an avc3 sample
+ * entry and codecs string. Everything else is stream-copied. muxer must
+ * not be initialized before this is called.
+ */
+YPMuxerClass* yp_smartcut(YPConfig *config, YPInputStream *instream, YPMuxerClass *muxer);
+void yp_smartcut_free(YPMuxerClass *self);
+
+#endif // YP_SMARTCUT_H_
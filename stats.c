@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "stats.h"
+
+#define STATS_MIN_ALLOC 64
+
+YPStats* yp_stats(unsigned int nb_streams)
+{
+    unsigned int i;
+    YPStats *stats = (YPStats *) calloc(1, sizeof(YPStats));
+
+    if (stats == NULL) {
+        return NULL;
+    }
+
+    stats->streams = (YPStreamStats *) calloc(nb_streams, sizeof(YPStreamStats));
+
+    if (stats->streams == NULL) {
+        free(stats);
+        return NULL;
+    }
+
+    pthread_mutex_init(&stats->lock, NULL);
+    stats->nb_streams = nb_streams;
+
+    for (i = 0; i < nb_streams; i++) {
+        yp_stream_stats_init(&stats->streams[i]);
+        stats->streams[i].parent = stats;
+    }
+
+    return stats;
+}
+
+void yp_stream_stats_init(YPStreamStats *stats)
+{
+    memset(stats, 0, sizeof(YPStreamStats));
+    stats->stream_idx = -1;
+}
+
+static int append_latencies(YPStreamStats *stats, const int64_t *latencies, unsigned int n)
+{
+    if (stats->nb_segments + n > stats->nb_alloc) {
+        unsigned int nb_alloc = stats->nb_alloc ? stats->nb_alloc : STATS_MIN_ALLOC;
+        int64_t *p;
+
+        while (nb_alloc < stats->nb_segments + n)
+            nb_alloc *= 2;
+
+        p = realloc(stats->flush_latencies, nb_alloc * sizeof(int64_t));
+
+        if (p == NULL) {
+            return -1;
+        }
+
+        stats->flush_latencies = p;
+        stats->nb_alloc = nb_alloc;
+    }
+
+    memcpy(stats->flush_latencies + stats->nb_segments, latencies, n * sizeof(int64_t));
+    stats->nb_segments += n;
+
+    return 0;
+}
+
+int yp_stream_stats_add_flush(YPStreamStats *stats, int64_t latency)
+{
+    stats->flush_time += latency;
+    return append_latencies(stats, &latency, 1);
+}
+
+int yp_stats_merge(YPStreamStats *dst, YPStreamStats *src)
+{
+    int ret;
+
+    pthread_mutex_lock(&dst->parent->lock);
+
+    dst->nb_packets += src->nb_packets;
+    dst->nb_bytes += src->nb_bytes;
+    dst->demux_time += src->demux_time;
+    dst->mux_time += src->mux_time;
+    dst->flush_time += src->flush_time;
+    dst->nb_shell_allocs += src->nb_shell_allocs;
+    dst->nb_shell_reuses += src->nb_shell_reuses;
+    ret = append_latencies(dst, src->flush_latencies, src->nb_segments);
+
+    pthread_mutex_unlock(&dst->parent->lock);
+
+    free(src->flush_latencies);
+    yp_stream_stats_init(src);
+
+    return ret;
+}
+
+void yp_stats_add_manifest(YPStats *stats, int64_t time)
+{
+    pthread_mutex_lock(&stats->lock);
+    stats->manifest_time += time;
+    stats->nb_manifests++;
+    pthread_mutex_unlock(&stats->lock);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Nearest rank percentile of sorted values
+static int64_t percentile(const int64_t *values, unsigned int n, unsigned int p)
+{
+    unsigned int rank;
+
+    if (n == 0)
+        return 0;
+
+    rank = (n * p + 99) / 100;
+    return values[rank > 0 ? rank - 1 : 0];
+}
+
+static void write_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', f);
+        if ((unsigned char) *str >= 0x20)
+            fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+static double per_second(uint64_t count, int64_t us)
+{
+    return us > 0 ? count * 1000000.0 / us : 0.0;
+}
+
+int yp_stats_write_json(YPStats *stats, const char *filename)
+{
+    unsigned int i;
+    uint64_t nb_packets = 0;
+    uint64_t nb_bytes = 0;
+    uint64_t nb_shell_allocs = 0;
+    uint64_t nb_shell_reuses = 0;
+    int64_t wall_time = stats->end_time - stats->start_time;
+    FILE *f = fopen(filename, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", filename);
+        return -1;
+    }
+
+    pthread_mutex_lock(&stats->lock);
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"wall_time_us\": %"PRId64",\n", wall_time);
+    fprintf(f, "  \"manifest\": { \"writes\": %u, \"time_us\": %"PRId64" },\n",
+            stats->nb_manifests, stats->manifest_time);
+    fprintf(f, "  \"representations\": [\n");
+
+    for (i = 0; i < stats->nb_streams; i++) {
+        YPStreamStats *s = &stats->streams[i];
+
+        qsort(s->flush_latencies, s->nb_segments, sizeof(int64_t), compare_int64);
+        nb_packets += s->nb_packets;
+        nb_bytes += s->nb_bytes;
+        nb_shell_allocs += s->nb_shell_allocs;
+        nb_shell_reuses += s->nb_shell_reuses;
+
+        fprintf(f, "    {\n");
+        fprintf(f, "      \"id\": %u,\n", s->stream_id);
+        fprintf(f, "      \"input\": ");
+        write_string(f, s->filename ? s->filename : "");
+        fprintf(f, ",\n");
+        fprintf(f, "      \"stream\": %d,\n", s->stream_idx);
+        fprintf(f, "      \"packets\": %"PRIu64",\n", s->nb_packets);
+        fprintf(f, "      \"bytes\": %"PRIu64",\n", s->nb_bytes);
+        fprintf(f, "      \"segments\": %u,\n", s->nb_segments);
+        fprintf(f, "      \"demux_time_us\": %"PRId64",\n", s->demux_time);
+        fprintf(f, "      \"mux_time_us\": %"PRId64",\n", s->mux_time);
+        fprintf(f, "      \"flush_time_us\": %"PRId64",\n", s->flush_time);
+        fprintf(f, "      \"packet_shell_allocs\": %"PRIu64",\n", s->nb_shell_allocs);
+        fprintf(f, "      \"packet_shell_reuses\": %"PRIu64",\n", s->nb_shell_reuses);
+        fprintf(f, "      \"packets_per_sec\": %.1f,\n", per_second(s->nb_packets, wall_time));
+        fprintf(f, "      \"bytes_per_sec\": %.1f,\n", per_second(s->nb_bytes, wall_time));
+        fprintf(f, "      \"flush_latency_us\": { \"p50\": %"PRId64", \"p90\": %"PRId64", "
+                   "\"p99\": %"PRId64", \"max\": %"PRId64" }\n",
+                percentile(s->flush_latencies, s->nb_segments, 50),
+                percentile(s->flush_latencies, s->nb_segments, 90),
+                percentile(s->flush_latencies, s->nb_segments, 99),
+                percentile(s->flush_latencies, s->nb_segments, 100));
+        fprintf(f, "    }%s\n", i + 1 < stats->nb_streams ? "," : "");
+    }
+
+    fprintf(f, "  ],\n");
+    fprintf(f, "  \"packets\": %"PRIu64",\n", nb_packets);
+    fprintf(f, "  \"bytes\": %"PRIu64",\n", nb_bytes);
+    fprintf(f, "  \"packet_shell_allocs\": %"PRIu64",\n", nb_shell_allocs);
+    fprintf(f, "  \"packet_shell_reuses\": %"PRIu64",\n", nb_shell_reuses);
+    fprintf(f, "  \"packets_per_sec\": %.1f,\n", per_second(nb_packets, wall_time));
+    fprintf(f, "  \"bytes_per_sec\": %.1f\n", per_second(nb_bytes, wall_time));
+    fprintf(f, "}\n");
+
+    pthread_mutex_unlock(&stats->lock);
+
+    fclose(f);
+
+    return 0;
+}
+
+void yp_stats_free(YPStats *stats)
+{
+    unsigned int i;
+
+    for (i = 0; i < stats->nb_streams; i++)
+        free(stats->streams[i].flush_latencies);
+
+    pthread_mutex_destroy(&stats->lock);
+    free(stats->streams);
+    free(stats);
+}
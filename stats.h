@@ -0,0 +1,52 @@
+#ifndef YP_STATS_H_
+#define YP_STATS_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct YPStats;
+
+// Counters of one representation. Times are in microseconds. Hot paths
+// fill a private copy and merge it into the shared one when they are done.
+typedef struct YPStreamStats {
+    struct YPStats *parent;
+    unsigned int stream_id;
+    const char *filename;
+    int stream_idx;
+    uint64_t nb_packets;
+    uint64_t nb_bytes;
+    // Spent in av_read_frame(), in av_write_frame() and flushing segments
+    int64_t demux_time;
+    int64_t mux_time;
+    int64_t flush_time;
+    // AVPacket structs (not payloads) the stages queueing packets, the
+    // native fragment writer and smart cut, allocated and reused from their
+    // pool. Payload buffers are allocated by libavformat and not counted.
+    uint64_t nb_shell_allocs;
+    uint64_t nb_shell_reuses;
+    // One flush latency per segment
+    unsigned int nb_segments;
+    unsigned int nb_alloc;
+    int64_t *flush_latencies;
+} YPStreamStats;
+
+typedef struct YPStats {
+    pthread_mutex_t lock;
+    int64_t start_time;
+    int64_t end_time;
+    int64_t manifest_time;
+    unsigned int nb_manifests;
+    unsigned int nb_streams;
+    YPStreamStats *streams;
+} YPStats;
+
+YPStats* yp_stats(unsigned int nb_streams);
+void yp_stream_stats_init(YPStreamStats *stats);
+int yp_stream_stats_add_flush(YPStreamStats *stats, int64_t latency);
+// Add src to dst, a stream of a YPStats, and reset src
+int yp_stats_merge(YPStreamStats *dst, YPStreamStats *src);
+void yp_stats_add_manifest(YPStats *stats, int64_t time);
+int yp_stats_write_json(YPStats *stats, const char *filename);
+void yp_stats_free(YPStats *stats);
+
+#endif // YP_STATS_H_
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "strbuf.h"
+
+#define STRBUF_MIN_SIZE 4096
+
+void yp_strbuf_init(YPStrBuf *buf)
+{
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+    buf->error = 0;
+}
+
+void yp_strbuf_reset(YPStrBuf *buf)
+{
+    buf->len = 0;
+    buf->error = 0;
+}
+
+void yp_strbuf_free(YPStrBuf *buf)
+{
+    free(buf->data);
+    yp_strbuf_init(buf);
+}
+
+void yp_strbuf_append(YPStrBuf *buf, const char *str, size_t len)
+{
+    if (buf->error || len == 0)
+        return;
+
+    if (buf->len + len > buf->size) {
+        size_t size = buf->size ? buf->size : STRBUF_MIN_SIZE;
+        char *data;
+
+        while (size < buf->len + len)
+            size *= 2;
+
+        data = realloc(buf->data, size);
+
+        if (data == NULL) {
+            buf->error = 1;
+            return;
+        }
+
+        buf->data = data;
+        buf->size = size;
+    }
+
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+}
+
+void yp_strbuf_puts(YPStrBuf *buf, const char *str)
+{
+    yp_strbuf_append(buf, str, strlen(str));
+}
+
+void yp_strbuf_put_int(YPStrBuf *buf, int64_t value)
+{
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    // Negate in unsigned arithmetic so that INT64_MIN works too
+    uint64_t v = value < 0 ? -(uint64_t) value : (uint64_t) value;
+
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (value < 0)
+        *--p = '-';
+
+    yp_strbuf_append(buf, p, digits + sizeof(digits) - p);
+}
+
+void yp_strbuf_put_milli(YPStrBuf *buf, int64_t value)
+{
+    char frac[4];
+    int64_t rem;
+
+    if (value < 0) {
+        yp_strbuf_append(buf, "-", 1);
+        value = -value;
+    }
+
+    rem = value % 1000;
+    frac[0] = '.';
+    frac[1] = '0' + rem / 100;
+    frac[2] = '0' + rem / 10 % 10;
+    frac[3] = '0' + rem % 10;
+
+    yp_strbuf_put_int(buf, value / 1000);
+    yp_strbuf_append(buf, frac, sizeof(frac));
+}
+
+void yp_strbuf_put_duration(YPStrBuf *buf, int64_t ms)
+{
+    int64_t days, hours, minutes;
+
+    if (ms < 0)
+        ms = 0;
+
+    days = ms / 86400000;
+    ms -= days * 86400000;
+    hours = ms / 3600000;
+    ms -= hours * 3600000;
+    minutes = ms / 60000;
+    ms -= minutes * 60000;
+
+    yp_strbuf_append(buf, "P", 1);
+
+    if (days > 0) {
+        yp_strbuf_put_int(buf, days);
+        yp_strbuf_append(buf, "D", 1);
+    }
+
+    yp_strbuf_append(buf, "T", 1);
+
+    if (hours > 0) {
+        yp_strbuf_put_int(buf, hours);
+        yp_strbuf_append(buf, "H", 1);
+    }
+
+    if (minutes > 0) {
+        yp_strbuf_put_int(buf, minutes);
+        yp_strbuf_append(buf, "M", 1);
+    }
+
+    // Always end with seconds, "PT" alone is not a valid duration
+    if (ms > 0 || (days == 0 && hours == 0 && minutes == 0)) {
+        if (ms % 1000)
+            yp_strbuf_put_milli(buf, ms);
+        else
+            yp_strbuf_put_int(buf, ms / 1000);
+        yp_strbuf_append(buf, "S", 1);
+    }
+}
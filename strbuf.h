@@ -0,0 +1,28 @@
+#ifndef YP_STRBUF_H_
+#define YP_STRBUF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Growable text buffer. Reset keeps the memory, so a buffer that is
+// refilled over and over stops allocating once it is large enough.
+// Appends after a failed allocation are dropped and error is set.
+typedef struct YPStrBuf {
+    char *data;
+    size_t len;
+    size_t size;
+    int error;
+} YPStrBuf;
+
+void yp_strbuf_init(YPStrBuf *buf);
+void yp_strbuf_reset(YPStrBuf *buf);
+void yp_strbuf_free(YPStrBuf *buf);
+void yp_strbuf_append(YPStrBuf *buf, const char *str, size_t len);
+void yp_strbuf_puts(YPStrBuf *buf, const char *str);
+void yp_strbuf_put_int(YPStrBuf *buf, int64_t value);
+// value / 1000 with exactly three decimals, e.g. 1500 -> "1.500"
+void yp_strbuf_put_milli(YPStrBuf *buf, int64_t value);
+// ISO 8601 duration, e.g. 5025500 ms -> "PT1H23M45.500S"
+void yp_strbuf_put_duration(YPStrBuf *buf, int64_t ms);
+
+#endif // YP_STRBUF_H_
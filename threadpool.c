@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+typedef struct YPJob {
+    YPJobFunc func;
+    void *arg;
+    struct YPJob *next;
+} YPJob;
+
+struct YPThreadPool {
+    pthread_mutex_t lock;
+    pthread_cond_t job_available;
+    pthread_cond_t job_done;
+    pthread_t *threads;
+    unsigned int nb_threads;
+    YPJob *head;
+    YPJob *tail;
+    // Jobs queued or running
+    unsigned int pending;
+    int error;
+    int quit;
+};
+
+static void *worker(void *opaque)
+{
+    YPThreadPool *pool = opaque;
+    YPJob *job;
+    int ret;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+
+        while (pool->head == NULL && !pool->quit)
+            pthread_cond_wait(&pool->job_available, &pool->lock);
+
+        if (pool->head == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        ret = job->func(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (ret < 0 && pool->error == 0)
+            pool->error = ret;
+        if (--pool->pending == 0)
+            pthread_cond_broadcast(&pool->job_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+YPThreadPool* yp_threadpool(unsigned int nb_threads)
+{
+    unsigned int i;
+    YPThreadPool *pool = (YPThreadPool *) malloc(sizeof(YPThreadPool));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->threads = (pthread_t *) malloc(nb_threads * sizeof(pthread_t));
+
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_available, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+    pool->nb_threads = 0;
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->pending = 0;
+    pool->error = 0;
+    pool->quit = 0;
+
+    for (i = 0; i < nb_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+            break;
+        pool->nb_threads++;
+    }
+
+    if (pool->nb_threads == 0) {
+        yp_threadpool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int yp_threadpool_submit(YPThreadPool *pool, YPJobFunc func, void *arg)
+{
+    YPJob *job = (YPJob *) malloc(sizeof(YPJob));
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    job->func = func;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->pending++;
+
+    pthread_cond_signal(&pool->job_available);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+int yp_threadpool_wait(YPThreadPool *pool)
+{
+    int ret;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+
+    ret = pool->error;
+    pool->error = 0;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return ret;
+}
+
+void yp_threadpool_free(YPThreadPool *pool)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->job_available);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job_available);
+    pthread_cond_destroy(&pool->job_done);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,14 @@
+#ifndef YP_THREADPOOL_H_
+#define YP_THREADPOOL_H_
+
+typedef struct YPThreadPool YPThreadPool;
+
+typedef int (*YPJobFunc)(void *arg);
+
+YPThreadPool* yp_threadpool(unsigned int nb_threads);
+int yp_threadpool_submit(YPThreadPool *pool, YPJobFunc func, void *arg);
+// Block until every submitted job has run. Returns the first job error, if any.
+int yp_threadpool_wait(YPThreadPool *pool);
+void yp_threadpool_free(YPThreadPool *pool);
+
+#endif // YP_THREADPOOL_H_
@@ -0,0 +1,74 @@
+#include "timeline.h"
+
+#define S_INDENT "\t\t\t\t\t\t"
+
+void yp_timeline_init(YPTimelineCache *cache)
+{
+    yp_strbuf_init(&cache->text);
+    cache->nb_segments = 0;
+}
+
+void yp_timeline_free(YPTimelineCache *cache)
+{
+    yp_strbuf_free(&cache->text);
+    cache->nb_segments = 0;
+}
+
+// One S element for segments [first, end), which all have the same duration
+static void put_s(YPStrBuf *out, const YPSegmentTable *segments,
+                  unsigned int first, unsigned int end, int64_t scale)
+{
+    yp_strbuf_puts(out, S_INDENT "<S ");
+
+    // First segment starts at the beginning of the period
+    if (first == 0) {
+        yp_strbuf_puts(out, "t=\"");
+        yp_strbuf_put_int(out, segments->start[0] * scale);
+        yp_strbuf_puts(out, "\" ");
+    }
+
+    yp_strbuf_puts(out, "d=\"");
+    yp_strbuf_put_int(out, segments->duration[first] * scale);
+
+    if (end - first > 1) {
+        yp_strbuf_puts(out, "\" r=\"");
+        yp_strbuf_put_int(out, end - first - 1);
+    }
+
+    yp_strbuf_puts(out, "\" />\n");
+}
+
+void yp_timeline_write(YPStrBuf *out, YPTimelineCache *cache,
+                       const YPSegmentTable *segments, int64_t scale)
+{
+    unsigned int i = cache->nb_segments;
+    unsigned int end;
+
+    while (i < segments->nb_segments) {
+        for (end = i + 1; end < segments->nb_segments &&
+                segments->duration[end] == segments->duration[i]; end++);
+
+        // The last run may still grow
+        if (end == segments->nb_segments)
+            break;
+
+        put_s(&cache->text, segments, i, end, scale);
+        i = end;
+    }
+
+    // A failed append would leave the cache short of S elements, start over
+    // next time instead
+    if (cache->text.error) {
+        yp_strbuf_reset(&cache->text);
+        cache->nb_segments = 0;
+        out->error = 1;
+        return;
+    }
+
+    cache->nb_segments = i;
+
+    yp_strbuf_append(out, cache->text.data, cache->text.len);
+
+    if (i < segments->nb_segments)
+        put_s(out, segments, i, segments->nb_segments, scale);
+}
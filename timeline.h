@@ -0,0 +1,23 @@
+#ifndef YP_TIMELINE_H_
+#define YP_TIMELINE_H_
+
+#include "segtable.h"
+#include "strbuf.h"
+
+// Serialized S elements of a SegmentTimeline. Segments are only ever
+// appended, so once a run of equal durations is followed by a segment of
+// another duration its S element is final and never formatted again.
+typedef struct YPTimelineCache {
+    YPStrBuf text;
+    // Segments covered by text
+    unsigned int nb_segments;
+} YPTimelineCache;
+
+void yp_timeline_init(YPTimelineCache *cache);
+void yp_timeline_free(YPTimelineCache *cache);
+// Append the S elements of segments to out, durations multiplied by scale.
+// Only segments added since the previous call get formatted.
+void yp_timeline_write(YPStrBuf *out, YPTimelineCache *cache,
+                       const YPSegmentTable *segments, int64_t scale);
+
+#endif // YP_TIMELINE_H_
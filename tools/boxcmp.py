@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+
+#
+# Compare ISO BMFF files box by box, e.g. the output of two packager runs.
+# Reports the first box that differs in each file, by path (moof/traf/trun)
+# and field offset, rather than a bare byte offset. Other files, e.g.
+# manifests, are compared byte for byte.
+#
+# Usage: tools/boxcmp.py <a> <b>
+#   where a and b are two files or two output directories
+#
+
+import os
+import struct
+import sys
+
+MP4_EXTENSIONS = ('.mp4', '.m4s', '.m4a', '.m4v', '.cmfv', '.cmfa')
+
+# Boxes made of boxes, see ISO/IEC 14496-12
+CONTAINERS = {b'moov', b'trak', b'mdia', b'minf', b'stbl', b'dinf', b'edts',
+              b'mvex', b'moof', b'traf', b'mfra', b'udta'}
+
+
+def boxes(data, start=0, end=None):
+    """Yield (type, offset, size, header size) of the boxes in data[start:end]."""
+    end = len(data) if end is None else end
+    pos = start
+    while pos < end:
+        if end - pos < 8:
+            raise ValueError('truncated box header at %d' % pos)
+        size, kind = struct.unpack('>I4s', data[pos:pos + 8])
+        header = 8
+        if size == 1:
+            size = struct.unpack('>Q', data[pos + 8:pos + 16])[0]
+            header = 16
+        elif size == 0:
+            size = end - pos
+        if size < header or pos + size > end:
+            raise ValueError('bad size %d for %s at %d' % (size, kind, pos))
+        yield kind, pos, size, header
+        pos += size
+
+
+def compare_boxes(a, b, path='', sa=0, ea=None, sb=0, eb=None):
+    """Return a description of the first difference, or None."""
+    la = list(boxes(a, sa, ea))
+    lb = list(boxes(b, sb, eb))
+
+    for i, (ba, bb) in enumerate(zip(la, lb)):
+        ka, pa, za, ha = ba
+        kb, pb, zb, hb = bb
+        name = '%s/%s[%d]' % (path, ka.decode('latin-1'), i)
+        if ka != kb:
+            return '%s: box type %s vs %s' % (name, ka, kb)
+        if za != zb:
+            return '%s: size %d vs %d' % (name, za, zb)
+        if ka in CONTAINERS:
+            diff = compare_boxes(a, b, name, pa + ha, pa + za, pb + hb, pb + zb)
+            if diff:
+                return diff
+        elif a[pa:pa + za] != b[pb:pb + zb]:
+            off = next(j for j in range(za) if a[pa + j] != b[pb + j])
+            return '%s: differs at byte %d of %d (file offset %d)' % (name, off, za, pa + off)
+
+    if len(la) != len(lb):
+        return '%s: %d boxes vs %d' % (path or '/', len(la), len(lb))
+
+    return None
+
+
+def compare_files(fa, fb):
+    with open(fa, 'rb') as f:
+        a = f.read()
+    with open(fb, 'rb') as f:
+        b = f.read()
+
+    if fa.endswith(MP4_EXTENSIONS):
+        try:
+            return compare_boxes(a, b)
+        except ValueError as e:
+            return 'not parsable: %s' % e
+
+    if a != b:
+        return 'contents differ'
+
+    return None
+
+
+def list_files(root):
+    files = set()
+    for dirpath, _, filenames in os.walk(root):
+        for name in filenames:
+            files.add(os.path.relpath(os.path.join(dirpath, name), root))
+    return files
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write('usage: %s <a> <b>\n' % sys.argv[0])
+        return 2
+
+    a, b = sys.argv[1:]
+
+    if os.path.isdir(a) and os.path.isdir(b):
+        files_a = list_files(a)
+        files_b = list_files(b)
+        pairs = [(os.path.join(a, f), os.path.join(b, f), f) for f in sorted(files_a & files_b)]
+        failed = len(files_a ^ files_b)
+        for f in sorted(files_a - files_b):
+            print('only in %s: %s' % (a, f))
+        for f in sorted(files_b - files_a):
+            print('only in %s: %s' % (b, f))
+    else:
+        pairs = [(a, b, a)]
+        failed = 0
+
+    for fa, fb, name in pairs:
+        diff = compare_files(fa, fb)
+        if diff:
+            print('%s: %s' % (name, diff))
+            failed += 1
+
+    if failed:
+        print('FAIL: %d of %d files differ' % (failed, len(pairs)))
+        return 1
+
+    print('OK: %d files match' % len(pairs))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Package the same inputs serially and with parallel options (--threads,
+# --shards), then check that both runs produced byte-identical output trees.
+#
+# Usage: tools/cmpruns.sh "<parallel options>" <packager arguments...>
+#   e.g. tools/cmpruns.sh "--threads 4" -i a.mp4 -i b.mp4 --segment-duration 2000
+#        tools/cmpruns.sh "--threads 8 --shards 8" -i long.mp4 --segment-duration 2000
+
+BIN=${BIN:-bin/segmenter}
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 \"<parallel options>\" <packager arguments...>" >&2
+    exit 2
+fi
+
+popts=$1
+shift
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir -p "$tmp/serial" "$tmp/parallel"
+
+"$BIN" "$@" -o "$tmp/serial" > "$tmp/serial.log" 2>&1 || {
+    echo "serial run failed, see log:" >&2; cat "$tmp/serial.log" >&2; exit 1; }
+"$BIN" "$@" -o "$tmp/parallel" $popts > "$tmp/parallel.log" 2>&1 || {
+    echo "parallel run failed, see log:" >&2; cat "$tmp/parallel.log" >&2; exit 1; }
+
+if diff -r "$tmp/serial" "$tmp/parallel"; then
+    echo "OK: outputs are byte-identical ($(find "$tmp/serial" -type f | wc -l) files)"
+else
+    echo "FAIL: serial and '$popts' outputs differ" >&2
+    exit 1
+fi
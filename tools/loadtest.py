@@ -0,0 +1,263 @@
+#!/usr/bin/env python3
+
+#
+# Load test for "ypackager serve": simulated viewers replay what DASH
+# players do against it and request latency is reported per request kind,
+# along with the packaging and CPU time the server reports per segment
+# (Server-Timing header).
+#
+# Every viewer picks a title (popular titles more often, Zipf distributed),
+# loads its manifest and init segments, then plays a session of consecutive
+# audio and video segments. Along the way it may seek to a random position
+# or switch to another video representation, which costs an init segment.
+#
+# Usage: tools/loadtest.py [options] <base url> <title> [<title>...]
+#   e.g. tools/loadtest.py --viewers 32 --duration 60 http://127.0.0.1:8080 movies/a.mp4 movies/b.mp4
+#
+
+import argparse
+import http.client
+import json
+import random
+import re
+import sys
+import threading
+import time
+import urllib.parse
+import xml.etree.ElementTree as ET
+
+NS = {'mpd': 'urn:mpeg:dash:schema:mpd:2011'}
+
+
+class Representation:
+    def __init__(self, rep_id, content_type, durations):
+        self.id = rep_id
+        self.content_type = content_type
+        # Seconds, one per segment
+        self.durations = durations
+
+
+def parse_manifest(data):
+    reps = []
+    root = ET.fromstring(data)
+
+    for aset in root.iter('{%s}AdaptationSet' % NS['mpd']):
+        content_type = aset.get('contentType')
+        for rep in aset.findall('mpd:Representation', NS):
+            tmpl = rep.find('mpd:SegmentTemplate', NS)
+            if tmpl is None:
+                tmpl = aset.find('mpd:SegmentTemplate', NS)
+            timescale = int(tmpl.get('timescale', '1'))
+            durations = []
+            timeline = tmpl.find('mpd:SegmentTimeline', NS)
+            if timeline is None:
+                raise ValueError('manifest without SegmentTimeline')
+            for s in timeline.findall('mpd:S', NS):
+                durations += [int(s.get('d')) / timescale] * (int(s.get('r', '0')) + 1)
+            reps.append(Representation(rep.get('id'), content_type, durations))
+
+    return reps
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.samples = {}
+
+    def add(self, kind, status, latency, size, timing):
+        with self.lock:
+            self.samples.setdefault(kind, []).append((status, latency, size, timing))
+
+
+def server_timing(header):
+    # "package;dur=12.345, cpu;dur=10.000, cache;desc=miss"
+    timing = {}
+    for name, dur in re.findall(r'(\w+);dur=([0-9.]+)', header or ''):
+        timing[name] = float(dur)
+    cache = re.search(r'cache;desc=(\w+)', header or '')
+    if cache:
+        timing['cache'] = cache.group(1)
+    return timing
+
+
+class Viewer(threading.Thread):
+    def __init__(self, args, titles, weights, stats, deadline, seed):
+        super().__init__(daemon=True)
+        self.args = args
+        self.titles = titles
+        self.weights = weights
+        self.stats = stats
+        self.deadline = deadline
+        self.rng = random.Random(seed)
+        url = urllib.parse.urlsplit(args.url)
+        self.host = url.hostname
+        self.port = url.port or 80
+        self.prefix = url.path.rstrip('/')
+        self.conn = None
+
+    def get(self, kind, path):
+        for attempt in range(2):
+            if self.conn is None:
+                self.conn = http.client.HTTPConnection(self.host, self.port, timeout=self.args.timeout)
+            start = time.monotonic()
+            try:
+                self.conn.request('GET', self.prefix + '/' + urllib.parse.quote(path))
+                res = self.conn.getresponse()
+                body = res.read()
+            except (http.client.HTTPException, OSError):
+                # Idle keep-alive connection closed by the server, retry once
+                self.conn.close()
+                self.conn = None
+                if attempt == 0:
+                    continue
+                self.stats.add(kind, 0, time.monotonic() - start, 0, {})
+                return None
+            latency = time.monotonic() - start
+            self.stats.add(kind, res.status, latency, len(body),
+                           server_timing(res.getheader('Server-Timing')))
+            if res.getheader('Connection', '').lower() == 'close':
+                self.conn.close()
+                self.conn = None
+            return body if res.status == 200 else None
+
+    def session(self):
+        args = self.args
+        rng = self.rng
+        title = rng.choices(self.titles, self.weights)[0]
+
+        data = self.get('manifest', title + '/manifest.mpd')
+        if data is None:
+            return
+        reps = parse_manifest(data)
+        video = [r for r in reps if r.content_type == 'video']
+        audio = [r for r in reps if r.content_type == 'audio'][:1]
+        if not video and not audio:
+            return
+
+        playing = ([rng.choice(video)] if video else []) + audio
+        for rep in playing:
+            self.get('init', '%s/%s/init.mp4' % (title, rep.id))
+
+        nb_segments = min(len(r.durations) for r in playing)
+        # Most viewers start at the beginning, some jump right in
+        num = 0 if rng.random() >= args.seek else rng.randrange(nb_segments)
+        # Geometric session length
+        left = 1
+        while rng.random() > 1.0 / args.session and left < nb_segments:
+            left += 1
+
+        while left > 0 and num < nb_segments and time.monotonic() < self.deadline:
+            start = time.monotonic()
+
+            for rep in playing:
+                self.get('segment', '%s/%s/seg-%d.m4s' % (title, rep.id, num + 1))
+
+            num += 1
+            left -= 1
+
+            if rng.random() < args.seek:
+                num = rng.randrange(nb_segments)
+            if video and len(video) > 1 and rng.random() < args.switch:
+                playing[0] = rng.choice(video)
+                self.get('init', '%s/%s/init.mp4' % (title, playing[0].id))
+
+            # A player with a full buffer fetches in real time
+            if args.speed > 0:
+                wait = playing[0].durations[num - 1] / args.speed - (time.monotonic() - start)
+                if wait > 0:
+                    time.sleep(wait)
+
+    def run(self):
+        while time.monotonic() < self.deadline:
+            self.session()
+        if self.conn:
+            self.conn.close()
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+def report(stats, elapsed):
+    summary = {}
+    print('%-9s %7s %6s %8s %8s %8s %8s %9s %9s %9s %6s' %
+          ('kind', 'count', 'errors', 'p50_ms', 'p90_ms', 'p99_ms', 'max_ms',
+           'avg_kb', 'pkg_ms', 'cpu_ms', 'hit%'))
+
+    for kind in ('manifest', 'init', 'segment'):
+        samples = stats.samples.get(kind, [])
+        ok = [s for s in samples if s[0] == 200]
+        lat = [s[1] * 1000 for s in ok]
+        pkg = [s[3]['package'] for s in ok if 'package' in s[3]]
+        cpu = [s[3]['cpu'] for s in ok if 'cpu' in s[3]]
+        cached = [s[3]['cache'] == 'hit' for s in ok if 'cache' in s[3]]
+        row = {
+            'count': len(samples),
+            'errors': len(samples) - len(ok),
+            'p50_ms': percentile(lat, 50),
+            'p90_ms': percentile(lat, 90),
+            'p99_ms': percentile(lat, 99),
+            'max_ms': max(lat) if lat else 0.0,
+            'avg_kb': sum(s[2] for s in ok) / 1024.0 / len(ok) if ok else 0.0,
+            'package_ms': sum(pkg) / len(pkg) if pkg else 0.0,
+            'cpu_ms': sum(cpu) / len(cpu) if cpu else 0.0,
+            # Served from the server's segment cache, or by waiting on
+            # another request packaging the same segment
+            'cache_hit_pct': 100.0 * sum(cached) / len(cached) if cached else 0.0,
+        }
+        summary[kind] = row
+        print('%-9s %7d %6d %8.2f %8.2f %8.2f %8.2f %9.1f %9.2f %9.2f %6.1f' %
+              (kind, row['count'], row['errors'], row['p50_ms'], row['p90_ms'],
+               row['p99_ms'], row['max_ms'], row['avg_kb'], row['package_ms'], row['cpu_ms'],
+               row['cache_hit_pct']))
+
+    total = sum(len(v) for v in stats.samples.values())
+    print('%d requests in %.1f s, %.1f req/s' % (total, elapsed, total / elapsed))
+    summary['requests_per_s'] = total / elapsed
+
+    return summary
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Replay player request patterns against ypackager serve')
+    parser.add_argument('url', help='server base URL, e.g. http://127.0.0.1:8080')
+    parser.add_argument('titles', nargs='+', help='title paths below the server root')
+    parser.add_argument('--viewers', type=int, default=16, help='concurrent viewers (default: 16)')
+    parser.add_argument('--duration', type=float, default=30, help='test duration in seconds (default: 30)')
+    parser.add_argument('--zipf', type=float, default=1.0, help='title popularity skew, 0 for uniform (default: 1.0)')
+    parser.add_argument('--session', type=float, default=20, help='mean segments played per session (default: 20)')
+    parser.add_argument('--seek', type=float, default=0.05, help='probability to seek, at start and after each segment (default: 0.05)')
+    parser.add_argument('--switch', type=float, default=0.05, help='probability to switch video representation after each segment (default: 0.05)')
+    parser.add_argument('--speed', type=float, default=0, help='fetch segments at this many times real time, 0 for as fast as possible (default: 0)')
+    parser.add_argument('--timeout', type=float, default=30, help='request timeout in seconds (default: 30)')
+    parser.add_argument('--seed', type=int, default=0, help='random seed, for reproducible runs (default: 0)')
+    parser.add_argument('--json', help='also write the summary to this file')
+    args = parser.parse_args()
+
+    weights = [1.0 / (i + 1) ** args.zipf for i in range(len(args.titles))]
+    stats = Stats()
+    start = time.monotonic()
+    deadline = start + args.duration
+    viewers = [Viewer(args, args.titles, weights, stats, deadline, args.seed * 1000 + i)
+               for i in range(args.viewers)]
+
+    for v in viewers:
+        v.start()
+    for v in viewers:
+        v.join()
+
+    summary = report(stats, time.monotonic() - start)
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(summary, f, indent=2)
+
+    errors = sum(row['errors'] for kind, row in summary.items() if isinstance(row, dict))
+    return 1 if errors else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+
+#
+# Stand-in origin for the http sinks: objects PUT or POSTed below / are
+# stored as files below a directory and can be read back with GET.
+# Connections are kept alive and pipelined requests are answered in order,
+# like a real origin would. On exit, counts of connections, requests and
+# bytes are printed, and written as JSON with --stats.
+#
+# Usage: tools/origin.py [--port 8090] [--root origin] [--stats file]
+#                        [--close-every n] [--fail-every n]
+#   e.g. tools/origin.py --root /tmp/origin &
+#        bin/segmenter -i data/sample.mp4 --segment-duration 2000 \
+#            --sink http -o http://127.0.0.1:8090/live
+#
+# --close-every and --fail-every drop the connection after every n-th
+# request and answer every n-th request with a 503, to check that clients
+# reconnect and report failures.
+#
+
+import argparse
+import json
+import os
+import signal
+import sys
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.connections = 0
+        self.requests = 0
+        self.objects = 0
+        self.bytes = 0
+        self.failed = 0
+        self.closed = 0
+
+    def as_dict(self):
+        with self.lock:
+            return {
+                'connections': self.connections,
+                'requests': self.requests,
+                'objects': self.objects,
+                'bytes': self.bytes,
+                'failed': self.failed,
+                'closed': self.closed,
+            }
+
+
+class OriginHandler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def setup(self):
+        super().setup()
+        with self.server.stats.lock:
+            self.server.stats.connections += 1
+
+    def log_message(self, fmt, *args):
+        if self.server.verbose:
+            super().log_message(fmt, *args)
+
+    def path_on_disk(self):
+        path = os.path.normpath(self.path.split('?', 1)[0]).lstrip('/')
+        if path.startswith('..'):
+            return None
+        return os.path.join(self.server.root, path)
+
+    def reply(self, status, body=b'', content_type='text/plain'):
+        self.send_response(status)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        if self.close_connection:
+            self.send_header('Connection', 'close')
+        self.end_headers()
+        self.wfile.write(body)
+
+    def count_request(self):
+        stats = self.server.stats
+        with stats.lock:
+            stats.requests += 1
+            n = stats.requests
+        if self.server.close_every and n % self.server.close_every == 0:
+            self.close_connection = True
+            with stats.lock:
+                stats.closed += 1
+        return n
+
+    def store(self):
+        n = self.count_request()
+        length = int(self.headers.get('Content-Length', 0))
+        data = self.rfile.read(length)
+        path = self.path_on_disk()
+
+        if self.server.fail_every and n % self.server.fail_every == 0:
+            with self.server.stats.lock:
+                self.server.stats.failed += 1
+            self.reply(503, b'unavailable\n')
+            return
+
+        if path is None:
+            self.reply(403, b'forbidden\n')
+            return
+
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        # Readers of the origin never see a partial object
+        part = '%s.%d.part' % (path, threading.get_ident())
+        with open(part, 'wb') as f:
+            f.write(data)
+        os.replace(part, path)
+
+        with self.server.stats.lock:
+            self.server.stats.objects += 1
+            self.server.stats.bytes += length
+
+        self.reply(201)
+
+    def do_PUT(self):
+        self.store()
+
+    def do_POST(self):
+        self.store()
+
+    def do_GET(self):
+        self.count_request()
+        path = self.path_on_disk()
+        if path is None or not os.path.isfile(path):
+            self.reply(404, b'not found\n')
+            return
+        with open(path, 'rb') as f:
+            self.reply(200, f.read(), 'application/octet-stream')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Stand-in origin accepting uploads')
+    parser.add_argument('--port', type=int, default=8090)
+    parser.add_argument('--root', default='origin', help='directory objects are stored below')
+    parser.add_argument('--stats', help='write counters to this file as JSON on exit')
+    parser.add_argument('--close-every', type=int, default=0, metavar='N')
+    parser.add_argument('--fail-every', type=int, default=0, metavar='N')
+    parser.add_argument('--verbose', action='store_true', help='log every request')
+    args = parser.parse_args()
+
+    os.makedirs(args.root, exist_ok=True)
+
+    server = ThreadingHTTPServer(('127.0.0.1', args.port), OriginHandler)
+    server.daemon_threads = True
+    server.root = args.root
+    server.stats = Stats()
+    server.close_every = args.close_every
+    server.fail_every = args.fail_every
+    server.verbose = args.verbose
+
+    def stop(signum, frame):
+        threading.Thread(target=server.shutdown).start()
+
+    signal.signal(signal.SIGTERM, stop)
+    signal.signal(signal.SIGINT, stop)
+
+    print('origin: serving %s on port %d' % (args.root, args.port), file=sys.stderr)
+    server.serve_forever()
+
+    stats = server.stats.as_dict()
+    print('origin: %(connections)d connections, %(requests)d requests, %(objects)d objects, '
+          '%(bytes)d bytes, %(failed)d failed, %(closed)d closed' % stats, file=sys.stderr)
+
+    if args.stats:
+        with open(args.stats, 'w') as f:
+            json.dump(stats, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
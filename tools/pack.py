@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+
+#
+# Reader of the archives written with "--sink tar". They are plain tar
+# files, ending with an index of where the data of the last version of
+# every object starts (pack.idx), located by a fixed size trailer member
+# (pack.end). Objects are read in place, without extracting the archive.
+#
+# Usage: tools/pack.py list <pack>
+#        tools/pack.py cat <pack> <name> [<offset> [<length>]]
+#        tools/pack.py extract <pack> <dir> [<name>...]
+#        tools/pack.py serve [--port 8092] <pack>
+#   e.g. tools/pack.py cat out.tar 0/seg-3.m4s > seg-3.m4s
+#        tools/pack.py serve out.tar   # GET /manifest.mpd, Range supported
+#
+# Archives without an index, e.g. from an interrupted run, are indexed by
+# walking their tar headers instead.
+#
+
+import argparse
+import os
+import re
+import sys
+import tarfile
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+BLOCK = 512
+MAGIC = b'YPPACK1'
+INDEX_NAME = 'pack.idx'
+TRAILER_NAME = 'pack.end'
+
+CONTENT_TYPES = {
+    '.mpd': 'application/dash+xml',
+    '.m3u8': 'application/vnd.apple.mpegurl',
+    '.m4s': 'video/iso.segment',
+    '.mp4': 'video/mp4',
+}
+
+
+class Pack:
+    def __init__(self, path):
+        self.path = path
+        self.f = open(path, 'rb')
+        self.entries = self.read_index()
+        if self.entries is None:
+            self.entries = self.scan()
+
+    def read_index(self):
+        # Trailer header and data, then two empty blocks
+        size = os.fstat(self.f.fileno()).st_size
+        pos = size - 4 * BLOCK
+        if pos < 0:
+            return None
+        self.f.seek(pos)
+        header = self.f.read(BLOCK)
+        trailer = self.f.read(BLOCK)
+        if header[:len(TRAILER_NAME) + 1] != TRAILER_NAME.encode() + b'\0' or not trailer.startswith(MAGIC):
+            return None
+        fields = trailer.split(b'\0', 1)[0].split()
+        offset, length = int(fields[1]), int(fields[2])
+        self.f.seek(offset)
+        entries = {}
+        for line in self.f.read(length).decode().splitlines():
+            offset, length, name = line.split(' ', 2)
+            entries[name] = (int(offset), int(length))
+        return entries
+
+    def scan(self):
+        entries = {}
+        with tarfile.open(self.path, 'r:') as tar:
+            for member in tar:
+                if member.isfile() and member.name not in (INDEX_NAME, TRAILER_NAME):
+                    # Later versions replace earlier ones
+                    entries[member.name] = (member.offset_data, member.size)
+        return entries
+
+    def read(self, name, start=0, length=None):
+        offset, size = self.entries[name]
+        start = min(max(start, 0), size)
+        end = size if length is None else min(size, start + length)
+        self.f.seek(offset + start)
+        return self.f.read(end - start)
+
+
+def cmd_list(pack, args):
+    for name in sorted(pack.entries):
+        offset, size = pack.entries[name]
+        print('%12d %10d %s' % (offset, size, name))
+
+
+def cmd_cat(pack, args):
+    if args.name not in pack.entries:
+        sys.exit('%s: no such object' % args.name)
+    sys.stdout.buffer.write(pack.read(args.name, args.offset, args.length))
+
+
+def cmd_extract(pack, args):
+    for name in args.names or sorted(pack.entries):
+        if name not in pack.entries:
+            sys.exit('%s: no such object' % name)
+        path = os.path.join(args.dir, os.path.normpath(name).lstrip('/'))
+        os.makedirs(os.path.dirname(path) or '.', exist_ok=True)
+        offset, size = pack.entries[name]
+        pack.f.seek(offset)
+        with open(path, 'wb') as out:
+            remaining = size
+            while remaining > 0:
+                chunk = pack.f.read(min(remaining, 1 << 20))
+                out.write(chunk)
+                remaining -= len(chunk)
+
+
+class PackHandler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def send_object(self, head):
+        name = self.path.split('?', 1)[0].lstrip('/')
+        pack = self.server.pack
+        if name not in pack.entries:
+            self.send_response(404)
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+
+        size = pack.entries[name][1]
+        start, end = 0, size - 1
+        status = 200
+        m = re.match(r'bytes=(\d*)-(\d*)$', self.headers.get('Range', ''))
+        if m and (m.group(1) or m.group(2)):
+            if m.group(1):
+                start = int(m.group(1))
+                end = int(m.group(2)) if m.group(2) else size - 1
+            else:
+                start = max(size - int(m.group(2)), 0)
+            end = min(end, size - 1)
+            if start > end:
+                self.send_response(416)
+                self.send_header('Content-Range', 'bytes */%d' % size)
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            status = 206
+
+        # One reader at a time on the shared file object
+        with self.server.lock:
+            data = b'' if head else pack.read(name, start, end - start + 1)
+
+        self.send_response(status)
+        self.send_header('Content-Type', CONTENT_TYPES.get(os.path.splitext(name)[1], 'application/octet-stream'))
+        self.send_header('Content-Length', str(end - start + 1))
+        self.send_header('Accept-Ranges', 'bytes')
+        self.send_header('Access-Control-Allow-Origin', '*')
+        if status == 206:
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, end, size))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_GET(self):
+        self.send_object(False)
+
+    def do_HEAD(self):
+        self.send_object(True)
+
+
+def cmd_serve(pack, args):
+    server = ThreadingHTTPServer(('127.0.0.1', args.port), PackHandler)
+    server.daemon_threads = True
+    server.pack = pack
+    server.lock = threading.Lock()
+    print('pack: serving %d objects of %s on port %d' % (len(pack.entries), pack.path, args.port),
+          file=sys.stderr)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Read archives written with --sink tar')
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    p = sub.add_parser('list', help='list objects with the offset and size of their data')
+    p.add_argument('pack')
+    p.set_defaults(func=cmd_list)
+
+    p = sub.add_parser('cat', help='write (a byte range of) an object to stdout')
+    p.add_argument('pack')
+    p.add_argument('name')
+    p.add_argument('offset', type=int, nargs='?', default=0)
+    p.add_argument('length', type=int, nargs='?')
+    p.set_defaults(func=cmd_cat)
+
+    p = sub.add_parser('extract', help='extract the last version of objects below dir')
+    p.add_argument('pack')
+    p.add_argument('dir')
+    p.add_argument('names', nargs='*')
+    p.set_defaults(func=cmd_extract)
+
+    p = sub.add_parser('serve', help='serve objects over HTTP, with byte ranges')
+    p.add_argument('--port', type=int, default=8092)
+    p.add_argument('pack')
+    p.set_defaults(func=cmd_serve)
+
+    args = parser.parse_args()
+    args.func(Pack(args.pack), args)
+
+
+if __name__ == '__main__':
+    main()
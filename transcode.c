@@ -0,0 +1,480 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+
+#include "transcode.h"
+#include "muxer.h"
+#include "threadpool.h"
+#include "log.h"
+
+typedef struct Rung {
+    struct Transcoder *tc;
+    int width;
+    int height;
+    int64_t bit_rate;
+    struct SwsContext *sws;
+    AVCodecContext *enc;
+    // Scaled picture, refilled for every source frame
+    AVFrame *frame;
+    AVPacket *pkt;
+    YPInputStream *instream;
+    YPMuxerClass *muxer;
+    uint64_t nb_packets;
+    // Microseconds, encode time includes muxing
+    int64_t scale_time;
+    int64_t encode_time;
+} Rung;
+
+typedef struct Transcoder {
+    // Source stream, as registered on the demuxer
+    YPInputStream instream;
+    AVCodecContext *dec;
+    // Last decoded frame, read by every rung
+    AVFrame *frame;
+    // Key frame forced on the current frame
+    int force_key;
+    // Input ended, rungs flush their encoders
+    int draining;
+    int64_t last_key_pts;
+    // Segment duration in microseconds
+    int64_t segment_duration;
+    // Input the rungs are packaged from, stream i is rung i
+    AVFormatContext *ctx;
+    unsigned int nb_rungs;
+    Rung *rungs;
+    // Rungs are encoded in parallel, NULL with a single rung
+    YPThreadPool *pool;
+    uint64_t nb_frames;
+    int64_t decode_time;
+} Transcoder;
+
+int yp_ladder_parse(const char *spec, YPRung **rungs, unsigned int *nb_rungs)
+{
+    const char *p = spec;
+    char *end;
+    long height, kbps;
+    unsigned int n = 1;
+    YPRung *r;
+
+    for (p = spec; *p; p++) {
+        if (*p == ',')
+            n++;
+    }
+
+    if ((r = calloc(n, sizeof(YPRung))) == NULL)
+        return -1;
+
+    for (p = spec, n = 0; ; n++) {
+        height = strtol(p, &end, 10);
+
+        if (end == p || *end != ':' || height <= 0 || height > 8192)
+            goto fail;
+
+        p = end + 1;
+        kbps = strtol(p, &end, 10);
+
+        if (end == p || (*end != ',' && *end != '\0') || kbps <= 0)
+            goto fail;
+
+        // Encoders want even dimensions for 4:2:0
+        r[n].height = (int) height & ~1;
+        r[n].bit_rate = (int64_t) kbps * 1000;
+
+        if (*end == '\0')
+            break;
+        p = end + 1;
+    }
+
+    *rungs = r;
+    *nb_rungs = n + 1;
+
+    return 0;
+
+fail:
+    free(r);
+    return -1;
+}
+
+// Frame through the scaler and encoder of a rung, NULL to flush the encoder
+static int encode_rung(void *arg)
+{
+    Rung *r = arg;
+    Transcoder *tc = r->tc;
+    AVFrame *src = tc->draining ? NULL : tc->frame;
+    int64_t start = av_gettime_relative();
+    int ret;
+
+    if (src) {
+        r->sws = sws_getCachedContext(r->sws, src->width, src->height, src->format,
+                                      r->width, r->height, r->enc->pix_fmt,
+                                      SWS_BICUBIC, NULL, NULL, NULL);
+
+        // The encoder may still hold the previous picture
+        if (r->sws == NULL || (ret = av_frame_make_writable(r->frame)) < 0)
+            return -1;
+
+        sws_scale(r->sws, (const uint8_t * const *) src->data, src->linesize, 0, src->height,
+                  r->frame->data, r->frame->linesize);
+
+        r->frame->pts = src->pts;
+        r->frame->pict_type = tc->force_key ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        r->scale_time += av_gettime_relative() - start;
+        start = av_gettime_relative();
+    }
+
+    if ((ret = avcodec_send_frame(r->enc, src ? r->frame : NULL)) < 0)
+        return ret;
+
+    while ((ret = avcodec_receive_packet(r->enc, r->pkt)) >= 0) {
+        r->nb_packets++;
+        ret = r->muxer->handle_packet(r->muxer, r->instream, r->pkt);
+        av_packet_unref(r->pkt);
+
+        if (ret < 0)
+            return ret;
+    }
+
+    r->encode_time += av_gettime_relative() - start;
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Hand the decoded frame, or the end of the stream, to every rung
+static int encode_frame(Transcoder *tc)
+{
+    unsigned int i;
+    int ret = 0;
+
+    if (tc->nb_rungs == 1)
+        return encode_rung(&tc->rungs[0]);
+
+    for (i = 0; i < tc->nb_rungs; i++) {
+        if (yp_threadpool_submit(tc->pool, encode_rung, &tc->rungs[i]) < 0)
+            ret = -1;
+    }
+
+    if (yp_threadpool_wait(tc->pool) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+/**
+ * Decode pkt, NULL to drain the decoder, and encode what comes out. Key
+ * frames are forced on the first frame at least a segment duration after
+ * the previous one, which is where the muxers cut.
+ */
+static int decode_packet(Transcoder *tc, AVPacket *pkt)
+{
+    AVStream *st = tc->instream.ctx->streams[tc->instream.stream_idx];
+    int64_t start = av_gettime_relative();
+    int ret;
+
+    if ((ret = avcodec_send_packet(tc->dec, pkt)) < 0 && ret != AVERROR_EOF)
+        return ret;
+
+    while (1) {
+        ret = avcodec_receive_frame(tc->dec, tc->frame);
+        tc->decode_time += av_gettime_relative() - start;
+
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        if (ret < 0)
+            return ret;
+
+        tc->frame->pts = tc->frame->best_effort_timestamp;
+
+        if (tc->frame->pts == AV_NOPTS_VALUE) {
+            yp_log(YP_LOG_TRANSCODE, YP_LOG_DEBUG, "Dropping frame without timestamp\n");
+            av_frame_unref(tc->frame);
+            start = av_gettime_relative();
+            continue;
+        }
+
+        tc->force_key = tc->last_key_pts == AV_NOPTS_VALUE ||
+                        yp_segment_duration_reached(tc->last_key_pts, tc->frame->pts,
+                                                    st->time_base, tc->segment_duration);
+        if (tc->force_key)
+            tc->last_key_pts = tc->frame->pts;
+
+        tc->nb_frames++;
+        ret = encode_frame(tc);
+        av_frame_unref(tc->frame);
+
+        if (ret < 0)
+            return ret;
+
+        start = av_gettime_relative();
+    }
+}
+
+static int transcoder_init(YPMuxerClass *self, YPConfig *config, int instream_index)
+{
+    // Codecs are opened by yp_transcoder(), the manifest needs their
+    // parameters before muxers are initialized
+    return 0;
+}
+
+static int transcoder_handle_packet(YPMuxerClass *self, YPInputStream *instream, AVPacket *pkt)
+{
+    Transcoder *tc = self->opaque;
+    int ret;
+
+    if ((ret = decode_packet(tc, pkt)) < 0)
+        yp_log(YP_LOG_TRANSCODE, YP_LOG_ERROR, "Transcoding stream #%d of %s failed: %s\n",
+               tc->instream.stream_idx, tc->instream.filename, av_err2str(ret));
+
+    return ret;
+}
+
+static int transcoder_finalize(YPMuxerClass *self)
+{
+    Transcoder *tc = self->opaque;
+    unsigned int i;
+    int ret;
+
+    // Frames held back by the decoder, then by the encoders
+    ret = decode_packet(tc, NULL);
+
+    if (ret >= 0) {
+        tc->draining = 1;
+        ret = encode_frame(tc);
+    }
+
+    yp_log(YP_LOG_TRANSCODE, YP_LOG_INFO, "Stream #%d of %s: %"PRIu64" frames decoded in %.3f s\n",
+           tc->instream.stream_idx, tc->instream.filename, tc->nb_frames, tc->decode_time / 1000000.0);
+
+    for (i = 0; i < tc->nb_rungs; i++) {
+        Rung *r = &tc->rungs[i];
+
+        if (r->muxer && r->muxer->finalize(r->muxer) < 0)
+            ret = -1;
+
+        yp_log(YP_LOG_TRANSCODE, YP_LOG_INFO, "  %dx%d %"PRId64" kbit/s: %"PRIu64" packets, "
+               "scaled in %.3f s, encoded in %.3f s\n",
+               r->width, r->height, r->bit_rate / 1000, r->nb_packets,
+               r->scale_time / 1000000.0, r->encode_time / 1000000.0);
+    }
+
+    return ret;
+}
+
+static int open_rung(Transcoder *tc, Rung *r, YPConfig *config)
+{
+    AVStream *in = tc->instream.ctx->streams[tc->instream.stream_idx];
+    AVCodecParameters *par = in->codecpar;
+    AVRational sar = par->sample_aspect_ratio.num > 0 ? par->sample_aspect_ratio : (AVRational) { 1, 1 };
+    AVRational frame_rate = in->avg_frame_rate.num > 0 ? in->avg_frame_rate : in->r_frame_rate;
+    AVCodec *codec;
+    AVStream *st;
+    int64_t frames_per_segment;
+    int ret;
+
+    // Same display aspect ratio with square pixels
+    r->width = (int) av_rescale(r->height, (int64_t) par->width * sar.num, (int64_t) par->height * sar.den) & ~1;
+
+    if ((codec = avcodec_find_encoder_by_name("libx264")) == NULL &&
+            (codec = avcodec_find_encoder(AV_CODEC_ID_H264)) == NULL) {
+        yp_log(YP_LOG_TRANSCODE, YP_LOG_ERROR, "No H.264 encoder available\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    if ((r->enc = avcodec_alloc_context3(codec)) == NULL)
+        return AVERROR(ENOMEM);
+
+    frames_per_segment = frame_rate.num > 0 ?
+                         av_rescale(config->seg_duration, frame_rate.num, (int64_t) frame_rate.den * 1000) : 0;
+
+    r->enc->width = r->width;
+    r->enc->height = r->height;
+    r->enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    r->enc->sample_aspect_ratio = (AVRational) { 1, 1 };
+    // Packets keep the timestamps of the source frames
+    r->enc->time_base = in->time_base;
+    r->enc->framerate = frame_rate;
+    r->enc->bit_rate = r->bit_rate;
+    r->enc->rc_max_rate = r->bit_rate;
+    r->enc->rc_buffer_size = (int) FFMIN(r->bit_rate * 2, INT_MAX);
+    // Segment boundaries get forced key frames, keep the encoder from
+    // placing its own in between
+    r->enc->gop_size = (int) FFMAX(frames_per_segment * 2, 12);
+    r->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    // Rungs already run in parallel
+    r->enc->thread_count = 1;
+
+    // libx264 only, other encoders don't know these options
+    av_opt_set(r->enc->priv_data, "preset", "veryfast", 0);
+    av_opt_set(r->enc->priv_data, "forced-idr", "1", 0);
+
+    if ((ret = avcodec_open2(r->enc, codec, NULL)) < 0) {
+        yp_log(YP_LOG_TRANSCODE, YP_LOG_ERROR, "Cannot open encoder for %dx%d: %s\n",
+               r->width, r->height, av_err2str(ret));
+        return ret;
+    }
+
+    if ((r->frame = av_frame_alloc()) == NULL || (r->pkt = av_packet_alloc()) == NULL)
+        return AVERROR(ENOMEM);
+
+    r->frame->width = r->width;
+    r->frame->height = r->height;
+    r->frame->format = r->enc->pix_fmt;
+
+    if ((ret = av_frame_get_buffer(r->frame, 32)) < 0)
+        return ret;
+
+    // What the muxer and the manifest see of the rung
+    if ((st = avformat_new_stream(tc->ctx, NULL)) == NULL)
+        return AVERROR(ENOMEM);
+
+    if ((ret = avcodec_parameters_from_context(st->codecpar, r->enc)) < 0)
+        return ret;
+
+    st->time_base = r->enc->time_base;
+    st->avg_frame_rate = frame_rate;
+    st->sample_aspect_ratio = r->enc->sample_aspect_ratio;
+    // Sizes the sidx reserved with --single-file
+    if (in->duration != AV_NOPTS_VALUE)
+        st->duration = av_rescale_q(in->duration, in->time_base, st->time_base);
+
+    return 0;
+}
+
+YPMuxerClass* yp_transcoder(YPConfig *config, YPDemuxer *demuxer, int stream_idx,
+                            const YPRung *rungs, unsigned int nb_rungs)
+{
+    YPMuxerClass *self;
+    Transcoder *tc;
+    AVStream *st = demuxer->ctx->streams[stream_idx];
+    AVCodec *codec;
+    unsigned int i;
+    int ret;
+
+    if ((self = calloc(1, sizeof(YPMuxerClass))) == NULL)
+        return NULL;
+
+    if ((tc = calloc(1, sizeof(Transcoder))) == NULL) {
+        free(self);
+        return NULL;
+    }
+
+    self->opaque = tc;
+    self->init = &transcoder_init;
+    self->handle_packet = &transcoder_handle_packet;
+    self->finalize = &transcoder_finalize;
+
+    tc->instream.filename = demuxer->filename;
+    tc->instream.ctx = demuxer->ctx;
+    tc->instream.stream_idx = stream_idx;
+    tc->instream.is_video = 1;
+    tc->last_key_pts = AV_NOPTS_VALUE;
+    tc->segment_duration = (int64_t) config->seg_duration * 1000;
+
+    if ((codec = avcodec_find_decoder(st->codecpar->codec_id)) == NULL) {
+        yp_log(YP_LOG_TRANSCODE, YP_LOG_ERROR, "No decoder for stream #%d of %s (%s)\n",
+               stream_idx, demuxer->filename, avcodec_get_name(st->codecpar->codec_id));
+        goto fail;
+    }
+
+    if ((tc->dec = avcodec_alloc_context3(codec)) == NULL ||
+            avcodec_parameters_to_context(tc->dec, st->codecpar) < 0 ||
+            (tc->frame = av_frame_alloc()) == NULL)
+        goto fail;
+
+    tc->dec->pkt_timebase = st->time_base;
+    // Decoding is done once for every rung, give it every core
+    tc->dec->thread_count = 0;
+
+    if ((ret = avcodec_open2(tc->dec, codec, NULL)) < 0) {
+        yp_log(YP_LOG_TRANSCODE, YP_LOG_ERROR, "Cannot open decoder for stream #%d of %s: %s\n",
+               stream_idx, demuxer->filename, av_err2str(ret));
+        goto fail;
+    }
+
+    if ((tc->ctx = avformat_alloc_context()) == NULL ||
+            (tc->rungs = calloc(nb_rungs, sizeof(Rung))) == NULL)
+        goto fail;
+
+    // Muxers copy these from their input
+    tc->ctx->flags = demuxer->ctx->flags;
+    tc->ctx->avoid_negative_ts = demuxer->ctx->avoid_negative_ts;
+    tc->ctx->interrupt_callback = demuxer->ctx->interrupt_callback;
+    tc->ctx->duration = demuxer->ctx->duration;
+
+    tc->nb_rungs = nb_rungs;
+
+    for (i = 0; i < nb_rungs; i++) {
+        tc->rungs[i].tc = tc;
+        tc->rungs[i].height = rungs[i].height;
+        tc->rungs[i].bit_rate = rungs[i].bit_rate;
+
+        if (open_rung(tc, &tc->rungs[i], config) < 0)
+            goto fail;
+    }
+
+    if (nb_rungs > 1 && (tc->pool = yp_threadpool(nb_rungs)) == NULL)
+        goto fail;
+
+    if (yp_demuxer_add_output(demuxer, &tc->instream, self) < 0)
+        goto fail;
+
+    return self;
+
+fail:
+    yp_transcoder_free(self);
+    return NULL;
+}
+
+int yp_transcoder_add_output(YPMuxerClass *self, unsigned int idx, YPInputStream *instream,
+                             YPMuxerClass *muxer)
+{
+    Transcoder *tc = self->opaque;
+
+    if (idx >= tc->nb_rungs)
+        return -1;
+
+    instream->filename = tc->instream.filename;
+    instream->ctx = tc->ctx;
+    instream->stream_idx = idx;
+    instream->is_video = 1;
+    instream->is_audio = 0;
+    instream->range = NULL;
+    instream->stats = NULL;
+    instream->in_band_ps = 0;
+
+    tc->rungs[idx].instream = instream;
+    tc->rungs[idx].muxer = muxer;
+
+    return 0;
+}
+
+void yp_transcoder_free(YPMuxerClass *self)
+{
+    Transcoder *tc = self->opaque;
+    unsigned int i;
+
+    if (tc->pool)
+        yp_threadpool_free(tc->pool);
+
+    for (i = 0; i < tc->nb_rungs; i++) {
+        sws_freeContext(tc->rungs[i].sws);
+        avcodec_free_context(&tc->rungs[i].enc);
+        av_frame_free(&tc->rungs[i].frame);
+        av_packet_free(&tc->rungs[i].pkt);
+    }
+
+    // Also frees the rung streams
+    if (tc->ctx)
+        avformat_free_context(tc->ctx);
+
+    avcodec_free_context(&tc->dec);
+    av_frame_free(&tc->frame);
+    free(tc->rungs);
+    free(tc);
+    free(self);
+}
@@ -0,0 +1,31 @@
+#ifndef YP_TRANSCODE_H_
+#define YP_TRANSCODE_H_
+
+#include "common.h"
+#include "demux.h"
+
+// One rendition of a transcoding ladder
+typedef struct YPRung {
+    int height;
+    int64_t bit_rate;
+} YPRung;
+
+// Parse a ladder such as "1080:5000,720:2800,480:1200", heights and
+// bitrates in kbit/s
+int yp_ladder_parse(const char *spec, YPRung **rungs, unsigned int *nb_rungs);
+
+/**
+ * Transcoder of video stream stream_idx of demuxer, registered on it like a
+ * muxer. Packets are decoded once, every frame is then scaled and encoded
+ * for all rungs in parallel, with keyframes forced where the muxers cut
+ * segments, so that segments of every rung line up. Encoded packets go to
+ * the muxers set with yp_transcoder_add_output().
+ */
+YPMuxerClass* yp_transcoder(YPConfig *config, YPDemuxer *demuxer, int stream_idx,
+                            const YPRung *rungs, unsigned int nb_rungs);
+// Fill instream with the encoded stream of rung idx, to be packaged by muxer
+int yp_transcoder_add_output(YPMuxerClass *self, unsigned int idx, YPInputStream *instream,
+                             YPMuxerClass *muxer);
+void yp_transcoder_free(YPMuxerClass *self);
+
+#endif // YP_TRANSCODE_H_
@@ -1,7 +1,11 @@
 #include "utils.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avstring.h>
+#include <libavutil/intreadwrite.h>
 
 int mkdir_p(const char *path)
 {
@@ -36,3 +40,55 @@ int mkdir_p(const char *path)
     free(temp);
     return ret;
 }
+
+// Whether path designates a network resource (http://...) rather than a
+// local file
+int is_url(const char *path)
+{
+    return strstr(path, "://") != NULL;
+}
+
+/**
+ * Split an input specification of the form "<file>[#<stream index>]" into
+ * its file name and stream index. The stream index defaults to 0.
+ */
+int parse_input_spec(const char *spec, char *filename, int size, int *stream_idx)
+{
+    const char *sep = strrchr(spec, '#');
+    char *end = NULL;
+    long idx = 0;
+    int len;
+
+    if (sep == NULL) {
+        *stream_idx = 0;
+        return snprintf(filename, size, "%s", spec) < size ? 0 : -1;
+    }
+
+    idx = strtol(sep + 1, &end, 10);
+
+    if (end == sep + 1 || *end != '\0' || idx < 0) {
+        return -1;
+    }
+
+    len = (int) (sep - spec);
+
+    if (len >= size) {
+        return -1;
+    }
+
+    memcpy(filename, spec, len);
+    filename[len] = '\0';
+    *stream_idx = (int) idx;
+
+    return 0;
+}
+
+void set_rfc6381_codec_name(const AVCodecParameters *codec_par, char *buf, int size)
+{
+    AV_WL32(buf, codec_par->codec_tag);
+    buf[4] = '\0';
+    av_strlcatf(buf, size, ".%02x%02x%02x",
+            codec_par->extradata[1],  // profile_idc
+            codec_par->extradata[2],  // profile compatibility
+            codec_par->extradata[3]); // level_idc
+}
@@ -1,7 +1,13 @@
 #ifndef YP_UTILS_H_
 #define YP_UTILS_H_
 
+struct AVCodecParameters;
+
 int mkdir_p(const char *path);
+int is_url(const char *path);
+int parse_input_spec(const char *spec, char *filename, int size, int *stream_idx);
+// Codec of codec_par as used in DASH and HLS "codecs" attributes
+void set_rfc6381_codec_name(const struct AVCodecParameters *codec_par, char *buf, int size);
 
 #endif // YP_UTILS_H_
 
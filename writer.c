@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "writer.h"
+#include "log.h"
+
+enum {
+    WRITE_JOB_OPEN,
+    WRITE_JOB_WRITE,
+    WRITE_JOB_CLOSE,
+};
+
+struct YPWriterFile {
+    char *filename;
+    int fd;
+    // First error met on this file, later jobs are skipped
+    int error;
+    unsigned int queue;
+};
+
+typedef struct WriteJob {
+    int type;
+    YPWriterFile *file;
+    uint8_t *data;
+    int64_t size;
+    int64_t offset;
+    YPWriteDone done;
+    void *opaque;
+    int64_t submit_time;
+    struct WriteJob *next;
+} WriteJob;
+
+typedef struct WriteQueue {
+    struct YPWriter *writer;
+    pthread_t thread;
+    pthread_cond_t job_available;
+    WriteJob *head;
+    WriteJob *tail;
+} WriteQueue;
+
+struct YPWriter {
+    pthread_mutex_t lock;
+    pthread_cond_t room_available;
+    pthread_cond_t job_done;
+    // One queue per I/O thread
+    WriteQueue *queues;
+    unsigned int nb_queues;
+    unsigned int max_jobs;
+    int64_t max_bytes;
+    int fsync;
+    // Jobs and bytes queued, not yet picked by an I/O thread
+    unsigned int queued_jobs;
+    int64_t queued_bytes;
+    // Jobs queued or running
+    unsigned int pending;
+    int error;
+    int quit;
+    YPWriterStats stats;
+};
+
+static int write_all(int fd, const uint8_t *data, int64_t size, int64_t offset)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        if (offset < 0)
+            n = write(fd, data, size);
+        else
+            n = pwrite(fd, data, size, offset);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+
+        data += n;
+        size -= n;
+        if (offset >= 0)
+            offset += n;
+    }
+
+    return 0;
+}
+
+static void run_job(YPWriter *writer, WriteJob *job)
+{
+    YPWriterFile *file = job->file;
+    int ret = 0;
+
+    switch (job->type) {
+    case WRITE_JOB_OPEN:
+        file->fd = open(file->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file->fd < 0) {
+            ret = AVERROR(errno);
+            yp_log(YP_LOG_WRITER, YP_LOG_ERROR, "Could not open %s for writing\n", file->filename);
+        }
+        break;
+    case WRITE_JOB_WRITE:
+        if (file->error == 0)
+            ret = write_all(file->fd, job->data, job->size, job->offset);
+        break;
+    case WRITE_JOB_CLOSE:
+        if (file->fd < 0)
+            break;
+        if (writer->fsync && file->error == 0 && fsync(file->fd) < 0)
+            ret = AVERROR(errno);
+        if (close(file->fd) < 0 && ret == 0)
+            ret = AVERROR(errno);
+        file->fd = -1;
+        break;
+    }
+
+    if (ret < 0 && file->error == 0) {
+        yp_log(YP_LOG_WRITER, YP_LOG_ERROR, "Error writing %s\n", file->filename);
+        file->error = ret;
+    }
+}
+
+static void *io_thread(void *opaque)
+{
+    WriteQueue *queue = opaque;
+    YPWriter *writer = queue->writer;
+    WriteJob *job;
+    int64_t start, end;
+    int status;
+
+    while (1) {
+        pthread_mutex_lock(&writer->lock);
+
+        while (queue->head == NULL && !writer->quit)
+            pthread_cond_wait(&queue->job_available, &writer->lock);
+
+        if (queue->head == NULL) {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+
+        job = queue->head;
+        queue->head = job->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+
+        writer->queued_jobs--;
+        writer->queued_bytes -= job->size;
+        pthread_cond_broadcast(&writer->room_available);
+
+        pthread_mutex_unlock(&writer->lock);
+
+        start = av_gettime_relative();
+        run_job(writer, job);
+        end = av_gettime_relative();
+
+        status = job->file->error;
+
+        if (job->done)
+            job->done(job->opaque, status);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->stats.nb_jobs++;
+        writer->stats.nb_bytes += job->size;
+        writer->stats.total_write_time += end - start;
+        writer->stats.max_write_time = FFMAX(writer->stats.max_write_time, end - start);
+        writer->stats.total_latency += end - job->submit_time;
+        writer->stats.max_latency = FFMAX(writer->stats.max_latency, end - job->submit_time);
+        if (status < 0 && writer->error == 0)
+            writer->error = status;
+        if (--writer->pending == 0)
+            pthread_cond_broadcast(&writer->job_done);
+        pthread_mutex_unlock(&writer->lock);
+
+        if (job->type == WRITE_JOB_CLOSE) {
+            free(job->file->filename);
+            free(job->file);
+        }
+
+        av_free(job->data);
+        free(job);
+    }
+
+    return NULL;
+}
+
+static int submit(YPWriter *writer, WriteJob *job)
+{
+    WriteQueue *queue = &writer->queues[job->file->queue];
+
+    job->next = NULL;
+
+    pthread_mutex_lock(&writer->lock);
+
+    // Backpressure: hold the muxer back until the disk catches up. A job
+    // larger than the byte budget still goes through on an empty queue.
+    if (writer->queued_jobs >= writer->max_jobs ||
+            (writer->queued_jobs > 0 && writer->queued_bytes + job->size > writer->max_bytes)) {
+        writer->stats.nb_stalls++;
+
+        while (writer->queued_jobs >= writer->max_jobs ||
+                (writer->queued_jobs > 0 && writer->queued_bytes + job->size > writer->max_bytes))
+            pthread_cond_wait(&writer->room_available, &writer->lock);
+    }
+
+    job->submit_time = av_gettime_relative();
+
+    if (queue->tail)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+
+    writer->queued_jobs++;
+    writer->queued_bytes += job->size;
+    writer->pending++;
+    writer->stats.max_queue_depth = FFMAX(writer->stats.max_queue_depth, writer->queued_jobs);
+    writer->stats.max_queue_bytes = FFMAX(writer->stats.max_queue_bytes, writer->queued_bytes);
+
+    pthread_cond_signal(&queue->job_available);
+    pthread_mutex_unlock(&writer->lock);
+
+    return 0;
+}
+
+static WriteJob *write_job(int type, YPWriterFile *file, YPWriteDone done, void *opaque)
+{
+    WriteJob *job = (WriteJob *) malloc(sizeof(WriteJob));
+
+    if (job) {
+        job->type = type;
+        job->file = file;
+        job->data = NULL;
+        job->size = 0;
+        job->offset = -1;
+        job->done = done;
+        job->opaque = opaque;
+    }
+
+    return job;
+}
+
+YPWriter* yp_writer(unsigned int nb_threads, unsigned int max_jobs, int64_t max_bytes,
+                    int fsync)
+{
+    unsigned int i;
+    YPWriter *writer = (YPWriter *) calloc(1, sizeof(YPWriter));
+
+    if (writer == NULL) {
+        return NULL;
+    }
+
+    writer->queues = (WriteQueue *) calloc(nb_threads, sizeof(WriteQueue));
+
+    if (writer->queues == NULL) {
+        free(writer);
+        return NULL;
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->room_available, NULL);
+    pthread_cond_init(&writer->job_done, NULL);
+    writer->max_jobs = FFMAX(max_jobs, 1);
+    writer->max_bytes = max_bytes;
+    writer->fsync = fsync;
+
+    for (i = 0; i < nb_threads; i++) {
+        WriteQueue *queue = &writer->queues[i];
+
+        queue->writer = writer;
+        pthread_cond_init(&queue->job_available, NULL);
+
+        if (pthread_create(&queue->thread, NULL, io_thread, queue) != 0) {
+            pthread_cond_destroy(&queue->job_available);
+            break;
+        }
+        writer->nb_queues++;
+    }
+
+    if (writer->nb_queues == 0) {
+        yp_writer_free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+YPWriterFile* yp_writer_open(YPWriter *writer, const char *filename, unsigned int key)
+{
+    WriteJob *job;
+    YPWriterFile *file = (YPWriterFile *) malloc(sizeof(YPWriterFile));
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    file->filename = strdup(filename);
+    file->fd = -1;
+    file->error = 0;
+    file->queue = key % writer->nb_queues;
+
+    job = write_job(WRITE_JOB_OPEN, file, NULL, NULL);
+
+    if (file->filename == NULL || job == NULL) {
+        free(file->filename);
+        free(file);
+        free(job);
+        return NULL;
+    }
+
+    submit(writer, job);
+
+    return file;
+}
+
+int yp_writer_write(YPWriter *writer, YPWriterFile *file, uint8_t *data, int64_t size,
+                    int64_t offset, YPWriteDone done, void *opaque)
+{
+    WriteJob *job = write_job(WRITE_JOB_WRITE, file, done, opaque);
+
+    if (job == NULL) {
+        av_free(data);
+        return -1;
+    }
+
+    job->data = data;
+    job->size = size;
+    job->offset = offset;
+
+    return submit(writer, job);
+}
+
+int yp_writer_close(YPWriter *writer, YPWriterFile *file, YPWriteDone done, void *opaque)
+{
+    WriteJob *job = write_job(WRITE_JOB_CLOSE, file, done, opaque);
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    return submit(writer, job);
+}
+
+int yp_writer_flush(YPWriter *writer)
+{
+    int ret;
+
+    pthread_mutex_lock(&writer->lock);
+
+    while (writer->pending > 0)
+        pthread_cond_wait(&writer->job_done, &writer->lock);
+
+    ret = writer->error;
+
+    pthread_mutex_unlock(&writer->lock);
+
+    return ret;
+}
+
+void yp_writer_get_stats(YPWriter *writer, YPWriterStats *stats)
+{
+    pthread_mutex_lock(&writer->lock);
+    *stats = writer->stats;
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void yp_writer_free(YPWriter *writer)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->quit = 1;
+    for (i = 0; i < writer->nb_queues; i++)
+        pthread_cond_broadcast(&writer->queues[i].job_available);
+    pthread_mutex_unlock(&writer->lock);
+
+    for (i = 0; i < writer->nb_queues; i++) {
+        pthread_join(writer->queues[i].thread, NULL);
+        pthread_cond_destroy(&writer->queues[i].job_available);
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->room_available);
+    pthread_cond_destroy(&writer->job_done);
+    free(writer->queues);
+    free(writer);
+}
@@ -0,0 +1,51 @@
+#ifndef YP_WRITER_H_
+#define YP_WRITER_H_
+
+#include <stdint.h>
+
+// Background file writer. Muxers hand it the bytes of finished chunks and
+// segments and go on muxing while I/O threads write, optionally fsync and
+// close the files. Jobs on one file always run in submission order, on the
+// same I/O thread.
+typedef struct YPWriter YPWriter;
+typedef struct YPWriterFile YPWriterFile;
+
+// Called from an I/O thread once a job is done, status is negative if the
+// job or an earlier one on the same file failed
+typedef void (*YPWriteDone)(void *opaque, int status);
+
+typedef struct YPWriterStats {
+    uint64_t nb_jobs;
+    uint64_t nb_bytes;
+    // Largest number of jobs and bytes waiting in the queue at once
+    unsigned int max_queue_depth;
+    int64_t max_queue_bytes;
+    // Times in microseconds. Latency runs from submission to completion,
+    // write time only covers the system calls.
+    int64_t total_latency;
+    int64_t max_latency;
+    int64_t total_write_time;
+    int64_t max_write_time;
+    // Submissions that had to wait for room in the queue
+    uint64_t nb_stalls;
+} YPWriterStats;
+
+// Submitters block once max_jobs jobs or max_bytes bytes are queued
+YPWriter* yp_writer(unsigned int nb_threads, unsigned int max_jobs, int64_t max_bytes,
+                    int fsync);
+// Create or truncate filename. key picks the I/O thread.
+YPWriterFile* yp_writer_open(YPWriter *writer, const char *filename, unsigned int key);
+// Write size bytes of data at offset, or at the end of what was written so
+// far if offset is negative. data must come from av_malloc(), the writer
+// frees it. done may be NULL.
+int yp_writer_write(YPWriter *writer, YPWriterFile *file, uint8_t *data, int64_t size,
+                    int64_t offset, YPWriteDone done, void *opaque);
+// Close file once everything submitted before has been written. file must
+// not be used anymore.
+int yp_writer_close(YPWriter *writer, YPWriterFile *file, YPWriteDone done, void *opaque);
+// Block until every submitted job is done. Returns the first error, if any.
+int yp_writer_flush(YPWriter *writer);
+void yp_writer_get_stats(YPWriter *writer, YPWriterStats *stats);
+void yp_writer_free(YPWriter *writer);
+
+#endif // YP_WRITER_H_